@@ -4,6 +4,7 @@
 #include <ngx_core.h>
 #include <ngx_rtmp.h>
 #include <ngx_rtmp_codec_module.h>
+#include <ngx_rtmp_cleanup.h>
 #include "ngx_rtmp_live_module.h"
 #include "ngx_rtmp_mp4.h"
 
@@ -39,7 +40,8 @@ typedef struct {
     ngx_uint_t                          mdat_size;
     ngx_uint_t                          sample_count;
     ngx_uint_t                          sample_mask;
-    ngx_fd_t                            fd;
+    u_char                             *mdat;       /* heap, reused */
+    size_t                              mdat_alloc;
     char                                type;
     uint32_t                            earliest_pres_time;
     uint32_t                            latest_pres_time;
@@ -72,12 +74,6 @@ typedef struct {
 } ngx_rtmp_dash_ctx_t;
 
 
-typedef struct {
-    ngx_str_t                           path;
-    ngx_msec_t                          playlen;
-} ngx_rtmp_dash_cleanup_t;
-
-
 typedef struct {
     ngx_flag_t                          dash;
     ngx_msec_t                          fraglen;
@@ -86,10 +82,16 @@ typedef struct {
     ngx_str_t                           path;
     ngx_uint_t                          winfrags;
     ngx_flag_t                          cleanup;
+    ngx_path_t                         *journal_path;
     ngx_path_t                         *slot;
 } ngx_rtmp_dash_app_conf_t;
 
 
+static ngx_path_init_t  ngx_rtmp_dash_journal_path = {
+    ngx_string(NGX_RTMP_CLEANUP_PATH), { 0, 0, 0 }
+};
+
+
 static ngx_command_t ngx_rtmp_dash_commands[] = {
 
     { ngx_string("dash"),
@@ -127,6 +129,13 @@ static ngx_command_t ngx_rtmp_dash_commands[] = {
       offsetof(ngx_rtmp_dash_app_conf_t, cleanup),
       NULL },
 
+    { ngx_string("dash_cleanup_journal_path"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_path_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_dash_app_conf_t, journal_path),
+      NULL },
+
     { ngx_string("dash_nested"),
       NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_flag_slot,
@@ -436,6 +445,11 @@ ngx_rtmp_dash_write_playlist(ngx_rtmp_session_t *s)
         return NGX_ERROR;
     }
 
+    if (dacf->slot && ctx->id == 0) {
+        ngx_rtmp_cleanup_journal(s->connection->log, dacf->slot->data,
+                                 ctx->playlist.data);
+    }
+
     return NGX_OK;
 }
 
@@ -443,14 +457,16 @@ ngx_rtmp_dash_write_playlist(ngx_rtmp_session_t *s)
 static ngx_int_t
 ngx_rtmp_dash_write_init_segments(ngx_rtmp_session_t *s)
 {
-    ngx_fd_t               fd;
-    ngx_int_t              rc;
-    ngx_buf_t              b;
-    ngx_rtmp_dash_ctx_t   *ctx;
-    ngx_rtmp_codec_ctx_t  *codec_ctx;
+    ngx_fd_t                   fd;
+    ngx_int_t                  rc;
+    ngx_buf_t                  b;
+    ngx_rtmp_dash_ctx_t       *ctx;
+    ngx_rtmp_codec_ctx_t      *codec_ctx;
+    ngx_rtmp_dash_app_conf_t  *dacf;
 
-    static u_char          buffer[NGX_RTMP_DASH_BUFSIZE];
+    static u_char              buffer[NGX_RTMP_DASH_BUFSIZE];
 
+    dacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_dash_module);
     ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_dash_module);
     codec_ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_codec_module);
 
@@ -486,6 +502,11 @@ ngx_rtmp_dash_write_init_segments(ngx_rtmp_session_t *s)
 
     ngx_close_file(fd);
 
+    if (dacf->slot) {
+        ngx_rtmp_cleanup_journal(s->connection->log, dacf->slot->data,
+                                 ctx->stream.data);
+    }
+
     /* init audio */
 
     *ngx_sprintf(ctx->stream.data + ctx->stream.len, "init.m4a") = 0;
@@ -512,6 +533,11 @@ ngx_rtmp_dash_write_init_segments(ngx_rtmp_session_t *s)
 
     ngx_close_file(fd);
 
+    if (dacf->slot) {
+        ngx_rtmp_cleanup_journal(s->connection->log, dacf->slot->data,
+                                 ctx->stream.data);
+    }
+
     return NGX_OK;
 }
 
@@ -520,12 +546,13 @@ static void
 ngx_rtmp_dash_close_fragment(ngx_rtmp_session_t *s, ngx_rtmp_dash_track_t *t)
 {
     u_char                    *pos, *pos1;
-    size_t                     left;
-    ssize_t                    n;
     ngx_fd_t                   fd;
-    ngx_buf_t                  b;
+    ngx_buf_t                  b, mb;
+    ngx_file_t                 file;
+    ngx_chain_t                hdr, mdat;
     ngx_rtmp_dash_ctx_t       *ctx;
     ngx_rtmp_dash_frag_t      *f;
+    ngx_rtmp_dash_app_conf_t  *dacf;
 
     static u_char              buffer[NGX_RTMP_DASH_BUFSIZE];
 
@@ -539,6 +566,8 @@ ngx_rtmp_dash_close_fragment(ngx_rtmp_session_t *s, ngx_rtmp_dash_track_t *t)
 
     ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_dash_module);
 
+    ngx_memzero(&b, sizeof(ngx_buf_t));
+
     b.start = buffer;
     b.end = buffer + sizeof(buffer);
     b.pos = b.last = b.start;
@@ -558,66 +587,65 @@ ngx_rtmp_dash_close_fragment(ngx_rtmp_session_t *s, ngx_rtmp_dash_track_t *t)
     b.last = pos1;
     ngx_rtmp_mp4_write_mdat(&b, t->mdat_size + 8);
 
-    /* move the data down to make room for the headers */
-
     f = ngx_rtmp_dash_get_frag(s, ctx->nfrags);
 
     *ngx_sprintf(ctx->stream.data + ctx->stream.len, "%uD.m4%c",
                  f->timestamp, t->type) = 0;
 
-    fd = ngx_open_file(ctx->stream.data, NGX_FILE_RDWR,
+    fd = ngx_open_file(ctx->stream.data, NGX_FILE_WRONLY,
                        NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
 
     if (fd == NGX_INVALID_FILE) {
         ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                      "dash: error creating dash temp video file");
+                      "dash: error creating dash fragment file");
         goto done;
     }
 
-    if (ngx_write_fd(fd, b.pos, (size_t) (b.last - b.pos)) == NGX_ERROR) {
-        goto done;
-    }
+    /* headers and the in-memory mdat payload go out in one gathered write */
 
-    left = (size_t) t->mdat_size;
+    hdr.buf = &b;
+    hdr.next = NULL;
 
-#if (NGX_WIN32)
-    if (SetFilePointer(t->fd, 0, 0, FILE_BEGIN) == INVALID_SET_FILE_POINTER) {
-        ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
-                      "dash: SetFilePointer error");
-        goto done;
-    }
-#else
-    if (lseek(t->fd, 0, SEEK_SET) == -1) {
-        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                      "dash: lseek error");
-        goto done;
+    if (t->mdat_size) {
+        ngx_memzero(&mb, sizeof(ngx_buf_t));
+
+        mb.start = mb.pos = t->mdat;
+        mb.end = mb.last = t->mdat + t->mdat_size;
+        mb.memory = 1;
+
+        mdat.buf = &mb;
+        mdat.next = NULL;
+
+        hdr.next = &mdat;
     }
-#endif
 
-    while (left > 0) {
+    b.memory = 1;
 
-        n = ngx_read_fd(t->fd, buffer, ngx_min(sizeof(buffer), left));
-        if (n == 0 || n == NGX_ERROR) {
-            break;
-        }
+    ngx_memzero(&file, sizeof(ngx_file_t));
 
-        n = ngx_write_fd(fd, buffer, (size_t) n);
-        if (n == 0 || n == NGX_ERROR) {
-            break;
-        }
+    file.fd = fd;
+    file.name.data = ctx->stream.data;
+    file.name.len = ngx_strlen(ctx->stream.data);
+    file.log = s->connection->log;
 
-        left -= n;
+    if (ngx_write_chain_to_file(&file, &hdr, 0, s->connection->pool)
+        == NGX_ERROR)
+    {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
+                      "dash: error writing fragment");
     }
 
-done:
+    ngx_close_file(fd);
 
-    if (fd != NGX_INVALID_FILE) {
-        ngx_close_file(fd);
+    dacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_dash_module);
+
+    if (dacf->slot) {
+        ngx_rtmp_cleanup_journal(s->connection->log, dacf->slot->data,
+                                 ctx->stream.data);
     }
 
-    ngx_close_file(t->fd);
+done:
 
-    t->fd = NGX_INVALID_FILE;
     t->opened = 0;
 }
 
@@ -653,8 +681,6 @@ static ngx_int_t
 ngx_rtmp_dash_open_fragment(ngx_rtmp_session_t *s, ngx_rtmp_dash_track_t *t,
     ngx_uint_t id, char type)
 {
-    ngx_rtmp_dash_ctx_t   *ctx;
-
     if (t->opened) {
         return NGX_OK;
     }
@@ -662,19 +688,6 @@ ngx_rtmp_dash_open_fragment(ngx_rtmp_session_t *s, ngx_rtmp_dash_track_t *t,
     ngx_log_debug2(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
                    "dash: open fragment id=%ui, type='%c'", id, type);
 
-    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_dash_module);
-
-    *ngx_sprintf(ctx->stream.data + ctx->stream.len, "raw.m4%c", type) = 0;
-
-    t->fd = ngx_open_file(ctx->stream.data, NGX_FILE_RDWR,
-                          NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
-
-    if (t->fd == NGX_INVALID_FILE) {
-        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                      "dash: error creating fragment file");
-        return NGX_ERROR;
-    }
-
     t->id = id;
     t->type = type;
     t->sample_count = 0;
@@ -818,13 +831,30 @@ ngx_rtmp_dash_ensure_directory(ngx_rtmp_session_t *s)
 }
 
 
+static void
+ngx_rtmp_dash_free_mdat(void *data)
+{
+    ngx_rtmp_dash_ctx_t  *ctx = data;
+
+    if (ctx->video.mdat) {
+        ngx_free(ctx->video.mdat);
+    }
+
+    if (ctx->audio.mdat) {
+        ngx_free(ctx->audio.mdat);
+    }
+}
+
+
 static ngx_int_t
 ngx_rtmp_dash_publish(ngx_rtmp_session_t *s, ngx_rtmp_publish_t *v)
 {
     u_char                    *p;
     size_t                     len;
+    ngx_pool_cleanup_t        *cln;
     ngx_rtmp_dash_ctx_t       *ctx;
     ngx_rtmp_dash_frag_t      *f;
+    ngx_rtmp_dash_track_t      video, audio;
     ngx_rtmp_dash_app_conf_t  *dacf;
 
     dacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_dash_module);
@@ -846,6 +876,15 @@ ngx_rtmp_dash_publish(ngx_rtmp_session_t *s, ngx_rtmp_publish_t *v)
         if (ctx == NULL) {
             goto next;
         }
+
+        cln = ngx_pool_cleanup_add(s->connection->pool, 0);
+        if (cln == NULL) {
+            return NGX_ERROR;
+        }
+
+        cln->handler = ngx_rtmp_dash_free_mdat;
+        cln->data = ctx;
+
         ngx_rtmp_set_ctx(s, ctx, ngx_rtmp_dash_module);
 
     } else {
@@ -854,8 +893,16 @@ ngx_rtmp_dash_publish(ngx_rtmp_session_t *s, ngx_rtmp_publish_t *v)
         }
 
         f = ctx->frags;
+        video = ctx->video;
+        audio = ctx->audio;
+
         ngx_memzero(ctx, sizeof(ngx_rtmp_dash_ctx_t));
+
         ctx->frags = f;
+        ctx->video.mdat = video.mdat;
+        ctx->video.mdat_alloc = video.mdat_alloc;
+        ctx->audio.mdat = audio.mdat;
+        ctx->audio.mdat_alloc = audio.mdat_alloc;
     }
 
     if (ctx->frags == NULL) {
@@ -1031,30 +1078,57 @@ ngx_rtmp_dash_update_fragments(ngx_rtmp_session_t *s, ngx_int_t boundary,
 }
 
 
+static ngx_int_t
+ngx_rtmp_dash_reserve(ngx_rtmp_session_t *s, ngx_rtmp_dash_track_t *t,
+    size_t size)
+{
+    u_char  *p;
+    size_t   n;
+
+    if (t->mdat_size + size <= t->mdat_alloc) {
+        return NGX_OK;
+    }
+
+    n = t->mdat_alloc ? t->mdat_alloc : NGX_RTMP_DASH_BUFSIZE / 4;
+
+    while (n < t->mdat_size + size) {
+        n *= 2;
+    }
+
+    p = ngx_alloc(n, s->connection->log);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (t->mdat) {
+        ngx_memcpy(p, t->mdat, t->mdat_size);
+        ngx_free(t->mdat);
+    }
+
+    t->mdat = p;
+    t->mdat_alloc = n;
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_rtmp_dash_append(ngx_rtmp_session_t *s, ngx_chain_t *in,
     ngx_rtmp_dash_track_t *t, ngx_int_t key, uint32_t timestamp, uint32_t delay)
 {
     u_char                 *p;
     size_t                  size, bsize;
+    ngx_chain_t            *cl;
     ngx_rtmp_mp4_sample_t  *smpl;
 
-    static u_char           buffer[NGX_RTMP_DASH_BUFSIZE];
-
-    p = buffer;
     size = 0;
 
-    for (; in && size < sizeof(buffer); in = in->next) {
-
-        bsize = (size_t) (in->buf->last - in->buf->pos);
-        if (size + bsize > sizeof(buffer)) {
-            bsize = (size_t) (sizeof(buffer) - size);
-        }
-
-        p = ngx_cpymem(p, in->buf->pos, bsize);
-        size += bsize;
+    for (cl = in; cl; cl = cl->next) {
+        size += (size_t) (cl->buf->last - cl->buf->pos);
     }
 
+    size = ngx_min(size, NGX_RTMP_DASH_BUFSIZE);
+
     ngx_rtmp_dash_update_fragments(s, key, timestamp);
 
     if (t->sample_count == 0) {
@@ -1065,12 +1139,24 @@ ngx_rtmp_dash_append(ngx_rtmp_session_t *s, ngx_chain_t *in,
 
     if (t->sample_count < NGX_RTMP_DASH_MAX_SAMPLES) {
 
-        if (ngx_write_fd(t->fd, buffer, size) == NGX_ERROR) {
-            ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                          "dash: " ngx_write_fd_n " failed");
+        /* mdat is kept in memory and written once when the fragment closes */
+
+        if (ngx_rtmp_dash_reserve(s, t, size) != NGX_OK) {
+            ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                          "dash: failed to allocate %uz bytes for mdat",
+                          t->mdat_size + size);
             return NGX_ERROR;
         }
 
+        p = t->mdat + t->mdat_size;
+
+        for (bsize = size; in && bsize; in = in->next) {
+            p = ngx_cpymem(p, in->buf->pos,
+                           ngx_min(bsize,
+                                   (size_t) (in->buf->last - in->buf->pos)));
+            bsize = size - (p - (t->mdat + t->mdat_size));
+        }
+
         smpl = &t->samples[t->sample_count];
 
         smpl->delay = delay;
@@ -1215,187 +1301,68 @@ ngx_rtmp_dash_stream_eof(ngx_rtmp_session_t *s, ngx_rtmp_stream_eof_t *v)
 
 
 static ngx_int_t
-ngx_rtmp_dash_cleanup_dir(ngx_str_t *ppath, ngx_msec_t playlen)
+ngx_rtmp_dash_cleanup_age(ngx_str_t *path, ngx_msec_t playlen,
+    time_t *max_age)
 {
-    time_t           mtime, max_age;
-    u_char          *p;
-    u_char           path[NGX_MAX_PATH + 1], mpd_path[NGX_MAX_PATH + 1];
-    ngx_dir_t        dir;
-    ngx_err_t        err;
-    ngx_str_t        name, spath, mpd;
-    ngx_int_t        nentries, nerased;
-    ngx_file_info_t  fi;
-
-    ngx_log_debug2(NGX_LOG_DEBUG_RTMP, ngx_cycle->log, 0,
-                   "dash: cleanup path='%V' playlen=%M", ppath, playlen);
-
-    if (ngx_open_dir(ppath, &dir) != NGX_OK) {
-        ngx_log_debug1(NGX_LOG_DEBUG_RTMP, ngx_cycle->log, ngx_errno,
-                       "dash: cleanup open dir failed '%V'", ppath);
-        return NGX_ERROR;
-    }
-
-    nentries = 0;
-    nerased = 0;
-
-    for ( ;; ) {
-        ngx_set_errno(0);
-
-        if (ngx_read_dir(&dir) == NGX_ERROR) {
-            err = ngx_errno;
-
-            if (ngx_close_dir(&dir) == NGX_ERROR) {
-                ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
-                              "dash: cleanup " ngx_close_dir_n " \"%V\" failed",
-                              ppath);
-            }
-
-            if (err == NGX_ENOMOREFILES) {
-                return nentries - nerased;
-            }
-
-            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, err,
-                          "dash: cleanup " ngx_read_dir_n
-                          " '%V' failed", ppath);
-            return NGX_ERROR;
-        }
-
-        name.data = ngx_de_name(&dir);
-        if (name.data[0] == '.') {
-            continue;
-        }
-
-        name.len = ngx_de_namelen(&dir);
+    u_char           *p, *name;
+    u_char            mpd_path[NGX_MAX_PATH + 1];
+    size_t            len;
+    ngx_str_t         dir, mpd;
+    ngx_file_info_t   fi;
 
-        p = ngx_snprintf(path, sizeof(path) - 1, "%V/%V", ppath, &name);
-        *p = 0;
+    p = path->data + path->len;
 
-        spath.data = path;
-        spath.len = p - path;
-
-        nentries++;
-
-        if (!dir.valid_info && ngx_de_info(path, &dir) == NGX_FILE_ERROR) {
-            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
-                          "dash: cleanup " ngx_de_info_n " \"%V\" failed",
-                          &spath);
-
-            continue;
-        }
-
-        if (ngx_de_is_dir(&dir)) {
-
-            if (ngx_rtmp_dash_cleanup_dir(&spath, playlen) == 0) {
-                ngx_log_debug1(NGX_LOG_DEBUG_RTMP, ngx_cycle->log, 0,
-                               "dash: cleanup dir '%V'", &name);
+    name = p;
+    while (name > path->data && name[-1] != '/') {
+        name--;
+    }
 
-                /*
-                 * null-termination gets spoiled in win32
-                 * version of ngx_open_dir
-                 */
+    len = p - name;
 
-                *p = 0;
+    if (len >= 8 && ngx_strncmp(p - 8, "init.m4", 7) == 0) {
 
-                if (ngx_delete_dir(path) == NGX_FILE_ERROR) {
-                    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, ngx_errno,
-                                  "dash: cleanup " ngx_delete_dir_n
-                                  " failed on '%V'", &spath);
-                } else {
-                    nerased++;
-                }
-            }
+        /* init segments live as long as the manifest */
 
-            continue;
+        if (len == 8) {
+            ngx_str_set(&mpd, "index");
+        } else {
+            mpd.data = name;
+            mpd.len = len - 9;
         }
 
-        if (!ngx_de_is_file(&dir)) {
-            continue;
-        }
+        dir.data = path->data;
+        dir.len = name - path->data;
 
-        if (name.len >= 8 && name.data[name.len - 8] == 'i' &&
-                             name.data[name.len - 7] == 'n' &&
-                             name.data[name.len - 6] == 'i' &&
-                             name.data[name.len - 5] == 't' &&
-                             name.data[name.len - 4] == '.' &&
-                             name.data[name.len - 3] == 'm' &&
-                             name.data[name.len - 2] == '4')
-        {
-            if (name.len == 8) {
-                ngx_str_set(&mpd, "index");
-            } else {
-                mpd.data = name.data;
-                mpd.len = name.len - 9;
-            }
-
-            p = ngx_snprintf(mpd_path, sizeof(mpd_path) - 1, "%V/%V.mpd",
-                             ppath, &mpd);
-            *p = 0;
-
-            if (ngx_file_info(mpd_path, &fi) != NGX_FILE_ERROR) {
-                ngx_log_debug2(NGX_LOG_DEBUG_RTMP, ngx_cycle->log, 0,
-                               "dash: cleanup '%V' delayed, mpd exists '%s'",
-                               &name, mpd_path);
-                continue;
-            }
+        *ngx_snprintf(mpd_path, sizeof(mpd_path) - 1, "%V%V.mpd",
+                      &dir, &mpd) = 0;
 
+        if (ngx_file_info(mpd_path, &fi) != NGX_FILE_ERROR) {
             ngx_log_debug2(NGX_LOG_DEBUG_RTMP, ngx_cycle->log, 0,
-                           "dash: cleanup '%V' allowed, mpd missing '%s'",
-                           &name, mpd_path);
-
-            max_age = 0;
-
-        } else if (name.len >= 4 && name.data[name.len - 4] == '.' &&
-                                    name.data[name.len - 3] == 'm' &&
-                                    name.data[name.len - 2] == '4' &&
-                                    name.data[name.len - 1] == 'v')
-        {
-            max_age = playlen / 500;
-
-        } else if (name.len >= 4 && name.data[name.len - 4] == '.' &&
-                                    name.data[name.len - 3] == 'm' &&
-                                    name.data[name.len - 2] == '4' &&
-                                    name.data[name.len - 1] == 'a')
-        {
-            max_age = playlen / 500;
-
-        } else if (name.len >= 4 && name.data[name.len - 4] == '.' &&
-                                    name.data[name.len - 3] == 'm' &&
-                                    name.data[name.len - 2] == 'p' &&
-                                    name.data[name.len - 1] == 'd')
-        {
-            max_age = playlen / 500;
-
-        } else if (name.len >= 4 && name.data[name.len - 4] == '.' &&
-                                    name.data[name.len - 3] == 'r' &&
-                                    name.data[name.len - 2] == 'a' &&
-                                    name.data[name.len - 1] == 'w')
-        {
-            max_age = playlen / 1000;
-
-        } else {
-            ngx_log_debug1(NGX_LOG_DEBUG_RTMP, ngx_cycle->log, 0,
-                           "dash: cleanup skip unknown file type '%V'", &name);
-            continue;
-        }
-
-        mtime = ngx_de_mtime(&dir);
-        if (mtime + max_age > ngx_cached_time->sec) {
-            continue;
+                           "dash: cleanup '%V' delayed, mpd exists '%s'",
+                           path, mpd_path);
+            return NGX_AGAIN;
         }
 
-        ngx_log_debug3(NGX_LOG_DEBUG_RTMP, ngx_cycle->log, 0,
-                       "dash: cleanup '%V' mtime=%T age=%T",
-                       &name, mtime, ngx_cached_time->sec - mtime);
+        *max_age = 0;
+        return NGX_OK;
+    }
 
-        if (ngx_delete_file(path) == NGX_FILE_ERROR) {
-            ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, ngx_errno,
-                          "dash: cleanup " ngx_delete_file_n " failed on '%V'",
-                          &spath);
-            continue;
-        }
+    if (len >= 4 && p[-4] == '.' && p[-3] == 'm'
+        && ((p[-2] == '4' && (p[-1] == 'v' || p[-1] == 'a'))
+            || (p[-2] == 'p' && p[-1] == 'd')))
+    {
+        *max_age = playlen / 500;
+        return NGX_OK;
+    }
 
-        nerased++;
+    if (len >= 4 && p[-4] == '.' && p[-3] == 'r' && p[-2] == 'a'
+        && p[-1] == 'w')
+    {
+        *max_age = playlen / 1000;
+        return NGX_OK;
     }
+
+    return NGX_DECLINED;
 }
 
 
@@ -1406,14 +1373,16 @@ static time_t
 #endif
 ngx_rtmp_dash_cleanup(void *data)
 {
-    ngx_rtmp_dash_cleanup_t *cleanup = data;
+    ngx_rtmp_cleanup_t  *cleanup = data;
+
+    time_t               next;
 
-    ngx_rtmp_dash_cleanup_dir(&cleanup->path, cleanup->playlen);
+    next = ngx_rtmp_cleanup_run(cleanup);
 
 #if (nginx_version >= 1011005)
-    return cleanup->playlen * 2;
+    return (ngx_msec_t) next * 1000;
 #else
-    return cleanup->playlen / 500;
+    return next;
 #endif
 }
 
@@ -1443,7 +1412,7 @@ ngx_rtmp_dash_merge_app_conf(ngx_conf_t *cf, void *parent, void *child)
 {
     ngx_rtmp_dash_app_conf_t    *prev = parent;
     ngx_rtmp_dash_app_conf_t    *conf = child;
-    ngx_rtmp_dash_cleanup_t     *cleanup;
+    ngx_rtmp_cleanup_t          *cleanup;
 
     ngx_conf_merge_value(conf->dash, prev->dash, 0);
     ngx_conf_merge_msec_value(conf->fraglen, prev->fraglen, 5000);
@@ -1451,6 +1420,13 @@ ngx_rtmp_dash_merge_app_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_value(conf->cleanup, prev->cleanup, 1);
     ngx_conf_merge_value(conf->nested, prev->nested, 0);
 
+    if (ngx_conf_merge_path_value(cf, &conf->journal_path, prev->journal_path,
+                                  &ngx_rtmp_dash_journal_path)
+        != NGX_CONF_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
     if (conf->fraglen) {
         conf->winfrags = conf->playlen / conf->fraglen;
     }
@@ -1469,6 +1445,14 @@ ngx_rtmp_dash_merge_app_conf(ngx_conf_t *cf, void *parent, void *child)
 
         cleanup->path = conf->path;
         cleanup->playlen = conf->playlen;
+        cleanup->name = "dash";
+        cleanup->age = ngx_rtmp_dash_cleanup_age;
+
+        if (ngx_rtmp_cleanup_init_journal(cf, cleanup, conf->journal_path)
+            != NGX_OK)
+        {
+            return NGX_CONF_ERROR;
+        }
 
         conf->slot = ngx_pcalloc(cf->pool, sizeof(*conf->slot));
         if (conf->slot == NULL) {
@@ -8,6 +8,8 @@
 #include <ngx_rtmp.h>
 #include <ngx_rtmp_cmd_module.h>
 #include <ngx_rtmp_codec_module.h>
+#include <ngx_rtmp_cleanup.h>
+#include "ngx_rtmp_live_module.h"
 #include "ngx_rtmp_mpegts.h"
 
 static ngx_rtmp_publish_pt next_publish;
@@ -39,8 +41,34 @@ typedef struct {
   ngx_array_t args;
 } ngx_rtmp_hls_variant_t;
 
+typedef struct {
+  unsigned active : 1;
+  ngx_uint_t bandwidth; /* bits/sec as advertised */
+  ngx_uint_t width;
+  ngx_uint_t height;
+  u_char codecs[sizeof("avc1.xxxxxx,mp4a.40.xx")];
+} ngx_rtmp_hls_rendition_t;
+
+/*
+ * Master playlist state shared by the renditions of one stream
+ * published to this worker. The rendered playlist is kept to skip
+ * rewriting the file when nothing visible to players has changed,
+ * though never for longer than the playlist cleanup allows. Ladders
+ * are worker runtime state, looked up by application and path.
+ */
+typedef struct {
+  ngx_queue_t queue;
+  void *hacf; /* application, compared only */
+  ngx_str_t name; /* master playlist path */
+  ngx_uint_t nactive;
+  ngx_rtmp_hls_rendition_t *renditions; /* one per hls_variant */
+  ngx_str_t text;
+  time_t written; /* kept fresh for the playlist cleanup */
+} ngx_rtmp_hls_ladder_t;
+
 typedef struct {
   unsigned opened : 1;
+  unsigned indexed : 1;
 
   ngx_file_t file;
 
@@ -66,15 +94,11 @@ typedef struct {
   uint64_t aframe_pts;
 
   ngx_rtmp_hls_variant_t *var;
+  ngx_rtmp_hls_ladder_t *ladder;
 
   ngx_flag_t is_hls;
 } ngx_rtmp_hls_ctx_t;
 
-typedef struct {
-  ngx_str_t path;
-  ngx_msec_t playlen;
-} ngx_rtmp_hls_cleanup_t;
-
 typedef struct {
   ngx_flag_t hls;
   ngx_msec_t fraglen;
@@ -93,12 +117,18 @@ typedef struct {
   ngx_msec_t max_audio_delay;
   size_t audio_buffer_size;
   ngx_flag_t cleanup;
+  ngx_path_t *journal_path;
   ngx_array_t *variant;
   ngx_str_t base_url;
   ngx_int_t granularity;
   ngx_str_t deny_name;
 } ngx_rtmp_hls_app_conf_t;
 
+static ngx_queue_t ngx_rtmp_hls_ladders;
+
+static ngx_path_init_t ngx_rtmp_hls_journal_path = {
+    ngx_string(NGX_RTMP_CLEANUP_PATH), {0, 0, 0}};
+
 #define NGX_RTMP_HLS_NAMING_SEQUENTIAL 1
 #define NGX_RTMP_HLS_NAMING_TIMESTAMP 2
 #define NGX_RTMP_HLS_NAMING_SYSTEM 3
@@ -217,6 +247,12 @@ static ngx_command_t ngx_rtmp_hls_commands[] = {
      ngx_conf_set_flag_slot, NGX_RTMP_APP_CONF_OFFSET,
      offsetof(ngx_rtmp_hls_app_conf_t, cleanup), NULL},
 
+    {ngx_string("hls_cleanup_journal_path"),
+     NGX_RTMP_MAIN_CONF | NGX_RTMP_SRV_CONF | NGX_RTMP_APP_CONF |
+         NGX_CONF_TAKE1,
+     ngx_conf_set_path_slot, NGX_RTMP_APP_CONF_OFFSET,
+     offsetof(ngx_rtmp_hls_app_conf_t, journal_path), NULL},
+
     {ngx_string("hls_variant"),
      NGX_RTMP_MAIN_CONF | NGX_RTMP_SRV_CONF | NGX_RTMP_APP_CONF |
          NGX_CONF_1MORE,
@@ -305,21 +341,260 @@ static ngx_int_t ngx_rtmp_hls_rename_file(u_char *src, u_char *dst) {
 #endif
 }
 
-static ngx_int_t ngx_rtmp_hls_write_variant_playlist(ngx_rtmp_session_t *s) {
-  static u_char buffer[1024];
+static ngx_rtmp_hls_ladder_t *ngx_rtmp_hls_get_ladder(ngx_rtmp_session_t *s) {
+  size_t size;
+  ngx_queue_t *q;
+  ngx_rtmp_hls_ctx_t *ctx;
+  ngx_rtmp_hls_ladder_t *ladder;
+  ngx_rtmp_hls_app_conf_t *hacf;
+
+  hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
+  ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
+
+  for (q = ngx_queue_head(&ngx_rtmp_hls_ladders);
+       q != ngx_queue_sentinel(&ngx_rtmp_hls_ladders); q = ngx_queue_next(q)) {
+    ladder = ngx_queue_data(q, ngx_rtmp_hls_ladder_t, queue);
+
+    if (ladder->hacf == hacf && ladder->name.len == ctx->var_playlist.len &&
+        ngx_memcmp(ladder->name.data, ctx->var_playlist.data,
+                   ctx->var_playlist.len) == 0) {
+      return ladder;
+    }
+  }
+
+  size = sizeof(ngx_rtmp_hls_ladder_t) +
+         sizeof(ngx_rtmp_hls_rendition_t) * hacf->variant->nelts +
+         ctx->var_playlist.len;
+
+  ladder = ngx_alloc(size, s->connection->log);
+  if (ladder == NULL) {
+    return NULL;
+  }
+
+  ngx_memzero(ladder, size);
+
+  ladder->renditions = (ngx_rtmp_hls_rendition_t *)&ladder[1];
 
+  ladder->name.len = ctx->var_playlist.len;
+  ladder->name.data = (u_char *)&ladder->renditions[hacf->variant->nelts];
+  ngx_memcpy(ladder->name.data, ctx->var_playlist.data, ladder->name.len);
+
+  ladder->hacf = hacf;
+  ngx_queue_insert_tail(&ngx_rtmp_hls_ladders, &ladder->queue);
+
+  return ladder;
+}
+
+static void ngx_rtmp_hls_free_ladder(ngx_rtmp_session_t *s,
+                                     ngx_rtmp_hls_ladder_t *ladder) {
+  ngx_queue_remove(&ladder->queue);
+
+  if (ladder->text.data) {
+    ngx_free(ladder->text.data);
+  }
+
+  ngx_free(ladder);
+}
+
+/*
+ * Measure the rendition published by this session and return
+ * whether anything advertised in the master playlist has changed.
+ */
+static ngx_uint_t ngx_rtmp_hls_update_rendition(ngx_rtmp_session_t *s,
+                                                ngx_rtmp_hls_rendition_t *r) {
   u_char *p, *last;
+  ngx_uint_t bandwidth, changed;
+  ngx_rtmp_live_ctx_t *lctx;
+  ngx_rtmp_codec_ctx_t *codec_ctx;
+
+  u_char codecs[sizeof(r->codecs)];
+
+  codec_ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_codec_module);
+  lctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_live_module);
+
+  bandwidth = 0;
+
+  if (lctx && lctx->stream && lctx->stream->bw_in.bandwidth) {
+    bandwidth = (ngx_uint_t)lctx->stream->bw_in.bandwidth * 8;
+
+  } else if (codec_ctx) {
+    bandwidth =
+        (codec_ctx->video_data_rate + codec_ctx->audio_data_rate) * 1000;
+  }
+
+  p = codecs;
+  last = codecs + sizeof(codecs) - 1;
+
+  if (codec_ctx) {
+    if (codec_ctx->video_codec_id == NGX_RTMP_VIDEO_H264) {
+      p = ngx_slprintf(p, last, "avc1.%02uxi%02uxi%02uxi",
+                       codec_ctx->avc_profile, codec_ctx->avc_compat,
+                       codec_ctx->avc_level);
+    }
+
+    if (codec_ctx->audio_codec_id == NGX_RTMP_AUDIO_AAC) {
+      p = ngx_slprintf(p, last, "%smp4a.40.%ui", p == codecs ? "" : ",",
+                       codec_ctx->aac_profile ? codec_ctx->aac_profile : 2);
+
+    } else if (codec_ctx->audio_codec_id == NGX_RTMP_AUDIO_MP3) {
+      p = ngx_slprintf(p, last, "%smp4a.40.34", p == codecs ? "" : ",");
+    }
+  }
+
+  *p = 0;
+
+  changed = !r->active;
+
+  r->active = 1;
+
+  /* bitrate jitters; re-advertise only on a sizeable drift */
+
+  if (bandwidth && (r->bandwidth == 0 ||
+                    bandwidth > r->bandwidth + r->bandwidth / 4 ||
+                    bandwidth < r->bandwidth - r->bandwidth / 4)) {
+    r->bandwidth = bandwidth;
+    changed = 1;
+  }
+
+  if (codec_ctx &&
+      (r->width != codec_ctx->width || r->height != codec_ctx->height)) {
+    r->width = codec_ctx->width;
+    r->height = codec_ctx->height;
+    changed = 1;
+  }
+
+  if (ngx_strcmp(r->codecs, codecs) != 0) {
+    ngx_memcpy(r->codecs, codecs, p - codecs + 1);
+    changed = 1;
+  }
+
+  return changed;
+}
+
+static ngx_uint_t ngx_rtmp_hls_measured_arg(ngx_rtmp_hls_rendition_t *r,
+                                            ngx_str_t *arg) {
+  if (!r->active) {
+    return 0;
+  }
+
+  if (r->bandwidth && arg->len > sizeof("BANDWIDTH") - 1 &&
+      ngx_strncasecmp(arg->data, (u_char *)"BANDWIDTH=",
+                      sizeof("BANDWIDTH=") - 1) == 0) {
+    return 1;
+  }
+
+  if (r->width && r->height && arg->len > sizeof("RESOLUTION") - 1 &&
+      ngx_strncasecmp(arg->data, (u_char *)"RESOLUTION=",
+                      sizeof("RESOLUTION=") - 1) == 0) {
+    return 1;
+  }
+
+  if (r->codecs[0] && arg->len > sizeof("CODECS") - 1 &&
+      ngx_strncasecmp(arg->data, (u_char *)"CODECS=", sizeof("CODECS=") - 1) ==
+          0) {
+    return 1;
+  }
+
+  return 0;
+}
+
+/*
+ * cleanup removes playlists older than playlen, so an unchanged master
+ * playlist is still rewritten every playlen/2 while the ladder has members
+ */
+static ngx_uint_t ngx_rtmp_hls_ladder_stale(ngx_rtmp_hls_app_conf_t *hacf,
+                                            ngx_rtmp_hls_ladder_t *ladder) {
+  return ngx_time() - ladder->written >= (time_t)(hacf->playlen / 2000);
+}
+
+static ngx_int_t ngx_rtmp_hls_write_variant_playlist(ngx_rtmp_session_t *s) {
+  static u_char buffer[NGX_RTMP_HLS_BUFSIZE];
+  static u_char path[NGX_MAX_PATH + 1];
+
+  u_char *p, *last, *pp;
+  size_t len;
   ssize_t rc;
   ngx_fd_t fd;
   ngx_str_t *arg;
   ngx_uint_t n, k;
+  ngx_file_info_t fi;
   ngx_rtmp_hls_ctx_t *ctx;
+  ngx_rtmp_hls_ladder_t *ladder;
   ngx_rtmp_hls_variant_t *var;
+  ngx_rtmp_hls_rendition_t *r;
   ngx_rtmp_hls_app_conf_t *hacf;
 
   hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
   ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
 
+  ladder = ctx->ladder;
+
+  p = buffer;
+  last = buffer + sizeof(buffer);
+
+  p = ngx_slprintf(p, last, "#EXTM3U\n#EXT-X-VERSION:3\n");
+
+  /* base playlist path without ".m3u8" */
+  len = ctx->var_playlist.len - (sizeof(".m3u8") - 1);
+
+  var = hacf->variant->elts;
+  for (n = 0; n < hacf->variant->nelts; n++, var++) {
+    r = &ladder->renditions[n];
+
+    if (!r->active) {
+      /*
+       * renditions published to other workers are known
+       * only by their media playlists being kept up to date
+       */
+
+      pp = ngx_snprintf(path, sizeof(path) - 1, "%*s%V%s.m3u8", len,
+                        ctx->var_playlist.data, &var->suffix,
+                        hacf->nested ? "/index" : "");
+      *pp = 0;
+
+      if (ngx_file_info(path, &fi) == NGX_FILE_ERROR ||
+          ngx_file_mtime(&fi) + (time_t)(hacf->playlen / 1000) <
+              ngx_time()) {
+        continue;
+      }
+    }
+
+    p = ngx_slprintf(p, last, "#EXT-X-STREAM-INF:PROGRAM-ID=1");
+
+    if (r->active && r->bandwidth) {
+      p = ngx_slprintf(p, last, ",BANDWIDTH=%ui", r->bandwidth);
+    }
+
+    if (r->active && r->width && r->height) {
+      p = ngx_slprintf(p, last, ",RESOLUTION=%uix%ui", r->width, r->height);
+    }
+
+    if (r->active && r->codecs[0]) {
+      p = ngx_slprintf(p, last, ",CODECS=\"%s\"", r->codecs);
+    }
+
+    arg = var->args.elts;
+    for (k = 0; k < var->args.nelts; k++, arg++) {
+      if (!ngx_rtmp_hls_measured_arg(r, arg)) {
+        p = ngx_slprintf(p, last, ",%V", arg);
+      }
+    }
+
+    p = ngx_slprintf(p, last, "\n%V%*s%V%s.m3u8\n", &hacf->base_url,
+                     ctx->name.len - ctx->var->suffix.len, ctx->name.data,
+                     &var->suffix, hacf->nested ? "/index" : "");
+  }
+
+  if (ladder->text.data && ladder->text.len == (size_t)(p - buffer) &&
+      ngx_memcmp(ladder->text.data, buffer, p - buffer) == 0 &&
+      !ngx_rtmp_hls_ladder_stale(hacf, ladder)) {
+    return NGX_OK;
+  }
+
+  ngx_log_debug2(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                 "hls: ladder changed '%V', active=%ui", &ladder->name,
+                 ladder->nactive);
+
   fd = ngx_open_file(ctx->var_playlist_bak.data, NGX_FILE_WRONLY,
                      NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
 
@@ -331,64 +606,113 @@ static ngx_int_t ngx_rtmp_hls_write_variant_playlist(ngx_rtmp_session_t *s) {
     return NGX_ERROR;
   }
 
-#define NGX_RTMP_HLS_VAR_HEADER "#EXTM3U\n#EXT-X-VERSION:3\n"
-
-  rc = ngx_write_fd(fd, NGX_RTMP_HLS_VAR_HEADER,
-                    sizeof(NGX_RTMP_HLS_VAR_HEADER) - 1);
+  rc = ngx_write_fd(fd, buffer, p - buffer);
   if (rc < 0) {
     ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                  "hls: " ngx_write_fd_n " failed: '%V'",
+                  "hls: " ngx_write_fd_n " failed '%V'",
                   &ctx->var_playlist_bak);
     ngx_close_file(fd);
     return NGX_ERROR;
   }
 
-  var = hacf->variant->elts;
-  for (n = 0; n < hacf->variant->nelts; n++, var++) {
-    p = buffer;
-    last = buffer + sizeof(buffer);
+  ngx_close_file(fd);
 
-    p = ngx_slprintf(p, last, "#EXT-X-STREAM-INF:PROGRAM-ID=1");
+  if (ngx_rtmp_hls_rename_file(ctx->var_playlist_bak.data,
+                               ctx->var_playlist.data) == NGX_FILE_ERROR) {
+    ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
+                  "hls: rename failed: '%V'->'%V'", &ctx->var_playlist_bak,
+                  &ctx->var_playlist);
+    return NGX_ERROR;
+  }
 
-    arg = var->args.elts;
-    for (k = 0; k < var->args.nelts; k++, arg++) {
-      p = ngx_slprintf(p, last, ",%V", arg);
-    }
+  /* remember what is on disk */
+
+  ladder->written = ngx_time();
 
-    if (p < last) {
-      *p++ = '\n';
+  if (ladder->text.data == NULL || ladder->text.len < (size_t)(p - buffer)) {
+    if (ladder->text.data) {
+      ngx_free(ladder->text.data);
     }
 
-    p = ngx_slprintf(p, last, "%V%*s%V", &hacf->base_url,
-                     ctx->name.len - ctx->var->suffix.len, ctx->name.data,
-                     &var->suffix);
-    if (hacf->nested) {
-      p = ngx_slprintf(p, last, "%s", "/index");
+    ladder->text.data = ngx_alloc(p - buffer, s->connection->log);
+    if (ladder->text.data == NULL) {
+      ladder->text.len = 0;
+      return NGX_OK;
     }
+  }
 
-    p = ngx_slprintf(p, last, "%s", ".m3u8\n");
+  ladder->text.len = p - buffer;
+  ngx_memcpy(ladder->text.data, buffer, p - buffer);
 
-    rc = ngx_write_fd(fd, buffer, p - buffer);
-    if (rc < 0) {
-      ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                    "hls: " ngx_write_fd_n " failed '%V'",
-                    &ctx->var_playlist_bak);
-      ngx_close_file(fd);
+  return NGX_OK;
+}
+
+static ngx_int_t ngx_rtmp_hls_update_ladder(ngx_rtmp_session_t *s) {
+  ngx_uint_t n;
+  ngx_rtmp_hls_ctx_t *ctx;
+  ngx_rtmp_hls_ladder_t *ladder;
+  ngx_rtmp_hls_rendition_t *r;
+  ngx_rtmp_hls_app_conf_t *hacf;
+
+  hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
+  ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
+
+  if (ctx->ladder == NULL) {
+    ctx->ladder = ngx_rtmp_hls_get_ladder(s);
+    if (ctx->ladder == NULL) {
       return NGX_ERROR;
     }
   }
 
-  ngx_close_file(fd);
+  ladder = ctx->ladder;
 
-  if (ngx_rtmp_hls_rename_file(ctx->var_playlist_bak.data,
-                               ctx->var_playlist.data) == NGX_FILE_ERROR) {
-    ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                  "hls: rename failed: '%V'->'%V'", &ctx->var_playlist_bak,
-                  &ctx->var_playlist);
-    return NGX_ERROR;
+  n = ctx->var - (ngx_rtmp_hls_variant_t *)hacf->variant->elts;
+  r = &ladder->renditions[n];
+
+  if (!r->active) {
+    ladder->nactive++;
   }
 
-  return NGX_OK;
+  if (!ngx_rtmp_hls_update_rendition(s, r) &&
+      !ngx_rtmp_hls_ladder_stale(hacf, ladder)) {
+    return NGX_OK;
+  }
+
+  return ngx_rtmp_hls_write_variant_playlist(s);
+}
+
+static void ngx_rtmp_hls_leave_ladder(ngx_rtmp_session_t *s) {
+  ngx_uint_t n;
+  ngx_rtmp_hls_ctx_t *ctx;
+  ngx_rtmp_hls_ladder_t *ladder;
+  ngx_rtmp_hls_rendition_t *r;
+  ngx_rtmp_hls_app_conf_t *hacf;
+
+  hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
+  ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
+
+  ladder = ctx->ladder;
+  if (ladder == NULL) {
+    return;
+  }
+
+  n = ctx->var - (ngx_rtmp_hls_variant_t *)hacf->variant->elts;
+  r = &ladder->renditions[n];
+
+  if (r->active) {
+    ngx_memzero(r, sizeof(ngx_rtmp_hls_rendition_t));
+    ladder->nactive--;
+  }
+
+  if (ladder->nactive) {
+    ngx_rtmp_hls_write_variant_playlist(s);
+
+  } else {
+    /* the last master playlist is left for cleanup */
+    ngx_rtmp_hls_free_ladder(s, ladder);
+  }
+
+  ctx->ladder = NULL;
 }
 
 static ngx_int_t ngx_rtmp_hls_write_playlist(ngx_rtmp_session_t *s) {
@@ -484,8 +808,20 @@ static ngx_int_t ngx_rtmp_hls_write_playlist(ngx_rtmp_session_t *s) {
     return NGX_ERROR;
   }
 
-  if (ctx->var) {
-    return ngx_rtmp_hls_write_variant_playlist(s);
+  if (ctx->var && ngx_rtmp_hls_update_ladder(s) != NGX_OK) {
+    return NGX_ERROR;
+  }
+
+  if (hacf->slot && !ctx->indexed) {
+    ctx->indexed = 1;
+
+    ngx_rtmp_cleanup_journal(s->connection->log, hacf->slot->data,
+                             ctx->playlist.data);
+
+    if (ctx->var) {
+      ngx_rtmp_cleanup_journal(s->connection->log, hacf->slot->data,
+                               ctx->var_playlist.data);
+    }
   }
 
   return NGX_OK;
@@ -760,6 +1096,11 @@ static ngx_int_t ngx_rtmp_hls_open_fragment(ngx_rtmp_session_t *s, uint64_t ts,
     return NGX_ERROR;
   }
 
+  if (hacf->slot) {
+    ngx_rtmp_cleanup_journal(s->connection->log, hacf->slot->data,
+                             ctx->stream.data);
+  }
+
   ctx->opened = 1;
 
   f = ngx_rtmp_hls_get_frag(s, ctx->nfrags);
@@ -1189,6 +1530,10 @@ static ngx_int_t ngx_rtmp_hls_close_stream(ngx_rtmp_session_t *s,
 
   ngx_rtmp_hls_close_fragment(s);
 
+  if (ctx->var) {
+    ngx_rtmp_hls_leave_ladder(s);
+  }
+
 next:
   return next_close_stream(s, v);
 }
@@ -1730,141 +2075,43 @@ static ngx_int_t ngx_rtmp_hls_stream_eof(ngx_rtmp_session_t *s,
   return next_stream_eof(s, v);
 }
 
-static ngx_int_t ngx_rtmp_hls_cleanup_dir(ngx_str_t *ppath,
-                                          ngx_msec_t playlen) {
-  ngx_dir_t dir;
-  time_t mtime, max_age;
-  ngx_err_t err;
-  ngx_str_t name, spath;
+static ngx_int_t ngx_rtmp_hls_cleanup_age(ngx_str_t *path,
+                                          ngx_msec_t playlen,
+                                          time_t *max_age) {
   u_char *p;
-  ngx_int_t nentries, nerased;
-  u_char path[NGX_MAX_PATH + 1];
 
-  ngx_log_debug2(NGX_LOG_DEBUG_RTMP, ngx_cycle->log, 0,
-                 "hls: cleanup path='%V' playlen=%M", ppath, playlen);
+  p = path->data + path->len;
 
-  if (ngx_open_dir(ppath, &dir) != NGX_OK) {
-    ngx_log_debug1(NGX_LOG_DEBUG_RTMP, ngx_cycle->log, ngx_errno,
-                   "hls: cleanup open dir failed '%V'", ppath);
-    return NGX_ERROR;
+  if (path->len >= 3 && p[-3] == '.' && p[-2] == 't' && p[-1] == 's') {
+    *max_age = playlen / 500;
+    return NGX_OK;
   }
 
-  nentries = 0;
-  nerased = 0;
-
-  for (;;) {
-    ngx_set_errno(0);
-
-    if (ngx_read_dir(&dir) == NGX_ERROR) {
-      err = ngx_errno;
-
-      if (ngx_close_dir(&dir) == NGX_ERROR) {
-        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
-                      "hls: cleanup " ngx_close_dir_n " \"%V\" failed", ppath);
-      }
-
-      if (err == NGX_ENOMOREFILES) {
-        return nentries - nerased;
-      }
-
-      ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, err,
-                    "hls: cleanup " ngx_read_dir_n " '%V' failed", ppath);
-      return NGX_ERROR;
-    }
-
-    name.data = ngx_de_name(&dir);
-    if (name.data[0] == '.') {
-      continue;
-    }
-
-    name.len = ngx_de_namelen(&dir);
-
-    p = ngx_snprintf(path, sizeof(path) - 1, "%V/%V", ppath, &name);
-    *p = 0;
-
-    spath.data = path;
-    spath.len = p - path;
-
-    nentries++;
-
-    if (!dir.valid_info && ngx_de_info(path, &dir) == NGX_FILE_ERROR) {
-      ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
-                    "hls: cleanup " ngx_de_info_n " \"%V\" failed", &spath);
-
-      continue;
-    }
-
-    if (ngx_de_is_dir(&dir)) {
-      if (ngx_rtmp_hls_cleanup_dir(&spath, playlen) == 0) {
-        ngx_log_debug1(NGX_LOG_DEBUG_RTMP, ngx_cycle->log, 0,
-                       "hls: cleanup dir '%V'", &name);
-
-        /*
-         * null-termination gets spoiled in win32
-         * version of ngx_open_dir
-         */
-
-        *p = 0;
-
-        if (ngx_delete_dir(path) == NGX_FILE_ERROR) {
-          ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, ngx_errno,
-                        "hls: cleanup " ngx_delete_dir_n " failed on '%V'",
-                        &spath);
-        } else {
-          nerased++;
-        }
-      }
-
-      continue;
-    }
-
-    if (!ngx_de_is_file(&dir)) {
-      continue;
-    }
-
-    if (name.len >= 3 && name.data[name.len - 3] == '.' &&
-        name.data[name.len - 2] == 't' && name.data[name.len - 1] == 's') {
-      max_age = playlen / 500;
-
-    } else if (name.len >= 5 && name.data[name.len - 5] == '.' &&
-               name.data[name.len - 4] == 'm' &&
-               name.data[name.len - 3] == '3' &&
-               name.data[name.len - 2] == 'u' &&
-               name.data[name.len - 1] == '8') {
-      max_age = playlen / 1000;
-
-    } else {
-      ngx_log_debug1(NGX_LOG_DEBUG_RTMP, ngx_cycle->log, 0,
-                     "hls: cleanup skip unknown file type '%V'", &name);
-      continue;
-    }
-
-    mtime = ngx_de_mtime(&dir);
-    if (mtime + max_age > ngx_cached_time->sec) {
-      continue;
-    }
-
-    ngx_log_debug3(NGX_LOG_DEBUG_RTMP, ngx_cycle->log, 0,
-                   "hls: cleanup '%V' mtime=%T age=%T", &name, mtime,
-                   ngx_cached_time->sec - mtime);
-
-    if (ngx_delete_file(path) == NGX_FILE_ERROR) {
-      ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, ngx_errno,
-                    "hls: cleanup " ngx_delete_file_n " failed on '%V'",
-                    &spath);
-      continue;
-    }
-
-    nerased++;
+  if (path->len >= 5 && p[-5] == '.' && p[-4] == 'm' && p[-3] == '3' &&
+      p[-2] == 'u' && p[-1] == '8') {
+    *max_age = playlen / 1000;
+    return NGX_OK;
   }
+
+  return NGX_DECLINED;
 }
 
-static time_t ngx_rtmp_hls_cleanup(void *data) {
-  ngx_rtmp_hls_cleanup_t *cleanup = data;
+#if (nginx_version >= 1011005)
+static ngx_msec_t
+#else
+static time_t
+#endif
+ngx_rtmp_hls_cleanup(void *data) {
+  ngx_rtmp_cleanup_t *cleanup = data;
+  time_t next;
 
-  ngx_rtmp_hls_cleanup_dir(&cleanup->path, cleanup->playlen);
+  next = ngx_rtmp_cleanup_run(cleanup);
 
-  return cleanup->playlen / 500;
+#if (nginx_version >= 1011005)
+  return (ngx_msec_t)next * 1000;
+#else
+  return next;
+#endif
 }
 
 static char *ngx_rtmp_hls_variant(ngx_conf_t *cf, ngx_command_t *cmd,
@@ -1946,7 +2193,7 @@ static char *ngx_rtmp_hls_merge_app_conf(ngx_conf_t *cf, void *parent,
                                          void *child) {
   ngx_rtmp_hls_app_conf_t *prev = parent;
   ngx_rtmp_hls_app_conf_t *conf = child;
-  ngx_rtmp_hls_cleanup_t *cleanup;
+  ngx_rtmp_cleanup_t *cleanup;
 
   ngx_conf_merge_value(conf->hls, prev->hls, 0);
   ngx_conf_merge_msec_value(conf->fraglen, prev->fraglen, 5000);
@@ -1966,6 +2213,13 @@ static char *ngx_rtmp_hls_merge_app_conf(ngx_conf_t *cf, void *parent,
   ngx_conf_merge_size_value(conf->audio_buffer_size, prev->audio_buffer_size,
                             NGX_RTMP_HLS_BUFSIZE);
   ngx_conf_merge_value(conf->cleanup, prev->cleanup, 1);
+
+  if (ngx_conf_merge_path_value(cf, &conf->journal_path, prev->journal_path,
+                                &ngx_rtmp_hls_journal_path) !=
+      NGX_CONF_OK) {
+    return NGX_CONF_ERROR;
+  }
+
   ngx_conf_merge_str_value(conf->base_url, prev->base_url, "");
   ngx_conf_merge_value(conf->granularity, prev->granularity, 0);
   ngx_conf_merge_str_value(conf->deny_name, prev->deny_name, "");
@@ -1989,6 +2243,13 @@ static char *ngx_rtmp_hls_merge_app_conf(ngx_conf_t *cf, void *parent,
 
     cleanup->path = conf->path;
     cleanup->playlen = conf->playlen;
+    cleanup->name = "hls";
+    cleanup->age = ngx_rtmp_hls_cleanup_age;
+
+    if (ngx_rtmp_cleanup_init_journal(cf, cleanup, conf->journal_path) !=
+        NGX_OK) {
+      return NGX_CONF_ERROR;
+    }
 
     conf->slot = ngx_pcalloc(cf->pool, sizeof(*conf->slot));
     if (conf->slot == NULL) {
@@ -2023,6 +2284,8 @@ static ngx_int_t ngx_rtmp_hls_postconfiguration(ngx_conf_t *cf) {
   h = ngx_array_push(&cmcf->events[NGX_RTMP_MSG_AUDIO]);
   *h = ngx_rtmp_hls_audio;
 
+  ngx_queue_init(&ngx_rtmp_hls_ladders);
+
   next_publish = ngx_rtmp_publish;
   ngx_rtmp_publish = ngx_rtmp_hls_publish;
 
@@ -121,122 +121,130 @@ ngx_rtmp_mpegts_write_pts(u_char *p, ngx_uint_t fb, uint64_t pts)
 }
 
 
-ngx_int_t
-ngx_rtmp_mpegts_write_frame(ngx_file_t *file, ngx_rtmp_mpegts_frame_t *f,
-    ngx_buf_t *b)
+/* one 188-byte packet of the PES, consumes b and bumps the counter */
+static void
+ngx_rtmp_mpegts_packet(ngx_rtmp_mpegts_frame_t *f, ngx_buf_t *b,
+    u_char *packet, ngx_uint_t first)
 {
     ngx_uint_t  pes_size, header_size, body_size, in_size, stuff_size, flags;
-    u_char      packet[188], *p, *base;
-    ngx_int_t   first, rc;
+    u_char     *p, *base;
 
-    ngx_log_debug6(NGX_LOG_DEBUG_HTTP, file->log, 0,
-                   "mpegts: pid=%ui, sid=%ui, pts=%uL, "
-                   "dts=%uL, key=%ui, size=%ui",
-                   f->pid, f->sid, f->pts, f->dts,
-                   (ngx_uint_t) f->key, (size_t) (b->last - b->pos));
+    p = packet;
 
-    first = 1;
+    f->cc++;
 
-    while (b->pos < b->last) {
-        p = packet;
+    *p++ = 0x47;
+    *p++ = (u_char) (f->pid >> 8);
 
-        f->cc++;
+    if (first) {
+        p[-1] |= 0x40;
+    }
 
-        *p++ = 0x47;
-        *p++ = (u_char) (f->pid >> 8);
+    *p++ = (u_char) f->pid;
+    *p++ = 0x10 | (f->cc & 0x0f); /* payload */
 
-        if (first) {
-            p[-1] |= 0x40;
-        }
+    if (first) {
 
-        *p++ = (u_char) f->pid;
-        *p++ = 0x10 | (f->cc & 0x0f); /* payload */
+        if (f->key) {
+            packet[3] |= 0x20; /* adaptation */
 
-        if (first) {
+            *p++ = 7;    /* size */
+            *p++ = 0x50; /* random access + PCR */
 
-            if (f->key) {
-                packet[3] |= 0x20; /* adaptation */
+            p = ngx_rtmp_mpegts_write_pcr(p, f->dts - NGX_RTMP_HLS_DELAY);
+        }
 
-                *p++ = 7;    /* size */
-                *p++ = 0x50; /* random access + PCR */
+        /* PES header */
 
-                p = ngx_rtmp_mpegts_write_pcr(p, f->dts - NGX_RTMP_HLS_DELAY);
-            }
+        *p++ = 0x00;
+        *p++ = 0x00;
+        *p++ = 0x01;
+        *p++ = (u_char) f->sid;
 
-            /* PES header */
+        header_size = 5;
+        flags = 0x80; /* PTS */
 
-            *p++ = 0x00;
-            *p++ = 0x00;
-            *p++ = 0x01;
-            *p++ = (u_char) f->sid;
+        if (f->dts != f->pts) {
+            header_size += 5;
+            flags |= 0x40; /* DTS */
+        }
 
-            header_size = 5;
-            flags = 0x80; /* PTS */
+        pes_size = (b->last - b->pos) + header_size + 3;
+        if (pes_size > 0xffff) {
+            pes_size = 0;
+        }
 
-            if (f->dts != f->pts) {
-                header_size += 5;
-                flags |= 0x40; /* DTS */
-            }
+        *p++ = (u_char) (pes_size >> 8);
+        *p++ = (u_char) pes_size;
+        *p++ = 0x80; /* H222 */
+        *p++ = (u_char) flags;
+        *p++ = (u_char) header_size;
 
-            pes_size = (b->last - b->pos) + header_size + 3;
-            if (pes_size > 0xffff) {
-                pes_size = 0;
-            }
+        p = ngx_rtmp_mpegts_write_pts(p, flags >> 6, f->pts +
+                                                     NGX_RTMP_HLS_DELAY);
 
-            *p++ = (u_char) (pes_size >> 8);
-            *p++ = (u_char) pes_size;
-            *p++ = 0x80; /* H222 */
-            *p++ = (u_char) flags;
-            *p++ = (u_char) header_size;
+        if (f->dts != f->pts) {
+            p = ngx_rtmp_mpegts_write_pts(p, 1, f->dts +
+                                                NGX_RTMP_HLS_DELAY);
+        }
+    }
 
-            p = ngx_rtmp_mpegts_write_pts(p, flags >> 6, f->pts +
-                                                         NGX_RTMP_HLS_DELAY);
+    body_size = (ngx_uint_t) (packet + NGX_RTMP_MPEGTS_PACKET_SIZE - p);
+    in_size = (ngx_uint_t) (b->last - b->pos);
 
-            if (f->dts != f->pts) {
-                p = ngx_rtmp_mpegts_write_pts(p, 1, f->dts +
-                                                    NGX_RTMP_HLS_DELAY);
-            }
+    if (body_size <= in_size) {
+        ngx_memcpy(p, b->pos, body_size);
+        b->pos += body_size;
 
-            first = 0;
-        }
+    } else {
+        stuff_size = (body_size - in_size);
+
+        if (packet[3] & 0x20) {
 
-        body_size = (ngx_uint_t) (packet + sizeof(packet) - p);
-        in_size = (ngx_uint_t) (b->last - b->pos);
+            /* has adaptation */
 
-        if (body_size <= in_size) {
-            ngx_memcpy(p, b->pos, body_size);
-            b->pos += body_size;
+            base = &packet[5] + packet[4];
+            p = ngx_movemem(base + stuff_size, base, p - base);
+            ngx_memset(base, 0xff, stuff_size);
+            packet[4] += (u_char) stuff_size;
 
         } else {
-            stuff_size = (body_size - in_size);
 
-            if (packet[3] & 0x20) {
+            /* no adaptation */
 
-                /* has adaptation */
+            packet[3] |= 0x20;
+            p = ngx_movemem(&packet[4] + stuff_size, &packet[4],
+                            p - &packet[4]);
 
-                base = &packet[5] + packet[4];
-                p = ngx_movemem(base + stuff_size, base, p - base);
-                ngx_memset(base, 0xff, stuff_size);
-                packet[4] += (u_char) stuff_size;
+            packet[4] = (u_char) (stuff_size - 1);
+            if (stuff_size >= 2) {
+                packet[5] = 0;
+                ngx_memset(&packet[6], 0xff, stuff_size - 2);
+            }
+        }
 
-            } else {
+        ngx_memcpy(p, b->pos, in_size);
+        b->pos = b->last;
+    }
+}
 
-                /* no adaptation */
 
-                packet[3] |= 0x20;
-                p = ngx_movemem(&packet[4] + stuff_size, &packet[4],
-                                p - &packet[4]);
+ngx_int_t
+ngx_rtmp_mpegts_write_frame(ngx_file_t *file, ngx_rtmp_mpegts_frame_t *f,
+    ngx_buf_t *b)
+{
+    u_char      packet[NGX_RTMP_MPEGTS_PACKET_SIZE];
+    ngx_uint_t  first;
+    ssize_t     rc;
 
-                packet[4] = (u_char) (stuff_size - 1);
-                if (stuff_size >= 2) {
-                    packet[5] = 0;
-                    ngx_memset(&packet[6], 0xff, stuff_size - 2);
-                }
-            }
+    ngx_log_debug6(NGX_LOG_DEBUG_HTTP, file->log, 0,
+                   "mpegts: pid=%ui, sid=%ui, pts=%uL, "
+                   "dts=%uL, key=%ui, size=%ui",
+                   f->pid, f->sid, f->pts, f->dts,
+                   (ngx_uint_t) f->key, (size_t) (b->last - b->pos));
 
-            ngx_memcpy(p, b->pos, in_size);
-            b->pos = b->last;
-        }
+    for (first = 1; b->pos < b->last; first = 0) {
+        ngx_rtmp_mpegts_packet(f, b, packet, first);
 
         rc = ngx_write_file(file, packet, sizeof(packet), file->offset);
         if (rc < 0) {
@@ -246,3 +254,43 @@ ngx_rtmp_mpegts_write_frame(ngx_file_t *file, ngx_rtmp_mpegts_frame_t *f,
 
     return NGX_OK;
 }
+
+
+/*
+ * In-memory variants for live outputs: out must hold
+ * ngx_rtmp_mpegts_size(b->last - b->pos) bytes for a frame and
+ * NGX_RTMP_MPEGTS_HEADER_SIZE for the PAT/PMT. Both return the new end.
+ */
+
+u_char *
+ngx_rtmp_mpegts_mux_frame(u_char *out, ngx_rtmp_mpegts_frame_t *f,
+    ngx_buf_t *b)
+{
+    ngx_uint_t  first;
+
+    for (first = 1; b->pos < b->last; first = 0) {
+        ngx_rtmp_mpegts_packet(f, b, out, first);
+        out += NGX_RTMP_MPEGTS_PACKET_SIZE;
+    }
+
+    return out;
+}
+
+
+u_char *
+ngx_rtmp_mpegts_mux_header(u_char *out, ngx_uint_t *cc)
+{
+    u_char  *p;
+
+    *cc = (*cc + 1) & 0x0f;
+
+    p = ngx_cpymem(out, ngx_rtmp_mpegts_header,
+                   sizeof(ngx_rtmp_mpegts_header));
+
+    /* PAT and PMT continuity counters */
+
+    out[3] = (u_char) (0x10 | *cc);
+    out[NGX_RTMP_MPEGTS_PACKET_SIZE + 3] = (u_char) (0x10 | *cc);
+
+    return p;
+}
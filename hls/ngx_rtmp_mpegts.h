@@ -12,6 +12,14 @@
 #include <ngx_core.h>
 
 
+#define NGX_RTMP_MPEGTS_PACKET_SIZE  188
+#define NGX_RTMP_MPEGTS_HEADER_SIZE  (2 * NGX_RTMP_MPEGTS_PACKET_SIZE)
+
+/* upper bound of the packets a PES with len bytes of payload takes */
+#define ngx_rtmp_mpegts_size(len)                                            \
+    (((len) / 184 + 2) * NGX_RTMP_MPEGTS_PACKET_SIZE)
+
+
 typedef struct {
     uint64_t    pts;
     uint64_t    dts;
@@ -25,6 +33,9 @@ typedef struct {
 ngx_int_t ngx_rtmp_mpegts_write_header(ngx_file_t *file);
 ngx_int_t ngx_rtmp_mpegts_write_frame(ngx_file_t *file,
           ngx_rtmp_mpegts_frame_t *f, ngx_buf_t *b);
+u_char *ngx_rtmp_mpegts_mux_header(u_char *out, ngx_uint_t *cc);
+u_char *ngx_rtmp_mpegts_mux_frame(u_char *out, ngx_rtmp_mpegts_frame_t *f,
+          ngx_buf_t *b);
 
 
 #endif /* _NGX_RTMP_MPEGTS_H_INCLUDED_ */
@@ -7,7 +7,9 @@
 #include <ngx_config.h>
 #include <ngx_core.h>
 #include <ngx_http.h>
+#include <ngx_sha1.h>
 #include "ngx_rtmp_bandwidth.h"
+#include "ngx_rtmp_histogram.h"
 #include "ngx_rtmp_notify_module.h"
 #include "ngx_rtmp_relay_module.h"
 
@@ -24,6 +26,16 @@ static void ngx_http_flv_live_cleanup(void *data);
 static ngx_int_t ngx_http_flv_live_init_process(ngx_cycle_t *cycle);
 
 static void ngx_http_flv_live_send_tail(ngx_rtmp_session_t *s);
+static ngx_int_t ngx_http_flv_live_websocket(ngx_http_request_t *r,
+                                             ngx_http_flv_live_ctx_t *ctx);
+static ngx_int_t ngx_http_flv_live_ws_accept(ngx_http_request_t *r,
+                                             ngx_http_flv_live_ctx_t *ctx);
+static void ngx_http_flv_live_send_ws_frame(ngx_rtmp_session_t *s,
+                                            u_char opcode, u_char *data,
+                                            size_t len);
+static ngx_int_t ngx_http_flv_live_ws_read(ngx_rtmp_session_t *s,
+                                           ngx_http_flv_live_ctx_t *ctx,
+                                           u_char *p, size_t n);
 static ngx_int_t ngx_http_flv_live_send_message(ngx_rtmp_session_t *s,
                                                 ngx_chain_t *out,
                                                 ngx_uint_t priority);
@@ -156,6 +168,18 @@ static ngx_str_t ngx_http_status_lines[] = {
 extern ngx_rtmp_live_proc_handler_t ngx_rtmp_live_proc_handler;
 static ngx_rtmp_live_proc_handler_t ngx_http_flv_live_proc_handler = {
     NULL,
+    NULL,
+    NULL,
+    ngx_http_flv_live_send_message,
+    ngx_http_flv_live_meta_message,
+    ngx_http_flv_live_append_message,
+    ngx_http_flv_live_free_message};
+
+/*
+ * same callbacks, but a handler of its own: the live fan-out serializes a
+ * message once per handler, so all WebSocket viewers share one framed copy
+ */
+static ngx_rtmp_live_proc_handler_t ngx_http_flv_live_ws_proc_handler = {
     NULL,
     NULL,
     NULL,
@@ -164,8 +188,19 @@ static ngx_rtmp_live_proc_handler_t ngx_http_flv_live_proc_handler = {
     ngx_http_flv_live_append_message,
     ngx_http_flv_live_free_message};
 
+/* MPEG-TS, replay is muxed per viewer, the live fan-out once per message */
+static ngx_rtmp_live_proc_handler_t ngx_http_flv_live_ts_proc_handler = {
+    NULL,
+    NULL,
+    NULL,
+    ngx_http_flv_live_send_message,
+    ngx_http_flv_live_ts_meta_message,
+    ngx_http_flv_live_ts_append_message,
+    ngx_http_flv_live_free_message};
+
 ngx_rtmp_live_proc_handler_t *ngx_rtmp_live_proc_handlers[] = {
-    &ngx_rtmp_live_proc_handler, &ngx_http_flv_live_proc_handler};
+    &ngx_rtmp_live_proc_handler, &ngx_http_flv_live_proc_handler,
+    &ngx_http_flv_live_ws_proc_handler, &ngx_http_flv_live_ts_proc_handler};
 
 static ngx_int_t ngx_http_flv_live_init_handlers(ngx_cycle_t *cycle);
 
@@ -210,6 +245,10 @@ static ngx_command_t ngx_http_flv_live_commands[] = {
      ngx_conf_set_flag_slot, NGX_HTTP_LOC_CONF_OFFSET,
      offsetof(ngx_http_flv_live_conf_t, flv_live), NULL},
 
+    {ngx_string("ts_live"), NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+     ngx_conf_set_flag_slot, NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof(ngx_http_flv_live_conf_t, ts_live), NULL},
+
     {ngx_string("poll_interval"), NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
      ngx_conf_set_msec_slot, NGX_HTTP_LOC_CONF_OFFSET,
      offsetof(ngx_http_flv_live_conf_t, poll_interval), NULL},
@@ -255,6 +294,7 @@ void *ngx_http_flv_live_create_loc_conf(ngx_conf_t *cf) {
   }
 
   conf->flv_live = NGX_CONF_UNSET;
+  conf->ts_live = NGX_CONF_UNSET;
   conf->poll_interval = NGX_CONF_UNSET_MSEC;
 
   return (void *)conf;
@@ -266,6 +306,7 @@ char *ngx_http_flv_live_merge_loc_conf(ngx_conf_t *cf, void *parent,
   ngx_http_flv_live_conf_t *conf = child;
 
   ngx_conf_merge_value(conf->flv_live, prev->flv_live, 0);
+  ngx_conf_merge_value(conf->ts_live, prev->ts_live, 0);
   ngx_conf_merge_msec_value(conf->poll_interval, prev->poll_interval, 20);
 
   if (conf->poll_interval == 0) {
@@ -321,6 +362,7 @@ ngx_int_t ngx_http_flv_live_send_header(ngx_rtmp_session_t *s) {
   ngx_http_request_t *r;
   ngx_rtmp_live_ctx_t *live_ctx;
   ngx_rtmp_codec_ctx_t *codec_ctx;
+  ngx_http_flv_live_ctx_t *hctx;
   ngx_list_part_t *part;
   ngx_table_elt_t *e, *header;
   u_char *p;
@@ -339,10 +381,23 @@ ngx_int_t ngx_http_flv_live_send_header(ngx_rtmp_session_t *s) {
   u_char flv_header[] = "FLV\x1\0\0\0\0\x9\0\0\0\0";
 
   r = s->data;
+  hctx = ngx_http_get_module_ctx(r, ngx_http_flv_live_module);
 
-  r->headers_out.status = NGX_HTTP_OK;
+  if (hctx->websocket) {
+    if (ngx_http_flv_live_ws_accept(r, hctx) != NGX_OK) {
+      return NGX_ERROR;
+    }
+
+  } else if (hctx->ts) {
+    r->headers_out.status = NGX_HTTP_OK;
+
+    ngx_str_set(&r->headers_out.content_type, "video/mp2t");
 
-  ngx_str_set(&r->headers_out.content_type, "video/x-flv");
+  } else {
+    r->headers_out.status = NGX_HTTP_OK;
+
+    ngx_str_set(&r->headers_out.content_type, "video/x-flv");
+  }
 
   /* fill HTTP header 'Connection' according to headers_in */
   r->keepalive = 0;
@@ -380,6 +435,11 @@ ngx_int_t ngx_http_flv_live_send_header(ngx_rtmp_session_t *s) {
     r->keepalive = 1;
   }
 
+  if (hctx->ts) {
+    /* not chunked, the TS body ends with the connection */
+    r->keepalive = 0;
+  }
+
   live_ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_live_module);
   if (live_ctx && !live_ctx->active) {
     ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
@@ -400,7 +460,22 @@ ngx_int_t ngx_http_flv_live_send_header(ngx_rtmp_session_t *s) {
     flv_header[4] |= (0x1 << 2);
   }
 
-  if (clcf->chunked_transfer_encoding) {
+  if (hctx->websocket) {
+    /* the FLV header is the first binary frame */
+    p = chunked_flv_header_data;
+    *p++ = 0x80 | NGX_HTTP_FLV_LIVE_WS_BINARY;
+    *p++ = 13;
+    ngx_memmove(p, flv_header, 13);
+
+    buf_flv_hdr.pos = chunked_flv_header_data;
+    buf_flv_hdr.last = chunked_flv_header_data + 2 + 13;
+
+  } else if (hctx->ts) {
+    /* no FLV header, the body starts with the PAT/PMT */
+    buf_flv_hdr.pos = NULL;
+    buf_flv_hdr.last = NULL;
+
+  } else if (clcf->chunked_transfer_encoding) {
     r->chunked = 1;
 
     p = chunked_flv_header_data;
@@ -452,7 +527,13 @@ ngx_int_t ngx_http_flv_live_send_header(ngx_rtmp_session_t *s) {
 
   cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
 
-  pkt = ngx_rtmp_append_shared_bufs(cscf, NULL, &cl_flv_hdr);
+  if (hctx->ts) {
+    pkt = ngx_http_flv_live_ts_header(s);
+
+  } else {
+    pkt = ngx_rtmp_append_shared_bufs(cscf, NULL, &cl_flv_hdr);
+  }
+
   if (pkt == NULL) {
     return NGX_ERROR;
   }
@@ -532,9 +613,11 @@ ngx_int_t ngx_http_flv_live_header_filter(ngx_rtmp_session_t *s) {
   ngx_table_elt_t *header;
   ngx_http_core_loc_conf_t *clcf;
   ngx_rtmp_core_srv_conf_t *cscf;
+  ngx_http_flv_live_ctx_t *ctx;
   ngx_http_request_t *r;
 
   r = s->data;
+  ctx = ngx_http_get_module_ctx(r, ngx_http_flv_live_module);
 
   if (r->header_sent) {
     return NGX_OK;
@@ -654,7 +737,10 @@ ngx_int_t ngx_http_flv_live_header_filter(ngx_rtmp_session_t *s) {
     len += sizeof("Transfer-Encoding: chunked" CRLF) - 1;
   }
 
-  if (r->keepalive) {
+  if (ctx->websocket) {
+    len += sizeof("Connection: upgrade" CRLF) - 1;
+
+  } else if (r->keepalive) {
     len += sizeof("Connection: keep-alive" CRLF) - 1;
 
     /*
@@ -775,7 +861,11 @@ ngx_int_t ngx_http_flv_live_header_filter(ngx_rtmp_session_t *s) {
                          sizeof("Transfer-Encoding: chunked" CRLF) - 1);
   }
 
-  if (r->keepalive) {
+  if (ctx->websocket) {
+    b->last = ngx_cpymem(b->last, "Connection: upgrade" CRLF,
+                         sizeof("Connection: upgrade" CRLF) - 1);
+
+  } else if (r->keepalive) {
     b->last = ngx_cpymem(b->last, "Connection: keep-alive" CRLF,
                          sizeof("Connection: keep-alive" CRLF) - 1);
 
@@ -863,33 +953,281 @@ void ngx_http_flv_live_send_tail(ngx_rtmp_session_t *s) {
   ngx_rtmp_free_shared_chain(cscf, pkt);
 }
 
-ngx_int_t ngx_http_flv_live_send_message(ngx_rtmp_session_t *s,
-                                         ngx_chain_t *out,
-                                         ngx_uint_t priority) {
-  ngx_uint_t nmsg;
-  ssize_t delta;
+/*
+ * RFC 6455 upgrade: GET with "Upgrade: websocket", a Sec-WebSocket-Key
+ * and version 13. Anything else is served as plain HTTP-FLV.
+ */
+ngx_int_t ngx_http_flv_live_websocket(ngx_http_request_t *r,
+                                      ngx_http_flv_live_ctx_t *ctx) {
+  ngx_list_part_t *part;
+  ngx_table_elt_t *header, *upgrade, *key, *version;
+  ngx_uint_t i;
+
+  upgrade = NULL;
+  key = NULL;
+  version = NULL;
+
+  part = &r->headers_in.headers.part;
+  header = part->elts;
+
+  for (i = 0; /* void */; i++) {
+    if (i >= part->nelts) {
+      if (part->next == NULL) {
+        break;
+      }
+
+      part = part->next;
+      header = part->elts;
+      i = 0;
+    }
+
+    if (header[i].hash == 0) {
+      continue;
+    }
 
-  delta = s->out_last - s->out_pos;
-  nmsg = (delta >= 0 ? delta : -delta) % s->out_queue + 1;
+    if (ngx_strcasecmp(header[i].key.data, (u_char *)"upgrade") == 0) {
+      upgrade = &header[i];
 
-  if (priority > 3) {
-    priority = 3;
+    } else if (ngx_strcasecmp(header[i].key.data,
+                              (u_char *)"sec-websocket-key") == 0) {
+      key = &header[i];
+
+    } else if (ngx_strcasecmp(header[i].key.data,
+                              (u_char *)"sec-websocket-version") == 0) {
+      version = &header[i];
+    }
   }
 
-  /* drop packet?
-   * Note we always leave 1 slot free */
-  if (nmsg + priority * s->out_queue / 4 >= s->out_queue) {
-    ngx_log_debug2(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
-                   "flv live: HTTP drop message bufs='%ui', priority='%ui'",
-                   nmsg, priority);
+  if (upgrade == NULL ||
+      ngx_strcasecmp(upgrade->value.data, (u_char *)"websocket") != 0) {
+    return NGX_OK;
+  }
 
-    return NGX_AGAIN;
+  if (r->http_version < NGX_HTTP_VERSION_11 || key == NULL ||
+      key->value.len == 0 || version == NULL ||
+      ngx_strcmp(version->value.data, "13") != 0) {
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                  "flv live: invalid websocket upgrade request");
+
+    return NGX_ERROR;
+  }
+
+  ctx->websocket = 1;
+  ctx->ws_key = key->value;
+
+  return NGX_OK;
+}
+
+ngx_int_t ngx_http_flv_live_ws_accept(ngx_http_request_t *r,
+                                      ngx_http_flv_live_ctx_t *ctx) {
+  ngx_sha1_t sha1;
+  ngx_str_t src, accept;
+  ngx_table_elt_t *h;
+  u_char digest[20];
+
+  static u_char guid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+  ngx_sha1_init(&sha1);
+  ngx_sha1_update(&sha1, ctx->ws_key.data, ctx->ws_key.len);
+  ngx_sha1_update(&sha1, guid, sizeof(guid) - 1);
+  ngx_sha1_final(digest, &sha1);
+
+  src.data = digest;
+  src.len = sizeof(digest);
+
+  accept.data = ngx_pnalloc(r->pool, ngx_base64_encoded_length(src.len));
+  if (accept.data == NULL) {
+    return NGX_ERROR;
+  }
+
+  ngx_encode_base64(&accept, &src);
+
+  r->headers_out.status = NGX_HTTP_SWITCHING_PROTOCOLS;
+  ngx_str_set(&r->headers_out.status_line, "101 Switching Protocols");
+
+  h = ngx_list_push(&r->headers_out.headers);
+  if (h == NULL) {
+    return NGX_ERROR;
+  }
+
+  h->hash = 1;
+  ngx_str_set(&h->key, "Upgrade");
+  ngx_str_set(&h->value, "websocket");
+
+  h = ngx_list_push(&r->headers_out.headers);
+  if (h == NULL) {
+    return NGX_ERROR;
+  }
+
+  h->hash = 1;
+  ngx_str_set(&h->key, "Sec-WebSocket-Accept");
+  h->value = accept;
+
+  return NGX_OK;
+}
+
+/* an unfragmented control frame, server frames are never masked */
+void ngx_http_flv_live_send_ws_frame(ngx_rtmp_session_t *s, u_char opcode,
+                                     u_char *data, size_t len) {
+  ngx_rtmp_core_srv_conf_t *cscf;
+  ngx_chain_t cl_frame, *pkt;
+  ngx_buf_t buf_frame;
+  u_char frame[2 + NGX_HTTP_FLV_LIVE_WS_CONTROL_SIZE];
+
+  len = ngx_min(len, NGX_HTTP_FLV_LIVE_WS_CONTROL_SIZE);
+
+  frame[0] = 0x80 | opcode;
+  frame[1] = (u_char)len;
+  ngx_memcpy(frame + 2, data, len);
+
+  buf_frame.start = frame;
+  buf_frame.pos = frame;
+  buf_frame.last = frame + 2 + len;
+  buf_frame.end = buf_frame.last;
+
+  cl_frame.buf = &buf_frame;
+  cl_frame.next = NULL;
+
+  cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
+
+  pkt = ngx_rtmp_append_shared_bufs(cscf, NULL, &cl_frame);
+  if (pkt == NULL) {
+    return;
+  }
+
+  ngx_http_flv_live_send_message(s, pkt, 0);
+  ngx_rtmp_free_shared_chain(cscf, pkt);
+}
+
+static size_t ngx_http_flv_live_ws_header_size(u_char *h, ngx_uint_t hlen) {
+  size_t size;
+
+  if (hlen < 2) {
+    return 2;
+  }
+
+  size = 2 + ((h[1] & 0x80) ? 4 : 0);
+
+  switch (h[1] & 0x7f) {
+    case 126:
+      size += 2;
+      break;
+
+    case 127:
+      size += 8;
+      break;
+  }
+
+  return size;
+}
+
+/*
+ * Viewers have nothing to say but pings and close, data frames are read
+ * and discarded. Returns NGX_ERROR when the connection must be closed.
+ */
+ngx_int_t ngx_http_flv_live_ws_read(ngx_rtmp_session_t *s,
+                                    ngx_http_flv_live_ctx_t *ctx, u_char *p,
+                                    size_t n) {
+  u_char *last, *h, *mask, opcode;
+  uint64_t left;
+  size_t size;
+  ngx_uint_t i;
+
+  last = p + n;
+
+  while (p < last) {
+    h = ctx->ws_header;
+
+    if (ctx->ws_hlen < ngx_http_flv_live_ws_header_size(h, ctx->ws_hlen)) {
+      h[ctx->ws_hlen++] = *p++;
+
+      if (ctx->ws_hlen < ngx_http_flv_live_ws_header_size(h, ctx->ws_hlen)) {
+        continue;
+      }
+
+      if (!(h[1] & 0x80)) {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                      "flv live: unmasked websocket frame from client");
+        return NGX_ERROR;
+      }
+
+      left = h[1] & 0x7f;
+
+      if (left == 126) {
+        left = ((uint64_t)h[2] << 8) | h[3];
+
+      } else if (left == 127) {
+        for (left = 0, i = 2; i < 10; i++) {
+          left = (left << 8) | h[i];
+        }
+      }
+
+      if ((h[0] & 0x08) && left > NGX_HTTP_FLV_LIVE_WS_CONTROL_SIZE) {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                      "flv live: websocket control frame too large");
+        return NGX_ERROR;
+      }
+
+      ctx->ws_left = left;
+      ctx->ws_pos = 0;
+
+      if (left) {
+        continue;
+      }
+
+    } else {
+      size = (size_t)ngx_min(ctx->ws_left, (uint64_t)(last - p));
+
+      /* control frame payloads are kept unmasked for the reply */
+      if (h[0] & 0x08) {
+        mask = h + ctx->ws_hlen - 4;
+
+        for (i = 0; i < size; i++) {
+          ctx->ws_payload[ctx->ws_pos + i] =
+              p[i] ^ mask[(ctx->ws_pos + i) & 3];
+        }
+      }
+
+      ctx->ws_pos += size;
+      ctx->ws_left -= size;
+      p += size;
+
+      if (ctx->ws_left) {
+        continue;
+      }
+    }
+
+    /* a whole frame */
+
+    ctx->ws_hlen = 0;
+    opcode = h[0] & 0x0f;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, s->connection->log, 0,
+                   "flv live: websocket frame opcode=%d len=%ui",
+                   (int)opcode, ctx->ws_pos);
+
+    switch (opcode) {
+      case NGX_HTTP_FLV_LIVE_WS_CLOSE:
+        return NGX_ERROR;
+
+      case NGX_HTTP_FLV_LIVE_WS_PING:
+        ngx_http_flv_live_send_ws_frame(s, NGX_HTTP_FLV_LIVE_WS_PONG,
+                                        ctx->ws_payload, ctx->ws_pos);
+        break;
+    }
   }
 
-  s->out[s->out_last++] = out;
-  s->out_last %= s->out_queue;
+  return NGX_OK;
+}
 
-  ngx_rtmp_acquire_shared_chain(out);
+ngx_int_t ngx_http_flv_live_send_message(ngx_rtmp_session_t *s,
+                                         ngx_chain_t *out,
+                                         ngx_uint_t priority) {
+  ngx_uint_t nmsg;
+
+  if (ngx_rtmp_queue_message(s, out, priority, &nmsg) != NGX_OK) {
+    return NGX_AGAIN;
+  }
 
   ngx_log_debug3(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
                  "flv live: HTTP send nmsg='%ui', priority='%ui' '#%ui'", nmsg,
@@ -900,7 +1238,7 @@ ngx_int_t ngx_http_flv_live_send_message(ngx_rtmp_session_t *s,
   }
 
   if (!s->connection->write->active) {
-    ngx_http_flv_live_write_handler(s->connection->write);
+    ngx_rtmp_flush_message(s, ngx_http_flv_live_write_handler);
   }
 
   return NGX_OK;
@@ -991,6 +1329,8 @@ ngx_int_t ngx_http_flv_live_join(ngx_rtmp_session_t *s, u_char *name,
   ngx_rtmp_live_app_conf_t *lacf;
 
   ngx_rtmp_relay_app_conf_t *racf;
+  ngx_http_flv_live_ctx_t *hctx;
+  ngx_http_request_t *r;
   ngx_flag_t create;
 
   /* only for subscribers */
@@ -1064,12 +1404,23 @@ ngx_int_t ngx_http_flv_live_join(ngx_rtmp_session_t *s, u_char *name,
     } while (0);
   }
 
-  ctx->stream = *stream;
+  r = s->data;
+  hctx = ngx_http_get_module_ctx(r, ngx_http_flv_live_module);
+
   ctx->publishing = publisher;
-  ctx->next = (*stream)->ctx;
-  ctx->protocol = NGX_RTMP_PROTOCOL_HTTP;
+  if (hctx->ts) {
+    ctx->protocol = NGX_RTMP_PROTOCOL_TS;
+
+  } else if (hctx->websocket) {
+    ctx->protocol = NGX_RTMP_PROTOCOL_WEBSOCKET;
+
+  } else {
+    ctx->protocol = NGX_RTMP_PROTOCOL_HTTP;
+  }
 
-  (*stream)->ctx = ctx;
+  if (ngx_rtmp_live_link_ctx(*stream, ctx) != NGX_OK) {
+    return NGX_ERROR;
+  }
 
   if (ctx->stream->pub_ctx) {
     s->publisher = ctx->stream->pub_ctx->session;
@@ -1154,11 +1505,20 @@ next:
 static void ngx_http_flv_live_close_http_request(ngx_rtmp_session_t *s) {
   ngx_http_request_t *r;
 
+  ngx_http_flv_live_ctx_t *ctx;
+
   r = s->data;
   if (r && r->connection && !r->connection->destroyed) {
     r->main->count--;
 
-    if (r->chunked) {
+    ctx = ngx_http_get_module_ctx(r, ngx_http_flv_live_module);
+
+    if (ctx && ctx->websocket) {
+      /* 1000, normal closure */
+      ngx_http_flv_live_send_ws_frame(s, NGX_HTTP_FLV_LIVE_WS_CLOSE,
+                                      (u_char *)"\x03\xe8", 2);
+
+    } else if (r->chunked) {
       ngx_http_flv_live_send_tail(s);
     }
   }
@@ -1166,7 +1526,7 @@ static void ngx_http_flv_live_close_http_request(ngx_rtmp_session_t *s) {
 
 ngx_int_t ngx_http_flv_live_close_stream(ngx_rtmp_session_t *s,
                                          ngx_rtmp_close_stream_t *v) {
-  ngx_rtmp_live_ctx_t *ctx, **cctx, *unlink;
+  ngx_rtmp_live_ctx_t *ctx, *pctx, *next;
   ngx_http_request_t *r;
   ngx_rtmp_live_app_conf_t *lacf;
   ngx_flag_t passive;
@@ -1208,48 +1568,34 @@ ngx_int_t ngx_http_flv_live_close_stream(ngx_rtmp_session_t *s,
                  "flv live: leave '%s'", ctx->stream->name);
 
   if (passive) {
-    /* TODO: maybe using red-black tree is more efficient */
-    for (cctx = &ctx->stream->ctx; *cctx; /* void */) {
-      if ((*cctx)->protocol == NGX_RTMP_PROTOCOL_HTTP) {
-        ngx_http_flv_live_close_http_request((*cctx)->session);
-
-        if (!(*cctx)->publishing && (*cctx)->stream->active) {
-          ngx_http_flv_live_set_status((*cctx)->session, 0);
-        }
+    for (pctx = ctx->stream->ctx; pctx; pctx = next) {
+      next = pctx->next;
 
-        ngx_http_flv_live_free_request((*cctx)->session);
-        ngx_rtmp_finalize_session((*cctx)->session);
+      if (pctx->protocol != NGX_RTMP_PROTOCOL_RTMP) {
+        ngx_http_flv_live_close_http_request(pctx->session);
 
-        unlink = *cctx;
+        if (!pctx->publishing && pctx->stream->active) {
+          ngx_http_flv_live_set_status(pctx->session, 0);
+        }
 
-        *cctx = (*cctx)->next;
+        ngx_http_flv_live_free_request(pctx->session);
+        ngx_rtmp_finalize_session(pctx->session);
 
-        unlink->next = NULL;
+        ngx_rtmp_live_unlink_ctx(pctx);
       } else {
-        ngx_rtmp_finalize_session((*cctx)->session);
-
-        cctx = &(*cctx)->next;
+        ngx_rtmp_finalize_session(pctx->session);
       }
     }
   } else {
-    for (cctx = &ctx->stream->ctx; *cctx; /* void */) {
-      if (*cctx == ctx) {
-        if (!ctx->publishing && ctx->stream->active) {
-          ngx_http_flv_live_set_status(s, 0);
-        }
-
-        *cctx = ctx->next;
+    if (!ctx->publishing && ctx->stream->active) {
+      ngx_http_flv_live_set_status(s, 0);
+    }
 
-        ctx->next = NULL;
-        ctx->stream = NULL;
+    ngx_rtmp_live_unlink_ctx(ctx);
 
-        ngx_http_flv_live_free_request(s);
+    ctx->stream = NULL;
 
-        break;
-      } else {
-        cctx = &(*cctx)->next;
-      }
-    }
+    ngx_http_flv_live_free_request(s);
   }
 
   /**
@@ -1363,7 +1709,16 @@ void ngx_http_flv_live_read_handler(ngx_event_t *rev) {
   ctx = ngx_http_get_module_ctx(r, ngx_http_flv_live_module);
   s = ctx->s;
 
-  n = c->recv(c, buf, sizeof(buf));
+  for (;;) {
+    n = c->recv(c, buf, sizeof(buf));
+
+    if (n > 0 && ctx->websocket &&
+        ngx_http_flv_live_ws_read(s, ctx, buf, n) == NGX_OK) {
+      continue;
+    }
+
+    break;
+  }
 
   if (n == NGX_AGAIN) {
     ngx_add_timer(c->read, s->timeout);
@@ -1381,7 +1736,6 @@ void ngx_http_flv_live_write_handler(ngx_event_t *wev) {
   ngx_http_request_t *r;
   ngx_rtmp_session_t *s;
   ngx_int_t n;
-  ngx_rtmp_core_srv_conf_t *cscf;
   ngx_http_flv_live_ctx_t *ctx;
 
   c = wev->data;
@@ -1430,16 +1784,13 @@ void ngx_http_flv_live_write_handler(ngx_event_t *wev) {
     s->out_bytes += n;
     s->ping_reset = 1;
     ngx_rtmp_update_bandwidth(&ngx_rtmp_bw_out, n);
+    ngx_rtmp_update_histogram(&ngx_rtmp_hist_send, n);
     s->out_bpos += n;
 
     if (s->out_bpos == s->out_chain->buf->last) {
       s->out_chain = s->out_chain->next;
       if (s->out_chain == NULL) {
-        cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
-        ngx_rtmp_free_shared_chain(cscf, s->out[s->out_pos]);
-        s->out[s->out_pos] = NULL;
-        ++s->out_pos;
-        s->out_pos %= s->out_queue;
+        ngx_rtmp_dequeue_message(s);
         if (s->out_pos == s->out_last) {
           break;
         }
@@ -1734,34 +2085,19 @@ ngx_rtmp_session_t *ngx_http_flv_live_init_session(
     return NULL;
   }
 
-  s->out_pool = ngx_create_pool(4096, c->log);
-  if (s->out_pool == NULL) {
-    return NULL;
-  }
+  /*
+   * http viewers only play: they never read rtmp chunks, so they get no
+   * input chunk streams or input pools, and the out ring lives in the
+   * connection pool instead of a pool of its own
+   */
 
-  s->out = ngx_pcalloc(
-      s->out_pool, sizeof(ngx_chain_t *) *
-                       ((ngx_rtmp_core_srv_conf_t *)addr_conf->default_server
-                            ->ctx->srv_conf[ngx_rtmp_core_module.ctx_index])
-                           ->out_queue);
-  if (s->out == NULL) {
-    return NULL;
-  }
+  cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
 
-  s->in_streams_pool = ngx_create_pool(4096, c->log);
-  if (s->in_streams_pool == NULL) {
+  if (ngx_rtmp_alloc_out_queue(s, c->pool, cscf->out_queue) != NGX_OK) {
     return NULL;
   }
 
-  cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
-
-  s->out_queue = cscf->out_queue;
   s->out_cork = cscf->out_cork;
-  s->in_streams = ngx_pcalloc(s->in_streams_pool,
-                              sizeof(ngx_rtmp_stream_t) * cscf->max_streams);
-  if (s->in_streams == NULL) {
-    return NULL;
-  }
 
 #if (nginx_version >= 1007005)
   ngx_queue_init(&s->posted_dry_events);
@@ -1770,7 +2106,7 @@ ngx_rtmp_session_t *ngx_http_flv_live_init_session(
   s->epoch = ngx_current_msec;
   s->timeout = cscf->timeout;
   s->buflen = cscf->buflen;
-  ngx_rtmp_set_chunk_size(s, NGX_RTMP_DEFAULT_CHUNK_SIZE);
+  s->in_chunk_size = NGX_RTMP_DEFAULT_CHUNK_SIZE;
 
   if (ngx_rtmp_fire_event(s, NGX_RTMP_CONNECT, NULL, NULL) != NGX_OK) {
     return NULL;
@@ -1856,7 +2192,9 @@ ngx_chain_t *ngx_http_flv_live_append_message(ngx_rtmp_session_t *s,
                                               ngx_rtmp_header_t *lh,
                                               ngx_chain_t *in) {
   ngx_rtmp_core_srv_conf_t *cscf;
+  ngx_http_flv_live_ctx_t *ctx;
   ngx_http_request_t *r;
+  ngx_uint_t framing;
 
   cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
   if (cscf == NULL) {
@@ -1869,7 +2207,19 @@ ngx_chain_t *ngx_http_flv_live_append_message(ngx_rtmp_session_t *s,
     return NULL;
   }
 
-  return ngx_http_flv_live_append_shared_bufs(cscf, h, in, r->chunked);
+  ctx = ngx_http_get_module_ctx(r, ngx_http_flv_live_module);
+
+  if (ctx->websocket) {
+    framing = NGX_HTTP_FLV_LIVE_FRAMING_WEBSOCKET;
+
+  } else if (r->chunked) {
+    framing = NGX_HTTP_FLV_LIVE_FRAMING_CHUNKED;
+
+  } else {
+    framing = NGX_HTTP_FLV_LIVE_FRAMING_NONE;
+  }
+
+  return ngx_http_flv_live_append_shared_bufs(cscf, h, in, framing);
 }
 
 /*
@@ -1881,7 +2231,7 @@ ngx_chain_t *ngx_http_flv_live_append_message(ngx_rtmp_session_t *s,
  */
 ngx_chain_t *ngx_http_flv_live_append_shared_bufs(
     ngx_rtmp_core_srv_conf_t *cscf, ngx_rtmp_header_t *h, ngx_chain_t *in,
-    ngx_flag_t chunked) {
+    ngx_uint_t framing) {
   ngx_chain_t *tag, *chunk_head, *chunk_tail, chunk, *iter, *last_in, **tail,
       prev_tag_size;
   u_char *pos, *p,
@@ -1892,6 +2242,8 @@ ngx_chain_t *ngx_http_flv_live_append_shared_bufs(
 #endif
   uint32_t data_size, size;
   off_t tag_size;
+  uint64_t frame_size;
+  ngx_uint_t i;
   ngx_buf_t prev_tag_size_buf, chunk_buf;
 
   for (data_size = 0, iter = in, last_in = iter; iter; iter = iter->next) {
@@ -1956,8 +2308,50 @@ ngx_chain_t *ngx_http_flv_live_append_shared_bufs(
   *pos++ = 0;
   *pos++ = 0;
 
+  /* one binary frame per tag, put in front as the chunk header is */
+  if (framing == NGX_HTTP_FLV_LIVE_FRAMING_WEBSOCKET) {
+    /* 4 is the size of previous tag size itself */
+    frame_size = (uint64_t)tag_size + 4;
+
+    pos = chunk_item;
+    *pos++ = 0x80 | NGX_HTTP_FLV_LIVE_WS_BINARY;
+
+    if (frame_size < 126) {
+      *pos++ = (u_char)frame_size;
+
+    } else if (frame_size < 65536) {
+      *pos++ = 126;
+      *pos++ = (u_char)(frame_size >> 8);
+      *pos++ = (u_char)frame_size;
+
+    } else {
+      *pos++ = 127;
+      for (i = 8; i--; /* void */) {
+        *pos++ = (u_char)(frame_size >> (i * 8));
+      }
+    }
+
+    chunk_buf.start = chunk_item;
+    chunk_buf.pos = chunk_buf.start;
+    chunk_buf.end = pos;
+    chunk_buf.last = chunk_buf.end;
+
+    chunk.buf = &chunk_buf;
+    chunk.next = NULL;
+
+    chunk_head = ngx_rtmp_append_shared_bufs(cscf, NULL, &chunk);
+    if (chunk_head == NULL) {
+      ngx_rtmp_free_shared_chain(cscf, tag);
+      return NULL;
+    }
+
+    chunk_head->next = tag;
+
+    return chunk_head;
+  }
+
   /* add chunk header and tail */
-  if (chunked) {
+  if (framing == NGX_HTTP_FLV_LIVE_FRAMING_CHUNKED) {
     /* 4 is the size of previous tag size itself */
     *ngx_sprintf(chunk_item, "%xO" CRLF, tag_size + 4) = 0;
 
@@ -2040,10 +2434,6 @@ static void ngx_http_flv_live_close_session_handler(ngx_rtmp_session_t *s) {
     ngx_del_timer(&s->ping_evt);
   }
 
-  if (s->in_old_pool) {
-    ngx_destroy_pool(s->in_old_pool);
-  }
-
   if (s->in_pool) {
     ngx_destroy_pool(s->in_pool);
   }
@@ -2084,7 +2474,7 @@ ngx_int_t ngx_http_flv_live_handler(ngx_http_request_t *r) {
   ngx_rtmp_connection_t *rconn;
 
   hfcf = ngx_http_get_module_loc_conf(r, ngx_http_flv_live_module);
-  if (!hfcf->flv_live) {
+  if (!hfcf->flv_live && !hfcf->ts_live) {
     return NGX_DECLINED;
   }
 
@@ -2123,6 +2513,12 @@ ngx_int_t ngx_http_flv_live_handler(ngx_http_request_t *r) {
     ngx_http_set_ctx(r, ctx, ngx_http_flv_live_module);
   }
 
+  ctx->ts = hfcf->ts_live;
+
+  if (!ctx->ts && ngx_http_flv_live_websocket(r, ctx) != NGX_OK) {
+    return NGX_HTTP_BAD_REQUEST;
+  }
+
   rconn = ngx_pcalloc(r->pool, sizeof(ngx_rtmp_connection_t));
   if (rconn == NULL) {
     return NGX_HTTP_INTERNAL_SERVER_ERROR;
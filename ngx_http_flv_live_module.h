@@ -15,6 +15,21 @@
 #define NGX_BUFF_MAX_SIZE 0x80
 #define NGX_FLV_TAG_HEADER_SIZE 11
 
+/* framing of the FLV stream on the HTTP connection */
+#define NGX_HTTP_FLV_LIVE_FRAMING_NONE 0
+#define NGX_HTTP_FLV_LIVE_FRAMING_CHUNKED 1
+#define NGX_HTTP_FLV_LIVE_FRAMING_WEBSOCKET 2
+
+/* RFC 6455, at most 2 + 8 bytes of header for an unmasked frame */
+#define NGX_HTTP_FLV_LIVE_WS_HEADER_SIZE 10
+#define NGX_HTTP_FLV_LIVE_WS_CONTROL_SIZE 125
+
+#define NGX_HTTP_FLV_LIVE_WS_CONTINUATION 0x0
+#define NGX_HTTP_FLV_LIVE_WS_BINARY 0x2
+#define NGX_HTTP_FLV_LIVE_WS_CLOSE 0x8
+#define NGX_HTTP_FLV_LIVE_WS_PING 0x9
+#define NGX_HTTP_FLV_LIVE_WS_PONG 0xa
+
 extern ngx_module_t ngx_rtmp_module;
 
 #define ngx_rtmp_cycle_get_module_main_conf(cycle, module)               \
@@ -27,21 +42,37 @@ typedef struct ngx_http_flv_live_ctx_s {
   ngx_rtmp_session_t *s;
   ngx_flag_t flv_live;
   ngx_flag_t header_sent;
+  ngx_flag_t websocket;
+  ngx_flag_t ts;
 
   ngx_str_t app;
   ngx_str_t port;
   ngx_str_t stream;
 
   ngx_event_t play;
+
+  /* WebSocket handshake and inbound frame parser */
+  ngx_str_t ws_key;
+  u_char ws_header[14];
+  ngx_uint_t ws_hlen;
+  uint64_t ws_left;
+  ngx_uint_t ws_pos;
+  u_char ws_payload[NGX_HTTP_FLV_LIVE_WS_CONTROL_SIZE];
+
+  /* HTTP-TS continuity counters of GOP cache and time-shift replay */
+  ngx_uint_t ts_psi_cc;
+  ngx_uint_t ts_video_cc;
+  ngx_uint_t ts_audio_cc;
+  ngx_flag_t ts_resync;
 } ngx_http_flv_live_ctx_t;
 
 typedef struct ngx_http_flv_live_conf_s {
   ngx_flag_t flv_live;
+  ngx_flag_t ts_live;
   ngx_msec_t poll_interval;
 } ngx_http_flv_live_conf_t;
 
 typedef struct {
-  ngx_chain_t *meta;
   ngx_chain_t *apkt;
   ngx_chain_t *acopkt;
   ngx_chain_t *rpkt;
@@ -60,6 +91,18 @@ ngx_int_t ngx_http_flv_live_send_header(ngx_rtmp_session_t *s);
 void ngx_http_flv_live_set_status(ngx_rtmp_session_t *s, unsigned active);
 ngx_chain_t *ngx_http_flv_live_append_shared_bufs(
     ngx_rtmp_core_srv_conf_t *cscf, ngx_rtmp_header_t *h, ngx_chain_t *in,
-    ngx_flag_t chunked);
+    ngx_uint_t framing);
+
+ngx_chain_t *ngx_http_flv_live_ts_header(ngx_rtmp_session_t *s);
+ngx_chain_t *ngx_http_flv_live_ts_meta_message(ngx_rtmp_session_t *s,
+                                               ngx_chain_t *in);
+ngx_chain_t *ngx_http_flv_live_ts_live_message(ngx_rtmp_session_t *s,
+                                               ngx_rtmp_header_t *h,
+                                               ngx_chain_t *in);
+ngx_chain_t *ngx_http_flv_live_ts_append_message(ngx_rtmp_session_t *s,
+                                                 ngx_rtmp_header_t *h,
+                                                 ngx_rtmp_header_t *lh,
+                                                 ngx_chain_t *in);
+ngx_chain_t *ngx_http_flv_live_ts_resync(ngx_rtmp_session_t *s);
 
 #endif
@@ -0,0 +1,470 @@
+
+/*
+ * Copyright (C) Winshining
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include "ngx_http_flv_live_module.h"
+#include "hls/ngx_rtmp_mpegts.h"
+
+/*
+ * HTTP-TS output: H.264 and AAC messages are turned into elementary
+ * streams (AnnexB with AUD and SPS/PPS before IDR, ADTS) and packetized by
+ * the HLS muxer straight into memory. The live fan-out muxes a message
+ * once for all TS players of a stream with the stream continuity counters,
+ * whatever path a player takes through it. GOP cache and time-shift replay
+ * are muxed per player with the player's own counters, so they never skew
+ * the shared ones. Those start from the stream counters, and a player
+ * going back to the fan-out gets an adaptation field only packet per PID
+ * flagging the jump to the stream counters as a discontinuity. Messages
+ * producing no media (codec headers, metadata, codecs TS does not carry
+ * here) are answered with the PAT/PMT repeating the last continuity counter
+ * of the stream, a duplicate table players joining mid-stream sync on.
+ */
+
+#define NGX_HTTP_FLV_LIVE_TS_BUFSIZE (1024 * 1024)
+
+#define NGX_HTTP_FLV_LIVE_TS_PMT_PID 0x1001
+#define NGX_HTTP_FLV_LIVE_TS_VIDEO_PID 0x100
+#define NGX_HTTP_FLV_LIVE_TS_AUDIO_PID 0x101
+
+extern ngx_module_t ngx_http_flv_live_module;
+
+static u_char ngx_http_flv_live_ts_in[NGX_HTTP_FLV_LIVE_TS_BUFSIZE];
+static u_char ngx_http_flv_live_ts_es[NGX_HTTP_FLV_LIVE_TS_BUFSIZE];
+static u_char ngx_http_flv_live_ts_out[NGX_RTMP_MPEGTS_HEADER_SIZE +
+                                       ngx_rtmp_mpegts_size(
+                                           NGX_HTTP_FLV_LIVE_TS_BUFSIZE)];
+
+/* flatten a message, returns its end or NULL if it does not fit */
+static u_char *ngx_http_flv_live_ts_flatten(ngx_chain_t *in, u_char *out,
+                                            u_char *end) {
+  size_t len;
+
+  for (/* void */; in; in = in->next) {
+    len = in->buf->last - in->buf->pos;
+
+    if ((size_t)(end - out) < len) {
+      return NULL;
+    }
+
+    out = ngx_cpymem(out, in->buf->pos, len);
+  }
+
+  return out;
+}
+
+static ngx_chain_t *ngx_http_flv_live_ts_shared(ngx_rtmp_session_t *s,
+                                                u_char *last) {
+  ngx_rtmp_core_srv_conf_t *cscf;
+  ngx_chain_t cl;
+  ngx_buf_t b;
+
+  cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
+
+  ngx_memzero(&b, sizeof(b));
+
+  b.start = ngx_http_flv_live_ts_out;
+  b.pos = b.start;
+  b.last = last;
+  b.end = last;
+
+  cl.buf = &b;
+  cl.next = NULL;
+
+  return ngx_rtmp_append_shared_bufs(cscf, NULL, &cl);
+}
+
+static ngx_rtmp_live_stream_t *ngx_http_flv_live_ts_stream(
+    ngx_rtmp_session_t *s) {
+  ngx_rtmp_live_ctx_t *ctx;
+
+  ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_live_module);
+
+  return ctx ? ctx->stream : NULL;
+}
+
+ngx_chain_t *ngx_http_flv_live_ts_header(ngx_rtmp_session_t *s) {
+  ngx_rtmp_live_stream_t *stream;
+  ngx_uint_t cc;
+  u_char *last;
+
+  stream = ngx_http_flv_live_ts_stream(s);
+
+  /* the muxer advances the counter, repeat the last one sent instead */
+  cc = stream ? stream->ts_psi_cc - 1 : 0;
+  last = ngx_rtmp_mpegts_mux_header(ngx_http_flv_live_ts_out, &cc);
+
+  return ngx_http_flv_live_ts_shared(s, last);
+}
+
+ngx_chain_t *ngx_http_flv_live_ts_meta_message(ngx_rtmp_session_t *s,
+                                               ngx_chain_t *in) {
+  return ngx_http_flv_live_ts_header(s);
+}
+
+static u_char *ngx_http_flv_live_ts_sps_pps(ngx_chain_t *header, u_char *out,
+                                            u_char *end) {
+  u_char buf[1024], *p, *last;
+  ngx_uint_t n, nnals, len;
+
+  last = ngx_http_flv_live_ts_flatten(header, buf, buf + sizeof(buf));
+  if (last == NULL) {
+    return out;
+  }
+
+  /*
+   * skip flv fmt, AVC packet type, composition time, version, profile,
+   * compatibility, level and NAL size bytes
+   */
+  p = buf + 10;
+
+  for (n = 0; n < 2 && p < last; n++) {
+    /* SPS count is 5 lsb, PPS count is a byte */
+    nnals = *p++;
+    if (n == 0) {
+      nnals &= 0x1f;
+    }
+
+    for (/* void */; nnals; nnals--) {
+      if (last - p < 2) {
+        return out;
+      }
+
+      len = (p[0] << 8) | p[1];
+      p += 2;
+
+      if ((ngx_uint_t)(last - p) < len || (ngx_uint_t)(end - out) < len + 4) {
+        return out;
+      }
+
+      *out++ = 0;
+      *out++ = 0;
+      *out++ = 0;
+      *out++ = 1;
+      out = ngx_cpymem(out, p, len);
+
+      p += len;
+    }
+  }
+
+  return out;
+}
+
+static ngx_int_t ngx_http_flv_live_ts_avc(ngx_rtmp_codec_ctx_t *codec_ctx,
+                                          u_char *p, u_char *last,
+                                          ngx_rtmp_mpegts_frame_t *frame,
+                                          ngx_buf_t *es) {
+  static u_char aud_nal[] = {0x00, 0x00, 0x00, 0x01, 0x09, 0xf0};
+
+  ngx_uint_t i, len, nal_type, aud_sent, sps_pps_sent;
+  int32_t cts;
+
+  if (codec_ctx->video_codec_id != NGX_RTMP_VIDEO_H264 ||
+      codec_ctx->avc_header == NULL || codec_ctx->avc_nal_bytes == 0 ||
+      codec_ctx->avc_nal_bytes > 4 || last - p < 5 || p[1] != 1) {
+    return NGX_DECLINED;
+  }
+
+  frame->key = ((p[0] >> 4) == 1);
+
+  /* composition time, signed 24 bits */
+  cts = (p[2] << 16) | (p[3] << 8) | p[4];
+  if (cts & 0x800000) {
+    cts -= 0x1000000;
+  }
+
+  frame->pts = frame->dts + cts * 90;
+
+  p += 5;
+
+  aud_sent = 0;
+  sps_pps_sent = 0;
+
+  while ((ngx_uint_t)(last - p) >= codec_ctx->avc_nal_bytes) {
+    for (len = 0, i = 0; i < codec_ctx->avc_nal_bytes; i++) {
+      len = (len << 8) | *p++;
+    }
+
+    if (len == 0) {
+      continue;
+    }
+
+    if ((ngx_uint_t)(last - p) < len) {
+      break;
+    }
+
+    nal_type = p[0] & 0x1f;
+
+    /* parameter sets and delimiters are put in by us */
+    if (nal_type >= 7 && nal_type <= 9) {
+      p += len;
+      continue;
+    }
+
+    if (!aud_sent) {
+      if ((size_t)(es->end - es->last) < sizeof(aud_nal)) {
+        return NGX_ERROR;
+      }
+
+      es->last = ngx_cpymem(es->last, aud_nal, sizeof(aud_nal));
+      aud_sent = 1;
+    }
+
+    if (nal_type == 5 && !sps_pps_sent) {
+      es->last = ngx_http_flv_live_ts_sps_pps(codec_ctx->avc_header, es->last,
+                                              es->end);
+      sps_pps_sent = 1;
+    }
+
+    if ((ngx_uint_t)(es->end - es->last) < len + 4) {
+      return NGX_ERROR;
+    }
+
+    *es->last++ = 0;
+    *es->last++ = 0;
+    *es->last++ = 0;
+    *es->last++ = 1;
+    es->last = ngx_cpymem(es->last, p, len);
+
+    p += len;
+  }
+
+  frame->pid = NGX_HTTP_FLV_LIVE_TS_VIDEO_PID;
+  frame->sid = 0xe0;
+
+  return es->last > es->pos ? NGX_OK : NGX_DECLINED;
+}
+
+static ngx_int_t ngx_http_flv_live_ts_aac(ngx_rtmp_codec_ctx_t *codec_ctx,
+                                          u_char *p, u_char *last,
+                                          ngx_rtmp_mpegts_frame_t *frame,
+                                          ngx_buf_t *es) {
+  u_char *h, *c;
+  ngx_uint_t objtype, srindex, chconf, size;
+
+  if (codec_ctx->audio_codec_id != NGX_RTMP_AUDIO_AAC ||
+      codec_ctx->aac_header == NULL || last - p < 3 || p[1] != 1) {
+    return NGX_DECLINED;
+  }
+
+  /* AudioSpecificConfig follows the 2 bytes of FLV audio header */
+  h = codec_ctx->aac_header->buf->pos;
+  if (codec_ctx->aac_header->buf->last - h < 4) {
+    return NGX_DECLINED;
+  }
+
+  objtype = h[2] >> 3;
+  srindex = ((h[2] << 1) & 0x0f) | ((h[3] & 0x80) >> 7);
+  chconf = (h[3] >> 3) & 0x0f;
+
+  if (objtype == 0 || objtype == 0x1f || srindex == 0x0f) {
+    return NGX_DECLINED;
+  }
+
+  if (objtype > 4) {
+    /* extended profiles as LC, as HLS does */
+    objtype = 2;
+  }
+
+  p += 2;
+  size = (last - p) + 7;
+
+  if ((ngx_uint_t)(es->end - es->last) < size || size > 0x1fff) {
+    return NGX_ERROR;
+  }
+
+  c = es->last;
+
+  c[0] = 0xff;
+  c[1] = 0xf1;
+  c[2] =
+      (u_char)(((objtype - 1) << 6) | (srindex << 2) | ((chconf & 0x04) >> 2));
+  c[3] = (u_char)(((chconf & 0x03) << 6) | ((size >> 11) & 0x03));
+  c[4] = (u_char)(size >> 3);
+  c[5] = (u_char)((size << 5) | 0x1f);
+  c[6] = 0xfc;
+
+  es->last = ngx_cpymem(c + 7, p, last - p);
+
+  frame->pts = frame->dts;
+  frame->pid = NGX_HTTP_FLV_LIVE_TS_AUDIO_PID;
+  frame->sid = 0xc0;
+
+  return NGX_OK;
+}
+
+static ngx_chain_t *ngx_http_flv_live_ts_mux(ngx_rtmp_session_t *s,
+                                             ngx_rtmp_header_t *h,
+                                             ngx_chain_t *in,
+                                             ngx_uint_t *psi_cc,
+                                             ngx_uint_t *video_cc,
+                                             ngx_uint_t *audio_cc) {
+  ngx_rtmp_codec_ctx_t *codec_ctx;
+  ngx_rtmp_mpegts_frame_t frame;
+  ngx_uint_t *cc;
+  ngx_buf_t es;
+  ngx_int_t rc;
+  u_char *last, *out;
+
+  codec_ctx = s->publisher ? ngx_rtmp_get_module_ctx(s->publisher,
+                                                     ngx_rtmp_codec_module)
+                           : NULL;
+
+  if (codec_ctx == NULL ||
+      (h->type != NGX_RTMP_MSG_VIDEO && h->type != NGX_RTMP_MSG_AUDIO)) {
+    return ngx_http_flv_live_ts_header(s);
+  }
+
+  last = ngx_http_flv_live_ts_flatten(
+      in, ngx_http_flv_live_ts_in,
+      ngx_http_flv_live_ts_in + NGX_HTTP_FLV_LIVE_TS_BUFSIZE);
+  if (last == NULL) {
+    ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                  "flv live: too big frame for ts");
+    return ngx_http_flv_live_ts_header(s);
+  }
+
+  ngx_memzero(&es, sizeof(es));
+  es.start = ngx_http_flv_live_ts_es;
+  es.end = es.start + NGX_HTTP_FLV_LIVE_TS_BUFSIZE;
+  es.pos = es.start;
+  es.last = es.start;
+
+  ngx_memzero(&frame, sizeof(frame));
+  frame.dts = (uint64_t)h->timestamp * 90;
+
+  if (h->type == NGX_RTMP_MSG_VIDEO) {
+    rc = ngx_http_flv_live_ts_avc(codec_ctx, ngx_http_flv_live_ts_in, last,
+                                  &frame, &es);
+    cc = video_cc;
+
+  } else {
+    rc = ngx_http_flv_live_ts_aac(codec_ctx, ngx_http_flv_live_ts_in, last,
+                                  &frame, &es);
+    cc = audio_cc;
+  }
+
+  if (rc != NGX_OK) {
+    return ngx_http_flv_live_ts_header(s);
+  }
+
+  out = ngx_http_flv_live_ts_out;
+
+  /* PSI in front of every key frame for players tuning in */
+  if (frame.key) {
+    out = ngx_rtmp_mpegts_mux_header(out, psi_cc);
+  }
+
+  frame.cc = *cc;
+  out = ngx_rtmp_mpegts_mux_frame(out, &frame, &es);
+  *cc = frame.cc;
+
+  return ngx_http_flv_live_ts_shared(s, out);
+}
+
+/* live fan-out, muxed once per message and shared by all TS players */
+ngx_chain_t *ngx_http_flv_live_ts_live_message(ngx_rtmp_session_t *s,
+                                               ngx_rtmp_header_t *h,
+                                               ngx_chain_t *in) {
+  ngx_rtmp_live_stream_t *stream;
+  ngx_http_request_t *r;
+
+  r = s->data;
+  if (r == NULL || (r->connection && r->connection->destroyed)) {
+    return NULL;
+  }
+
+  stream = ngx_http_flv_live_ts_stream(s);
+  if (stream == NULL) {
+    return ngx_http_flv_live_ts_header(s);
+  }
+
+  return ngx_http_flv_live_ts_mux(s, h, in, &stream->ts_psi_cc,
+                                  &stream->ts_video_cc, &stream->ts_audio_cc);
+}
+
+/* replay to a single player, with the player's own counters */
+ngx_chain_t *ngx_http_flv_live_ts_append_message(ngx_rtmp_session_t *s,
+                                                 ngx_rtmp_header_t *h,
+                                                 ngx_rtmp_header_t *lh,
+                                                 ngx_chain_t *in) {
+  ngx_rtmp_live_stream_t *stream;
+  ngx_http_flv_live_ctx_t *hctx;
+  ngx_http_request_t *r;
+  ngx_uint_t video_cc, audio_cc;
+  ngx_chain_t *pkt;
+
+  r = s->data;
+  if (r == NULL || (r->connection && r->connection->destroyed)) {
+    return NULL;
+  }
+
+  hctx = ngx_http_get_module_ctx(r, ngx_http_flv_live_module);
+  if (hctx == NULL) {
+    return ngx_http_flv_live_ts_header(s);
+  }
+
+  /* leaving the fan-out, carry on from where it stands */
+  stream = ngx_http_flv_live_ts_stream(s);
+  if (stream && !hctx->ts_resync) {
+    hctx->ts_psi_cc = stream->ts_psi_cc;
+    hctx->ts_video_cc = stream->ts_video_cc;
+    hctx->ts_audio_cc = stream->ts_audio_cc;
+  }
+
+  video_cc = hctx->ts_video_cc;
+  audio_cc = hctx->ts_audio_cc;
+
+  pkt = ngx_http_flv_live_ts_mux(s, h, in, &hctx->ts_psi_cc,
+                                 &hctx->ts_video_cc, &hctx->ts_audio_cc);
+
+  if (hctx->ts_video_cc != video_cc || hctx->ts_audio_cc != audio_cc) {
+    hctx->ts_resync = 1;
+  }
+
+  return pkt;
+}
+
+/*
+ * back to the fan-out after replay: the counters of every PID move to the
+ * stream ones in an adaptation field only packet with the discontinuity
+ * indicator set, which keeps the counter of the previous packet
+ */
+ngx_chain_t *ngx_http_flv_live_ts_resync(ngx_rtmp_session_t *s) {
+  static ngx_uint_t pids[] = {0, NGX_HTTP_FLV_LIVE_TS_PMT_PID,
+                              NGX_HTTP_FLV_LIVE_TS_VIDEO_PID,
+                              NGX_HTTP_FLV_LIVE_TS_AUDIO_PID};
+
+  ngx_rtmp_live_stream_t *stream;
+  ngx_uint_t n, cc[4];
+  u_char *p;
+
+  stream = ngx_http_flv_live_ts_stream(s);
+  if (stream == NULL) {
+    return NULL;
+  }
+
+  cc[0] = stream->ts_psi_cc;
+  cc[1] = stream->ts_psi_cc;
+  cc[2] = stream->ts_video_cc;
+  cc[3] = stream->ts_audio_cc;
+
+  p = ngx_http_flv_live_ts_out;
+
+  for (n = 0; n < 4; n++) {
+    p[0] = 0x47;
+    p[1] = (u_char)((pids[n] >> 8) & 0x1f);
+    p[2] = (u_char)pids[n];
+    p[3] = (u_char)(0x20 | (cc[n] & 0x0f));
+    p[4] = NGX_RTMP_MPEGTS_PACKET_SIZE - 5;
+    p[5] = 0x80;
+    ngx_memset(p + 6, 0xff, NGX_RTMP_MPEGTS_PACKET_SIZE - 6);
+
+    p += NGX_RTMP_MPEGTS_PACKET_SIZE;
+  }
+
+  return ngx_http_flv_live_ts_shared(s, p);
+}
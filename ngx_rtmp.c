@@ -1188,7 +1188,15 @@ ngx_int_t ngx_rtmp_set_virtual_server(ngx_rtmp_session_t *s, ngx_str_t *host) {
   s->server_changed = 1;
   s->srv_conf = cscf->ctx->srv_conf;
 
-  if (dcscf->out_queue != cscf->out_queue) {
+  if (dcscf->out_queue != cscf->out_queue && s->out_pool == NULL) {
+    /* http-flv session, the ring lives in the connection pool */
+    if (ngx_rtmp_alloc_out_queue(s, s->connection->pool, cscf->out_queue) !=
+        NGX_OK) {
+      ngx_rtmp_finalize_session(s);
+      return NGX_ERROR;
+    }
+
+  } else if (dcscf->out_queue != cscf->out_queue) {
     /* use new pool */
     s->out_temp_pool = ngx_create_pool(4096, s->connection->log);
     if (s->out_temp_pool == NULL) {
@@ -1201,16 +1209,13 @@ ngx_int_t ngx_rtmp_set_virtual_server(ngx_rtmp_session_t *s, ngx_str_t *host) {
     s->out_pool = s->out_temp_pool;
 
     /* send not used yet, need not copy data */
-    s->out = ngx_pcalloc(
-        s->out_pool,
-        sizeof(ngx_chain_t *) * ((ngx_rtmp_core_srv_conf_t *)cscf->ctx
-                                     ->srv_conf[ngx_rtmp_core_module.ctx_index])
-                                    ->out_queue);
-
-    s->out_queue = cscf->out_queue;
+    if (ngx_rtmp_alloc_out_queue(s, s->out_pool, cscf->out_queue) != NGX_OK) {
+      ngx_rtmp_finalize_session(s);
+      return NGX_ERROR;
+    }
   }
 
-  if (dcscf->max_streams != cscf->max_streams) {
+  if (s->in_streams && dcscf->max_streams != cscf->max_streams) {
     /* use new pool */
     s->in_streams_temp_pool = ngx_create_pool(4096, s->connection->log);
     if (s->in_streams_temp_pool == NULL) {
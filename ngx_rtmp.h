@@ -203,7 +203,12 @@ typedef struct {
  * + max 4  extended header (timestamp) */
 #define NGX_RTMP_MAX_CHUNK_HEADER 18
 
-enum { NGX_RTMP_PROTOCOL_RTMP = 0, NGX_RTMP_PROTOCOL_HTTP };
+enum {
+  NGX_RTMP_PROTOCOL_RTMP = 0,
+  NGX_RTMP_PROTOCOL_HTTP,
+  NGX_RTMP_PROTOCOL_WEBSOCKET,
+  NGX_RTMP_PROTOCOL_TS
+};
 
 #define NGX_RTMP_INTERNAL_SERVER_ERROR 500
 #define NGX_RTMP_MD5_LEN 16
@@ -223,9 +228,22 @@ typedef struct {
   uint32_t dtime;
   uint32_t len; /* current fragment length */
   uint8_t ext;
-  ngx_chain_t *in;
+  ngx_chain_t *in; /* last chunk received, in->next is the first one */
 } ngx_rtmp_stream_t;
 
+/*
+ * Inbound data is read into large blocks; chunk payloads are linked into
+ * messages by reference (buf->shadow points to the block) so a block is
+ * reused once every message referring to it has been handled.
+ */
+typedef struct ngx_rtmp_in_block_s ngx_rtmp_in_block_t;
+
+struct ngx_rtmp_in_block_s {
+  ngx_buf_t buf; /* must be first */
+  ngx_rtmp_in_block_t *next;
+  ngx_uint_t refs; /* chunks linked + 1 while reading into it */
+};
+
 /* disable zero-sized array warning by msvc */
 
 #if (NGX_WIN32)
@@ -350,18 +368,18 @@ struct ngx_rtmp_session_s {
   unsigned wait_notify_connect : 1;
   unsigned wait_notify_play : 1;
 
-  /* input stream 0 (reserved by RTMP spec)
-   * is used as free chain link */
-
   ngx_rtmp_stream_t *in_streams;
-  uint32_t in_csid;
   ngx_uint_t in_chunk_size;
   ngx_pool_t *in_pool;
   uint32_t in_bytes;
   uint32_t in_last_ack;
 
-  ngx_pool_t *in_old_pool;
-  ngx_int_t in_chunk_size_changing;
+  ngx_rtmp_in_block_t *in_block;
+  ngx_rtmp_in_block_t *in_free_blocks;
+  ngx_chain_t *in_free;
+  ngx_uint_t in_nfree;
+  size_t in_block_size;
+  size_t in_allocated;
 
   ngx_connection_t *connection;
 
@@ -376,6 +394,17 @@ struct ngx_rtmp_session_s {
   size_t out_cork;
   ngx_chain_t **out;
 
+  /* enqueue time and size of every message in out */
+  ngx_msec_t *out_msec;
+  size_t *out_size;
+  size_t out_queued;
+  ngx_uint_t out_dropped;
+  unsigned out_wait_key : 1;
+
+  /* set on play until the first key frame is queued */
+  unsigned out_join : 1;
+  ngx_msec_t out_join_msec;
+
   u_char stream_name[256];
 };
 
@@ -443,11 +472,14 @@ struct ngx_rtmp_core_srv_conf_s {
   ngx_chain_t *free;
   ngx_chain_t *free_hs;
   size_t max_message;
+  size_t in_buffer_size;
   ngx_flag_t play_time_fix;
   ngx_flag_t publish_time_fix;
   ngx_flag_t busy;
   size_t out_queue;
   size_t out_cork;
+  size_t out_queue_size;
+  ngx_msec_t out_queue_latency;
   ngx_msec_t buflen;
 
   ngx_rtmp_conf_ctx_t *ctx;
@@ -564,9 +596,8 @@ void ngx_rtmp_client_handshake(ngx_rtmp_session_t *s, unsigned async);
 void ngx_rtmp_free_handshake_buffers(ngx_rtmp_session_t *s);
 void ngx_rtmp_cycle(ngx_rtmp_session_t *s);
 void ngx_rtmp_reset_ping(ngx_rtmp_session_t *s);
+void ngx_rtmp_free_in_blocks(ngx_rtmp_session_t *s);
 
-ngx_chain_t *ngx_rtmp_alloc_in_buf(ngx_rtmp_session_t *s);
-ngx_int_t ngx_rtmp_finalize_set_chunk_size(ngx_rtmp_session_t *s);
 
 ngx_int_t ngx_rtmp_fire_event(ngx_rtmp_session_t *s, ngx_uint_t evt,
                               ngx_rtmp_header_t *h, ngx_chain_t *in);
@@ -638,6 +669,16 @@ void ngx_rtmp_prepare_message(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
 ngx_int_t ngx_rtmp_send_message(ngx_rtmp_session_t *s, ngx_chain_t *out,
                                 ngx_uint_t priority);
 
+/* Output queue shared by rtmp and http-flv sessions */
+ngx_int_t ngx_rtmp_alloc_out_queue(ngx_rtmp_session_t *s, ngx_pool_t *pool,
+                                   size_t n);
+ngx_int_t ngx_rtmp_queue_message(ngx_rtmp_session_t *s, ngx_chain_t *out,
+                                 ngx_uint_t priority, ngx_uint_t *nmsg);
+void ngx_rtmp_dequeue_message(ngx_rtmp_session_t *s);
+ngx_uint_t ngx_rtmp_queue_congested(ngx_rtmp_session_t *s, size_t size);
+/* send queued messages now, or once per loop while ngx_rtmp_send_deferred */
+void ngx_rtmp_flush_message(ngx_rtmp_session_t *s, ngx_event_handler_pt send);
+
 /* Note on priorities:
  * the bigger value the lower the priority.
  * priority=0 is the highest */
@@ -696,6 +737,18 @@ ngx_chain_t *ngx_rtmp_create_amf(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
 ngx_int_t ngx_rtmp_send_amf(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
                             ngx_rtmp_amf_elt_t *elts, size_t nelts);
 
+/*
+ * Pre-encoded AMF: replies encoded once at configuration time are copied
+ * per session with only their variable numbers patched in
+ */
+ngx_int_t ngx_rtmp_encode_amf(ngx_conf_t *cf, ngx_rtmp_amf_elt_t *elts,
+                              size_t nelts, ngx_str_t *out);
+ngx_chain_t *ngx_rtmp_create_encoded_amf(ngx_rtmp_session_t *s,
+                                         ngx_rtmp_header_t *h, u_char *data,
+                                         size_t len);
+ngx_int_t ngx_rtmp_send_encoded_amf(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
+                                    u_char *data, size_t len);
+
 /* AMF status sender */
 ngx_chain_t *ngx_rtmp_create_status(ngx_rtmp_session_t *s, char *code,
                                     char *level, char *desc);
@@ -726,6 +779,7 @@ static ngx_inline ngx_int_t ngx_rtmp_is_codec_header(ngx_chain_t *in) {
 
 
 extern ngx_uint_t ngx_rtmp_naccepted;
+extern ngx_uint_t ngx_rtmp_send_deferred;
 #if (nginx_version >= 1007011)
 extern ngx_queue_t ngx_rtmp_init_queue;
 #elif (nginx_version >= 1007005)
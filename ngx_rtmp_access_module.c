@@ -14,6 +14,10 @@ static ngx_rtmp_play_pt next_play;
 #define NGX_RTMP_ACCESS_PUBLISH 0x01
 #define NGX_RTMP_ACCESS_PLAY 0x02
 
+/* one compiled tree per access flag */
+#define NGX_RTMP_ACCESS_TREES 2
+#define ngx_rtmp_access_tree(flag) ((flag) == NGX_RTMP_ACCESS_PUBLISH ? 0 : 1)
+
 static char *ngx_rtmp_access_rule(ngx_conf_t *cf, ngx_command_t *cmd,
                                   void *conf);
 static ngx_int_t ngx_rtmp_access_postconfiguration(ngx_conf_t *cf);
@@ -44,6 +48,13 @@ typedef struct {
 #if (NGX_HAVE_INET6)
   ngx_array_t rules6; /* array of ngx_rtmp_access_rule6_t */
 #endif
+
+  /* rules compiled on merge, the value is the deny flag */
+  ngx_radix_tree_t *tree[NGX_RTMP_ACCESS_TREES];
+#if (NGX_HAVE_INET6)
+  ngx_radix_tree_t *tree6[NGX_RTMP_ACCESS_TREES];
+#endif
+  ngx_uint_t compiled;
 } ngx_rtmp_access_app_conf_t;
 
 static ngx_command_t ngx_rtmp_access_commands[] = {
@@ -131,11 +142,158 @@ static ngx_int_t ngx_rtmp_access_merge_rules(ngx_array_t *prev,
   return NGX_OK;
 }
 
+/*
+ * Rules are matched in order, so a rule goes into the tree only if no
+ * earlier rule covers its whole network.  Every prefix in the tree then
+ * belongs to the first rule matching the addresses under it, and the
+ * longest prefix found by a lookup is the first matching rule.
+ */
+
+static ngx_uint_t ngx_rtmp_access_covered(ngx_radix_tree_t *tree,
+                                          uint32_t key, uint32_t mask) {
+  uint32_t bit;
+  ngx_radix_node_t *node;
+
+  bit = 0x80000000;
+  node = tree->root;
+
+  while (node) {
+    if (node->value != NGX_RADIX_NO_VALUE) {
+      return 1;
+    }
+
+    if ((bit & mask) == 0) {
+      break;
+    }
+
+    node = (key & bit) ? node->right : node->left;
+    bit >>= 1;
+  }
+
+  return 0;
+}
+
+static ngx_int_t ngx_rtmp_access_compile(ngx_conf_t *cf, ngx_array_t *rules,
+                                         ngx_radix_tree_t **tree,
+                                         ngx_uint_t flag) {
+  uint32_t key, mask;
+  ngx_int_t rc;
+  ngx_uint_t i;
+  ngx_rtmp_access_rule_t *rule;
+
+  rule = rules->elts;
+
+  for (i = 0; i < rules->nelts; i++) {
+    if (!(rule[i].flags & flag)) {
+      continue;
+    }
+
+    if (*tree == NULL) {
+      *tree = ngx_radix_tree_create(cf->pool, 0);
+      if (*tree == NULL) {
+        return NGX_ERROR;
+      }
+    }
+
+    key = ntohl(rule[i].addr);
+    mask = ntohl(rule[i].mask);
+
+    if (ngx_rtmp_access_covered(*tree, key, mask)) {
+      continue;
+    }
+
+    rc = ngx_radix32tree_insert(*tree, key, mask, rule[i].deny);
+    if (rc == NGX_ERROR) {
+      return NGX_ERROR;
+    }
+  }
+
+  return NGX_OK;
+}
+
+#if (NGX_HAVE_INET6)
+
+static ngx_uint_t ngx_rtmp_access_covered6(ngx_radix_tree_t *tree, u_char *key,
+                                           u_char *mask) {
+  u_char bit;
+  ngx_uint_t i;
+  ngx_radix_node_t *node;
+
+  i = 0;
+  bit = 0x80;
+  node = tree->root;
+
+  while (node) {
+    if (node->value != NGX_RADIX_NO_VALUE) {
+      return 1;
+    }
+
+    if (i == 16 || (mask[i] & bit) == 0) {
+      break;
+    }
+
+    node = (key[i] & bit) ? node->right : node->left;
+
+    bit >>= 1;
+    if (bit == 0) {
+      bit = 0x80;
+      i++;
+    }
+  }
+
+  return 0;
+}
+
+static ngx_int_t ngx_rtmp_access_compile6(ngx_conf_t *cf, ngx_array_t *rules,
+                                          ngx_radix_tree_t **tree,
+                                          ngx_uint_t flag) {
+  ngx_int_t rc;
+  ngx_uint_t i;
+  ngx_rtmp_access_rule6_t *rule6;
+
+  rule6 = rules->elts;
+
+  for (i = 0; i < rules->nelts; i++) {
+    if (!(rule6[i].flags & flag)) {
+      continue;
+    }
+
+    if (*tree == NULL) {
+      *tree = ngx_radix_tree_create(cf->pool, 0);
+      if (*tree == NULL) {
+        return NGX_ERROR;
+      }
+    }
+
+    if (ngx_rtmp_access_covered6(*tree, rule6[i].addr.s6_addr,
+                                 rule6[i].mask.s6_addr)) {
+      continue;
+    }
+
+    rc = ngx_radix128tree_insert(*tree, rule6[i].addr.s6_addr,
+                                 rule6[i].mask.s6_addr, rule6[i].deny);
+    if (rc == NGX_ERROR) {
+      return NGX_ERROR;
+    }
+  }
+
+  return NGX_OK;
+}
+
+#endif
+
 static char *ngx_rtmp_access_merge_app_conf(ngx_conf_t *cf, void *parent,
                                             void *child) {
   ngx_rtmp_access_app_conf_t *prev = parent;
   ngx_rtmp_access_app_conf_t *conf = child;
 
+  ngx_uint_t n, own;
+
+  own = conf->rules.nelts;
+#if (NGX_HAVE_INET6)
+  own += conf->rules6.nelts;
+#endif
+
   if (ngx_rtmp_access_merge_rules(&prev->rules, &conf->rules) != NGX_OK) {
     return NGX_CONF_ERROR;
   }
@@ -146,6 +304,31 @@ static char *ngx_rtmp_access_merge_app_conf(ngx_conf_t *cf, void *parent,
   }
 #endif
 
+  conf->compiled = 1;
+
+  /* inherited rules share the trees of the parent */
+  if (!own && prev->compiled) {
+    ngx_memcpy(conf->tree, prev->tree, sizeof(conf->tree));
+#if (NGX_HAVE_INET6)
+    ngx_memcpy(conf->tree6, prev->tree6, sizeof(conf->tree6));
+#endif
+    return NGX_CONF_OK;
+  }
+
+  for (n = 0; n < NGX_RTMP_ACCESS_TREES; n++) {
+    if (ngx_rtmp_access_compile(cf, &conf->rules, &conf->tree[n], 1 << n) !=
+        NGX_OK) {
+      return NGX_CONF_ERROR;
+    }
+
+#if (NGX_HAVE_INET6)
+    if (ngx_rtmp_access_compile6(cf, &conf->rules6, &conf->tree6[n],
+                                 1 << n) != NGX_OK) {
+      return NGX_CONF_ERROR;
+    }
+#endif
+  }
+
   return NGX_CONF_OK;
 }
 
@@ -161,70 +344,65 @@ static ngx_int_t ngx_rtmp_access_found(ngx_rtmp_session_t *s, ngx_uint_t deny) {
 
 static ngx_int_t ngx_rtmp_access_inet(ngx_rtmp_session_t *s, in_addr_t addr,
                                       ngx_uint_t flag) {
-  ngx_uint_t i;
-  ngx_rtmp_access_rule_t *rule;
+  uintptr_t deny;
+  ngx_radix_tree_t *tree;
   ngx_rtmp_access_app_conf_t *ascf;
 
   ascf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_access_module);
 
-  rule = ascf->rules.elts;
-  for (i = 0; i < ascf->rules.nelts; i++) {
-    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, s->connection->log, 0,
-                   "access: %08XD %08XD %08XD", addr, rule[i].mask,
-                   rule[i].addr);
+  tree = ascf->tree[ngx_rtmp_access_tree(flag)];
+  if (tree == NULL) {
+    return NGX_OK;
+  }
 
-    if ((addr & rule[i].mask) == rule[i].addr && (flag & rule[i].flags)) {
-      return ngx_rtmp_access_found(s, rule[i].deny);
-    }
+  deny = ngx_radix32tree_find(tree, ntohl(addr));
+
+  ngx_log_debug2(NGX_LOG_DEBUG_HTTP, s->connection->log, 0,
+                 "access: %08XD %i", addr,
+                 deny == NGX_RADIX_NO_VALUE ? -1 : (ngx_int_t)deny);
+
+  if (deny == NGX_RADIX_NO_VALUE) {
+    return NGX_OK;
   }
 
-  return NGX_OK;
+  return ngx_rtmp_access_found(s, deny);
 }
 
 #if (NGX_HAVE_INET6)
 
 static ngx_int_t ngx_rtmp_access_inet6(ngx_rtmp_session_t *s, u_char *p,
                                        ngx_uint_t flag) {
-  ngx_uint_t n;
-  ngx_uint_t i;
-  ngx_rtmp_access_rule6_t *rule6;
+  uintptr_t deny;
+  ngx_radix_tree_t *tree;
   ngx_rtmp_access_app_conf_t *ascf;
 
   ascf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_access_module);
 
-  rule6 = ascf->rules6.elts;
-  for (i = 0; i < ascf->rules6.nelts; i++) {
+  tree = ascf->tree6[ngx_rtmp_access_tree(flag)];
+  if (tree == NULL) {
+    return NGX_OK;
+  }
+
+  deny = ngx_radix128tree_find(tree, p);
+
 #if (NGX_DEBUG)
-    {
-      size_t cl, ml, al;
-      u_char ct[NGX_INET6_ADDRSTRLEN];
-      u_char mt[NGX_INET6_ADDRSTRLEN];
-      u_char at[NGX_INET6_ADDRSTRLEN];
-
-      cl = ngx_inet6_ntop(p, ct, NGX_INET6_ADDRSTRLEN);
-      ml = ngx_inet6_ntop(rule6[i].mask.s6_addr, mt, NGX_INET6_ADDRSTRLEN);
-      al = ngx_inet6_ntop(rule6[i].addr.s6_addr, at, NGX_INET6_ADDRSTRLEN);
-
-      ngx_log_debug6(NGX_LOG_DEBUG_HTTP, s->connection->log, 0,
-                     "access: %*s %*s %*s", cl, ct, ml, mt, al, at);
-    }
-#endif
+  {
+    size_t cl;
+    u_char ct[NGX_INET6_ADDRSTRLEN];
 
-    for (n = 0; n < 16; n++) {
-      if ((p[n] & rule6[i].mask.s6_addr[n]) != rule6[i].addr.s6_addr[n]) {
-        goto next;
-      }
-    }
+    cl = ngx_inet6_ntop(p, ct, NGX_INET6_ADDRSTRLEN);
 
-    if (flag & rule6[i].flags) {
-      return ngx_rtmp_access_found(s, rule6[i].deny);
-    }
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, s->connection->log, 0,
+                   "access: %*s %i", cl, ct,
+                   deny == NGX_RADIX_NO_VALUE ? -1 : (ngx_int_t)deny);
+  }
+#endif
 
-  next:
-    continue;
+  if (deny == NGX_RADIX_NO_VALUE) {
+    return NGX_OK;
   }
 
-  return NGX_OK;
+  return ngx_rtmp_access_found(s, deny);
 }
 
 #endif
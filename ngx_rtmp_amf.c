@@ -591,3 +591,7 @@ ngx_int_t ngx_rtmp_amf_write(ngx_rtmp_amf_ctx_t *ctx, ngx_rtmp_amf_elt_t *elts,
 
   return NGX_OK;
 }
+
+void ngx_rtmp_amf_write_number(u_char *p, double v) {
+  ngx_rtmp_amf_reverse_copy(p, &v, 8);
+}
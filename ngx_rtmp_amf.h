@@ -58,4 +58,7 @@ ngx_int_t ngx_rtmp_amf_read(ngx_rtmp_amf_ctx_t *ctx, ngx_rtmp_amf_elt_t *elts,
 ngx_int_t ngx_rtmp_amf_write(ngx_rtmp_amf_ctx_t *ctx, ngx_rtmp_amf_elt_t *elts,
                              size_t nelts);
 
+/* patching a number in encoded AMF, p points past the type marker */
+void ngx_rtmp_amf_write_number(u_char *p, double v);
+
 #endif /* _NGX_RTMP_AMF_H_INCLUDED_ */
@@ -0,0 +1,480 @@
+/*
+ * Copyright (C) Roman Arutyunyan
+ */
+
+#include "ngx_rtmp_cleanup.h"
+#include "ngx_rtmp.h"
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+#define NGX_RTMP_CLEANUP_JOURNAL_MAX (64 * 1024)
+
+struct ngx_rtmp_cleanup_entry_s {
+  time_t check;
+  size_t len;
+  u_char path[1];
+};
+
+ngx_int_t ngx_rtmp_cleanup_init_journal(ngx_conf_t *cf, ngx_rtmp_cleanup_t *c,
+                                        ngx_path_t *dir) {
+  u_char *p;
+  size_t len;
+
+  len = dir->name.len + ngx_strlen(c->name) + sizeof("/-12345678.journal");
+
+  if (len + sizeof(".old") > NGX_MAX_PATH) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "%s: too long journal path '%V'",
+                       c->name, &dir->name);
+    return NGX_ERROR;
+  }
+
+  c->journal.data = ngx_pnalloc(cf->pool, len);
+  if (c->journal.data == NULL) {
+    return NGX_ERROR;
+  }
+
+  p = ngx_sprintf(c->journal.data, "%V/%s-%08xD.journal", &dir->name, c->name,
+                  ngx_crc32_short(c->path.data, c->path.len));
+  *p = 0;
+
+  c->journal.len = p - c->journal.data;
+
+  return NGX_OK;
+}
+
+ngx_int_t ngx_rtmp_cleanup_journal(ngx_log_t *log, ngx_rtmp_cleanup_t *c,
+                                   u_char *file) {
+  u_char *p, *name;
+  size_t len;
+  ngx_fd_t fd;
+  u_char line[NGX_MAX_PATH + 1];
+
+  len = ngx_strlen(file);
+
+  if (len == 0 || len >= sizeof(line) ||
+      ngx_strlchr(file, file + len, '\n') != NULL) {
+    return NGX_DECLINED;
+  }
+
+  name = c->journal.data;
+
+  p = ngx_cpymem(line, file, len);
+  *p++ = '\n';
+
+  /* one O_APPEND write per record keeps concurrent workers from interleaving */
+
+  fd = ngx_open_file(name, NGX_FILE_APPEND, NGX_FILE_CREATE_OR_OPEN,
+                     NGX_FILE_DEFAULT_ACCESS);
+
+  if (fd == NGX_INVALID_FILE) {
+    ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+                  "cleanup: " ngx_open_file_n " failed: '%s'", name);
+    return NGX_ERROR;
+  }
+
+  if (ngx_write_fd(fd, line, p - line) != p - line) {
+    ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+                  "cleanup: " ngx_write_fd_n " failed: '%s'", name);
+    ngx_close_file(fd);
+    return NGX_ERROR;
+  }
+
+  ngx_close_file(fd);
+
+  return NGX_OK;
+}
+
+static void ngx_rtmp_cleanup_add(ngx_rtmp_cleanup_t *c, u_char *path,
+                                 size_t len) {
+  time_t max_age;
+  ngx_int_t rc;
+  ngx_str_t name;
+  ngx_rtmp_cleanup_entry_t *e, **entries;
+
+  name.data = path;
+  name.len = len;
+
+  rc = c->age(&name, c->playlen, &max_age);
+  if (rc == NGX_DECLINED) {
+    return;
+  }
+
+  if (rc != NGX_OK) {
+    max_age = c->playlen / 500;
+  }
+
+  if (c->nentries == c->nalloc) {
+    entries = ngx_alloc(sizeof(ngx_rtmp_cleanup_entry_t *) *
+                            (c->nalloc ? c->nalloc * 2 : 64),
+                        ngx_cycle->log);
+    if (entries == NULL) {
+      return;
+    }
+
+    if (c->entries) {
+      ngx_memcpy(entries, c->entries,
+                 sizeof(ngx_rtmp_cleanup_entry_t *) * c->nentries);
+      ngx_free(c->entries);
+    }
+
+    c->entries = entries;
+    c->nalloc = c->nalloc ? c->nalloc * 2 : 64;
+  }
+
+  e = ngx_alloc(offsetof(ngx_rtmp_cleanup_entry_t, path) + len + 1,
+                ngx_cycle->log);
+  if (e == NULL) {
+    return;
+  }
+
+  e->check = ngx_time() + max_age;
+  e->len = len;
+  *ngx_cpymem(e->path, path, len) = 0;
+
+  c->entries[c->nentries++] = e;
+}
+
+static void ngx_rtmp_cleanup_read(ngx_rtmp_cleanup_t *c, u_char *name,
+                                  off_t *offset) {
+  u_char *p, *last, *nl;
+  ssize_t n;
+  ngx_file_t file;
+
+  static u_char buffer[NGX_MAX_PATH * 2];
+
+  ngx_memzero(&file, sizeof(file));
+
+  file.name.data = name;
+  file.name.len = ngx_strlen(name);
+  file.log = ngx_cycle->log;
+
+  file.fd = ngx_open_file(name, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+  if (file.fd == NGX_INVALID_FILE) {
+    if (ngx_errno != NGX_ENOENT) {
+      ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, ngx_errno,
+                    "%s: cleanup " ngx_open_file_n " failed: '%s'", c->name,
+                    name);
+    }
+    return;
+  }
+
+  for (;;) {
+    n = ngx_read_file(&file, buffer, sizeof(buffer), *offset);
+    if (n <= 0) {
+      break;
+    }
+
+    p = buffer;
+    last = buffer + n;
+
+    for (;;) {
+      nl = ngx_strlchr(p, last, '\n');
+      if (nl == NULL) {
+        break;
+      }
+
+      if (nl != p) {
+        ngx_rtmp_cleanup_add(c, p, nl - p);
+      }
+
+      p = nl + 1;
+    }
+
+    if (p == buffer) {
+      /* garbage line longer than any path */
+      p = last;
+    }
+
+    /* an incomplete trailing record is picked up on the next run */
+
+    *offset += p - buffer;
+
+    if ((size_t)n < sizeof(buffer)) {
+      break;
+    }
+  }
+
+  ngx_close_file(file.fd);
+}
+
+static time_t ngx_rtmp_cleanup_expire(ngx_rtmp_cleanup_t *c,
+                                      ngx_rtmp_cleanup_entry_t *e) {
+  time_t mtime, max_age, now;
+  u_char *p;
+  ngx_int_t rc;
+  ngx_str_t path;
+  ngx_file_info_t fi;
+
+  now = ngx_time();
+
+  path.data = e->path;
+  path.len = e->len;
+
+  rc = c->age(&path, c->playlen, &max_age);
+
+  if (rc == NGX_DECLINED) {
+    return 0;
+  }
+
+  if (rc == NGX_AGAIN) {
+    return now + ngx_max(c->playlen / 500, 1);
+  }
+
+  if (ngx_file_info(e->path, &fi) == NGX_FILE_ERROR) {
+    if (ngx_errno != NGX_ENOENT) {
+      ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                    "%s: cleanup " ngx_file_info_n " \"%V\" failed", c->name,
+                    &path);
+    }
+    return 0;
+  }
+
+  /* rewritten since it was recorded (playlists, reused names) */
+
+  mtime = ngx_file_mtime(&fi);
+  if (mtime + max_age > now) {
+    return mtime + max_age;
+  }
+
+  ngx_log_debug3(NGX_LOG_DEBUG_RTMP, ngx_cycle->log, 0,
+                 "%s: cleanup '%V' age=%T", c->name, &path, now - mtime);
+
+  if (ngx_delete_file(e->path) == NGX_FILE_ERROR) {
+    if (ngx_errno != NGX_ENOENT) {
+      ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, ngx_errno,
+                    "%s: cleanup " ngx_delete_file_n " failed on '%V'",
+                    c->name, &path);
+    }
+    return 0;
+  }
+
+  /* nested stream directories go away with their last file */
+
+  p = e->path + e->len;
+  while (p > e->path && p[-1] != '/') {
+    p--;
+  }
+
+  if (p - 1 > e->path + c->path.len) {
+    p[-1] = 0;
+
+    if (ngx_delete_dir(e->path) != NGX_FILE_ERROR) {
+      ngx_log_debug2(NGX_LOG_DEBUG_RTMP, ngx_cycle->log, 0,
+                     "%s: cleanup dir '%s'", c->name, e->path);
+    }
+  }
+
+  return 0;
+}
+
+time_t ngx_rtmp_cleanup_run(ngx_rtmp_cleanup_t *c) {
+  time_t now, next, check;
+  ngx_uint_t i;
+  ngx_rtmp_cleanup_entry_t *e;
+  u_char old[NGX_MAX_PATH + 1];
+
+  *ngx_snprintf(old, sizeof(old) - 1, "%V.old", &c->journal) = 0;
+
+  if (!c->scanned) {
+    /* files of a previous instance are only known to the file system */
+
+    ngx_rtmp_cleanup_dir(c, &c->path);
+
+    c->scanned = 1;
+    c->rotated = 1;
+    c->old_offset = 0;
+  }
+
+  /*
+   * a rotated journal is drained one run after the rename
+   * so that records appended by workers which opened it
+   * just before are not lost
+   */
+
+  if (c->rotated) {
+    ngx_rtmp_cleanup_read(c, old, &c->old_offset);
+
+    if (ngx_delete_file(old) == NGX_FILE_ERROR && ngx_errno != NGX_ENOENT) {
+      ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, ngx_errno,
+                    "%s: cleanup " ngx_delete_file_n " failed on '%s'",
+                    c->name, old);
+    }
+
+    c->rotated = 0;
+  }
+
+  ngx_rtmp_cleanup_read(c, c->journal.data, &c->offset);
+
+  if (c->offset >= NGX_RTMP_CLEANUP_JOURNAL_MAX) {
+    if (ngx_rename_file(c->journal.data, old) == NGX_FILE_ERROR) {
+      ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, ngx_errno,
+                    "%s: cleanup " ngx_rename_file_n " failed on '%V'",
+                    c->name, &c->journal);
+    } else {
+      c->old_offset = c->offset;
+      c->offset = 0;
+      c->rotated = 1;
+    }
+  }
+
+  now = ngx_time();
+  next = now + ngx_max(c->playlen / 500, 1);
+
+  for (i = 0; i < c->nentries; /* void */) {
+    e = c->entries[i];
+
+    check = e->check;
+
+    if (check <= now) {
+      check = ngx_rtmp_cleanup_expire(c, e);
+
+      if (check == 0) {
+        ngx_free(e);
+        c->entries[i] = c->entries[--c->nentries];
+        continue;
+      }
+
+      e->check = check;
+    }
+
+    if (check < next) {
+      next = check;
+    }
+
+    i++;
+  }
+
+  ngx_log_debug2(NGX_LOG_DEBUG_RTMP, ngx_cycle->log, 0,
+                 "%s: cleanup pending=%ui", c->name, c->nentries);
+
+  return ngx_max(next - now, 1);
+}
+
+ngx_int_t ngx_rtmp_cleanup_dir(ngx_rtmp_cleanup_t *c, ngx_str_t *ppath) {
+  ngx_dir_t dir;
+  time_t mtime, max_age;
+  ngx_err_t err;
+  ngx_str_t name, spath;
+  u_char *p;
+  ngx_int_t nentries, nerased;
+  u_char path[NGX_MAX_PATH + 1];
+
+  ngx_log_debug3(NGX_LOG_DEBUG_RTMP, ngx_cycle->log, 0,
+                 "%s: cleanup path='%V' playlen=%M", c->name, ppath,
+                 c->playlen);
+
+  if (ngx_open_dir(ppath, &dir) != NGX_OK) {
+    ngx_log_debug2(NGX_LOG_DEBUG_RTMP, ngx_cycle->log, ngx_errno,
+                   "%s: cleanup open dir failed '%V'", c->name, ppath);
+    return NGX_ERROR;
+  }
+
+  nentries = 0;
+  nerased = 0;
+
+  for (;;) {
+    ngx_set_errno(0);
+
+    if (ngx_read_dir(&dir) == NGX_ERROR) {
+      err = ngx_errno;
+
+      if (ngx_close_dir(&dir) == NGX_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      "%s: cleanup " ngx_close_dir_n " \"%V\" failed",
+                      c->name, ppath);
+      }
+
+      if (err == NGX_ENOMOREFILES) {
+        return nentries - nerased;
+      }
+
+      ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, err,
+                    "%s: cleanup " ngx_read_dir_n " '%V' failed", c->name,
+                    ppath);
+      return NGX_ERROR;
+    }
+
+    name.data = ngx_de_name(&dir);
+    if (name.data[0] == '.') {
+      continue;
+    }
+
+    name.len = ngx_de_namelen(&dir);
+
+    p = ngx_snprintf(path, sizeof(path) - 1, "%V/%V", ppath, &name);
+    *p = 0;
+
+    spath.data = path;
+    spath.len = p - path;
+
+    nentries++;
+
+    if (!dir.valid_info && ngx_de_info(path, &dir) == NGX_FILE_ERROR) {
+      ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                    "%s: cleanup " ngx_de_info_n " \"%V\" failed", c->name,
+                    &spath);
+
+      continue;
+    }
+
+    if (ngx_de_is_dir(&dir)) {
+      if (ngx_rtmp_cleanup_dir(c, &spath) == 0) {
+        ngx_log_debug2(NGX_LOG_DEBUG_RTMP, ngx_cycle->log, 0,
+                       "%s: cleanup dir '%V'", c->name, &name);
+
+        /*
+         * null-termination gets spoiled in win32
+         * version of ngx_open_dir
+         */
+
+        *p = 0;
+
+        if (ngx_delete_dir(path) == NGX_FILE_ERROR) {
+          ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, ngx_errno,
+                        "%s: cleanup " ngx_delete_dir_n " failed on '%V'",
+                        c->name, &spath);
+        } else {
+          nerased++;
+        }
+      }
+
+      continue;
+    }
+
+    if (!ngx_de_is_file(&dir)) {
+      continue;
+    }
+
+    switch (c->age(&spath, c->playlen, &max_age)) {
+      case NGX_OK:
+        break;
+
+      case NGX_DECLINED:
+        ngx_log_debug2(NGX_LOG_DEBUG_RTMP, ngx_cycle->log, 0,
+                       "%s: cleanup skip unknown file type '%V'", c->name,
+                       &name);
+        /* fall through */
+
+      default:
+        continue;
+    }
+
+    mtime = ngx_de_mtime(&dir);
+    if (mtime + max_age > ngx_cached_time->sec) {
+      continue;
+    }
+
+    ngx_log_debug4(NGX_LOG_DEBUG_RTMP, ngx_cycle->log, 0,
+                   "%s: cleanup '%V' mtime=%T age=%T", c->name, &name, mtime,
+                   ngx_cached_time->sec - mtime);
+
+    if (ngx_delete_file(path) == NGX_FILE_ERROR) {
+      ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, ngx_errno,
+                    "%s: cleanup " ngx_delete_file_n " failed on '%V'",
+                    c->name, &spath);
+      continue;
+    }
+
+    nerased++;
+  }
+}
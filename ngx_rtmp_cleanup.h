@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) Roman Arutyunyan
+ */
+
+#ifndef _NGX_RTMP_CLEANUP_H_INCLUDED_
+#define _NGX_RTMP_CLEANUP_H_INCLUDED_
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+/*
+ * Fragment cleanup for hls/dash paths.
+ *
+ * Workers append the name of every file they create to a journal. The
+ * journal is kept outside the served tree, in the journal path (by
+ * default <prefix>/rtmp_cleanup) as <module>-<crc32 of path>.journal, so
+ * fragment names and their expiry are never published. The cache manager
+ * process reads the journal incrementally, keeps the pending files in
+ * memory and only stats a file when it is due to expire. The whole tree is
+ * scanned once at startup to pick up files left behind by a previous
+ * instance.
+ */
+
+#define NGX_RTMP_CLEANUP_PATH "rtmp_cleanup"
+
+/*
+ * Returns NGX_OK and sets max_age (seconds since last modification) for
+ * known file types, NGX_AGAIN if the file must be kept for now and
+ * NGX_DECLINED for files the module does not own.
+ */
+typedef ngx_int_t (*ngx_rtmp_cleanup_age_pt)(ngx_str_t *path,
+                                             ngx_msec_t playlen,
+                                             time_t *max_age);
+
+typedef struct ngx_rtmp_cleanup_entry_s ngx_rtmp_cleanup_entry_t;
+
+typedef struct {
+  ngx_str_t path;
+  ngx_msec_t playlen;
+  const char *name;
+  ngx_rtmp_cleanup_age_pt age;
+  ngx_str_t journal; /* null-terminated */
+
+  /* cache manager state */
+  unsigned scanned : 1;
+  unsigned rotated : 1;
+  off_t offset;
+  off_t old_offset;
+  ngx_rtmp_cleanup_entry_t **entries;
+  ngx_uint_t nentries;
+  ngx_uint_t nalloc;
+} ngx_rtmp_cleanup_t;
+
+ngx_int_t ngx_rtmp_cleanup_init_journal(ngx_conf_t *cf, ngx_rtmp_cleanup_t *c,
+                                        ngx_path_t *dir);
+ngx_int_t ngx_rtmp_cleanup_journal(ngx_log_t *log, ngx_rtmp_cleanup_t *c,
+                                   u_char *file);
+time_t ngx_rtmp_cleanup_run(ngx_rtmp_cleanup_t *c);
+ngx_int_t ngx_rtmp_cleanup_dir(ngx_rtmp_cleanup_t *c, ngx_str_t *ppath);
+
+#endif /* _NGX_RTMP_CLEANUP_H_INCLUDED_ */
@@ -195,47 +195,77 @@ static ngx_int_t ngx_rtmp_cmd_connect_init(ngx_rtmp_session_t *s,
   return ngx_rtmp_connect(s, &v);
 }
 
-static ngx_int_t ngx_rtmp_cmd_connect(ngx_rtmp_session_t *s,
-                                      ngx_rtmp_connect_t *v) {
-  ngx_rtmp_core_srv_conf_t *cscf;
-  ngx_rtmp_core_app_conf_t **cacfp;
-  ngx_uint_t n;
-  ngx_rtmp_header_t h;
-  u_char *p;
+/*
+ * _result replies are encoded once at configuration time, only the
+ * numbers are patched in per call
+ */
 
-  static double trans;
-  static double capabilities = NGX_RTMP_CAPABILITIES;
-  static double object_encoding = 0;
+#define NGX_RTMP_CMD_RESULT_BUFSIZE 512
 
-  static ngx_rtmp_amf_elt_t out_obj[] = {
+/* number following "_result" */
+#define NGX_RTMP_CMD_RESULT_TRANS (1 + 2 + sizeof("_result") - 1 + 1)
 
-      {NGX_RTMP_AMF_STRING, ngx_string("fmsVer"), NGX_RTMP_FMS_VERSION, 0},
+static double ngx_rtmp_cmd_zero;
+static double ngx_rtmp_cmd_capabilities = NGX_RTMP_CAPABILITIES;
 
-      {NGX_RTMP_AMF_NUMBER, ngx_string("capabilities"), &capabilities, 0},
-  };
+static ngx_rtmp_amf_elt_t ngx_rtmp_cmd_connect_obj[] = {
 
-  static ngx_rtmp_amf_elt_t out_inf[] = {
+    {NGX_RTMP_AMF_STRING, ngx_string("fmsVer"), NGX_RTMP_FMS_VERSION, 0},
 
-      {NGX_RTMP_AMF_STRING, ngx_string("level"), "status", 0},
+    {NGX_RTMP_AMF_NUMBER, ngx_string("capabilities"),
+     &ngx_rtmp_cmd_capabilities, 0},
+};
 
-      {NGX_RTMP_AMF_STRING, ngx_string("code"), "NetConnection.Connect.Success",
-       0},
+static ngx_rtmp_amf_elt_t ngx_rtmp_cmd_connect_inf[] = {
 
-      {NGX_RTMP_AMF_STRING, ngx_string("description"), "Connection succeeded.",
-       0},
+    {NGX_RTMP_AMF_STRING, ngx_string("level"), "status", 0},
 
-      {NGX_RTMP_AMF_NUMBER, ngx_string("objectEncoding"), &object_encoding, 0}};
+    {NGX_RTMP_AMF_STRING, ngx_string("code"), "NetConnection.Connect.Success",
+     0},
 
-  static ngx_rtmp_amf_elt_t out_elts[] = {
+    {NGX_RTMP_AMF_STRING, ngx_string("description"), "Connection succeeded.",
+     0},
 
-      {NGX_RTMP_AMF_STRING, ngx_null_string, "_result", 0},
+    /* last number of the reply, followed by the object end */
+    {NGX_RTMP_AMF_NUMBER, ngx_string("objectEncoding"), &ngx_rtmp_cmd_zero, 0}};
 
-      {NGX_RTMP_AMF_NUMBER, ngx_null_string, &trans, 0},
+static ngx_rtmp_amf_elt_t ngx_rtmp_cmd_connect_elts[] = {
 
-      {NGX_RTMP_AMF_OBJECT, ngx_null_string, out_obj, sizeof(out_obj)},
+    {NGX_RTMP_AMF_STRING, ngx_null_string, "_result", 0},
 
-      {NGX_RTMP_AMF_OBJECT, ngx_null_string, out_inf, sizeof(out_inf)},
-  };
+    {NGX_RTMP_AMF_NUMBER, ngx_null_string, &ngx_rtmp_cmd_zero, 0},
+
+    {NGX_RTMP_AMF_OBJECT, ngx_null_string, ngx_rtmp_cmd_connect_obj,
+     sizeof(ngx_rtmp_cmd_connect_obj)},
+
+    {NGX_RTMP_AMF_OBJECT, ngx_null_string, ngx_rtmp_cmd_connect_inf,
+     sizeof(ngx_rtmp_cmd_connect_inf)},
+};
+
+static ngx_rtmp_amf_elt_t ngx_rtmp_cmd_create_stream_elts[] = {
+
+    {NGX_RTMP_AMF_STRING, ngx_null_string, "_result", 0},
+
+    {NGX_RTMP_AMF_NUMBER, ngx_null_string, &ngx_rtmp_cmd_zero, 0},
+
+    {NGX_RTMP_AMF_NULL, ngx_null_string, NULL, 0},
+
+    /* stream id, last number of the reply */
+    {NGX_RTMP_AMF_NUMBER, ngx_null_string, &ngx_rtmp_cmd_zero, 0},
+};
+
+static ngx_str_t ngx_rtmp_cmd_connect_result;
+static ngx_str_t ngx_rtmp_cmd_create_stream_result;
+
+static ngx_int_t ngx_rtmp_cmd_connect(ngx_rtmp_session_t *s,
+                                      ngx_rtmp_connect_t *v) {
+  ngx_rtmp_core_srv_conf_t *cscf;
+  ngx_rtmp_core_app_conf_t **cacfp;
+  ngx_uint_t n;
+  ngx_rtmp_header_t h;
+  u_char *p;
+  size_t len;
+  u_char out[NGX_RTMP_CMD_RESULT_BUFSIZE];
 
   if (s->connected) {
     ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
@@ -245,8 +275,6 @@ static ngx_int_t ngx_rtmp_cmd_connect(ngx_rtmp_session_t *s,
 
   cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
 
-  trans = v->trans;
-
   /* fill session parameters */
   s->connected = 1;
 
@@ -299,7 +327,10 @@ static ngx_int_t ngx_rtmp_cmd_connect(ngx_rtmp_session_t *s,
     return NGX_ERROR;
   }
 
-  object_encoding = v->object_encoding;
+  len = ngx_rtmp_cmd_connect_result.len;
+  ngx_memcpy(out, ngx_rtmp_cmd_connect_result.data, len);
+  ngx_rtmp_amf_write_number(out + NGX_RTMP_CMD_RESULT_TRANS, v->trans);
+  ngx_rtmp_amf_write_number(out + len - 3 - 8, v->object_encoding);
 
   if (s->wait_notify_connect) {
     s->wait_notify_connect = 0;
@@ -309,9 +340,7 @@ static ngx_int_t ngx_rtmp_cmd_connect(ngx_rtmp_session_t *s,
                  ngx_rtmp_send_bandwidth(s, cscf->ack_window,
                                          NGX_RTMP_LIMIT_DYNAMIC) != NGX_OK ||
                  ngx_rtmp_send_chunk_size(s, cscf->chunk_size) != NGX_OK ||
-                 ngx_rtmp_send_amf(s, &h, out_elts,
-                                   sizeof(out_elts) / sizeof(out_elts[0])) !=
-                     NGX_OK
+                 ngx_rtmp_send_encoded_amf(s, &h, out, len) != NGX_OK
              ? NGX_ERROR
              : NGX_OK;
 }
@@ -338,32 +367,23 @@ static ngx_int_t ngx_rtmp_cmd_create_stream_init(ngx_rtmp_session_t *s,
 
 static ngx_int_t ngx_rtmp_cmd_create_stream(ngx_rtmp_session_t *s,
                                             ngx_rtmp_create_stream_t *v) {
-  /* support one message stream per connection */
-  static double stream;
-  static double trans;
   ngx_rtmp_header_t h;
+  size_t len;
+  u_char out[NGX_RTMP_CMD_RESULT_BUFSIZE];
 
-  static ngx_rtmp_amf_elt_t out_elts[] = {
-
-      {NGX_RTMP_AMF_STRING, ngx_null_string, "_result", 0},
-
-      {NGX_RTMP_AMF_NUMBER, ngx_null_string, &trans, 0},
-
-      {NGX_RTMP_AMF_NULL, ngx_null_string, NULL, 0},
-
-      {NGX_RTMP_AMF_NUMBER, ngx_null_string, &stream, sizeof(stream)},
-  };
+  len = ngx_rtmp_cmd_create_stream_result.len;
+  ngx_memcpy(out, ngx_rtmp_cmd_create_stream_result.data, len);
+  ngx_rtmp_amf_write_number(out + NGX_RTMP_CMD_RESULT_TRANS, v->trans);
 
-  trans = v->trans;
-  stream = NGX_RTMP_MSID;
+  /* support one message stream per connection */
+  ngx_rtmp_amf_write_number(out + len - 8, NGX_RTMP_MSID);
 
   ngx_memzero(&h, sizeof(h));
 
   h.csid = NGX_RTMP_CSID_AMF_INI;
   h.type = NGX_RTMP_MSG_AMF_CMD;
 
-  return ngx_rtmp_send_amf(s, &h, out_elts,
-                           sizeof(out_elts) / sizeof(out_elts[0])) == NGX_OK
+  return ngx_rtmp_send_encoded_amf(s, &h, out, len) == NGX_OK
              ? NGX_DONE
              : NGX_ERROR;
 }
@@ -869,6 +889,23 @@ static ngx_int_t ngx_rtmp_cmd_postconfiguration(ngx_conf_t *cf) {
 
   *h = ngx_rtmp_cmd_disconnect_init;
 
+  if (ngx_rtmp_encode_amf(cf, ngx_rtmp_cmd_connect_elts,
+                          sizeof(ngx_rtmp_cmd_connect_elts) /
+                              sizeof(ngx_rtmp_cmd_connect_elts[0]),
+                          &ngx_rtmp_cmd_connect_result) != NGX_OK ||
+      ngx_rtmp_encode_amf(cf, ngx_rtmp_cmd_create_stream_elts,
+                          sizeof(ngx_rtmp_cmd_create_stream_elts) /
+                              sizeof(ngx_rtmp_cmd_create_stream_elts[0]),
+                          &ngx_rtmp_cmd_create_stream_result) != NGX_OK) {
+    return NGX_ERROR;
+  }
+
+  if (ngx_rtmp_cmd_connect_result.len > NGX_RTMP_CMD_RESULT_BUFSIZE ||
+      ngx_rtmp_cmd_create_stream_result.len > NGX_RTMP_CMD_RESULT_BUFSIZE) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "rtmp cmd: _result too long");
+    return NGX_ERROR;
+  }
+
   /* register AMF callbacks */
 
   ncalls = sizeof(ngx_rtmp_cmd_map) / sizeof(ngx_rtmp_cmd_map[0]);
@@ -146,12 +146,18 @@ static ngx_uint_t ngx_rtmp_codec_get_next_version() {
 static ngx_int_t ngx_rtmp_codec_disconnect(ngx_rtmp_session_t *s,
                                            ngx_rtmp_header_t *h,
                                            ngx_chain_t *in) {
+  ngx_rtmp_codec_reset(s);
+
+  return NGX_OK;
+}
+
+void ngx_rtmp_codec_reset(ngx_rtmp_session_t *s) {
   ngx_rtmp_codec_ctx_t *ctx;
   ngx_rtmp_core_srv_conf_t *cscf;
 
   ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_codec_module);
   if (ctx == NULL) {
-    return NGX_OK;
+    return;
   }
 
   cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
@@ -175,8 +181,6 @@ static ngx_int_t ngx_rtmp_codec_disconnect(ngx_rtmp_session_t *s,
     ngx_rtmp_free_shared_chain(cscf, ctx->meta_streaminfo);
     ctx->meta_streaminfo = NULL;
   }
-
-  return NGX_OK;
 }
 
 #define NGX_RTMP_CODEC_NON_SEQ_HEADER 0
@@ -975,6 +979,7 @@ static ngx_int_t ngx_rtmp_codec_send_meta(ngx_rtmp_session_t *s,
 
   ngx_rtmp_live_ctx_t *ctx, *pctx;
   ngx_rtmp_session_t *ss;
+  ngx_uint_t n;
 
   ngx_rtmp_core_srv_conf_t *cscf;
 
@@ -996,8 +1001,11 @@ static ngx_int_t ngx_rtmp_codec_send_meta(ngx_rtmp_session_t *s,
 
   ngx_rtmp_codec_prepare_meta(s, timestamp);
 
-  for (pctx = ctx->stream->ctx; pctx; pctx = pctx->next) {
-    if (pctx == ctx || pctx->paused ||
+  for (n = 0; n < ctx->stream->nplayers; n++) {
+    pctx = ctx->stream->players[n];
+
+    /* time-shifted viewers get the metadata of their window */
+    if (pctx->paused || pctx->timeshift ||
         codec_ctx->meta_version == pctx->meta_version) {
       continue;
     }
@@ -127,4 +127,7 @@ typedef struct {
 
 extern ngx_module_t ngx_rtmp_codec_module;
 
+/* drop the sequence headers and metadata kept for the session */
+void ngx_rtmp_codec_reset(ngx_rtmp_session_t *s);
+
 #endif /* _NGX_RTMP_LIVE_H_INCLUDED_ */
@@ -118,6 +118,11 @@ static ngx_command_t ngx_rtmp_core_commands[] = {
      ngx_conf_set_size_slot, NGX_RTMP_SRV_CONF_OFFSET,
      offsetof(ngx_rtmp_core_srv_conf_t, max_message), NULL},
 
+    {ngx_string("in_buffer_size"),
+     NGX_RTMP_MAIN_CONF | NGX_RTMP_SRV_CONF | NGX_CONF_TAKE1,
+     ngx_conf_set_size_slot, NGX_RTMP_SRV_CONF_OFFSET,
+     offsetof(ngx_rtmp_core_srv_conf_t, in_buffer_size), NULL},
+
     {ngx_string("out_queue"),
      NGX_RTMP_MAIN_CONF | NGX_RTMP_SRV_CONF | NGX_CONF_TAKE1,
      ngx_conf_set_size_slot, NGX_RTMP_SRV_CONF_OFFSET,
@@ -128,6 +133,16 @@ static ngx_command_t ngx_rtmp_core_commands[] = {
      ngx_conf_set_size_slot, NGX_RTMP_SRV_CONF_OFFSET,
      offsetof(ngx_rtmp_core_srv_conf_t, out_cork), NULL},
 
+    {ngx_string("out_queue_size"),
+     NGX_RTMP_MAIN_CONF | NGX_RTMP_SRV_CONF | NGX_CONF_TAKE1,
+     ngx_conf_set_size_slot, NGX_RTMP_SRV_CONF_OFFSET,
+     offsetof(ngx_rtmp_core_srv_conf_t, out_queue_size), NULL},
+
+    {ngx_string("out_queue_latency"),
+     NGX_RTMP_MAIN_CONF | NGX_RTMP_SRV_CONF | NGX_CONF_TAKE1,
+     ngx_conf_set_msec_slot, NGX_RTMP_SRV_CONF_OFFSET,
+     offsetof(ngx_rtmp_core_srv_conf_t, out_queue_latency), NULL},
+
     {ngx_string("busy"),
      NGX_RTMP_MAIN_CONF | NGX_RTMP_SRV_CONF | NGX_CONF_TAKE1,
      ngx_conf_set_flag_slot, NGX_RTMP_SRV_CONF_OFFSET,
@@ -338,8 +353,11 @@ static void *ngx_rtmp_core_create_srv_conf(ngx_conf_t *cf) {
   conf->chunk_size = NGX_CONF_UNSET;
   conf->ack_window = NGX_CONF_UNSET_UINT;
   conf->max_message = NGX_CONF_UNSET_SIZE;
+  conf->in_buffer_size = NGX_CONF_UNSET_SIZE;
   conf->out_queue = NGX_CONF_UNSET_SIZE;
   conf->out_cork = NGX_CONF_UNSET_SIZE;
+  conf->out_queue_size = NGX_CONF_UNSET_SIZE;
+  conf->out_queue_latency = NGX_CONF_UNSET_MSEC;
   conf->play_time_fix = NGX_CONF_UNSET;
   conf->publish_time_fix = NGX_CONF_UNSET;
   conf->buflen = NGX_CONF_UNSET_MSEC;
@@ -369,9 +387,14 @@ static char *ngx_rtmp_core_merge_srv_conf(ngx_conf_t *cf, void *parent,
   ngx_conf_merge_uint_value(conf->ack_window, prev->ack_window, 5000000);
   ngx_conf_merge_size_value(conf->max_message, prev->max_message,
                             1 * 1024 * 1024);
+  ngx_conf_merge_size_value(conf->in_buffer_size, prev->in_buffer_size,
+                            64 * 1024);
   ngx_conf_merge_size_value(conf->out_queue, prev->out_queue, 256);
   ngx_conf_merge_size_value(conf->out_cork, prev->out_cork,
                             conf->out_queue / 8);
+  ngx_conf_merge_size_value(conf->out_queue_size, prev->out_queue_size, 0);
+  ngx_conf_merge_msec_value(conf->out_queue_latency, prev->out_queue_latency,
+                            0);
   ngx_conf_merge_value(conf->play_time_fix, prev->play_time_fix, 1);
   ngx_conf_merge_value(conf->publish_time_fix, prev->publish_time_fix, 1);
   ngx_conf_merge_msec_value(conf->buflen, prev->buflen, 1000);
@@ -43,7 +43,7 @@ static char *ngx_rtmp_gop_cache_merge_app_conf(ngx_conf_t *cf, void *parent,
                                                void *child);
 
 extern ngx_rtmp_live_proc_handler_t
-    *ngx_rtmp_live_proc_handlers[NGX_RTMP_PROTOCOL_HTTP + 1];
+    *ngx_rtmp_live_proc_handlers[NGX_RTMP_PROTOCOL_TS + 1];
 extern ngx_module_t ngx_http_flv_live_module;
 
 static ngx_command_t ngx_rtmp_gop_cache_commands[] = {
@@ -504,7 +504,7 @@ static void ngx_rtmp_gop_cache_send(ngx_rtmp_session_t *s) {
   /* pub_ctx saved the publisher info */
   ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_live_module);
   if (ctx == NULL || ctx->stream == NULL || ctx->stream->pub_ctx == NULL ||
-      !ctx->stream->publishing) {
+      !ctx->stream->publishing || ctx->timeshift) {
     return;
   }
 
@@ -525,7 +525,7 @@ static void ngx_rtmp_gop_cache_send(ngx_rtmp_session_t *s) {
   }
 
   for (cache = gctx->cache_head; cache; cache = cache->next) {
-    if (ctx->protocol == NGX_RTMP_PROTOCOL_HTTP) {
+    if (ctx->protocol != NGX_RTMP_PROTOCOL_RTMP) {
       r = s->data;
       if (r == NULL || (r->connection && r->connection->destroyed)) {
         return;
@@ -539,13 +539,11 @@ static void ngx_rtmp_gop_cache_send(ngx_rtmp_session_t *s) {
     }
 
     if (meta == NULL && meta_version != gctx->meta_version) {
-      meta = handler->meta_message_pt(s, gctx->meta);
+      meta = ngx_rtmp_live_get_meta(s, ctx, gctx->meta, gctx->meta_version);
       if (meta == NULL) {
         return;
       }
-    }
 
-    if (meta) {
       meta_version = gctx->meta_version;
     }
 
@@ -560,7 +558,6 @@ static void ngx_rtmp_gop_cache_send(ngx_rtmp_session_t *s) {
       }
 
       ctx->meta_version = meta_version;
-      handler->free_message_pt(s, meta);
     }
 
     for (gf = cache->frame_head; gf; gf = gf->next) {
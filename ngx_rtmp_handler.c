@@ -9,6 +9,7 @@
 #include "ngx_rtmp.h"
 #include "ngx_rtmp_amf.h"
 #include "ngx_rtmp_bandwidth.h"
+#include "ngx_rtmp_histogram.h"
 #include "ngx_rtmp_cmd_module.h"
 
 static void ngx_rtmp_recv(ngx_event_t *rev);
@@ -16,10 +17,16 @@ static void ngx_rtmp_send(ngx_event_t *rev);
 static void ngx_rtmp_ping(ngx_event_t *rev);
 
 ngx_uint_t ngx_rtmp_naccepted;
+ngx_uint_t ngx_rtmp_send_deferred;
 
 ngx_rtmp_bandwidth_t ngx_rtmp_bw_out;
 ngx_rtmp_bandwidth_t ngx_rtmp_bw_in;
 
+ngx_rtmp_histogram_t ngx_rtmp_hist_latency;
+ngx_rtmp_histogram_t ngx_rtmp_hist_out_queue;
+ngx_rtmp_histogram_t ngx_rtmp_hist_join;
+ngx_rtmp_histogram_t ngx_rtmp_hist_send;
+
 #ifdef NGX_DEBUG
 char *ngx_rtmp_message_type(uint8_t type) {
   static char *types[] = {
@@ -58,27 +65,210 @@ void ngx_rtmp_cycle(ngx_rtmp_session_t *s) {
   ngx_rtmp_recv(c->read);
 }
 
-ngx_chain_t *ngx_rtmp_alloc_in_buf(ngx_rtmp_session_t *s) {
-  ngx_chain_t *cl;
+/* at most that many idle receive blocks are kept per session */
+#define NGX_RTMP_IN_FREE_BLOCKS 4
+
+/* contiguous room needed for one chunk; chunks never exceed a message */
+#define ngx_rtmp_in_block_need(s, cscf)                                    \
+  (ngx_min((s)->in_chunk_size, (cscf)->max_message) +                    \
+   NGX_RTMP_MAX_CHUNK_HEADER)
+
+static void ngx_rtmp_free_in_block(ngx_rtmp_session_t *s,
+                                   ngx_rtmp_in_block_t *blk) {
+  s->in_allocated -= blk->buf.end - blk->buf.start;
+  ngx_free(blk);
+}
+
+static ngx_rtmp_in_block_t *ngx_rtmp_alloc_in_block(ngx_rtmp_session_t *s,
+                                                    size_t size) {
+  ngx_rtmp_core_srv_conf_t *cscf;
+  ngx_rtmp_in_block_t *blk;
   ngx_buf_t *b;
+  size_t limit;
+
+  cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
+
+  size = ngx_max(size, s->in_block_size);
+
+  /* idle blocks are reused whatever the chunk size unless too small */
+  while (s->in_free_blocks) {
+    blk = s->in_free_blocks;
+    s->in_free_blocks = blk->next;
+    s->in_nfree--;
+
+    if ((size_t)(blk->buf.end - blk->buf.start) >= size) {
+      goto done;
+    }
+
+    ngx_rtmp_free_in_block(s, blk);
+  }
+
+  /*
+   * memory is pinned by incomplete messages only, so twice the largest
+   * message plus the read-ahead is plenty for any sane peer
+   */
+  limit = 2 * (cscf->max_message + cscf->in_buffer_size);
+
+  if (s->in_allocated + size > limit) {
+    ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
+                  "too much inbound data buffered: %uz", s->in_allocated);
+    return NULL;
+  }
+
+  blk = ngx_alloc(sizeof(ngx_rtmp_in_block_t) + size, s->connection->log);
+  if (blk == NULL) {
+    return NULL;
+  }
+
+  ngx_memzero(&blk->buf, sizeof(ngx_buf_t));
+  blk->buf.start = (u_char *)&blk[1];
+  blk->buf.end = blk->buf.start + size;
+
+  s->in_allocated += size;
+
+done:
+  b = &blk->buf;
+  b->pos = b->last = b->start;
+  blk->next = NULL;
+  blk->refs = 1;
+
+  return blk;
+}
+
+static void ngx_rtmp_put_in_block(ngx_rtmp_session_t *s,
+                                  ngx_rtmp_in_block_t *blk) {
+  ngx_rtmp_core_srv_conf_t *cscf;
   size_t size;
 
+  if (--blk->refs) {
+    return;
+  }
+
+  cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
+
+  /* drop blocks grown for a chunk size that is no longer in use */
+  size = ngx_max(s->in_block_size, ngx_rtmp_in_block_need(s, cscf));
+
+  if (s->in_nfree >= NGX_RTMP_IN_FREE_BLOCKS ||
+      (size_t)(blk->buf.end - blk->buf.start) > size) {
+    ngx_rtmp_free_in_block(s, blk);
+    return;
+  }
+
+  blk->next = s->in_free_blocks;
+  s->in_free_blocks = blk;
+  s->in_nfree++;
+}
+
+static ngx_chain_t *ngx_rtmp_alloc_in_link(ngx_rtmp_session_t *s) {
+  ngx_chain_t *cl;
+
+  cl = s->in_free;
+  if (cl) {
+    s->in_free = cl->next;
+    return cl;
+  }
+
   if ((cl = ngx_alloc_chain_link(s->in_pool)) == NULL ||
       (cl->buf = ngx_calloc_buf(s->in_pool)) == NULL) {
     return NULL;
   }
 
-  cl->next = NULL;
-  b = cl->buf;
-  size = s->in_chunk_size + NGX_RTMP_MAX_CHUNK_HEADER;
+  cl->buf->memory = 1;
 
-  b->start = b->last = b->pos = ngx_palloc(s->in_pool, size);
-  if (b->start == NULL) {
-    return NULL;
+  return cl;
+}
+
+static void ngx_rtmp_free_in_chain(ngx_rtmp_session_t *s, ngx_chain_t *in) {
+  ngx_chain_t *cl;
+
+  while (in) {
+    cl = in;
+    in = in->next;
+
+    ngx_rtmp_put_in_block(s, (ngx_rtmp_in_block_t *)cl->buf->shadow);
+
+    cl->next = s->in_free;
+    s->in_free = cl;
   }
-  b->end = b->start + size;
+}
 
-  return cl;
+void ngx_rtmp_free_in_blocks(ngx_rtmp_session_t *s) {
+  ngx_rtmp_core_srv_conf_t *cscf;
+  ngx_rtmp_stream_t *st;
+  ngx_rtmp_in_block_t *blk;
+  ngx_chain_t *head;
+  ngx_int_t n;
+
+  cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
+
+  if (s->in_streams) {
+    for (n = 0; n < cscf->max_streams; n++) {
+      st = &s->in_streams[n];
+      if (st->in == NULL) {
+        continue;
+      }
+
+      head = st->in->next;
+      st->in->next = NULL;
+      st->in = NULL;
+
+      ngx_rtmp_free_in_chain(s, head);
+    }
+  }
+
+  if (s->in_block) {
+    ngx_rtmp_put_in_block(s, s->in_block);
+    s->in_block = NULL;
+  }
+
+  while (s->in_free_blocks) {
+    blk = s->in_free_blocks;
+    s->in_free_blocks = blk->next;
+    ngx_rtmp_free_in_block(s, blk);
+  }
+
+  s->in_nfree = 0;
+}
+
+/*
+ * Make sure a whole chunk fits between the unparsed data and the end of
+ * the receive block, moving the (partial) chunk to the start of an idle
+ * or a new block otherwise. This is the only copy on the inbound path.
+ */
+static ngx_int_t ngx_rtmp_shift_in_block(ngx_rtmp_session_t *s, size_t need) {
+  ngx_rtmp_in_block_t *blk, *nblk;
+  ngx_buf_t *b;
+  size_t size;
+
+  blk = s->in_block;
+  b = &blk->buf;
+  size = b->last - b->pos;
+
+  if ((size_t)(b->end - b->pos) >= need) {
+    return NGX_OK;
+  }
+
+  if (blk->refs == 1 && (size_t)(b->end - b->start) >= need) {
+    b->last = ngx_movemem(b->start, b->pos, size);
+    b->pos = b->start;
+    return NGX_OK;
+  }
+
+  nblk = ngx_rtmp_alloc_in_block(s, need);
+  if (nblk == NULL) {
+    return NGX_ERROR;
+  }
+
+  nblk->buf.last = ngx_cpymem(nblk->buf.start, b->pos, size);
+
+  ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                 "reusing formerly read data: %uz", size);
+
+  s->in_block = nblk;
+  ngx_rtmp_put_in_block(s, blk);
+
+  return NGX_OK;
 }
 
 void ngx_rtmp_reset_ping(ngx_rtmp_session_t *s) {
@@ -143,19 +333,18 @@ static void ngx_rtmp_recv(ngx_event_t *rev) {
   ngx_rtmp_session_t *s;
   ngx_rtmp_core_srv_conf_t *cscf;
   ngx_rtmp_header_t *h;
-  ngx_rtmp_stream_t *st, *st0;
-  ngx_chain_t *in, *head;
+  ngx_rtmp_stream_t *st;
+  ngx_rtmp_in_block_t *blk;
+  ngx_chain_t *cl, *head;
   ngx_buf_t *b;
-  u_char *p, *pp, *old_pos;
-  size_t size, fsize, old_size;
-  uint8_t fmt, ext;
-  uint32_t csid, timestamp;
+  u_char *p, *pp;
+  size_t size, fsize;
+  uint8_t fmt, ext, type;
+  uint32_t csid, timestamp, mlen, msid;
+  ngx_int_t rc;
 
   c = rev->data;
   s = c->data;
-  b = NULL;
-  old_pos = NULL;
-  old_size = 0;
   cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
 
   if (c->destroyed) {
@@ -163,264 +352,255 @@ static void ngx_rtmp_recv(ngx_event_t *rev) {
   }
 
   for (;;) {
-    st = &s->in_streams[s->in_csid];
-
-    /* allocate new buffer */
-    if (st->in == NULL) {
-      st->in = ngx_rtmp_alloc_in_buf(s);
-      if (st->in == NULL) {
+    if (s->in_block == NULL) {
+      s->in_block =
+          ngx_rtmp_alloc_in_block(s, ngx_rtmp_in_block_need(s, cscf));
+      if (s->in_block == NULL) {
         ngx_log_error(NGX_LOG_INFO, c->log, 0, "in buf alloc failed");
         ngx_rtmp_finalize_session(s);
         return;
       }
     }
 
-    h = &st->hdr;
-    in = st->in;
-    b = in->buf;
+    blk = s->in_block;
+    b = &blk->buf;
 
-    if (old_size) {
-      ngx_log_debug1(NGX_LOG_DEBUG_RTMP, c->log, 0,
-                     "reusing formerly read data: %d", old_size);
+    /* nothing refers to the block, start over */
+    if (b->pos == b->last && blk->refs == 1) {
+      b->pos = b->last = b->start;
+    }
 
-      b->pos = b->start;
-      b->last = ngx_movemem(b->pos, old_pos, old_size);
+    /* parse chunk header, nothing is stored until the chunk is complete */
+    p = b->pos;
 
-      if (s->in_chunk_size_changing) {
-        ngx_rtmp_finalize_set_chunk_size(s);
-      }
+    if (b->last - p < 1) goto read;
 
-    } else {
-      if (old_pos) {
-        b->pos = b->last = b->start;
-      }
+    fmt = (*p >> 6) & 0x03;
+    csid = *p++ & 0x3f;
 
-      n = c->recv(c, b->last, b->end - b->last);
+    if (csid == 0) {
+      if (b->last - p < 1) goto read;
+      csid = 64;
+      csid += *(uint8_t *)p++;
 
-      if (n == NGX_ERROR || n == 0) {
-        ngx_rtmp_finalize_session(s);
-        return;
-      }
-
-      if (n == NGX_AGAIN) {
-        if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
-          ngx_rtmp_finalize_session(s);
-        }
-        return;
-      }
-
-      s->ping_reset = 1;
-      ngx_rtmp_update_bandwidth(&ngx_rtmp_bw_in, n);
-      b->last += n;
-      s->in_bytes += n;
+    } else if (csid == 1) {
+      if (b->last - p < 2) goto read;
+      csid = 64;
+      csid += *(uint8_t *)p++;
+      csid += (uint32_t)256 * (*(uint8_t *)p++);
+    }
 
-      if (s->in_bytes >= 0xf0000000) {
-        ngx_log_debug0(NGX_LOG_DEBUG_RTMP, c->log, 0, "resetting byte counter");
-        s->in_bytes = 0;
-        s->in_last_ack = 0;
-      }
+    if (csid >= (uint32_t)cscf->max_streams) {
+      ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                    "RTMP in chunk stream too big: %D >= %D", csid,
+                    cscf->max_streams);
+      ngx_rtmp_finalize_session(s);
+      return;
+    }
 
-      if (s->ack_size && s->in_bytes - s->in_last_ack >= s->ack_size) {
-        s->in_last_ack = s->in_bytes;
+    st = &s->in_streams[csid];
+    h = &st->hdr;
 
-        ngx_log_debug1(NGX_LOG_DEBUG_RTMP, c->log, 0, "sending RTMP ACK(%uD)",
-                       s->in_bytes);
+    ext = st->ext;
+    timestamp = st->dtime;
+    mlen = h->mlen;
+    type = h->type;
+    msid = h->msid;
+
+    if (fmt <= 2) {
+      if (b->last - p < 3) goto read;
+      /* timestamp:
+       *  big-endian 3b -> little-endian 4b */
+      pp = (u_char *)&timestamp;
+      pp[2] = *p++;
+      pp[1] = *p++;
+      pp[0] = *p++;
+      pp[3] = 0;
+
+      ext = (timestamp == 0x00ffffff);
+
+      if (fmt <= 1) {
+        if (b->last - p < 4) goto read;
+        /* size:
+         *  big-endian 3b -> little-endian 4b
+         * type:
+         *  1b -> 1b*/
+        pp = (u_char *)&mlen;
+        pp[2] = *p++;
+        pp[1] = *p++;
+        pp[0] = *p++;
+        pp[3] = 0;
+        type = *(uint8_t *)p++;
 
-        if (ngx_rtmp_send_ack(s, s->in_bytes)) {
-          ngx_rtmp_finalize_session(s);
-          return;
+        if (fmt == 0) {
+          if (b->last - p < 4) goto read;
+          /* stream:
+           *  little-endian 4b -> little-endian 4b */
+          pp = (u_char *)&msid;
+          pp[0] = *p++;
+          pp[1] = *p++;
+          pp[2] = *p++;
+          pp[3] = *p++;
         }
       }
     }
 
-    old_pos = NULL;
-    old_size = 0;
+    /* extended header */
+    if (ext) {
+      if (b->last - p < 4) goto read;
+      pp = (u_char *)&timestamp;
+      pp[3] = *p++;
+      pp[2] = *p++;
+      pp[1] = *p++;
+      pp[0] = *p++;
+    }
 
-    /* parse headers */
-    if (b->pos == b->start) {
-      p = b->pos;
+    if (mlen > cscf->max_message) {
+      ngx_log_error(NGX_LOG_INFO, c->log, 0, "too big message: %uz, %uz",
+                    (size_t)mlen, cscf->max_message);
+      ngx_rtmp_finalize_session(s);
+      return;
+    }
 
-      /* chunk basic header */
-      fmt = (*p >> 6) & 0x03;
-      csid = *p++ & 0x3f;
+    fsize = mlen - st->len;
+    size = ngx_min(fsize, s->in_chunk_size);
 
-      if (csid == 0) {
-        if (b->last - p < 1) continue;
-        csid = 64;
-        csid += *(uint8_t *)p++;
+    if ((size_t)(b->last - p) < size) goto read;
 
-      } else if (csid == 1) {
-        if (b->last - p < 2) continue;
-        csid = 64;
-        csid += *(uint8_t *)p++;
-        csid += (uint32_t)256 * (*(uint8_t *)p++);
-      }
+    /* chunk is complete, header done */
 
-      ngx_log_debug2(NGX_LOG_DEBUG_RTMP, c->log, 0,
-                     "RTMP bheader fmt=%d csid=%D", (int)fmt, csid);
+    h->csid = csid;
+    h->mlen = mlen;
+    h->type = type;
+    h->msid = msid;
 
-      if (csid >= (uint32_t)cscf->max_streams) {
-        ngx_log_error(NGX_LOG_INFO, c->log, 0,
-                      "RTMP in chunk stream too big: %D >= %D", csid,
-                      cscf->max_streams);
-        ngx_rtmp_finalize_session(s);
-        return;
+    if (st->len == 0) {
+      /* Messages with type=3 should
+       * never have ext timestamp field
+       * according to standard.
+       * However that's not always the case
+       * in real life */
+      st->ext = (ext && cscf->publish_time_fix);
+      if (fmt) {
+        st->dtime = timestamp;
+      } else {
+        h->timestamp = timestamp;
+        st->dtime = 0;
       }
+    }
 
-      /* link orphan */
-      if (s->in_csid == 0) {
-        /* unlink from stream #0 */
-        st->in = st->in->next;
-
-        /* link to new stream */
-        s->in_csid = csid;
-        st = &s->in_streams[csid];
-        if (st->in == NULL) {
-          in->next = in;
-        } else {
-          in->next = st->in->next;
-          st->in->next = in;
-        }
-        st->in = in;
-        h = &st->hdr;
-        h->csid = csid;
-      }
+    ngx_log_debug8(NGX_LOG_DEBUG_RTMP, c->log, 0,
+                   "RTMP mheader fmt=%d %s (%d) "
+                   "time=%uD+%uD mlen=%D len=%D msid=%D",
+                   (int)fmt, ngx_rtmp_message_type(h->type), (int)h->type,
+                   h->timestamp, st->dtime, h->mlen, st->len, h->msid);
 
-      ext = st->ext;
-      timestamp = st->dtime;
-      if (fmt <= 2) {
-        if (b->last - p < 3) continue;
-        /* timestamp:
-         *  big-endian 3b -> little-endian 4b */
-        pp = (u_char *)&timestamp;
-        pp[2] = *p++;
-        pp[1] = *p++;
-        pp[0] = *p++;
-        pp[3] = 0;
+    /* link the payload by reference */
+    cl = ngx_rtmp_alloc_in_link(s);
+    if (cl == NULL) {
+      ngx_log_error(NGX_LOG_INFO, c->log, 0, "in buf alloc failed");
+      ngx_rtmp_finalize_session(s);
+      return;
+    }
 
-        ext = (timestamp == 0x00ffffff);
+    cl->buf->pos = p;
+    cl->buf->last = p + size;
+    cl->buf->shadow = b;
+    blk->refs++;
 
-        if (fmt <= 1) {
-          if (b->last - p < 4) continue;
-          /* size:
-           *  big-endian 3b -> little-endian 4b
-           * type:
-           *  1b -> 1b*/
-          pp = (u_char *)&h->mlen;
-          pp[2] = *p++;
-          pp[1] = *p++;
-          pp[0] = *p++;
-          pp[3] = 0;
-          h->type = *(uint8_t *)p++;
-
-          if (fmt == 0) {
-            if (b->last - p < 4) continue;
-            /* stream:
-             *  little-endian 4b -> little-endian 4b */
-            pp = (u_char *)&h->msid;
-            pp[0] = *p++;
-            pp[1] = *p++;
-            pp[2] = *p++;
-            pp[3] = *p++;
-          }
-        }
-      }
+    if (st->in == NULL) {
+      cl->next = cl;
+    } else {
+      cl->next = st->in->next;
+      st->in->next = cl;
+    }
+    st->in = cl;
 
-      /* extended header */
-      if (ext) {
-        if (b->last - p < 4) continue;
-        pp = (u_char *)&timestamp;
-        pp[3] = *p++;
-        pp[2] = *p++;
-        pp[1] = *p++;
-        pp[0] = *p++;
-      }
+    b->pos = p + size;
 
-      if (st->len == 0) {
-        /* Messages with type=3 should
-         * never have ext timestamp field
-         * according to standard.
-         * However that's not always the case
-         * in real life */
-        st->ext = (ext && cscf->publish_time_fix);
-        if (fmt) {
-          st->dtime = timestamp;
-        } else {
-          h->timestamp = timestamp;
-          st->dtime = 0;
-        }
-      }
+    if (fsize > s->in_chunk_size) {
+      /* collect fragmented chunks */
+      st->len += s->in_chunk_size;
+      continue;
+    }
 
-      ngx_log_debug8(NGX_LOG_DEBUG_RTMP, c->log, 0,
-                     "RTMP mheader fmt=%d %s (%d) "
-                     "time=%uD+%uD mlen=%D len=%D msid=%D",
-                     (int)fmt, ngx_rtmp_message_type(h->type), (int)h->type,
-                     h->timestamp, st->dtime, h->mlen, st->len, h->msid);
+    /* handle! */
+    head = st->in->next;
+    st->in->next = NULL;
+    st->in = NULL;
+    st->len = 0;
+    h->timestamp += st->dtime;
 
-      /* header done */
-      b->pos = p;
+    rc = ngx_rtmp_receive_message(s, h, head);
 
-      if (h->mlen > cscf->max_message) {
-        ngx_log_error(NGX_LOG_INFO, c->log, 0, "too big message: %uz, %uz",
-                      h->mlen, cscf->max_message);
-        ngx_rtmp_finalize_session(s);
-        return;
-      }
+    ngx_rtmp_free_in_chain(s, head);
+
+    if (rc != NGX_OK) {
+      ngx_rtmp_finalize_session(s);
+      return;
     }
 
-    size = b->last - b->pos;
-    fsize = h->mlen - st->len;
+    /* server configuration may change due to virtual server match */
+    if (s->server_changed) {
+      cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
+      s->server_changed = 0;
+    }
 
-    if (size < ngx_min(fsize, s->in_chunk_size)) continue;
+    continue;
 
-    /* buffer is ready */
+  read:
 
-    if (fsize > s->in_chunk_size) {
-      /* collect fragmented chunks */
-      st->len += s->in_chunk_size;
-      b->last = b->pos + s->in_chunk_size;
-      old_pos = b->last;
-      old_size = size - s->in_chunk_size;
+    if (ngx_rtmp_shift_in_block(s, ngx_rtmp_in_block_need(s, cscf)) !=
+        NGX_OK) {
+      ngx_log_error(NGX_LOG_INFO, c->log, 0, "in buf alloc failed");
+      ngx_rtmp_finalize_session(s);
+      return;
+    }
 
-    } else {
-      /* handle! */
-      head = st->in->next;
-      st->in->next = NULL;
-      b->last = b->pos + fsize;
-      old_pos = b->last;
-      old_size = size - fsize;
-      st->len = 0;
-      h->timestamp += st->dtime;
+    b = &s->in_block->buf;
+    size = b->end - b->last;
+
+    n = c->recv(c, b->last, size);
+
+    if (n == NGX_ERROR || n == 0) {
+      ngx_rtmp_finalize_session(s);
+      return;
+    }
 
-      if (ngx_rtmp_receive_message(s, h, head) != NGX_OK) {
+    if (n == NGX_AGAIN) {
+      if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
         ngx_rtmp_finalize_session(s);
-        return;
       }
+      return;
+    }
 
-      /* server configuration may change due to virtual server match */
-      if (s->server_changed) {
-        cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
-        st = &s->in_streams[s->in_csid];
+    /* the peer keeps the socket full, read in larger blocks from now on */
+    if ((size_t)n == size) {
+      s->in_block_size = cscf->in_buffer_size;
+    }
 
-        s->server_changed = 0;
-      }
+    s->ping_reset = 1;
+    ngx_rtmp_update_bandwidth(&ngx_rtmp_bw_in, n);
+    b->last += n;
+    s->in_bytes += n;
+
+    if (s->in_bytes >= 0xf0000000) {
+      ngx_log_debug0(NGX_LOG_DEBUG_RTMP, c->log, 0, "resetting byte counter");
+      s->in_bytes = 0;
+      s->in_last_ack = 0;
+    }
 
-      if (s->in_chunk_size_changing) {
-        /* copy old data to a new buffer */
-        if (!old_size) {
-          ngx_rtmp_finalize_set_chunk_size(s);
-        }
+    if (s->ack_size && s->in_bytes - s->in_last_ack >= s->ack_size) {
+      s->in_last_ack = s->in_bytes;
 
-      } else {
-        /* add used bufs to stream #0 */
-        st0 = &s->in_streams[0];
-        st->in->next = st0->in;
-        st0->in = head;
-        st->in = NULL;
+      ngx_log_debug1(NGX_LOG_DEBUG_RTMP, c->log, 0, "sending RTMP ACK(%uD)",
+                     s->in_bytes);
+
+      if (ngx_rtmp_send_ack(s, s->in_bytes)) {
+        ngx_rtmp_finalize_session(s);
+        return;
       }
     }
-
-    s->in_csid = 0;
   }
 }
 
@@ -428,7 +608,6 @@ static void ngx_rtmp_send(ngx_event_t *wev) {
   ngx_connection_t *c;
   ngx_rtmp_session_t *s;
   ngx_int_t n;
-  ngx_rtmp_core_srv_conf_t *cscf;
 
   c = wev->data;
   s = c->data;
@@ -472,14 +651,12 @@ static void ngx_rtmp_send(ngx_event_t *wev) {
     s->out_bytes += n;
     s->ping_reset = 1;
     ngx_rtmp_update_bandwidth(&ngx_rtmp_bw_out, n);
+    ngx_rtmp_update_histogram(&ngx_rtmp_hist_send, n);
     s->out_bpos += n;
     if (s->out_bpos == s->out_chain->buf->last) {
       s->out_chain = s->out_chain->next;
       if (s->out_chain == NULL) {
-        cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
-        ngx_rtmp_free_shared_chain(cscf, s->out[s->out_pos]);
-        ++s->out_pos;
-        s->out_pos %= s->out_queue;
+        ngx_rtmp_dequeue_message(s);
         if (s->out_pos == s->out_last) {
           break;
         }
@@ -637,11 +814,51 @@ void ngx_rtmp_prepare_message(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
   }
 }
 
-ngx_int_t ngx_rtmp_send_message(ngx_rtmp_session_t *s, ngx_chain_t *out,
-                                ngx_uint_t priority) {
-  ngx_uint_t nmsg;
+ngx_int_t ngx_rtmp_alloc_out_queue(ngx_rtmp_session_t *s, ngx_pool_t *pool,
+                                   size_t n) {
+  u_char *p;
 
-  nmsg = (s->out_last + s->out_queue - s->out_pos) % s->out_queue + 1;
+  p = ngx_pcalloc(pool, (sizeof(ngx_chain_t *) + sizeof(ngx_msec_t) +
+                         sizeof(size_t)) * n);
+  if (p == NULL) {
+    return NGX_ERROR;
+  }
+
+  s->out = (ngx_chain_t **)p;
+  s->out_msec = (ngx_msec_t *)(p + sizeof(ngx_chain_t *) * n);
+  s->out_size =
+      (size_t *)(p + (sizeof(ngx_chain_t *) + sizeof(ngx_msec_t)) * n);
+  s->out_queue = n;
+
+  return NGX_OK;
+}
+
+/* would size more bytes go over out_queue_size or out_queue_latency */
+ngx_uint_t ngx_rtmp_queue_congested(ngx_rtmp_session_t *s, size_t size) {
+  ngx_rtmp_core_srv_conf_t *cscf;
+
+  cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
+
+  return (cscf->out_queue_size &&
+          s->out_queued + size > cscf->out_queue_size) ||
+         (cscf->out_queue_latency && s->out_pos != s->out_last &&
+          ngx_current_msec - s->out_msec[s->out_pos] >
+              cscf->out_queue_latency);
+}
+
+/*
+ * Video messages (priority > 0) are dropped when the queue holds more
+ * than out_queue_size bytes or its oldest message is older than
+ * out_queue_latency; after such a drop the rest of the GOP is discarded
+ * too and the session resumes at the next key frame.  Audio, metadata
+ * and control messages are only bound by the out_queue slot count.
+ */
+ngx_int_t ngx_rtmp_queue_message(ngx_rtmp_session_t *s, ngx_chain_t *out,
+                                 ngx_uint_t priority, ngx_uint_t *nmsg) {
+  ngx_chain_t *cl;
+  size_t size;
+
+  *nmsg = (s->out_last + s->out_queue - s->out_pos) % s->out_queue + 1;
 
   if (priority > 3) {
     priority = 3;
@@ -649,18 +866,83 @@ ngx_int_t ngx_rtmp_send_message(ngx_rtmp_session_t *s, ngx_chain_t *out,
 
   /* drop packet?
    * Note we always leave 1 slot free */
-  if (nmsg + priority * s->out_queue / 4 >= s->out_queue) {
-    ngx_log_debug2(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
-                   "RTMP drop message bufs=%ui, priority=%ui", nmsg, priority);
+  if (*nmsg + priority * s->out_queue / 4 >= s->out_queue) {
+    goto drop;
+  }
 
-    return NGX_AGAIN;
+  size = 0;
+  for (cl = out; cl; cl = cl->next) {
+    size += cl->buf->last - cl->buf->pos;
   }
 
+  if (priority) {
+    if (s->out_wait_key && priority != NGX_RTMP_VIDEO_KEY_FRAME) {
+      goto drop;
+    }
+
+    if (ngx_rtmp_queue_congested(s, size)) {
+      s->out_wait_key = 1;
+      goto drop;
+    }
+
+    s->out_wait_key = 0;
+  }
+
+  s->out_msec[s->out_last] = ngx_current_msec;
+  s->out_size[s->out_last] = size;
+  s->out_queued += size;
+
   s->out[s->out_last++] = out;
   s->out_last %= s->out_queue;
 
   ngx_rtmp_acquire_shared_chain(out);
 
+  ngx_rtmp_update_histogram(&ngx_rtmp_hist_out_queue, *nmsg);
+
+  if (s->out_join && priority == NGX_RTMP_VIDEO_KEY_FRAME) {
+    s->out_join = 0;
+    ngx_rtmp_update_histogram(&ngx_rtmp_hist_join,
+                              ngx_current_msec - s->out_join_msec);
+  }
+
+  return NGX_OK;
+
+drop:
+
+  ++s->out_dropped;
+
+  ngx_log_debug4(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                 "drop message bufs=%ui, bytes=%uz, priority=%ui, wait_key=%ui",
+                 *nmsg, s->out_queued, priority, (ngx_uint_t)s->out_wait_key);
+
+  return NGX_AGAIN;
+}
+
+void ngx_rtmp_dequeue_message(ngx_rtmp_session_t *s) {
+  ngx_rtmp_core_srv_conf_t *cscf;
+
+  cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
+
+  ngx_rtmp_free_shared_chain(cscf, s->out[s->out_pos]);
+
+  ngx_rtmp_update_histogram(&ngx_rtmp_hist_latency,
+                            ngx_current_msec - s->out_msec[s->out_pos]);
+
+  s->out[s->out_pos] = NULL;
+  s->out_queued -= s->out_size[s->out_pos];
+
+  ++s->out_pos;
+  s->out_pos %= s->out_queue;
+}
+
+ngx_int_t ngx_rtmp_send_message(ngx_rtmp_session_t *s, ngx_chain_t *out,
+                                ngx_uint_t priority) {
+  ngx_uint_t nmsg;
+
+  if (ngx_rtmp_queue_message(s, out, priority, &nmsg) != NGX_OK) {
+    return NGX_AGAIN;
+  }
+
   ngx_log_debug3(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
                  "RTMP send nmsg=%ui, priority=%ui #%ui", nmsg, priority,
                  s->out_last);
@@ -670,14 +952,33 @@ ngx_int_t ngx_rtmp_send_message(ngx_rtmp_session_t *s, ngx_chain_t *out,
   }
 
   if (!s->connection->write->active) {
-    ngx_rtmp_send(s->connection->write);
-    /*return ngx_add_event(s->connection->write, NGX_WRITE_EVENT,
-     * NGX_CLEAR_EVENT);*/
+    ngx_rtmp_flush_message(s, ngx_rtmp_send);
   }
 
   return NGX_OK;
 }
 
+void ngx_rtmp_flush_message(ngx_rtmp_session_t *s, ngx_event_handler_pt send) {
+  ngx_event_t *wev;
+
+  wev = s->connection->write;
+
+  if (!ngx_rtmp_send_deferred) {
+    send(wev);
+    return;
+  }
+
+  /*
+   * fan-out in progress: flush once all subscribers are queued, from the
+   * posted events of this loop iteration; the event is posted only once
+   * however many messages the session got
+   */
+
+  if (!wev->posted) {
+    ngx_post_event(wev, &ngx_posted_events);
+  }
+}
+
 ngx_int_t ngx_rtmp_receive_message(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
                                    ngx_chain_t *in) {
   ngx_rtmp_core_main_conf_t *cmcf;
@@ -736,11 +1037,6 @@ ngx_int_t ngx_rtmp_receive_message(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
 }
 
 ngx_int_t ngx_rtmp_set_chunk_size(ngx_rtmp_session_t *s, ngx_uint_t size) {
-  ngx_rtmp_core_srv_conf_t *cscf;
-  ngx_chain_t *li, *fli, *lo, *flo;
-  ngx_buf_t *bi, *bo;
-  ngx_int_t n;
-
   ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
                  "setting chunk_size=%ui", size);
 
@@ -750,69 +1046,19 @@ ngx_int_t ngx_rtmp_set_chunk_size(ngx_rtmp_session_t *s, ngx_uint_t size) {
     return NGX_ERROR;
   }
 
-  cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
-
-  s->in_old_pool = s->in_pool;
+  /*
+   * chunks already received are linked by reference, so they need not be
+   * moved; the receive block grows on the next read if it is too small
+   * and oversized blocks are released as they become idle
+   */
   s->in_chunk_size = size;
-  s->in_pool = ngx_create_pool(4096, s->connection->log);
-
-  /* copy existing chunk data */
-  if (s->in_old_pool) {
-    s->in_chunk_size_changing = 1;
-    s->in_streams[0].in = NULL;
-
-    for (n = 1; n < cscf->max_streams; ++n) {
-      /* stream buffer is circular
-       * for all streams except for the current one
-       * (which caused this chunk size change);
-       * we can simply ignore it */
-      li = s->in_streams[n].in;
-      if (li == NULL || li->next == NULL) {
-        s->in_streams[n].in = NULL;
-        continue;
-      }
-      /* move from last to the first */
-      li = li->next;
-      fli = li;
-      lo = ngx_rtmp_alloc_in_buf(s);
-      if (lo == NULL) {
-        return NGX_ERROR;
-      }
-      flo = lo;
-      for (;;) {
-        bi = li->buf;
-        bo = lo->buf;
-
-        if (bo->end - bo->last >= bi->last - bi->pos) {
-          bo->last = ngx_cpymem(bo->last, bi->pos, bi->last - bi->pos);
-          li = li->next;
-          if (li == fli) {
-            lo->next = flo;
-            s->in_streams[n].in = lo;
-            break;
-          }
-          continue;
-        }
 
-        bi->pos +=
-            (ngx_cpymem(bo->last, bi->pos, bo->end - bo->last) - bo->last);
-        lo->next = ngx_rtmp_alloc_in_buf(s);
-        lo = lo->next;
-        if (lo == NULL) {
-          return NGX_ERROR;
-        }
-      }
+  if (s->in_pool == NULL) {
+    s->in_pool = ngx_create_pool(4096, s->connection->log);
+    if (s->in_pool == NULL) {
+      return NGX_ERROR;
     }
   }
 
   return NGX_OK;
 }
-
-ngx_int_t ngx_rtmp_finalize_set_chunk_size(ngx_rtmp_session_t *s) {
-  if (s->in_chunk_size_changing && s->in_old_pool) {
-    ngx_destroy_pool(s->in_old_pool);
-    s->in_old_pool = NULL;
-    s->in_chunk_size_changing = 0;
-  }
-  return NGX_OK;
-}
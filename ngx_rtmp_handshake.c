@@ -8,6 +8,7 @@
 #include "ngx_rtmp.h"
 
 #include <openssl/hmac.h>
+#include <openssl/rand.h>
 #include <openssl/sha.h>
 
 static void ngx_rtmp_handshake_send(ngx_event_t *wev);
@@ -75,27 +76,86 @@ static ngx_str_t ngx_rtmp_client_full_key = {sizeof(ngx_rtmp_client_key),
                                              ngx_rtmp_client_key};
 static ngx_str_t ngx_rtmp_client_partial_key = {30, ngx_rtmp_client_key};
 
-static ngx_int_t ngx_rtmp_make_digest(ngx_str_t *key, ngx_buf_t *src,
-                                      u_char *skip, u_char *dst,
-                                      ngx_log_t *log) {
-  static HMAC_CTX *hmac;
-  unsigned int len;
+/*
+ * HMAC contexts keyed once per process with the static handshake keys;
+ * re-initializing them with a NULL key restores the precomputed inner and
+ * outer pads instead of hashing the key again for every digest.
+ */
+static ngx_str_t *ngx_rtmp_hmac_keys[] = {
+    &ngx_rtmp_server_full_key, &ngx_rtmp_server_partial_key,
+    &ngx_rtmp_client_full_key, &ngx_rtmp_client_partial_key, NULL};
 
-  if (hmac == NULL) {
+static HMAC_CTX *ngx_rtmp_hmac_keyed[4];
+
+/* per-worker xorshift128+ state for handshake random bytes */
+static uint64_t ngx_rtmp_random_state[2];
+
+static HMAC_CTX *ngx_rtmp_hmac_create(void) {
 #if OPENSSL_VERSION_NUMBER < 0x10100000L
-    static HMAC_CTX shmac;
-    hmac = &shmac;
-    HMAC_CTX_init(hmac);
+  HMAC_CTX *hmac;
+
+  hmac = ngx_alloc(sizeof(HMAC_CTX), ngx_cycle->log);
+  if (hmac == NULL) {
+    return NULL;
+  }
+
+  HMAC_CTX_init(hmac);
+
+  return hmac;
 #else
-    hmac = HMAC_CTX_new();
+  return HMAC_CTX_new();
+#endif
+}
+
+static HMAC_CTX *ngx_rtmp_hmac_init(ngx_str_t *key) {
+  static HMAC_CTX *hmac;
+  ngx_uint_t n;
+
+  for (n = 0; ngx_rtmp_hmac_keys[n]; ++n) {
+    if (ngx_rtmp_hmac_keys[n] != key) {
+      continue;
+    }
+
+    if (ngx_rtmp_hmac_keyed[n]) {
+      HMAC_Init_ex(ngx_rtmp_hmac_keyed[n], NULL, 0, NULL, NULL);
+      return ngx_rtmp_hmac_keyed[n];
+    }
+
+    ngx_rtmp_hmac_keyed[n] = ngx_rtmp_hmac_create();
+    if (ngx_rtmp_hmac_keyed[n] == NULL) {
+      return NULL;
+    }
+
+    HMAC_Init_ex(ngx_rtmp_hmac_keyed[n], key->data, key->len, EVP_sha256(),
+                 NULL);
+    return ngx_rtmp_hmac_keyed[n];
+  }
+
+  /* per-session key */
+
+  if (hmac == NULL) {
+    hmac = ngx_rtmp_hmac_create();
     if (hmac == NULL) {
-      return NGX_ERROR;
+      return NULL;
     }
-#endif
   }
 
   HMAC_Init_ex(hmac, key->data, key->len, EVP_sha256(), NULL);
 
+  return hmac;
+}
+
+static ngx_int_t ngx_rtmp_make_digest(ngx_str_t *key, ngx_buf_t *src,
+                                      u_char *skip, u_char *dst,
+                                      ngx_log_t *log) {
+  HMAC_CTX *hmac;
+  unsigned int len;
+
+  hmac = ngx_rtmp_hmac_init(key);
+  if (hmac == NULL) {
+    return NGX_ERROR;
+  }
+
   if (skip && src->pos <= skip && skip <= src->last) {
     if (skip != src->pos) {
       HMAC_Update(hmac, src->pos, skip - src->pos);
@@ -157,8 +217,31 @@ static ngx_int_t ngx_rtmp_write_digest(ngx_buf_t *b, ngx_str_t *key,
 }
 
 static void ngx_rtmp_fill_random_buffer(ngx_buf_t *b) {
-  for (; b->last != b->end; ++b->last) {
-    *b->last = (u_char)rand();
+  uint64_t x, y, *st;
+  size_t n;
+
+  st = ngx_rtmp_random_state;
+
+  if (st[0] == 0 && st[1] == 0) {
+    /* seeded lazily, so every worker gets its own stream */
+    if (RAND_bytes((u_char *)st, sizeof(ngx_rtmp_random_state)) != 1) {
+      st[0] = ((uint64_t)ngx_random() << 32) ^ (uint64_t)ngx_pid;
+      st[1] = ((uint64_t)ngx_random() << 32) ^ (uint64_t)ngx_current_msec;
+    }
+
+    st[0] |= 1;
+  }
+
+  while (b->last != b->end) {
+    x = st[0];
+    y = st[1];
+    st[0] = y;
+    x ^= x << 23;
+    st[1] = x ^ y ^ (x >> 17) ^ (y >> 26);
+    x = st[1] + y;
+
+    n = ngx_min((size_t)(b->end - b->last), sizeof(uint64_t));
+    b->last = ngx_cpymem(b->last, &x, n);
   }
 }
 
@@ -184,7 +267,9 @@ static ngx_buf_t *ngx_rtmp_alloc_handshake_buffer(ngx_rtmp_session_t *s) {
       return NULL;
     }
     b->memory = 1;
-    b->start = ngx_pcalloc(cscf->pool, NGX_RTMP_HANDSHAKE_BUFSIZE);
+    /* room for the peer digest key past the packet, see hs_digest */
+    b->start = ngx_pcalloc(
+        cscf->pool, NGX_RTMP_HANDSHAKE_BUFSIZE + NGX_RTMP_HANDSHAKE_KEYLEN);
     if (b->start == NULL) {
       return NULL;
     }
@@ -212,6 +297,7 @@ void ngx_rtmp_free_handshake_buffers(ngx_rtmp_session_t *s) {
   cl->next = cscf->free_hs;
   cscf->free_hs = cl;
   s->hs_buf = NULL;
+  s->hs_digest = NULL;
 }
 
 static ngx_int_t ngx_rtmp_handshake_create_challenge(ngx_rtmp_session_t *s,
@@ -274,7 +360,7 @@ static ngx_int_t ngx_rtmp_handshake_parse_challenge(ngx_rtmp_session_t *s,
                  "handshake: digest found at pos=%i", offs);
   b->pos += offs;
   b->last = b->pos + NGX_RTMP_HANDSHAKE_KEYLEN;
-  s->hs_digest = ngx_palloc(s->connection->pool, NGX_RTMP_HANDSHAKE_KEYLEN);
+  s->hs_digest = b->end;
   if (ngx_rtmp_make_digest(key, b, NULL, s->hs_digest, s->connection->log) !=
       NGX_OK) {
     return NGX_ERROR;
@@ -0,0 +1,52 @@
+
+/*
+ * Copyright (C) Winshining
+ */
+
+#ifndef _NGX_RTMP_HISTOGRAM_H_INCLUDED_
+#define _NGX_RTMP_HISTOGRAM_H_INCLUDED_
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+/*
+ * Per-worker power-of-two histograms: bucket n counts the values below
+ * 2^n that did not fit bucket n - 1, the last one takes the rest.
+ */
+#define NGX_RTMP_HISTOGRAM_BUCKETS 24
+
+typedef struct {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+  uint64_t bucket[NGX_RTMP_HISTOGRAM_BUCKETS];
+} ngx_rtmp_histogram_t;
+
+/* msec from queueing a message to its last byte leaving */
+extern ngx_rtmp_histogram_t ngx_rtmp_hist_latency;
+/* messages in out_queue, sampled on each queueing */
+extern ngx_rtmp_histogram_t ngx_rtmp_hist_out_queue;
+/* msec from joining a stream to the first key frame queued */
+extern ngx_rtmp_histogram_t ngx_rtmp_hist_join;
+/* bytes written by each successful send() */
+extern ngx_rtmp_histogram_t ngx_rtmp_hist_send;
+
+static ngx_inline void ngx_rtmp_update_histogram(ngx_rtmp_histogram_t *h,
+                                                 uint64_t v) {
+  ngx_uint_t n;
+  uint64_t x;
+
+  for (n = 0, x = v; x && n < NGX_RTMP_HISTOGRAM_BUCKETS - 1; x >>= 1) {
+    n++;
+  }
+
+  h->bucket[n]++;
+  h->count++;
+  h->sum += v;
+
+  if (v > h->max) {
+    h->max = v;
+  }
+}
+
+#endif /* _NGX_RTMP_HISTOGRAM_H_INCLUDED_ */
@@ -199,12 +199,9 @@ ngx_rtmp_session_t *ngx_rtmp_init_session(ngx_connection_t *c,
     return NULL;
   }
 
-  s->out = ngx_pcalloc(
-      s->out_pool, sizeof(ngx_chain_t *) *
-                       ((ngx_rtmp_core_srv_conf_t *)addr_conf->default_server
-                            ->ctx->srv_conf[ngx_rtmp_core_module.ctx_index])
-                           ->out_queue);
-  if (s->out == NULL) {
+  cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
+
+  if (ngx_rtmp_alloc_out_queue(s, s->out_pool, cscf->out_queue) != NGX_OK) {
     ngx_rtmp_close_connection(c);
     return NULL;
   }
@@ -215,9 +212,6 @@ ngx_rtmp_session_t *ngx_rtmp_init_session(ngx_connection_t *c,
     return NULL;
   }
 
-  cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
-
-  s->out_queue = cscf->out_queue;
   s->out_cork = cscf->out_cork;
   s->in_streams = ngx_pcalloc(s->in_streams_pool,
                               sizeof(ngx_rtmp_stream_t) * cscf->max_streams);
@@ -305,9 +299,7 @@ static void ngx_rtmp_close_session_handler(ngx_event_t *e) {
     ngx_del_timer(&s->ping_evt);
   }
 
-  if (s->in_old_pool) {
-    ngx_destroy_pool(s->in_old_pool);
-  }
+  ngx_rtmp_free_in_blocks(s);
 
   if (s->in_pool) {
     ngx_destroy_pool(s->in_pool);
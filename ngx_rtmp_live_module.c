@@ -38,6 +38,8 @@ static ngx_chain_t *ngx_rtmp_live_append_message(ngx_rtmp_session_t *s,
                                                  ngx_rtmp_header_t *lh,
                                                  ngx_chain_t *in);
 static void ngx_rtmp_live_free_message(ngx_rtmp_session_t *s, ngx_chain_t *in);
+static void ngx_rtmp_live_free_meta(ngx_rtmp_session_t *s,
+                                    ngx_rtmp_live_stream_t *stream);
 
 #define ACTION_VAR_LEN 128
 #define STREAM_VAR_LEN 1024
@@ -46,14 +48,13 @@ ngx_rtmp_live_proc_handler_t ngx_rtmp_live_proc_handler = {
     NULL,
     NULL,
     NULL,
-    NULL,
     ngx_rtmp_live_send_message,
     ngx_rtmp_live_meta_message,
     ngx_rtmp_live_append_message,
     ngx_rtmp_live_free_message};
 
 extern ngx_rtmp_live_proc_handler_t
-    *ngx_rtmp_live_proc_handlers[NGX_RTMP_PROTOCOL_HTTP + 1];
+    *ngx_rtmp_live_proc_handlers[NGX_RTMP_PROTOCOL_TS + 1];
 extern ngx_module_t ngx_http_flv_live_module;
 
 static ngx_command_t ngx_rtmp_live_commands[] = {
@@ -251,6 +252,70 @@ void ngx_rtmp_live_free_message(ngx_rtmp_session_t *s, ngx_chain_t *in) {
   ngx_rtmp_free_shared_chain(cscf, in);
 }
 
+/*
+ * RTMP needs a single variant since the chunk size is per server, HTTP-FLV
+ * differs by framing and TS carries PAT/PMT instead of onMetaData
+ */
+ngx_chain_t *ngx_rtmp_live_get_meta(ngx_rtmp_session_t *s,
+                                    ngx_rtmp_live_ctx_t *ctx, ngx_chain_t *meta,
+                                    ngx_uint_t version) {
+  ngx_rtmp_live_stream_t *stream;
+  ngx_rtmp_live_proc_handler_t *handler;
+  ngx_http_request_t *r;
+  ngx_chain_t *pkt;
+  ngx_uint_t n;
+
+  stream = ctx->stream;
+  if (stream == NULL || meta == NULL) {
+    return NULL;
+  }
+
+  n = ctx->protocol;
+
+  if (n == NGX_RTMP_PROTOCOL_HTTP) {
+    r = s->data;
+    if (r && !r->chunked) {
+      n = NGX_RTMP_LIVE_META_FLV_PLAIN;
+    }
+  }
+
+  if (stream->meta[n] && stream->meta_version[n] == version) {
+    return stream->meta[n];
+  }
+
+  handler = ngx_rtmp_live_proc_handlers[ctx->protocol];
+
+  pkt = handler->meta_message_pt(s, meta);
+  if (pkt == NULL) {
+    return NULL;
+  }
+
+  if (stream->meta[n]) {
+    handler->free_message_pt(s, stream->meta[n]);
+  }
+
+  ngx_log_debug2(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                 "live: meta variant=%ui version=%ui", n, version);
+
+  stream->meta[n] = pkt;
+  stream->meta_version[n] = version;
+
+  return pkt;
+}
+
+static void ngx_rtmp_live_free_meta(ngx_rtmp_session_t *s,
+                                    ngx_rtmp_live_stream_t *stream) {
+  ngx_uint_t n;
+
+  for (n = 0; n < NGX_RTMP_LIVE_META_VARIANTS; n++) {
+    if (stream->meta[n]) {
+      ngx_rtmp_live_free_message(s, stream->meta[n]);
+      stream->meta[n] = NULL;
+      stream->meta_version[n] = 0;
+    }
+  }
+}
+
 static void *ngx_rtmp_live_create_app_conf(ngx_conf_t *cf) {
   ngx_rtmp_live_app_conf_t *lacf;
 
@@ -344,6 +409,8 @@ ngx_rtmp_live_stream_t **ngx_rtmp_live_get_stream(ngx_rtmp_session_t *s,
                                                   u_char *name, int create) {
   ngx_rtmp_live_app_conf_t *lacf;
   ngx_rtmp_live_stream_t **stream;
+  ngx_rtmp_live_ctx_t **players;
+  ngx_uint_t nalloc;
   size_t len;
   ngx_array_t *videoFrameArray = NULL;
 
@@ -368,12 +435,17 @@ ngx_rtmp_live_stream_t **ngx_rtmp_live_get_stream(ngx_rtmp_session_t *s,
   ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
                  "live: create stream '%s'", name);
 
+  players = NULL;
+  nalloc = 0;
+
   if (lacf->free_streams) {
     *stream = lacf->free_streams;
     lacf->free_streams = lacf->free_streams->next;
 
     (*stream)->videoframe_in.elementArray->nelts = 0;
     videoFrameArray = (*stream)->videoframe_in.elementArray;
+    players = (*stream)->players;
+    nalloc = (*stream)->nalloc;
   } else {
     *stream = ngx_palloc(lacf->pool, sizeof(ngx_rtmp_live_stream_t));
     videoFrameArray = ngx_array_create(
@@ -384,10 +456,86 @@ ngx_rtmp_live_stream_t **ngx_rtmp_live_get_stream(ngx_rtmp_session_t *s,
 
   (*stream)->epoch = ngx_current_msec;
   (*stream)->videoframe_in.elementArray = videoFrameArray;
+  (*stream)->players = players;
+  (*stream)->nalloc = nalloc;
 
   return stream;
 }
 
+/*
+ * Players are kept in a dense array besides the stream list so that the
+ * fan-out loops walk contiguous memory instead of chasing ctx->next; the
+ * array outlives the stream on the free list and is only ever grown.
+ */
+
+ngx_int_t ngx_rtmp_live_link_ctx(ngx_rtmp_live_stream_t *stream,
+                                 ngx_rtmp_live_ctx_t *ctx) {
+  ngx_rtmp_live_ctx_t **players;
+  ngx_uint_t nalloc;
+
+  if (!ctx->publishing) {
+    if (stream->nplayers == stream->nalloc) {
+      nalloc = stream->nalloc ? stream->nalloc * 2 : 16;
+
+      players = ngx_alloc(nalloc * sizeof(ngx_rtmp_live_ctx_t *),
+                          ctx->session->connection->log);
+      if (players == NULL) {
+        return NGX_ERROR;
+      }
+
+      if (stream->players) {
+        ngx_memcpy(players, stream->players,
+                   stream->nplayers * sizeof(ngx_rtmp_live_ctx_t *));
+        ngx_free(stream->players);
+      }
+
+      stream->players = players;
+      stream->nalloc = nalloc;
+    }
+
+    ctx->index = stream->nplayers;
+    stream->players[stream->nplayers++] = ctx;
+  }
+
+  ctx->stream = stream;
+
+  ctx->next = stream->ctx;
+  ctx->prev = &stream->ctx;
+  if (ctx->next) {
+    ctx->next->prev = &ctx->next;
+  }
+
+  stream->ctx = ctx;
+
+  return NGX_OK;
+}
+
+void ngx_rtmp_live_unlink_ctx(ngx_rtmp_live_ctx_t *ctx) {
+  ngx_rtmp_live_stream_t *stream;
+  ngx_rtmp_live_ctx_t *last;
+
+  stream = ctx->stream;
+
+  if (ctx->prev) {
+    *ctx->prev = ctx->next;
+    if (ctx->next) {
+      ctx->next->prev = ctx->prev;
+    }
+
+    ctx->prev = NULL;
+    ctx->next = NULL;
+  }
+
+  if (stream == NULL || ctx->index >= stream->nplayers ||
+      stream->players[ctx->index] != ctx) {
+    return;
+  }
+
+  last = stream->players[--stream->nplayers];
+  stream->players[ctx->index] = last;
+  last->index = ctx->index;
+}
+
 static void ngx_rtmp_live_idle(ngx_event_t *pev) {
   ngx_connection_t *c;
   ngx_rtmp_session_t *s;
@@ -408,6 +556,7 @@ static void ngx_rtmp_live_set_status(ngx_rtmp_session_t *s,
   ngx_rtmp_live_ctx_t *ctx, *pctx;
   ngx_chain_t **cl;
   ngx_event_t *e;
+  ngx_uint_t i;
   size_t n;
 
   lacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_live_module);
@@ -445,15 +594,15 @@ static void ngx_rtmp_live_set_status(ngx_rtmp_session_t *s,
 
     ctx->stream->active = active;
 
-    for (pctx = ctx->stream->ctx; pctx; pctx = pctx->next) {
-      if (pctx->publishing == 0) {
-        if (pctx->protocol == NGX_RTMP_PROTOCOL_HTTP) {
-          pctx->session->publisher = s;
-          ngx_http_flv_live_set_status(pctx->session, active);
-        } else {
-          ngx_rtmp_live_set_status(pctx->session, control, status, nstatus,
-                                   active);
-        }
+    for (i = 0; i < ctx->stream->nplayers; i++) {
+      pctx = ctx->stream->players[i];
+
+      if (pctx->protocol != NGX_RTMP_PROTOCOL_RTMP) {
+        pctx->session->publisher = s;
+        ngx_http_flv_live_set_status(pctx->session, active);
+      } else {
+        ngx_rtmp_live_set_status(pctx->session, control, status, nstatus,
+                                 active);
       }
     }
 
@@ -462,7 +611,7 @@ static void ngx_rtmp_live_set_status(ngx_rtmp_session_t *s,
 
   /* subscriber */
 
-  if (ctx->protocol == NGX_RTMP_PROTOCOL_HTTP) {
+  if (ctx->protocol != NGX_RTMP_PROTOCOL_RTMP) {
     ngx_http_flv_live_set_status(s, active);
   } else {
     if (control && ngx_rtmp_send_message(s, control, 0) != NGX_OK) {
@@ -660,11 +809,18 @@ static void ngx_rtmp_live_join(ngx_rtmp_session_t *s, u_char *name,
     (*stream)->videoframe_in.publish = s;
   }
 
-  ctx->stream = *stream;
   ctx->publishing = publisher;
-  ctx->next = (*stream)->ctx;
 
-  (*stream)->ctx = ctx;
+  if (ngx_rtmp_live_link_ctx(*stream, ctx) != NGX_OK) {
+    if (publisher) {
+      (*stream)->publishing = 0;
+      (*stream)->pub_ctx = NULL;
+      (*stream)->videoframe_in.publish = NULL;
+    }
+
+    ngx_rtmp_finalize_session(s);
+    return;
+  }
 
   if (lacf->buflen) {
     s->out_buffer = 1;
@@ -673,6 +829,11 @@ static void ngx_rtmp_live_join(ngx_rtmp_session_t *s, u_char *name,
   ctx->cs[0].csid = NGX_RTMP_CSID_VIDEO;
   ctx->cs[1].csid = NGX_RTMP_CSID_AUDIO;
 
+  if (!ctx->publishing) {
+    s->out_join = 1;
+    s->out_join_msec = ngx_current_msec;
+  }
+
   if (!ctx->publishing && ctx->stream->active) {
     ngx_rtmp_live_start(s);
   }
@@ -681,9 +842,10 @@ static void ngx_rtmp_live_join(ngx_rtmp_session_t *s, u_char *name,
 static ngx_int_t ngx_rtmp_live_close_stream(ngx_rtmp_session_t *s,
                                             ngx_rtmp_close_stream_t *v) {
   ngx_rtmp_session_t *ss;
-  ngx_rtmp_live_ctx_t *ctx, **cctx, *pctx;
+  ngx_rtmp_live_ctx_t *ctx, *pctx;
   ngx_rtmp_live_stream_t **stream;
   ngx_rtmp_live_app_conf_t *lacf;
+  ngx_uint_t i;
 
   lacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_live_module);
   if (lacf == NULL) {
@@ -710,15 +872,13 @@ static ngx_int_t ngx_rtmp_live_close_stream(ngx_rtmp_session_t *s,
 
   if (ctx->publishing) {
     ctx->stream->pub_ctx = NULL;
-  }
 
-  for (cctx = &ctx->stream->ctx; *cctx; cctx = &(*cctx)->next) {
-    if (*cctx == ctx) {
-      *cctx = ctx->next;
-      break;
-    }
+    /* the versions die with the publisher's codec context */
+    ngx_rtmp_live_free_meta(s, ctx->stream);
   }
 
+  ngx_rtmp_live_unlink_ctx(ctx);
+
   if (ctx->publishing || ctx->stream->active) {
     ngx_rtmp_live_stop(s);
   }
@@ -727,13 +887,16 @@ static ngx_int_t ngx_rtmp_live_close_stream(ngx_rtmp_session_t *s,
     ngx_rtmp_send_status(s, "NetStream.Unpublish.Success", "status",
                          "Stop publishing");
     if (!lacf->idle_streams) {
-      for (pctx = ctx->stream->ctx; pctx; pctx = pctx->next) {
-        if (pctx->publishing == 0) {
-          ss = pctx->session;
-          ngx_log_debug0(NGX_LOG_DEBUG_RTMP, ss->connection->log, 0,
-                         "live: no publisher");
-          ngx_rtmp_finalize_session(ss);
+      for (i = 0; i < ctx->stream->nplayers; i++) {
+        pctx = ctx->stream->players[i];
+        if (pctx->timeshift) {
+          continue;
         }
+
+        ss = pctx->session;
+        ngx_log_debug0(NGX_LOG_DEBUG_RTMP, ss->connection->log, 0,
+                       "live: no publisher");
+        ngx_rtmp_finalize_session(ss);
       }
     }
   }
@@ -752,6 +915,8 @@ static ngx_int_t ngx_rtmp_live_close_stream(ngx_rtmp_session_t *s,
   }
   *stream = (*stream)->next;
 
+  ngx_rtmp_live_free_meta(s, ctx->stream);
+
   ctx->stream->next = lacf->free_streams;
   lacf->free_streams = ctx->stream;
   ctx->stream = NULL;
@@ -803,12 +968,34 @@ next:
   return next_pause(s, v);
 }
 
+/*
+ * the relative packet is built once per message and protocol, TS muxes it
+ * with the stream continuity counters so that every TS player shares it
+ */
+static ngx_chain_t *ngx_rtmp_live_rel_message(
+    ngx_rtmp_session_t *s, ngx_rtmp_live_ctx_t *ctx,
+    ngx_rtmp_live_proc_handler_t *handler, ngx_rtmp_header_t *h,
+    ngx_rtmp_header_t *lh, ngx_chain_t *in) {
+  if (handler->rpkt) {
+    return handler->rpkt;
+  }
+
+  if (ctx->protocol == NGX_RTMP_PROTOCOL_TS) {
+    handler->rpkt = ngx_http_flv_live_ts_live_message(s, h, in);
+
+  } else {
+    handler->rpkt = handler->append_message_pt(s, h, lh, in);
+  }
+
+  return handler->rpkt;
+}
+
 static ngx_int_t ngx_rtmp_live_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
                                   ngx_chain_t *in) {
   ngx_rtmp_live_proc_handler_t *handler;
   ngx_rtmp_live_ctx_t *ctx, *pctx;
   ngx_rtmp_codec_ctx_t *codec_ctx;
-  ngx_chain_t *header, *coheader;
+  ngx_chain_t *header, *coheader, *meta, *pkt;
   ngx_rtmp_live_app_conf_t *lacf;
   ngx_rtmp_session_t *ss;
   ngx_rtmp_header_t ch, lh, clh;
@@ -817,6 +1004,7 @@ static ngx_int_t ngx_rtmp_live_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
   ngx_uint_t peers;
   ngx_uint_t meta_version;
   ngx_uint_t csidx;
+  ngx_uint_t n;
   uint32_t delta;
   ngx_rtmp_live_chunk_stream_t *cs;
   ngx_http_request_t *r;
@@ -866,10 +1054,9 @@ static ngx_int_t ngx_rtmp_live_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
   meta_version = 0;
   mandatory = 0;
 
-  for (i = 0; i <= NGX_RTMP_PROTOCOL_HTTP; i++) {
+  for (i = 0; i <= NGX_RTMP_PROTOCOL_TS; i++) {
     handler = ngx_rtmp_live_proc_handlers[i];
 
-    handler->meta = NULL;
     handler->rpkt = NULL;
     handler->apkt = NULL;
     handler->acopkt = NULL;
@@ -950,10 +1137,14 @@ static ngx_int_t ngx_rtmp_live_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
     }
   }
 
-  /* broadcast to all subscribers */
+  /* broadcast to all subscribers, flushing each of them once afterwards */
+
+  ngx_rtmp_send_deferred = 1;
 
-  for (pctx = ctx->stream->ctx; pctx; pctx = pctx->next) {
-    if (pctx == ctx || pctx->paused) {
+  for (n = 0; n < ctx->stream->nplayers; n++) {
+    pctx = ctx->stream->players[n];
+
+    if (pctx->paused || pctx->timeshift) {
       continue;
     }
 
@@ -965,7 +1156,7 @@ static ngx_int_t ngx_rtmp_live_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
     /* send metadata */
 
     if (codec_ctx) {
-      if (pctx->protocol == NGX_RTMP_PROTOCOL_HTTP) {
+      if (pctx->protocol != NGX_RTMP_PROTOCOL_RTMP) {
         r = ss->data;
         if (r == NULL || (r->connection && r->connection->destroyed)) {
           continue;
@@ -976,20 +1167,29 @@ static ngx_int_t ngx_rtmp_live_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
           hctx->header_sent = 1;
           ngx_http_flv_live_send_header(ss);
         }
+
+        if (hctx->ts_resync) {
+          pkt = ngx_http_flv_live_ts_resync(ss);
+          if (pkt) {
+            if (handler->send_message_pt(ss, pkt, 0) == NGX_OK) {
+              hctx->ts_resync = 0;
+            }
+
+            handler->free_message_pt(ss, pkt);
+          }
+        }
       }
     }
 
-    if (handler->meta == NULL && meta_version != pctx->meta_version) {
-      handler->meta = handler->meta_message_pt(ss, codec_ctx->meta);
-      if (handler->meta == NULL) {
+    if (meta_version && meta_version != pctx->meta_version) {
+      meta = ngx_rtmp_live_get_meta(ss, pctx, codec_ctx->meta, meta_version);
+      if (meta == NULL) {
         continue;
       }
-    }
 
-    if (handler->meta && meta_version != pctx->meta_version) {
       ngx_log_debug0(NGX_LOG_DEBUG_RTMP, ss->connection->log, 0, "live: meta");
 
-      if (handler->send_message_pt(ss, handler->meta, 0) == NGX_OK) {
+      if (handler->send_message_pt(ss, meta, 0) == NGX_OK) {
         pctx->meta_version = meta_version;
       }
     }
@@ -1027,6 +1227,17 @@ static ngx_int_t ngx_rtmp_live_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
         continue;
       }
 
+      /*
+       * a backlogged viewer restarts at a key frame the queue has room
+       * for, priority 0 headers must not pile up ahead of it
+       */
+      if (ss->out_wait_key && (prio != NGX_RTMP_VIDEO_KEY_FRAME ||
+                               ngx_rtmp_queue_congested(ss, h->mlen))) {
+        ngx_log_debug0(NGX_LOG_DEBUG_RTMP, ss->connection->log, 0,
+                       "live: backlogged, waiting for key");
+        continue;
+      }
+
       if (header || coheader) {
         /* send absolute codec header */
 
@@ -1074,14 +1285,23 @@ static ngx_int_t ngx_rtmp_live_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
                        "live: abs %s packet timestamp=%uD", type_s,
                        ch.timestamp);
 
-        if (handler->apkt == NULL) {
-          handler->apkt = handler->append_message_pt(ss, &ch, NULL, in);
+        if (pctx->protocol == NGX_RTMP_PROTOCOL_TS) {
+          /* TS timestamps are absolute, share the relative packet */
+          pkt = ngx_rtmp_live_rel_message(ss, pctx, handler, &ch, &lh, in);
+
+        } else {
           if (handler->apkt == NULL) {
-            continue;
+            handler->apkt = handler->append_message_pt(ss, &ch, NULL, in);
           }
+
+          pkt = handler->apkt;
+        }
+
+        if (pkt == NULL) {
+          continue;
         }
 
-        rc = handler->send_message_pt(ss, handler->apkt, prio);
+        rc = handler->send_message_pt(ss, pkt, prio);
         if (rc != NGX_OK) {
           continue;
         }
@@ -1096,11 +1316,8 @@ static ngx_int_t ngx_rtmp_live_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
       }
     }
 
-    if (handler->rpkt == NULL) {
-      handler->rpkt = handler->append_message_pt(ss, &ch, &lh, in);
-      if (handler->rpkt == NULL) {
-        continue;
-      }
+    if (ngx_rtmp_live_rel_message(ss, pctx, handler, &ch, &lh, in) == NULL) {
+      continue;
     }
 
     /* send relative packet */
@@ -1113,6 +1330,12 @@ static ngx_int_t ngx_rtmp_live_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
 
       cs->dropped += delta;
 
+      if (ss->out_wait_key && h->type == NGX_RTMP_MSG_VIDEO) {
+        /* the rest of the GOP is dropped, restart with a key frame */
+        cs->active = 0;
+        cs->dropped = 0;
+      }
+
       if (mandatory) {
         ngx_log_debug0(NGX_LOG_DEBUG_RTMP, ss->connection->log, 0,
                        "live: mandatory packet failed");
@@ -1127,13 +1350,10 @@ static ngx_int_t ngx_rtmp_live_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
     ss->current_time = cs->timestamp;
   }
 
-  for (i = 0; i <= NGX_RTMP_PROTOCOL_HTTP; i++) {
-    handler = ngx_rtmp_live_proc_handlers[i];
+  ngx_rtmp_send_deferred = 0;
 
-    if (handler->meta) {
-      handler->free_message_pt(s, handler->meta);
-      handler->meta = NULL;
-    }
+  for (i = 0; i <= NGX_RTMP_PROTOCOL_TS; i++) {
+    handler = ngx_rtmp_live_proc_handlers[i];
 
     if (handler->rpkt) {
       handler->free_message_pt(s, handler->rpkt);
@@ -1181,6 +1401,7 @@ static ngx_int_t ngx_rtmp_live_data(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
   ngx_int_t csidx;
   ngx_uint_t prio;
   ngx_uint_t peers;
+  ngx_uint_t n;
   uint32_t delta;
   ngx_rtmp_live_chunk_stream_t *cs;
 #ifdef NGX_DEBUG
@@ -1248,8 +1469,12 @@ static ngx_int_t ngx_rtmp_live_data(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
   rpkt = ngx_rtmp_append_shared_bufs(cscf, data, in);
   ngx_rtmp_prepare_message(s, &ch, NULL, rpkt);
 
-  for (pctx = ctx->stream->ctx; pctx; pctx = pctx->next) {
-    if (pctx == ctx || pctx->paused) {
+  ngx_rtmp_send_deferred = 1;
+
+  for (n = 0; n < ctx->stream->nplayers; n++) {
+    pctx = ctx->stream->players[n];
+
+    if (pctx->paused || pctx->timeshift) {
       continue;
     }
 
@@ -1266,6 +1491,8 @@ static ngx_int_t ngx_rtmp_live_data(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
     ss->current_time = cs->timestamp;
   }
 
+  ngx_rtmp_send_deferred = 0;
+
   if (data) {
     ngx_rtmp_free_shared_chain(cscf, data);
   }
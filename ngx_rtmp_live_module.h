@@ -17,6 +17,10 @@
 typedef struct ngx_rtmp_live_ctx_s ngx_rtmp_live_ctx_t;
 typedef struct ngx_rtmp_live_stream_s ngx_rtmp_live_stream_t;
 
+/* HTTP-FLV without chunked encoding comes after the protocols */
+#define NGX_RTMP_LIVE_META_FLV_PLAIN (NGX_RTMP_PROTOCOL_TS + 1)
+#define NGX_RTMP_LIVE_META_VARIANTS (NGX_RTMP_PROTOCOL_TS + 2)
+
 typedef struct {
   unsigned active : 1;
   uint32_t timestamp;
@@ -25,25 +29,33 @@ typedef struct {
 } ngx_rtmp_live_chunk_stream_t;
 
 struct ngx_rtmp_live_ctx_s {
+  /* fan-out fields first, they share the leading cache lines */
   ngx_rtmp_session_t *session;
-  ngx_rtmp_live_stream_t *stream;
-  ngx_rtmp_live_ctx_t *next;
-  ngx_uint_t ndropped;
   ngx_rtmp_live_chunk_stream_t cs[2];
   ngx_uint_t meta_version;
-  ngx_event_t idle_evt;
+  ngx_uint_t ndropped;
+  ngx_uint_t protocol;
   unsigned active : 1;
   unsigned publishing : 1;
   unsigned silent : 1;
   unsigned paused : 1;
-  ngx_uint_t protocol;
+  unsigned timeshift : 1; /* fed by the time-shift module */
+
+  ngx_rtmp_live_stream_t *stream;
+  ngx_rtmp_live_ctx_t *next;
+  ngx_rtmp_live_ctx_t **prev;
+  ngx_uint_t index; /* in stream->players */
+  ngx_event_t idle_evt;
 };
 
 struct ngx_rtmp_live_stream_s {
   u_char name[NGX_RTMP_MAX_NAME];
   ngx_rtmp_live_stream_t *next;
-  ngx_rtmp_live_ctx_t *ctx;
+  ngx_rtmp_live_ctx_t *ctx; /* publisher and players */
   ngx_rtmp_live_ctx_t *pub_ctx;
+  ngx_rtmp_live_ctx_t **players; /* dense, for fan-out */
+  ngx_uint_t nplayers;
+  ngx_uint_t nalloc;
   ngx_rtmp_bandwidth_t bw_in;
   ngx_rtmp_bandwidth_t bw_in_audio;
   ngx_rtmp_bandwidth_t bw_in_video;
@@ -51,6 +63,13 @@ struct ngx_rtmp_live_stream_s {
   ngx_rtmp_bandwidth_t bw_out;
   ngx_msec_t epoch;
   ngx_rtmp_in_videoframe_t videoframe_in;
+  /* HTTP-TS continuity counters of the live fan-out */
+  ngx_uint_t ts_psi_cc;
+  ngx_uint_t ts_video_cc;
+  ngx_uint_t ts_audio_cc;
+  /* metadata serialized once per version and output variant */
+  ngx_chain_t *meta[NGX_RTMP_LIVE_META_VARIANTS];
+  ngx_uint_t meta_version[NGX_RTMP_LIVE_META_VARIANTS];
   unsigned active : 1;
   unsigned publishing : 1;
 };
@@ -88,4 +107,14 @@ extern ngx_module_t ngx_rtmp_live_module;
 ngx_rtmp_live_stream_t **ngx_rtmp_live_get_stream(ngx_rtmp_session_t *s,
                                                   u_char *name, int create);
 
+/* add to/remove from the stream in O(1); players also go to the array */
+ngx_int_t ngx_rtmp_live_link_ctx(ngx_rtmp_live_stream_t *stream,
+                                 ngx_rtmp_live_ctx_t *ctx);
+void ngx_rtmp_live_unlink_ctx(ngx_rtmp_live_ctx_t *ctx);
+
+/* serialized metadata kept by the stream, send it but do not free it */
+ngx_chain_t *ngx_rtmp_live_get_meta(ngx_rtmp_session_t *s,
+                                    ngx_rtmp_live_ctx_t *ctx, ngx_chain_t *meta,
+                                    ngx_uint_t version);
+
 #endif /* _NGX_RTMP_LIVE_H_INCLUDED_ */
@@ -7,6 +7,10 @@
 #include <ngx_core.h>
 #include "ngx_rtmp_cmd_module.h"
 
+#if (NGX_ZLIB)
+#include <zlib.h>
+#endif
+
 static ngx_rtmp_publish_pt next_publish;
 static ngx_rtmp_play_pt next_play;
 
@@ -23,6 +27,15 @@ static char *ngx_rtmp_log_compile_format(ngx_conf_t *cf, ngx_array_t *ops,
                                          ngx_array_t *args, ngx_uint_t s);
 static ngx_int_t ngx_rtmp_log_flush(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
                                     ngx_chain_t *in);
+static void ngx_rtmp_log_flush_buffer(ngx_open_file_t *file, ngx_log_t *log);
+static void ngx_rtmp_log_flush_handler(ngx_event_t *ev);
+
+#if (NGX_ZLIB)
+static ssize_t ngx_rtmp_log_gzip(ngx_fd_t fd, u_char *buf, size_t len,
+                                 ngx_int_t level, ngx_log_t *log);
+static void *ngx_rtmp_log_gzip_alloc(void *opaque, u_int items, u_int size);
+static void ngx_rtmp_log_gzip_free(void *opaque, void *address);
+#endif
 
 typedef struct ngx_rtmp_log_op_s ngx_rtmp_log_op_t;
 
@@ -51,10 +64,22 @@ typedef struct {
   ngx_array_t *ops; /* ngx_rtmp_log_op_t */
 } ngx_rtmp_log_fmt_t;
 
+/* shared by all logs writing to the same file, hangs off file->data */
+typedef struct {
+  u_char *start;
+  u_char *pos;
+  u_char *last;
+
+  ngx_event_t *event;
+  ngx_msec_t flush;
+  ngx_int_t gzip;
+} ngx_rtmp_log_buf_t;
+
 typedef struct {
   ngx_open_file_t *file;
   time_t disk_full_time;
   time_t error_log_time;
+  ngx_syslog_peer_t *syslog_peer;
   ngx_rtmp_log_fmt_t *format;
 } ngx_rtmp_log_t;
 
@@ -85,7 +110,7 @@ static ngx_command_t ngx_rtmp_log_commands[] = {
 
     {ngx_string("access_log"),
      NGX_RTMP_MAIN_CONF | NGX_RTMP_SRV_CONF | NGX_RTMP_APP_CONF |
-         NGX_CONF_TAKE12,
+         NGX_CONF_1MORE,
      ngx_rtmp_log_set_log, NGX_RTMP_APP_CONF_OFFSET, 0, NULL},
 
     {ngx_string("log_format"),
@@ -509,6 +534,7 @@ static char *ngx_rtmp_log_merge_app_conf(ngx_conf_t *cf, void *parent,
 
   log->disk_full_time = 0;
   log->error_log_time = 0;
+  log->syslog_peer = NULL;
 
   lmcf = ngx_rtmp_conf_get_module_main_conf(cf, ngx_rtmp_log_module);
   fmt = lmcf->formats.elts;
@@ -526,8 +552,13 @@ static char *ngx_rtmp_log_set_log(ngx_conf_t *cf, ngx_command_t *cmd,
   ngx_rtmp_log_main_conf_t *lmcf;
   ngx_rtmp_log_fmt_t *fmt;
   ngx_rtmp_log_t *log;
-  ngx_str_t *value, name;
-  ngx_uint_t n;
+  ngx_rtmp_log_buf_t *buffer;
+  ngx_syslog_peer_t *peer;
+  ngx_str_t *value, name, str;
+  ngx_uint_t n, i;
+  ngx_int_t gzip;
+  ngx_msec_t flush;
+  ssize_t size;
 
   value = cf->args->elts;
 
@@ -552,20 +583,39 @@ static char *ngx_rtmp_log_set_log(ngx_conf_t *cf, ngx_command_t *cmd,
 
   lmcf = ngx_rtmp_conf_get_module_main_conf(cf, ngx_rtmp_log_module);
 
-  log->file = ngx_conf_open_file(cf->cycle, &value[1]);
-  if (log->file == NULL) {
-    return NGX_CONF_ERROR;
-  }
+  if (ngx_strncmp(value[1].data, "syslog:", 7) == 0) {
+    peer = ngx_pcalloc(cf->pool, sizeof(ngx_syslog_peer_t));
+    if (peer == NULL) {
+      return NGX_CONF_ERROR;
+    }
 
-  if (cf->args->nelts == 2) {
-    ngx_str_set(&name, "combined");
-    lmcf->combined_used = 1;
+    if (ngx_syslog_process_conf(cf, peer) != NGX_CONF_OK) {
+      return NGX_CONF_ERROR;
+    }
+
+    log->syslog_peer = peer;
 
   } else {
+    log->file = ngx_conf_open_file(cf->cycle, &value[1]);
+    if (log->file == NULL) {
+      return NGX_CONF_ERROR;
+    }
+  }
+
+  /* the format name is optional before buffer=, flush= and gzip */
+  if (cf->args->nelts > 2 &&
+      ngx_strlchr(value[2].data, value[2].data + value[2].len, '=') == NULL &&
+      ngx_strcmp(value[2].data, "gzip") != 0) {
     name = value[2];
     if (ngx_strcmp(name.data, "combined") == 0) {
       lmcf->combined_used = 1;
     }
+    i = 3;
+
+  } else {
+    ngx_str_set(&name, "combined");
+    lmcf->combined_used = 1;
+    i = 2;
   }
 
   fmt = lmcf->formats.elts;
@@ -582,6 +632,142 @@ static char *ngx_rtmp_log_set_log(ngx_conf_t *cf, ngx_command_t *cmd,
     return NGX_CONF_ERROR;
   }
 
+  size = 0;
+  flush = 0;
+  gzip = 0;
+
+  for (n = i; n < cf->args->nelts; n++) {
+    if (ngx_strncmp(value[n].data, "buffer=", 7) == 0) {
+      str.len = value[n].len - 7;
+      str.data = value[n].data + 7;
+
+      size = ngx_parse_size(&str);
+
+      if (size == NGX_ERROR || size == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid buffer size \"%V\"",
+                           &str);
+        return NGX_CONF_ERROR;
+      }
+
+      continue;
+    }
+
+    if (ngx_strncmp(value[n].data, "flush=", 6) == 0) {
+      str.len = value[n].len - 6;
+      str.data = value[n].data + 6;
+
+      flush = ngx_parse_time(&str, 0);
+
+      if (flush == (ngx_msec_t)NGX_ERROR || flush == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid flush time \"%V\"",
+                           &str);
+        return NGX_CONF_ERROR;
+      }
+
+      continue;
+    }
+
+    if (ngx_strncmp(value[n].data, "gzip", 4) == 0 &&
+        (value[n].len == 4 || value[n].data[4] == '=')) {
+#if (NGX_ZLIB)
+      if (size == 0) {
+        size = 64 * 1024;
+      }
+
+      if (value[n].len == 4) {
+        gzip = Z_BEST_SPEED;
+        continue;
+      }
+
+      str.len = value[n].len - 5;
+      str.data = value[n].data + 5;
+
+      gzip = ngx_atoi(str.data, str.len);
+
+      if (gzip < 1 || gzip > 9) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid compression level \"%V\"", &str);
+        return NGX_CONF_ERROR;
+      }
+
+      continue;
+
+#else
+      ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                         "nginx was built without zlib support");
+      return NGX_CONF_ERROR;
+#endif
+    }
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"",
+                       &value[n]);
+    return NGX_CONF_ERROR;
+  }
+
+  if (flush && size == 0) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "no buffer is defined for access_log \"%V\"",
+                       &value[1]);
+    return NGX_CONF_ERROR;
+  }
+
+  if (size == 0) {
+    return NGX_CONF_OK;
+  }
+
+  if (log->syslog_peer) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "logs to syslog cannot be buffered");
+    return NGX_CONF_ERROR;
+  }
+
+  if (log->file->data) {
+    buffer = log->file->data;
+
+    if (buffer->last - buffer->start != size || buffer->flush != flush ||
+        buffer->gzip != gzip) {
+      ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                         "access_log \"%V\" already defined "
+                         "with conflicting parameters",
+                         &value[1]);
+      return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+  }
+
+  buffer = ngx_pcalloc(cf->pool, sizeof(ngx_rtmp_log_buf_t));
+  if (buffer == NULL) {
+    return NGX_CONF_ERROR;
+  }
+
+  buffer->start = ngx_pnalloc(cf->pool, size);
+  if (buffer->start == NULL) {
+    return NGX_CONF_ERROR;
+  }
+
+  buffer->pos = buffer->start;
+  buffer->last = buffer->start + size;
+
+  if (flush) {
+    buffer->event = ngx_pcalloc(cf->pool, sizeof(ngx_event_t));
+    if (buffer->event == NULL) {
+      return NGX_CONF_ERROR;
+    }
+
+    buffer->event->data = log->file;
+    buffer->event->handler = ngx_rtmp_log_flush_handler;
+    buffer->event->log = &cf->cycle->new_log;
+    buffer->event->cancelable = 1;
+
+    buffer->flush = flush;
+  }
+
+  buffer->gzip = gzip;
+
+  log->file->flush = ngx_rtmp_log_flush_buffer;
+  log->file->data = buffer;
+
   return NGX_CONF_OK;
 }
 
@@ -837,10 +1023,25 @@ static void ngx_rtmp_log_write(ngx_rtmp_session_t *s, ngx_rtmp_log_t *log,
   time_t now;
   ssize_t n;
   int err;
+#if (NGX_ZLIB)
+  ngx_rtmp_log_buf_t *buffer;
+#endif
 
   err = 0;
   name = log->file->name.data;
+
+#if (NGX_ZLIB)
+  buffer = log->file->data;
+
+  if (buffer && buffer->gzip) {
+    n = ngx_rtmp_log_gzip(log->file->fd, buf, len, buffer->gzip,
+                          s->connection->log);
+  } else {
+    n = ngx_write_fd(log->file->fd, buf, len);
+  }
+#else
   n = ngx_write_fd(log->file->fd, buf, len);
+#endif
 
   if (n == (ssize_t)len) {
     return;
@@ -870,69 +1071,166 @@ static void ngx_rtmp_log_write(ngx_rtmp_session_t *s, ngx_rtmp_log_t *log,
   }
 }
 
-static ngx_int_t ngx_rtmp_log_flush(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
-                                    ngx_chain_t *in) {
-  ngx_rtmp_log_app_conf_t *lacf;
-  ngx_rtmp_log_t *log;
-  ngx_rtmp_log_op_t *op;
-  ngx_uint_t n, i;
-  u_char *line, *p;
-  size_t len;
+#if (NGX_ZLIB)
 
-  if (s->auto_pushed || s->relay) {
-    return NGX_OK;
+static ssize_t ngx_rtmp_log_gzip(ngx_fd_t fd, u_char *buf, size_t len,
+                                 ngx_int_t level, ngx_log_t *log) {
+  int rc, wbits, memlevel;
+  u_char *out;
+  size_t size;
+  ssize_t n;
+  z_stream zstream;
+  ngx_err_t err;
+  ngx_pool_t *pool;
+
+  wbits = MAX_WBITS;
+  memlevel = MAX_MEM_LEVEL - 1;
+
+  while ((ssize_t)len < ((1 << (wbits - 1)) - 262)) {
+    wbits--;
+    memlevel--;
   }
 
-  lacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_log_module);
-  if (lacf == NULL || lacf->off || lacf->logs == NULL) {
-    return NGX_OK;
+  /*
+   * This is a formula from deflateBound() for conservative upper bound of
+   * compressed data plus 18 bytes of gzip wrapper.
+   */
+
+  size = len + ((len + 7) >> 3) + ((len + 63) >> 6) + 5 + 18;
+
+  ngx_memzero(&zstream, sizeof(z_stream));
+
+  pool = ngx_create_pool(256, log);
+  if (pool == NULL) {
+    /* simulate successful logging */
+    return len;
   }
 
-  log = lacf->logs->elts;
-  for (i = 0; i < lacf->logs->nelts; ++i, ++log) {
-    if (ngx_time() == log->disk_full_time) {
-      /* FreeBSD full disk protection;
-       * nginx http logger does the same */
-      continue;
-    }
+  pool->log = log;
 
-    len = 0;
-    op = log->format->ops->elts;
-    for (n = 0; n < log->format->ops->nelts; ++n, ++op) {
-      len += op->getlen(s, op);
-    }
+  zstream.zalloc = ngx_rtmp_log_gzip_alloc;
+  zstream.zfree = ngx_rtmp_log_gzip_free;
+  zstream.opaque = pool;
 
-    len += NGX_LINEFEED_SIZE;
+  out = ngx_pnalloc(pool, size);
+  if (out == NULL) {
+    goto done;
+  }
 
-    line = ngx_palloc(s->connection->pool, len);
-    if (line == NULL) {
-      return NGX_OK;
-    }
+  zstream.next_in = buf;
+  zstream.avail_in = len;
+  zstream.next_out = out;
+  zstream.avail_out = size;
 
-    p = line;
-    op = log->format->ops->elts;
-    for (n = 0; n < log->format->ops->nelts; ++n, ++op) {
-      p = op->getdata(s, p, op);
-    }
+  rc = deflateInit2(&zstream, (int)level, Z_DEFLATED, wbits + 16, memlevel,
+                    Z_DEFAULT_STRATEGY);
 
-    ngx_linefeed(p);
+  if (rc != Z_OK) {
+    ngx_log_error(NGX_LOG_ALERT, log, 0, "deflateInit2() failed: %d", rc);
+    goto done;
+  }
 
-    ngx_rtmp_log_write(s, log, line, p - line);
+  rc = deflate(&zstream, Z_FINISH);
+
+  if (rc != Z_STREAM_END) {
+    ngx_log_error(NGX_LOG_ALERT, log, 0, "deflate(Z_FINISH) failed: %d", rc);
+    goto done;
   }
 
-  return NGX_OK;
+  size -= zstream.avail_out;
+
+  rc = deflateEnd(&zstream);
+
+  if (rc != Z_OK) {
+    ngx_log_error(NGX_LOG_ALERT, log, 0, "deflateEnd() failed: %d", rc);
+    goto done;
+  }
+
+  n = ngx_write_fd(fd, out, size);
+
+  if (n != (ssize_t)size) {
+    err = (n == -1) ? ngx_errno : 0;
+
+    ngx_destroy_pool(pool);
+
+    ngx_set_errno(err);
+    return -1;
+  }
+
+done:
+
+  ngx_destroy_pool(pool);
+
+  /* simulate successful logging */
+  return len;
 }
 
-static ngx_int_t ngx_rtmp_log_disconnect(ngx_rtmp_session_t *s,
-                                         ngx_rtmp_header_t *h,
-                                         ngx_chain_t *in) {
+static void *ngx_rtmp_log_gzip_alloc(void *opaque, u_int items, u_int size) {
+  ngx_pool_t *pool = opaque;
+
+  return ngx_palloc(pool, items * size);
+}
+
+static void ngx_rtmp_log_gzip_free(void *opaque, void *address) {}
+
+#endif
+
+static void ngx_rtmp_log_flush_buffer(ngx_open_file_t *file, ngx_log_t *log) {
+  size_t len;
+  ssize_t n;
+  ngx_rtmp_log_buf_t *buffer;
+
+  buffer = file->data;
+
+  len = buffer->pos - buffer->start;
+
+  if (len == 0) {
+    return;
+  }
+
+#if (NGX_ZLIB)
+  if (buffer->gzip) {
+    n = ngx_rtmp_log_gzip(file->fd, buffer->start, len, buffer->gzip, log);
+  } else {
+    n = ngx_write_fd(file->fd, buffer->start, len);
+  }
+#else
+  n = ngx_write_fd(file->fd, buffer->start, len);
+#endif
+
+  if (n == -1) {
+    ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                  ngx_write_fd_n " to \"%s\" failed", file->name.data);
+
+  } else if ((size_t)n != len) {
+    ngx_log_error(NGX_LOG_ALERT, log, 0,
+                  ngx_write_fd_n " to \"%s\" was incomplete: %z of %uz",
+                  file->name.data, n, len);
+  }
+
+  buffer->pos = buffer->start;
+
+  if (buffer->event && buffer->event->timer_set) {
+    ngx_del_timer(buffer->event);
+  }
+}
+
+static void ngx_rtmp_log_flush_handler(ngx_event_t *ev) {
+  ngx_log_debug0(NGX_LOG_DEBUG_RTMP, ev->log, 0, "log: buffer flush handler");
+
+  ngx_rtmp_log_flush_buffer(ev->data, ev->log);
+}
+
+static ngx_int_t ngx_rtmp_log_flush(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
+                                    ngx_chain_t *in) {
   ngx_rtmp_log_app_conf_t *lacf;
   ngx_rtmp_log_t *log;
   ngx_rtmp_log_op_t *op;
+  ngx_rtmp_log_buf_t *buffer;
   ngx_uint_t n, i;
   u_char *line, *p;
-  ngx_rtmp_log_ctx_t *ctx;
-  size_t len;
+  size_t len, size;
+  ssize_t sent;
 
   if (s->auto_pushed || s->relay) {
     return NGX_OK;
@@ -957,24 +1255,108 @@ static ngx_int_t ngx_rtmp_log_disconnect(ngx_rtmp_session_t *s,
       len += op->getlen(s, op);
     }
 
+    if (log->syslog_peer) {
+      /* length of syslog's PRI and HEADER message parts */
+      len += sizeof("<255>Jan 01 00:00:00 ") - 1 + ngx_cycle->hostname.len +
+             1 + log->syslog_peer->tag.len + 2;
+
+      goto alloc_line;
+    }
+
     len += NGX_LINEFEED_SIZE;
 
-    line = ngx_palloc(s->connection->pool, len);
+    buffer = log->file->data;
+
+    if (buffer) {
+      if (len > (size_t)(buffer->last - buffer->pos)) {
+        ngx_rtmp_log_write(s, log, buffer->start, buffer->pos - buffer->start);
+
+        buffer->pos = buffer->start;
+      }
+
+      if (len <= (size_t)(buffer->last - buffer->pos)) {
+        p = buffer->pos;
+
+        if (buffer->event && p == buffer->start) {
+          ngx_add_timer(buffer->event, buffer->flush);
+        }
+
+        op = log->format->ops->elts;
+        for (n = 0; n < log->format->ops->nelts; ++n, ++op) {
+          p = op->getdata(s, p, op);
+        }
+
+        ngx_linefeed(p);
+
+        buffer->pos = p;
+
+        continue;
+      }
+
+      if (buffer->event && buffer->event->timer_set) {
+        ngx_del_timer(buffer->event);
+      }
+    }
+
+  alloc_line:
+
+    /*
+     * not from the connection pool: with log_interval set a long-lived
+     * session would otherwise grow its pool by one line per interval
+     */
+
+    line = ngx_alloc(len, s->connection->log);
     if (line == NULL) {
       return NGX_OK;
     }
 
     p = line;
+
+    if (log->syslog_peer) {
+      p = ngx_syslog_add_header(log->syslog_peer, line);
+    }
+
     op = log->format->ops->elts;
     for (n = 0; n < log->format->ops->nelts; ++n, ++op) {
       p = op->getdata(s, p, op);
     }
 
+    if (log->syslog_peer) {
+      size = p - line;
+
+      sent = ngx_syslog_send(log->syslog_peer, line, size);
+
+      if (sent < 0) {
+        ngx_log_error(NGX_LOG_WARN, s->connection->log, 0,
+                      "send() to syslog failed");
+
+      } else if ((size_t)sent != size) {
+        ngx_log_error(NGX_LOG_WARN, s->connection->log, 0,
+                      "send() to syslog has written only %z of %uz", sent,
+                      size);
+      }
+
+      ngx_free(line);
+      continue;
+    }
+
     ngx_linefeed(p);
 
     ngx_rtmp_log_write(s, log, line, p - line);
+
+    ngx_free(line);
   }
 
+  return NGX_OK;
+}
+
+static ngx_int_t ngx_rtmp_log_disconnect(ngx_rtmp_session_t *s,
+                                         ngx_rtmp_header_t *h,
+                                         ngx_chain_t *in) {
+  ngx_rtmp_log_ctx_t *ctx;
+
+  ngx_rtmp_log_flush(s, h, in);
+
   ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_log_module);
   if (ctx && ctx->ev.timer_set) {
     ngx_del_timer(&ctx->ev);
@@ -39,6 +39,10 @@ static ngx_int_t ngx_rtmp_notify_done(ngx_rtmp_session_t *s, char *cbname,
 static void ngx_rtmp_notify_reconnect_evt_handler(ngx_event_t *rec_evt);
 static ngx_int_t ngx_rtmp_notify_copy_str(ngx_pool_t *pool, ngx_str_t *dst,
                                           ngx_str_t *src);
+static char *ngx_rtmp_notify_cache_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+                                        void *conf);
+static void ngx_rtmp_notify_cache_done(ngx_rtmp_session_t *s, ngx_chain_t *in,
+                                       ngx_uint_t decision);
 
 ngx_str_t ngx_rtmp_notify_urlencoded =
     ngx_string("application/x-www-form-urlencoded");
@@ -46,6 +50,9 @@ ngx_str_t ngx_rtmp_notify_urlencoded =
 #define NGX_RTMP_NOTIFY_PUBLISHING 0x01
 #define NGX_RTMP_NOTIFY_PLAYING 0x02
 
+#define NGX_RTMP_NOTIFY_CACHE_ALLOW 1
+#define NGX_RTMP_NOTIFY_CACHE_DENY 2
+
 typedef struct {
   u_char *cbname;
   ngx_uint_t url_idx;
@@ -131,6 +138,23 @@ static ngx_command_t ngx_rtmp_notify_commands[] = {
      ngx_conf_set_msec_slot, NGX_RTMP_APP_CONF_OFFSET,
      offsetof(ngx_rtmp_notify_app_conf_t, reconnect_timeout), NULL},
 
+    {ngx_string("notify_cache_zone"),
+     NGX_RTMP_MAIN_CONF | NGX_RTMP_SRV_CONF | NGX_RTMP_APP_CONF |
+         NGX_CONF_TAKE1,
+     ngx_rtmp_notify_cache_zone, NGX_RTMP_APP_CONF_OFFSET, 0, NULL},
+
+    {ngx_string("notify_cache_valid"),
+     NGX_RTMP_MAIN_CONF | NGX_RTMP_SRV_CONF | NGX_RTMP_APP_CONF |
+         NGX_CONF_TAKE1,
+     ngx_conf_set_sec_slot, NGX_RTMP_APP_CONF_OFFSET,
+     offsetof(ngx_rtmp_notify_app_conf_t, cache_valid), NULL},
+
+    {ngx_string("notify_cache_negative_valid"),
+     NGX_RTMP_MAIN_CONF | NGX_RTMP_SRV_CONF | NGX_RTMP_APP_CONF |
+         NGX_CONF_TAKE1,
+     ngx_conf_set_sec_slot, NGX_RTMP_APP_CONF_OFFSET,
+     offsetof(ngx_rtmp_notify_app_conf_t, cache_negative_valid), NULL},
+
     ngx_null_command};
 
 static ngx_rtmp_module_t ngx_rtmp_notify_module_ctx = {
@@ -177,6 +201,9 @@ static void *ngx_rtmp_notify_create_app_conf(ngx_conf_t *cf) {
   nacf->reconnect_timeout = NGX_CONF_UNSET_MSEC;
   nacf->update_strict = NGX_CONF_UNSET;
   nacf->relay_redirect = NGX_CONF_UNSET;
+  nacf->cache_zone = NGX_CONF_UNSET_PTR;
+  nacf->cache_valid = NGX_CONF_UNSET;
+  nacf->cache_negative_valid = NGX_CONF_UNSET;
 
   return nacf;
 }
@@ -207,6 +234,10 @@ static char *ngx_rtmp_notify_merge_app_conf(ngx_conf_t *cf, void *parent,
                             300000);  // 5m
   ngx_conf_merge_value(conf->update_strict, prev->update_strict, 0);
   ngx_conf_merge_value(conf->relay_redirect, prev->relay_redirect, 0);
+  ngx_conf_merge_ptr_value(conf->cache_zone, prev->cache_zone, NULL);
+  ngx_conf_merge_value(conf->cache_valid, prev->cache_valid, 60);
+  ngx_conf_merge_value(conf->cache_negative_valid, prev->cache_negative_valid,
+                       10);
   conf->loop_times = conf->reconnect_timeout / conf->reconnect_timegap;
 
   return NGX_CONF_OK;
@@ -703,8 +734,9 @@ static ngx_chain_t *ngx_rtmp_notify_record_done_create(ngx_rtmp_session_t *s,
                                         pl);
 }
 
-static ngx_int_t ngx_rtmp_notify_parse_http_retcode(ngx_rtmp_session_t *s,
-                                                    ngx_chain_t *in) {
+/* returns the first digit of the HTTP status or NGX_ERROR */
+static ngx_int_t ngx_rtmp_notify_parse_http_status(ngx_rtmp_session_t *s,
+                                                   ngx_chain_t *in) {
   ngx_buf_t *b;
   ngx_int_t n;
   u_char c;
@@ -719,14 +751,7 @@ static ngx_int_t ngx_rtmp_notify_parse_http_retcode(ngx_rtmp_session_t *s,
       if (c >= (u_char)'0' && c <= (u_char)'9') {
         ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
                        "notify: HTTP retcode: %dxx", (int)(c - '0'));
-        switch (c) {
-          case (u_char)'2':
-            return NGX_OK;
-          case (u_char)'3':
-            return NGX_AGAIN;
-          default:
-            return NGX_ERROR;
-        }
+        return c - '0';
       }
 
       ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
@@ -749,6 +774,18 @@ static ngx_int_t ngx_rtmp_notify_parse_http_retcode(ngx_rtmp_session_t *s,
   return NGX_ERROR;
 }
 
+static ngx_int_t ngx_rtmp_notify_parse_http_retcode(ngx_rtmp_session_t *s,
+                                                    ngx_chain_t *in) {
+  switch (ngx_rtmp_notify_parse_http_status(s, in)) {
+    case 2:
+      return NGX_OK;
+    case 3:
+      return NGX_AGAIN;
+    default:
+      return NGX_ERROR;
+  }
+}
+
 static ngx_int_t ngx_rtmp_notify_parse_http_header(ngx_rtmp_session_t *s,
                                                    ngx_chain_t *in,
                                                    ngx_str_t *name,
@@ -910,16 +947,20 @@ static ngx_int_t ngx_rtmp_notify_publish_handle(ngx_rtmp_session_t *s,
 
   rc = ngx_rtmp_notify_parse_http_retcode(s, in);
   if (rc == NGX_ERROR) {
+    ngx_rtmp_notify_cache_done(s, in, NGX_RTMP_NOTIFY_CACHE_DENY);
     ngx_rtmp_notify_clear_flag(s, NGX_RTMP_NOTIFY_PUBLISHING);
     return NGX_ERROR;
   }
 
   if (rc != NGX_AGAIN) {
+    ngx_rtmp_notify_cache_done(s, in, NGX_RTMP_NOTIFY_CACHE_ALLOW);
     goto next;
   }
 
   /* HTTP 3xx */
 
+  ngx_rtmp_notify_cache_done(s, in, 0);
+
   ngx_log_debug0(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
                  "notify: publish redirect received");
 
@@ -972,97 +1013,394 @@ next:
   return next_publish(s, v);
 }
 
+/*
+ * Pull callbacks answer with a JSON body of the form
+ *
+ *   {"state": 0, "content": {"addrs": [{"addr": "rtmp://..."}, ...]}}
+ *
+ * The body is scanned in place from the netcall chain, across buffer
+ * boundaries, without assembling or parsing it into a tree: only the
+ * integer "state" and the "addr" strings found under "content"/"addrs"
+ * are kept.  Key names are matched case-insensitively.
+ */
+
+#define NGX_RTMP_NOTIFY_JSON_MAX_DEPTH 32
+
+enum {
+  NGX_RTMP_NOTIFY_JSON_NONE = 0,
+  NGX_RTMP_NOTIFY_JSON_STATE,
+  NGX_RTMP_NOTIFY_JSON_CONTENT,
+  NGX_RTMP_NOTIFY_JSON_ADDRS,
+  NGX_RTMP_NOTIFY_JSON_ADDR
+};
+
+typedef struct {
+  unsigned object : 1;
+  unsigned content : 1;
+  unsigned addrs : 1;
+} ngx_rtmp_notify_json_frame_t;
+
+static ngx_uint_t ngx_rtmp_notify_json_key(u_char *name, size_t len) {
+  ngx_uint_t n;
+
+  static ngx_str_t keys[] = {ngx_null_string, ngx_string("state"),
+                             ngx_string("content"), ngx_string("addrs"),
+                             ngx_string("addr")};
+
+  for (n = 1; n < sizeof(keys) / sizeof(keys[0]); n++) {
+    if (len == keys[n].len && ngx_strncasecmp(name, keys[n].data, len) == 0) {
+      return n;
+    }
+  }
+
+  return NGX_RTMP_NOTIFY_JSON_NONE;
+}
+
 static ngx_int_t ngx_rtmp_notify_parse_http_json_body(ngx_rtmp_session_t *s,
                                                       ngx_chain_t *in) {
-  ngx_uint_t i;
-  json_char *json;
-  ngx_chain_t *cur;
-  ngx_array_t *body;
-  ngx_buf_t *buffer;
-  u_char *pos, c, *temp, has_body = 0;
-  json_value *value, *temp_ret;
-  ngx_rtmp_notify_app_conf_t *nacf;
   ngx_rtmp_notify_ctx_t *ctx;
-  ngx_str_t json_state = ngx_string("state"),
-            target_name[3] = {ngx_string("content"), ngx_string("addrs"),
-                              ngx_string("addr")};
+  ngx_rtmp_notify_json_frame_t stack[NGX_RTMP_NOTIFY_JSON_MAX_DEPTH], *frame;
+  ngx_array_t *addrs;
+  ngx_str_t *addr;
+  ngx_buf_t *b;
+  ngx_uint_t depth, key, vkey, nhex, has_body, is_key, capture, bad, number,
+      neg;
+  ngx_int_t state, n;
+  size_t name_len, value_len;
+  u_char *p, c, ch;
+  u_char name[8], value[NGX_RTMP_MAX_NAME];
+
+  enum {
+    sw_header = 0,
+    sw_header_lf,
+    sw_value,
+    sw_key,
+    sw_colon,
+    sw_next,
+    sw_string,
+    sw_escape,
+    sw_unicode,
+    sw_literal
+  } st;
 
-  nacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_notify_module);
   ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_notify_module);
 
   if (ctx == NULL) return NGX_ERROR;
 
-  enum { in_header, next_header } state = in_header;
+  st = sw_header;
+  addrs = NULL;
+  state = NGX_CONF_UNSET;
+  depth = 0;
+  key = NGX_RTMP_NOTIFY_JSON_NONE;
+  vkey = NGX_RTMP_NOTIFY_JSON_NONE;
+  nhex = 0;
+  has_body = 0;
+  is_key = 0;
+  capture = 0;
+  bad = 0;
+  number = 0;
+  name_len = 0;
+  value_len = 0;
+  ch = 0;
+
+  for (; in; in = in->next) {
+    b = in->buf;
 
-  body =
-      ngx_array_create(s->connection->pool, NGX_RTMP_MAX_NAME, sizeof(u_char));
-  if (body == NULL) {
-    return NGX_ERROR;
-  }
+    for (p = b->pos; p < b->last; p++) {
+      c = *p;
 
-  cur = in;
-  while (cur != NULL) {
-    // skip header
-    buffer = cur->buf;
-    for (pos = buffer->pos; pos != buffer->last; ++pos) {
-      c = *pos;
-      if (has_body) {
-        temp = ngx_array_push(body);
-        *temp = c;
-      } else if (c == '\r')
-        continue;
-      else if (state == next_header && c == '\n') {
-        has_body = 1;
-      } else if (c == '\n')
-        state = next_header;
-      else
-        state = in_header;
+    again:
+
+      switch (st) {
+        case sw_header:
+          if (c == '\n') {
+            st = sw_header_lf;
+          }
+          continue;
+
+        case sw_header_lf:
+          if (c == '\n') {
+            has_body = 1;
+            st = sw_value;
+          } else if (c != '\r') {
+            st = sw_header;
+          }
+          continue;
+
+        case sw_value:
+          vkey = key;
+          key = NGX_RTMP_NOTIFY_JSON_NONE;
+
+          switch (c) {
+            case ' ':
+            case '\t':
+            case '\r':
+            case '\n':
+              key = vkey;
+              continue;
+
+            case '{':
+            case '[':
+              if (depth == NGX_RTMP_NOTIFY_JSON_MAX_DEPTH) {
+                goto invalid;
+              }
+
+              frame = &stack[depth];
+              frame->object = (c == '{');
+              frame->content = (depth && stack[depth - 1].content) ||
+                               vkey == NGX_RTMP_NOTIFY_JSON_CONTENT;
+              frame->addrs = (depth && stack[depth - 1].addrs) ||
+                             (frame->content &&
+                              vkey == NGX_RTMP_NOTIFY_JSON_ADDRS);
+              depth++;
+
+              st = frame->object ? sw_key : sw_value;
+              continue;
+
+            case ']':
+              /* empty array */
+              if (depth && !stack[depth - 1].object) {
+                goto close;
+              }
+              goto invalid;
+
+            case '"':
+              is_key = 0;
+              capture = (vkey == NGX_RTMP_NOTIFY_JSON_ADDR && depth &&
+                         stack[depth - 1].addrs);
+              bad = 0;
+              value_len = 0;
+              st = sw_string;
+              continue;
+
+            default:
+              number = (vkey == NGX_RTMP_NOTIFY_JSON_STATE &&
+                        state == NGX_CONF_UNSET);
+              value_len = 0;
+              st = sw_literal;
+              goto again;
+          }
+
+        case sw_literal:
+          switch (c) {
+            case ',':
+            case '}':
+            case ']':
+            case ' ':
+            case '\t':
+            case '\r':
+            case '\n':
+              if (number && value_len) {
+                neg = (value[0] == '-');
+                n = ngx_atoi(value + neg, value_len - neg);
+
+                if (n != NGX_ERROR) {
+                  state = neg ? -n : n;
+                }
+              }
+
+              st = sw_next;
+              goto again;
+          }
+
+          if (number) {
+            if (value_len == 32) {
+              number = 0;
+            } else {
+              value[value_len++] = c;
+            }
+          }
+          continue;
+
+        case sw_string:
+          if (c == '"') {
+            if (is_key) {
+              key = ngx_rtmp_notify_json_key(name, name_len);
+              st = sw_colon;
+              continue;
+            }
+
+            if (capture && !bad && value_len >= 7) {
+              if (addrs == NULL) {
+                addrs = ngx_array_create(s->connection->pool, 1,
+                                         sizeof(ngx_str_t));
+                if (addrs == NULL) {
+                  return NGX_ERROR;
+                }
+              }
+
+              addr = ngx_array_push(addrs);
+              if (addr == NULL) {
+                return NGX_ERROR;
+              }
+
+              addr->data = ngx_pnalloc(s->connection->pool, value_len);
+              if (addr->data == NULL) {
+                return NGX_ERROR;
+              }
+
+              addr->len = value_len;
+              ngx_memcpy(addr->data, value, value_len);
+            }
+
+            st = sw_next;
+            continue;
+          }
+
+          if (c == '\\') {
+            st = sw_escape;
+            continue;
+          }
+
+          ch = c;
+          break;
+
+        case sw_escape:
+          st = sw_string;
+
+          switch (c) {
+            case 'b':
+              ch = '\b';
+              break;
+            case 'f':
+              ch = '\f';
+              break;
+            case 'n':
+              ch = '\n';
+              break;
+            case 'r':
+              ch = '\r';
+              break;
+            case 't':
+              ch = '\t';
+              break;
+            case 'u':
+              /* never part of a usable address or a known key */
+              nhex = 0;
+              bad = 1;
+              name_len = sizeof(name) + 1;
+              st = sw_unicode;
+              continue;
+            default:
+              ch = c;
+          }
+          break;
+
+        case sw_unicode:
+          if (++nhex == 4) {
+            st = sw_string;
+          }
+          continue;
+
+        case sw_key:
+          switch (c) {
+            case ' ':
+            case '\t':
+            case '\r':
+            case '\n':
+              continue;
+            case '"':
+              is_key = 1;
+              name_len = 0;
+              st = sw_string;
+              continue;
+            case '}':
+              goto close;
+          }
+          goto invalid;
+
+        case sw_colon:
+          switch (c) {
+            case ' ':
+            case '\t':
+            case '\r':
+            case '\n':
+              continue;
+            case ':':
+              st = sw_value;
+              continue;
+          }
+          goto invalid;
+
+        case sw_next:
+          switch (c) {
+            case ' ':
+            case '\t':
+            case '\r':
+            case '\n':
+              continue;
+          }
+
+          if (depth == 0) {
+            goto done;
+          }
+
+          if (c == ',') {
+            st = stack[depth - 1].object ? sw_key : sw_value;
+            continue;
+          }
+
+          if (c == (stack[depth - 1].object ? '}' : ']')) {
+            goto close;
+          }
+          goto invalid;
+      }
+
+      /* string character */
+
+      if (is_key) {
+        if (name_len < sizeof(name)) {
+          name[name_len] = ch;
+        }
+        name_len++;
+
+      } else if (capture) {
+        if (value_len < sizeof(value) - 1) {
+          value[value_len++] = ch;
+        } else {
+          bad = 1;
+        }
+      }
+
+      continue;
+
+    close:
+
+      depth--;
+      st = sw_next;
     }
-    cur = cur->next;
   }
 
-  if (has_body == 0) {
-    ngx_array_destroy(body);
+  if (!has_body) {
     return NGX_DECLINED;
   }
 
-  json = body->elts;
+  if (st != sw_next || depth) {
+    goto invalid;
+  }
 
-  value = json_parse(json, body->nelts / body->size);
+done:
 
-  if (value != NULL &&
-      (temp_ret = ngx_find_json_name(value, &json_state)) != NULL &&
-      temp_ret->type == json_integer && temp_ret->u.integer == 0) {
-    temp_ret = value;
-    for (i = 0; i < 2; ++i) {
-      temp_ret = ngx_find_json_name(temp_ret, &target_name[i]);
-      if (temp_ret == NULL) break;
-    }
-    if (i != 2) {
-      goto error;
-    }
-    ctx->addrs_buffer =
-        ngx_array_create(s->connection->pool, 1, sizeof(ngx_str_t));
-    if (ctx->addrs_buffer == NULL) {
-      goto error;
-    }
+  if (state != 0) {
+    return NGX_OK;
+  }
 
-    ngx_match_json_name(temp_ret, &target_name[2], s->connection->pool,
-                        ctx->addrs_buffer);
-    if (ctx->addrs_buffer->nelts <= 0) {
-      ngx_array_destroy(ctx->addrs_buffer);
-      ctx->addrs_buffer = NULL;
-      goto error;
-    }
+  if (addrs == NULL) {
+    ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
+                  "notify: no content.addrs.addr in pull response");
+    return NGX_ERROR;
   }
-  if (value != NULL) json_value_free(value);
-  ngx_array_destroy(body);
+
+  ctx->addrs_buffer = addrs;
+
   return NGX_OK;
 
-error:
-  ngx_array_destroy(body);
-  if (value != NULL) json_value_free(value);
-  return NGX_ERROR;
+invalid:
+
+  ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
+                "notify: invalid JSON in pull response");
+
+  return NGX_OK;
 }
 
 static ngx_int_t ngx_rtmp_notify_play_handle(ngx_rtmp_session_t *s, void *arg,
@@ -1082,6 +1420,7 @@ static ngx_int_t ngx_rtmp_notify_play_handle(ngx_rtmp_session_t *s, void *arg,
   rc = ngx_rtmp_notify_parse_http_retcode(s, in);
 
   if (rc == NGX_ERROR) {
+    ngx_rtmp_notify_cache_done(s, in, NGX_RTMP_NOTIFY_CACHE_DENY);
     ngx_rtmp_notify_clear_flag(s, NGX_RTMP_NOTIFY_PLAYING);
     return NGX_ERROR;
   }
@@ -1090,6 +1429,8 @@ static ngx_int_t ngx_rtmp_notify_play_handle(ngx_rtmp_session_t *s, void *arg,
                  "notify: play redirect received");
   /* HTTP 3xx */
   if (rc == NGX_AGAIN) {
+    ngx_rtmp_notify_cache_done(s, in, 0);
+
     ctx->addrs_buffer =
         ngx_array_create(s->connection->pool, 1, sizeof(ngx_str_t));
 
@@ -1099,9 +1440,14 @@ static ngx_int_t ngx_rtmp_notify_play_handle(ngx_rtmp_session_t *s, void *arg,
                                                sizeof(name) - 1);
   } else {
     /* HTTP 2xx rc==-2==NGX_OK*/
-    if (ngx_rtmp_notify_parse_http_json_body(s, in) != NGX_OK) {
+    if (ngx_rtmp_notify_parse_http_json_body(s, in) != NGX_OK ||
+        ctx->addrs_buffer == NULL) {
+      ngx_rtmp_notify_cache_done(s, in, NGX_RTMP_NOTIFY_CACHE_ALLOW);
       return next_play(s, v);
     }
+
+    /* pull addresses are per-response, never cached */
+    ngx_rtmp_notify_cache_done(s, in, 0);
   }
 
   if (rc == NGX_AGAIN) {
@@ -1136,86 +1482,302 @@ static void ngx_rtmp_notify_reconnect_evt_handler(ngx_event_t *rec_evt) {
   ngx_rtmp_peer_connect_from_addrs(s);
 }
 
-ngx_int_t ngx_rtmp_peer_connect_from_addrs(ngx_rtmp_session_t *s) {
-  u_char name[NGX_RTMP_MAX_NAME];
-  ngx_uint_t length, addrs_len;
-  ngx_str_t local_name, *cur_addr, *start_addr;
-  ngx_rtmp_relay_target_t target;
-  ngx_url_t *u;
-  ngx_rtmp_notify_app_conf_t *nacf;
-  ngx_rtmp_live_ctx_t *lctx;
-  ngx_rtmp_notify_ctx_t *ctx;
-  ngx_array_t *buffer;
-
-  ngx_memzero(name, sizeof(name));
-
-  ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_notify_module);
-  nacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_notify_module);
-
-  if (ctx == NULL || ctx->addrs_buffer == NULL) return NGX_ERROR;
+/* single-flight pull: one relay per (app, stream) for redirected plays */
 
-  buffer = ctx->addrs_buffer;
-  addrs_len = buffer->nelts;
+typedef struct {
+  ngx_queue_t queue;
+  ngx_queue_t members; /* ngx_rtmp_notify_ctx_t */
+  ngx_rtmp_session_t *leader;
+  ngx_str_t key;
+  ngx_str_t name; /* local name the leader pulls into */
+  u_char name_data[NGX_RTMP_MAX_NAME];
+} ngx_rtmp_notify_pull_t;
+
+static ngx_queue_t ngx_rtmp_notify_pulls;
+
+static ngx_int_t ngx_rtmp_notify_pull_attach(ngx_rtmp_session_t *s,
+                                             ngx_rtmp_notify_ctx_t *ctx,
+                                             ngx_rtmp_notify_pull_t *pull) {
+  ngx_rtmp_live_ctx_t *lctx;
+  ngx_int_t rc;
 
-  if (ctx->cnt >= addrs_len) {
-    goto reconnect;
+  if (pull->name.len == 0) {
+    return NGX_DECLINED;
   }
 
-  start_addr = buffer->elts;
-
-  for (; ctx->cnt < addrs_len; ++ctx->cnt) {
-    cur_addr = start_addr + ctx->cnt;
-    length = cur_addr->len;
-    ngx_memcpy(name, cur_addr->data, length);
-    if (ngx_strncasecmp(name, (u_char *)"rtmp://", 7) == 0) {
-      break;
-    }
+  rc = ngx_rtmp_relay_attach(s, &pull->name);
+  if (rc != NGX_OK) {
+    return rc;
   }
 
-  if (ctx->cnt >= addrs_len) {
-    goto reconnect;
-  }
+  ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
+                "notify: pull '%V' shared", &pull->name);
 
-  ++ctx->cnt;
   lctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_live_module);
   if (lctx != NULL) {
     lctx->stream = NULL;
   }
 
-  ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
-                "notify: pull '%s' from '%*s'", ctx->v_play->name, length,
-                name);
+  *ngx_cpymem(ctx->v_play->name, pull->name.data, pull->name.len) = 0;
 
-  ngx_memzero(&target, sizeof(target));
+  return next_play(s, ctx->v_play);
+}
 
-  u = &target.url;  // tar.url==u
-  u->url = local_name;
-  u->url.data = name + 7;
-  u->url.len = length - 7;
-  u->default_port = 1935;
-  u->uri_part = 1;
-  u->no_resolve = 1; /* want ip here */
+static ngx_int_t ngx_rtmp_notify_pull_join(ngx_rtmp_session_t *s,
+                                           ngx_rtmp_notify_ctx_t *ctx) {
+  ngx_rtmp_notify_pull_t *pull;
+  ngx_queue_t *q;
+  ngx_int_t rc;
+  size_t len;
 
-  if (ngx_parse_url(s->connection->pool, u) != NGX_OK) {
-    ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
-                  "notify: pull failed '%V'", &local_name);
-    return NGX_ERROR;
-  }
+  pull = ctx->pull;
 
-  if (target.app.len == 0 || target.play_path.len == 0) {
-    ngx_str_t *uri, temp;
-    u_char *first, *last, *p;
-    uri = &u->uri;
-    first = uri->data;
-    last = uri->data + uri->len;
-    if (first != last && *first == '/') {
-      ++first;
-    }
+  if (pull == NULL) {
+    len = s->app.len + 1 + ctx->stream_name->len;
 
-    if (first != last) {
-      p = ngx_strlchr(first, last, '/');
-      if (p == NULL) {
-        p = last;
+    for (q = ngx_queue_head(&ngx_rtmp_notify_pulls);
+         q != ngx_queue_sentinel(&ngx_rtmp_notify_pulls);
+         q = ngx_queue_next(q)) {
+      pull = ngx_queue_data(q, ngx_rtmp_notify_pull_t, queue);
+
+      if (pull->key.len == len &&
+          ngx_memcmp(pull->key.data, s->app.data, s->app.len) == 0 &&
+          ngx_memcmp(pull->key.data + s->app.len + 1, ctx->stream_name->data,
+                     ctx->stream_name->len) == 0) {
+        break;
+      }
+    }
+
+    if (q == ngx_queue_sentinel(&ngx_rtmp_notify_pulls)) {
+      pull = ngx_alloc(sizeof(ngx_rtmp_notify_pull_t) + len, ngx_cycle->log);
+      if (pull == NULL) {
+        return NGX_ERROR;
+      }
+
+      ngx_memzero(pull, sizeof(ngx_rtmp_notify_pull_t));
+
+      pull->leader = s;
+      pull->name.data = pull->name_data;
+      pull->key.len = len;
+      pull->key.data = (u_char *)(pull + 1);
+      ngx_sprintf(pull->key.data, "%V/%V", &s->app, ctx->stream_name);
+
+      ngx_queue_init(&pull->members);
+      ngx_queue_insert_tail(&ngx_rtmp_notify_pulls, &pull->queue);
+    }
+
+    ctx->pull = pull;
+    ctx->pull_wait = 0;
+    ngx_queue_insert_tail(&pull->members, &ctx->pull_queue);
+  }
+
+  if (pull->leader == s) {
+    return NGX_DECLINED;
+  }
+
+  rc = ngx_rtmp_notify_pull_attach(s, ctx, pull);
+  if (rc != NGX_DECLINED) {
+    return rc;
+  }
+
+  /* leader has no relay running yet; wait for it */
+
+  ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                 "notify: pull '%V' pending, waiting", &pull->key);
+
+  ctx->pull_wait = 1;
+
+  return NGX_OK;
+}
+
+static void ngx_rtmp_notify_pull_started(ngx_rtmp_session_t *s,
+                                         ngx_rtmp_notify_ctx_t *ctx,
+                                         ngx_str_t *name) {
+  ngx_rtmp_notify_pull_t *pull;
+  ngx_rtmp_notify_ctx_t *mctx;
+  ngx_queue_t *q;
+  ngx_int_t rc;
+
+  pull = ctx->pull;
+  if (pull == NULL || pull->leader != s) {
+    return;
+  }
+
+  pull->name.len = ngx_min(name->len, NGX_RTMP_MAX_NAME - 1);
+  ngx_memcpy(pull->name.data, name->data, pull->name.len);
+
+  for (q = ngx_queue_head(&pull->members);
+       q != ngx_queue_sentinel(&pull->members); q = ngx_queue_next(q)) {
+    mctx = ngx_queue_data(q, ngx_rtmp_notify_ctx_t, pull_queue);
+
+    /* members that failed to attach are already being closed */
+    if (!mctx->pull_wait || mctx->session->connection->destroyed) {
+      continue;
+    }
+
+    rc = ngx_rtmp_notify_pull_attach(mctx->session, mctx, pull);
+
+    if (rc == NGX_DECLINED) {
+      /* relay could not be created, keep waiting for the next attempt */
+      return;
+    }
+
+    if (rc != NGX_OK) {
+      ngx_rtmp_finalize_session(mctx->session);
+      continue;
+    }
+
+    mctx->pull_wait = 0;
+  }
+}
+
+static void ngx_rtmp_notify_pull_leave(ngx_rtmp_session_t *s,
+                                       ngx_rtmp_notify_ctx_t *ctx,
+                                       ngx_uint_t failed) {
+  ngx_rtmp_notify_pull_t *pull;
+  ngx_rtmp_notify_ctx_t *mctx;
+  ngx_rtmp_session_t *ms;
+  ngx_queue_t *q;
+
+  pull = ctx->pull;
+  if (pull == NULL) {
+    return;
+  }
+
+  ctx->pull = NULL;
+  ngx_queue_remove(&ctx->pull_queue);
+
+  if (pull->leader != s) {
+    return;
+  }
+
+  pull->leader = NULL;
+
+  while (!ngx_queue_empty(&pull->members)) {
+    q = ngx_queue_head(&pull->members);
+    mctx = ngx_queue_data(q, ngx_rtmp_notify_ctx_t, pull_queue);
+    ms = mctx->session;
+
+    if (ms->connection->destroyed) {
+      /* closing already, cannot take the pull over */
+      ngx_queue_remove(q);
+      mctx->pull = NULL;
+      continue;
+    }
+
+    if (!failed || !mctx->pull_wait) {
+      /* promote: the member drives the pull from now on */
+
+      pull->leader = ms;
+
+      if (mctx->pull_wait) {
+        mctx->pull_wait = 0;
+        if (ngx_rtmp_peer_connect_from_addrs(ms) != NGX_OK) {
+          ngx_rtmp_finalize_session(ms);
+        }
+      }
+
+      return;
+    }
+
+    /* leader gave up on every address, so would the waiters */
+
+    ngx_queue_remove(q);
+    mctx->pull = NULL;
+    mctx->pull_wait = 0;
+    ngx_rtmp_finalize_session(ms);
+  }
+
+  ngx_queue_remove(&pull->queue);
+  ngx_free(pull);
+}
+
+ngx_int_t ngx_rtmp_peer_connect_from_addrs(ngx_rtmp_session_t *s) {
+  u_char name[NGX_RTMP_MAX_NAME];
+  ngx_uint_t length, addrs_len;
+  ngx_str_t local_name, *cur_addr, *start_addr;
+  ngx_rtmp_relay_target_t target;
+  ngx_url_t *u;
+  ngx_rtmp_notify_app_conf_t *nacf;
+  ngx_rtmp_live_ctx_t *lctx;
+  ngx_rtmp_notify_ctx_t *ctx;
+  ngx_array_t *buffer;
+  ngx_int_t rc;
+
+  ngx_memzero(name, sizeof(name));
+
+  ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_notify_module);
+  nacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_notify_module);
+
+  if (ctx == NULL || ctx->addrs_buffer == NULL) return NGX_ERROR;
+
+  rc = ngx_rtmp_notify_pull_join(s, ctx);
+  if (rc != NGX_DECLINED) {
+    return rc;
+  }
+
+  buffer = ctx->addrs_buffer;
+  addrs_len = buffer->nelts;
+
+  if (ctx->cnt >= addrs_len) {
+    goto reconnect;
+  }
+
+  start_addr = buffer->elts;
+
+  for (; ctx->cnt < addrs_len; ++ctx->cnt) {
+    cur_addr = start_addr + ctx->cnt;
+    length = cur_addr->len;
+    ngx_memcpy(name, cur_addr->data, length);
+    if (ngx_strncasecmp(name, (u_char *)"rtmp://", 7) == 0) {
+      break;
+    }
+  }
+
+  if (ctx->cnt >= addrs_len) {
+    goto reconnect;
+  }
+
+  ++ctx->cnt;
+  lctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_live_module);
+  if (lctx != NULL) {
+    lctx->stream = NULL;
+  }
+
+  ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
+                "notify: pull '%s' from '%*s'", ctx->v_play->name, length,
+                name);
+
+  ngx_memzero(&target, sizeof(target));
+
+  u = &target.url;  // tar.url==u
+  u->url = local_name;
+  u->url.data = name + 7;
+  u->url.len = length - 7;
+  u->default_port = 1935;
+  u->uri_part = 1;
+  u->no_resolve = 1; /* want ip here */
+
+  if (ngx_parse_url(s->connection->pool, u) != NGX_OK) {
+    ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
+                  "notify: pull failed '%V'", &local_name);
+    return NGX_ERROR;
+  }
+
+  if (target.app.len == 0 || target.play_path.len == 0) {
+    ngx_str_t *uri, temp;
+    u_char *first, *last, *p;
+    uri = &u->uri;
+    first = uri->data;
+    last = uri->data + uri->len;
+    if (first != last && *first == '/') {
+      ++first;
+    }
+
+    if (first != last) {
+      p = ngx_strlchr(first, last, '/');
+      if (p == NULL) {
+        p = last;
       }
       if (target.app.len == 0 && first != p) {
         temp.data = first;
@@ -1257,6 +1819,8 @@ ngx_int_t ngx_rtmp_peer_connect_from_addrs(ngx_rtmp_session_t *s) {
   local_name.len = ngx_strlen(ctx->v_play->name);
   ngx_rtmp_relay_pull(s, &local_name, &target);
 
+  ngx_rtmp_notify_pull_started(s, ctx, &local_name);
+
   return next_play(s, ctx->v_play);
 
 reconnect:
@@ -1272,6 +1836,7 @@ reconnect:
   return NGX_OK;
 
 destory:
+  ngx_rtmp_notify_pull_leave(s, ctx, 1);
   ngx_array_destroy(buffer);
   ctx->addrs_buffer = NULL;
   ctx->v_play = NULL;
@@ -1338,1523 +1903,1064 @@ static void ngx_rtmp_notify_update(ngx_event_t *e) {
   ngx_rtmp_notify_update_handle(s, NULL, NULL);
 }
 
-static void ngx_rtmp_notify_init(ngx_rtmp_session_t *s,
-                                 u_char name[NGX_RTMP_MAX_NAME],
-                                 u_char args[NGX_RTMP_MAX_ARGS],
-                                 ngx_uint_t flags) {
-  ngx_rtmp_notify_ctx_t *ctx;
-  ngx_rtmp_notify_app_conf_t *nacf;
-  ngx_event_t *e;
-
-  nacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_notify_module);
-  if (!nacf->active) {
-    return;
-  }
+/* auth decision cache */
 
-  ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_notify_module);
+typedef struct {
+  ngx_str_node_t sn;
+  ngx_queue_t queue;
+  time_t expire;
+  ngx_uint_t decision;
+  u_char data[1];
+} ngx_rtmp_notify_cache_node_t;
 
-  if (ctx == NULL) {
-    ctx = ngx_pcalloc(s->connection->pool, sizeof(ngx_rtmp_notify_ctx_t));
-    if (ctx == NULL) {
-      return;
-    }
+typedef struct {
+  ngx_rbtree_t rbtree;
+  ngx_rbtree_node_t sentinel;
+  ngx_queue_t queue; /* LRU, most recently used first */
+} ngx_rtmp_notify_cache_sh_t;
 
-    ngx_rtmp_set_ctx(s, ctx, ngx_rtmp_notify_module);
-  }
+typedef struct {
+  ngx_rtmp_notify_cache_sh_t *sh;
+  ngx_slab_pool_t *shpool;
+} ngx_rtmp_notify_cache_t;
 
-  ngx_memcpy(ctx->name, name, NGX_RTMP_MAX_NAME);
-  ngx_memcpy(ctx->args, args, NGX_RTMP_MAX_ARGS);
+/* callback in flight in this worker; identical lookups wait on it */
+typedef struct {
+  ngx_queue_t queue;
+  ngx_queue_t waiters; /* ngx_rtmp_notify_ctx_t */
+  ngx_rtmp_session_t *leader;
+  uint32_t hash;
+  ngx_str_t key;
+} ngx_rtmp_notify_cache_pending_t;
 
-  ctx->flags |= flags;
-  ctx->cnt = 0;
-  ctx->addrs_buffer = NULL;
-  ctx->v_play = NULL;
+static ngx_queue_t ngx_rtmp_notify_cache_pending;
 
-  if (nacf->url[NGX_RTMP_NOTIFY_UPDATE] == NULL || nacf->update_timeout == 0) {
-    return;
-  }
+static ngx_int_t ngx_rtmp_notify_publish_netcall(ngx_rtmp_session_t *s,
+                                                 ngx_rtmp_publish_t *v) {
+  ngx_rtmp_notify_app_conf_t *nacf;
+  ngx_rtmp_netcall_init_t ci;
+  ngx_url_t *url;
 
-  if (ctx->update_evt.timer_set) {
-    return;
-  }
+  nacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_notify_module);
 
-  ctx->start = ngx_cached_time->sec;
+  url = nacf->url[NGX_RTMP_NOTIFY_PUBLISH];
 
-  e = &ctx->update_evt;
+  ngx_log_error(NGX_LOG_INFO, s->connection->log, 0, "notify: publish '%V'",
+                &url->url);
 
-  e->data = s->connection;
-  e->log = s->connection->log;
-  e->handler = ngx_rtmp_notify_update;
+  ngx_memzero(&ci, sizeof(ci));
 
-  ngx_add_timer(e, nacf->update_timeout);
+  ci.url = url;
+  ci.create = ngx_rtmp_notify_publish_create;
+  ci.handle = ngx_rtmp_notify_publish_handle;
+  ci.arg = v;
+  ci.argsize = sizeof(*v);
 
-  ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
-                 "notify: schedule initial update %Mms", nacf->update_timeout);
+  return ngx_rtmp_netcall_create(s, &ci);
 }
 
-static ngx_int_t ngx_rtmp_notify_connect(ngx_rtmp_session_t *s,
-                                         ngx_rtmp_connect_t *v) {
-  ngx_rtmp_notify_srv_conf_t *nscf;
+static ngx_int_t ngx_rtmp_notify_play_netcall(ngx_rtmp_session_t *s,
+                                              ngx_rtmp_play_t *v) {
+  ngx_rtmp_notify_app_conf_t *nacf;
   ngx_rtmp_netcall_init_t ci;
   ngx_url_t *url;
 
-  if (s->auto_pushed || s->relay) {
-    goto next;
-  }
-
-  nscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_notify_module);
+  nacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_notify_module);
 
-  url = nscf->url[NGX_RTMP_NOTIFY_CONNECT];
-  if (url == NULL) {
-    goto next;
-  }
+  url = nacf->url[NGX_RTMP_NOTIFY_PLAY];
 
-  ngx_log_error(NGX_LOG_INFO, s->connection->log, 0, "notify: connect '%V'",
+  ngx_log_error(NGX_LOG_INFO, s->connection->log, 0, "notify: play '%V'",
                 &url->url);
 
   ngx_memzero(&ci, sizeof(ci));
 
   ci.url = url;
-  ci.create = ngx_rtmp_notify_connect_create;
-  ci.handle = ngx_rtmp_notify_connect_handle;
+  ci.create = ngx_rtmp_notify_play_create;
+  ci.handle = ngx_rtmp_notify_play_handle;
   ci.arg = v;
   ci.argsize = sizeof(*v);
 
   return ngx_rtmp_netcall_create(s, &ci);
-
-next:
-  return next_connect(s, v);
 }
 
-static ngx_int_t ngx_rtmp_notify_disconnect(ngx_rtmp_session_t *s) {
-  ngx_rtmp_notify_srv_conf_t *nscf;
-  ngx_rtmp_netcall_init_t ci;
-  ngx_url_t *url;
+static void ngx_rtmp_notify_cache_expire(ngx_rtmp_notify_cache_t *cache,
+                                         ngx_uint_t force) {
+  ngx_rtmp_notify_cache_node_t *node;
+  ngx_queue_t *q;
+  ngx_uint_t n;
+  time_t now;
 
-  if (s->auto_pushed || s->relay) {
-    goto next;
-  }
+  now = ngx_time();
 
-  nscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_notify_module);
+  /* remove at most 3 entries per call, as limit_req does */
 
-  url = nscf->url[NGX_RTMP_NOTIFY_DISCONNECT];
-  if (url == NULL) {
-    goto next;
-  }
+  for (n = 0; n < 3; ++n) {
+    if (ngx_queue_empty(&cache->sh->queue)) {
+      return;
+    }
 
-  ngx_log_error(NGX_LOG_INFO, s->connection->log, 0, "notify: disconnect '%V'",
-                &url->url);
+    q = ngx_queue_last(&cache->sh->queue);
+    node = ngx_queue_data(q, ngx_rtmp_notify_cache_node_t, queue);
 
-  ngx_memzero(&ci, sizeof(ci));
+    if (!force && node->expire > now) {
+      return;
+    }
 
-  ci.url = url;
-  ci.create = ngx_rtmp_notify_disconnect_create;
-
-  ngx_rtmp_netcall_create(s, &ci);
+    force = 0;
 
-next:
-  return next_disconnect(s);
+    ngx_queue_remove(q);
+    ngx_rbtree_delete(&cache->sh->rbtree, &node->sn.node);
+    ngx_slab_free_locked(cache->shpool, node);
+  }
 }
 
-static ngx_int_t ngx_rtmp_notify_publish(ngx_rtmp_session_t *s,
-                                         ngx_rtmp_publish_t *v) {
-  ngx_rtmp_notify_app_conf_t *nacf;
-  ngx_rtmp_netcall_init_t ci;
-  ngx_url_t *url;
+static time_t ngx_rtmp_notify_cache_valid(ngx_rtmp_session_t *s,
+                                          ngx_chain_t *in, time_t valid) {
+  u_char cc[NGX_RTMP_MAX_NAME], *p, *last;
+  ngx_int_t n;
 
-  if (s->auto_pushed) {
-    goto next;
-  }
+  static ngx_str_t cache_control = ngx_string("cache-control");
 
-  nacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_notify_module);
-  if (nacf == NULL) {
-    goto next;
+  n = ngx_rtmp_notify_parse_http_header(s, in, &cache_control, cc,
+                                        sizeof(cc) - 1);
+  if (n <= 0) {
+    return valid;
   }
 
-  url = nacf->url[NGX_RTMP_NOTIFY_PUBLISH];
-
-  ngx_rtmp_notify_init(s, v->name, v->args, NGX_RTMP_NOTIFY_PUBLISHING);
+  last = cc + n;
 
-  if (url == NULL) {
-    goto next;
+  if (ngx_strlcasestrn(cc, last, (u_char *)"no-cache", 8 - 1) ||
+      ngx_strlcasestrn(cc, last, (u_char *)"no-store", 8 - 1) ||
+      ngx_strlcasestrn(cc, last, (u_char *)"private", 7 - 1)) {
+    return 0;
   }
 
-  ngx_log_error(NGX_LOG_INFO, s->connection->log, 0, "notify: publish '%V'",
-                &url->url);
+  p = ngx_strlcasestrn(cc, last, (u_char *)"max-age=", 8 - 1);
+  if (p == NULL) {
+    return valid;
+  }
 
-  ngx_memzero(&ci, sizeof(ci));
+  p += sizeof("max-age=") - 1;
 
-  ci.url = url;
-  ci.create = ngx_rtmp_notify_publish_create;
-  ci.handle = ngx_rtmp_notify_publish_handle;
-  ci.arg = v;
-  ci.argsize = sizeof(*v);
+  for (last = p; last < cc + n && *last >= '0' && *last <= '9'; ++last) {
+    /* void */
+  }
 
-  return ngx_rtmp_netcall_create(s, &ci);
+  n = ngx_atoi(p, last - p);
+  if (n == NGX_ERROR) {
+    return valid;
+  }
 
-next:
-  return next_publish(s, v);
+  return (time_t)n;
 }
 
-static ngx_int_t ngx_rtmp_notify_play(ngx_rtmp_session_t *s,
-                                      ngx_rtmp_play_t *v) {
+static ngx_int_t ngx_rtmp_notify_cache_lookup(ngx_rtmp_session_t *s,
+                                              ngx_uint_t event, u_char *name,
+                                              u_char *args, void *v,
+                                              size_t size) {
   ngx_rtmp_notify_app_conf_t *nacf;
-  ngx_rtmp_netcall_init_t ci;
-  ngx_url_t *url;
-
-  if (s->auto_pushed || v->silent) {
-    goto next;
-  }
+  ngx_rtmp_notify_ctx_t *ctx;
+  ngx_rtmp_notify_cache_t *cache;
+  ngx_rtmp_notify_cache_node_t *node;
+  ngx_rtmp_notify_cache_pending_t *p;
+  ngx_queue_t *q;
+  ngx_uint_t decision;
+  ngx_str_t key;
+  uint32_t hash;
+  size_t name_len, args_len;
 
   nacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_notify_module);
-  if (nacf == NULL) {
-    goto next;
-  }
+  ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_notify_module);
 
-  url = nacf->url[NGX_RTMP_NOTIFY_PLAY];
+  if (nacf->cache_zone == NULL || ctx == NULL) {
+    return NGX_DONE;
+  }
 
-  ngx_rtmp_notify_init(s, v->name, v->args, NGX_RTMP_NOTIFY_PLAYING);
+  name_len = ngx_strlen(name);
+  args_len = ngx_strlen(args);
 
-  if (url == NULL) {
-    goto next;
+  key.len = NGX_INT_T_LEN + s->app.len + name_len + args_len + 3;
+  key.data = ngx_pnalloc(s->connection->pool, key.len);
+  if (key.data == NULL) {
+    return NGX_ERROR;
   }
 
-  ngx_log_error(NGX_LOG_INFO, s->connection->log, 0, "notify: play '%V'",
-                &url->url);
-
-  ngx_memzero(&ci, sizeof(ci));
+  key.len = ngx_sprintf(key.data, "%ui/%V/%*s?%*s", event, &s->app, name_len,
+                        name, args_len, args) -
+            key.data;
 
-  ci.url = url;
-  ci.create = ngx_rtmp_notify_play_create;
-  ci.handle = ngx_rtmp_notify_play_handle;
-  ci.arg = v;
-  ci.argsize = sizeof(*v);
+  hash = ngx_crc32_short(key.data, key.len);
 
-  return ngx_rtmp_netcall_create(s, &ci);
+  cache = nacf->cache_zone->data;
+  decision = 0;
 
-next:
-  return next_play(s, v);
-}
+  ngx_shmtx_lock(&cache->shpool->mutex);
 
-static ngx_int_t ngx_rtmp_notify_close_stream(ngx_rtmp_session_t *s,
-                                              ngx_rtmp_close_stream_t *v) {
-  ngx_rtmp_notify_ctx_t *ctx;
-  ngx_rtmp_notify_app_conf_t *nacf;
+  node = (ngx_rtmp_notify_cache_node_t *)ngx_str_rbtree_lookup(
+      &cache->sh->rbtree, &key, hash);
 
-  if (s->auto_pushed) {
-    goto next;
-  }
+  if (node) {
+    ngx_queue_remove(&node->queue);
 
-  ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_notify_module);
+    if (node->expire > ngx_time()) {
+      decision = node->decision;
+      ngx_queue_insert_head(&cache->sh->queue, &node->queue);
 
-  if (ctx == NULL) {
-    goto next;
+    } else {
+      ngx_rbtree_delete(&cache->sh->rbtree, &node->sn.node);
+      ngx_slab_free_locked(cache->shpool, node);
+    }
   }
 
-  nacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_notify_module);
+  ngx_shmtx_unlock(&cache->shpool->mutex);
 
-  if (nacf == NULL) {
-    goto next;
+  if (decision == NGX_RTMP_NOTIFY_CACHE_ALLOW) {
+    ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                   "notify: cache hit '%V', allow", &key);
+    return NGX_OK;
   }
 
-  if (ctx->flags & NGX_RTMP_NOTIFY_PUBLISHING) {
-    ngx_rtmp_notify_done(s, "publish_done", NGX_RTMP_NOTIFY_PUBLISH_DONE);
+  if (decision == NGX_RTMP_NOTIFY_CACHE_DENY) {
+    ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
+                  "notify: cache hit '%V', deny", &key);
+    return NGX_DECLINED;
   }
 
-  if (ctx->flags & NGX_RTMP_NOTIFY_PLAYING) {
-    ngx_rtmp_notify_done(s, "play_done", NGX_RTMP_NOTIFY_PLAY_DONE);
-  }
+  /* coalesce with an identical callback already in flight */
 
-  if (ctx->flags) {
-    ngx_rtmp_notify_done(s, "done", NGX_RTMP_NOTIFY_DONE);
+  for (q = ngx_queue_head(&ngx_rtmp_notify_cache_pending);
+       q != ngx_queue_sentinel(&ngx_rtmp_notify_cache_pending);
+       q = ngx_queue_next(q)) {
+    p = ngx_queue_data(q, ngx_rtmp_notify_cache_pending_t, queue);
+
+    if (p->hash != hash || p->key.len != key.len ||
+        ngx_memcmp(p->key.data, key.data, key.len) != 0) {
+      continue;
+    }
+
+    ctx->cache_arg = ngx_palloc(s->connection->pool, size);
+    if (ctx->cache_arg == NULL) {
+      return NGX_ERROR;
+    }
+
+    ngx_memcpy(ctx->cache_arg, v, size);
+
+    ctx->cache_event = event;
+    ctx->cache_pending = p;
+    ngx_queue_insert_tail(&p->waiters, &ctx->cache_queue);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                   "notify: cache wait '%V'", &key);
+
+    return NGX_AGAIN;
   }
 
-  if (ctx->update_evt.timer_set) {
-    ngx_del_timer(&ctx->update_evt);
+  p = ngx_alloc(sizeof(ngx_rtmp_notify_cache_pending_t) + key.len,
+                ngx_cycle->log);
+  if (p == NULL) {
+    return NGX_ERROR;
   }
 
-  ctx->flags = 0;
+  p->leader = s;
+  p->hash = hash;
+  p->key.len = key.len;
+  p->key.data = (u_char *)(p + 1);
+  ngx_memcpy(p->key.data, key.data, key.len);
 
-next:
-  return next_close_stream(s, v);
+  ngx_queue_init(&p->waiters);
+  ngx_queue_insert_tail(&ngx_rtmp_notify_cache_pending, &p->queue);
+
+  ctx->session = s;
+  ctx->cache_event = event;
+  ctx->cache_pending = p;
+
+  ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                 "notify: cache miss '%V'", &key);
+
+  return NGX_DONE;
 }
 
-static ngx_int_t ngx_rtmp_notify_record_done(ngx_rtmp_session_t *s,
-                                             ngx_rtmp_record_done_t *v) {
-  ngx_rtmp_netcall_init_t ci;
-  ngx_rtmp_notify_app_conf_t *nacf;
+static void ngx_rtmp_notify_cache_store(ngx_rtmp_notify_app_conf_t *nacf,
+                                        ngx_rtmp_notify_cache_pending_t *p,
+                                        ngx_uint_t decision, time_t valid) {
+  ngx_rtmp_notify_cache_t *cache;
+  ngx_rtmp_notify_cache_node_t *node;
+  size_t size;
 
-  if (s->auto_pushed) {
-    goto next;
+  cache = nacf->cache_zone->data;
+
+  size = offsetof(ngx_rtmp_notify_cache_node_t, data) + p->key.len;
+
+  ngx_shmtx_lock(&cache->shpool->mutex);
+
+  node = (ngx_rtmp_notify_cache_node_t *)ngx_str_rbtree_lookup(
+      &cache->sh->rbtree, &p->key, p->hash);
+
+  if (node) {
+    ngx_queue_remove(&node->queue);
+    goto done;
   }
 
-  nacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_notify_module);
-  if (nacf == NULL || nacf->url[NGX_RTMP_NOTIFY_RECORD_DONE] == NULL) {
-    goto next;
+  ngx_rtmp_notify_cache_expire(cache, 0);
+
+  node = ngx_slab_alloc_locked(cache->shpool, size);
+  if (node == NULL) {
+    ngx_rtmp_notify_cache_expire(cache, 1);
+
+    node = ngx_slab_alloc_locked(cache->shpool, size);
+    if (node == NULL) {
+      ngx_shmtx_unlock(&cache->shpool->mutex);
+      ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                    "notify: could not allocate cache node in zone \"%V\"",
+                    &nacf->cache_zone->shm.name);
+      return;
+    }
   }
 
-  ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
-                "notify: record_done recorder=%V path='%V' url='%V'",
-                &v->recorder, &v->path,
-                &nacf->url[NGX_RTMP_NOTIFY_RECORD_DONE]->url);
+  node->sn.node.key = p->hash;
+  node->sn.str.len = p->key.len;
+  node->sn.str.data = node->data;
+  ngx_memcpy(node->data, p->key.data, p->key.len);
 
-  ngx_memzero(&ci, sizeof(ci));
+  ngx_rbtree_insert(&cache->sh->rbtree, &node->sn.node);
 
-  ci.url = nacf->url[NGX_RTMP_NOTIFY_RECORD_DONE];
-  ci.create = ngx_rtmp_notify_record_done_create;
-  ci.arg = v;
+done:
 
-  ngx_rtmp_netcall_create(s, &ci);
+  node->expire = ngx_time() + valid;
+  node->decision = decision;
 
-next:
-  return next_record_done(s, v);
+  ngx_queue_insert_head(&cache->sh->queue, &node->queue);
+
+  ngx_shmtx_unlock(&cache->shpool->mutex);
 }
 
-static ngx_int_t ngx_rtmp_notify_done(ngx_rtmp_session_t *s, char *cbname,
-                                      ngx_uint_t url_idx) {
-  ngx_rtmp_netcall_init_t ci;
-  ngx_rtmp_notify_done_t ds;
-  ngx_rtmp_notify_app_conf_t *nacf;
-  ngx_url_t *url;
+static ngx_int_t ngx_rtmp_notify_cache_resume(ngx_rtmp_session_t *s,
+                                              ngx_rtmp_notify_ctx_t *ctx,
+                                              ngx_uint_t decision) {
+  switch (decision) {
+    case NGX_RTMP_NOTIFY_CACHE_ALLOW:
+      ngx_log_debug0(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                     "notify: coalesced callback allowed");
 
-  nacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_notify_module);
+      if (ctx->cache_event == NGX_RTMP_NOTIFY_PLAY) {
+        return next_play(s, ctx->cache_arg);
+      }
 
-  url = nacf->url[url_idx];
-  if (url == NULL) {
-    return NGX_OK;
-  }
+      return next_publish(s, ctx->cache_arg);
 
-  ngx_log_error(NGX_LOG_INFO, s->connection->log, 0, "notify: %s '%V'", cbname,
-                &url->url);
+    case NGX_RTMP_NOTIFY_CACHE_DENY:
+      ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
+                    "notify: coalesced callback denied");
 
-  ds.cbname = (u_char *)cbname;
-  ds.url_idx = url_idx;
+      ngx_rtmp_notify_clear_flag(s, ctx->cache_event == NGX_RTMP_NOTIFY_PLAY
+                                        ? NGX_RTMP_NOTIFY_PLAYING
+                                        : NGX_RTMP_NOTIFY_PUBLISHING);
+      return NGX_ERROR;
 
-  ngx_memzero(&ci, sizeof(ci));
+    default:
+      /* redirect or lost leader: each session asks on its own */
 
-  ci.url = url;
-  ci.arg = &ds;
-  ci.create = ngx_rtmp_notify_done_create;
+      if (ctx->cache_event == NGX_RTMP_NOTIFY_PLAY) {
+        return ngx_rtmp_notify_play_netcall(s, ctx->cache_arg);
+      }
 
-  return ngx_rtmp_netcall_create(s, &ci);
+      return ngx_rtmp_notify_publish_netcall(s, ctx->cache_arg);
+  }
 }
 
-static ngx_url_t *ngx_rtmp_notify_parse_url(ngx_conf_t *cf, ngx_str_t *url) {
-  ngx_url_t *u;
-  size_t add;
+static void ngx_rtmp_notify_cache_release(ngx_rtmp_notify_cache_pending_t *p,
+                                          ngx_uint_t decision) {
+  ngx_rtmp_notify_ctx_t *ctx;
+  ngx_rtmp_session_t *s;
+  ngx_queue_t *q;
 
-  add = 0;
+  ngx_queue_remove(&p->queue);
 
-  u = ngx_pcalloc(cf->pool, sizeof(ngx_url_t));
-  if (u == NULL) {
-    return NULL;
-  }
+  while (!ngx_queue_empty(&p->waiters)) {
+    q = ngx_queue_head(&p->waiters);
+    ngx_queue_remove(q);
 
-  if (ngx_strncasecmp(url->data, (u_char *)"http://", 7) == 0) {
-    add = 7;
-  }
+    ctx = ngx_queue_data(q, ngx_rtmp_notify_ctx_t, cache_queue);
+    ctx->cache_pending = NULL;
 
-  u->url.len = url->len - add;
-  u->url.data = url->data + add;
-  u->default_port = 80;
-  u->uri_part = 1;
+    s = ctx->session;
 
-  if (ngx_parse_url(cf->pool, u) != NGX_OK) {
-    if (u->err) {
-      ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "%s in url \"%V\"", u->err,
-                         &u->url);
+    if (ngx_rtmp_notify_cache_resume(s, ctx, decision) != NGX_OK) {
+      ngx_rtmp_finalize_session(s);
     }
-    return NULL;
   }
 
-  return u;
+  ngx_free(p);
 }
 
-static char *ngx_rtmp_notify_on_srv_event(ngx_conf_t *cf, ngx_command_t *cmd,
-                                          void *conf) {
-  ngx_rtmp_notify_srv_conf_t *nscf = conf;
+static void ngx_rtmp_notify_cache_done(ngx_rtmp_session_t *s, ngx_chain_t *in,
+                                       ngx_uint_t decision) {
+  ngx_rtmp_notify_app_conf_t *nacf;
+  ngx_rtmp_notify_ctx_t *ctx;
+  ngx_rtmp_notify_cache_pending_t *p;
+  ngx_int_t status;
+  time_t valid;
 
-  ngx_str_t *name, *value;
-  ngx_url_t *u;
-  ngx_uint_t n;
+  ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_notify_module);
+  if (ctx == NULL || ctx->cache_pending == NULL) {
+    return;
+  }
 
-  value = cf->args->elts;
+  p = ctx->cache_pending;
+  ctx->cache_pending = NULL;
 
-  u = ngx_rtmp_notify_parse_url(cf, &value[1]);
-  if (u == NULL) {
-    return NGX_CONF_ERROR;
+  if (p->leader != s) {
+    return;
   }
 
-  name = &value[0];
+  nacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_notify_module);
 
-  n = 0;
+  /* only definite answers are cached: 2xx allow and 4xx deny */
 
-  switch (name->len) {
-    case sizeof("on_connect") - 1:
-      n = NGX_RTMP_NOTIFY_CONNECT;
-      break;
+  status = ngx_rtmp_notify_parse_http_status(s, in);
+  valid = 0;
 
-    case sizeof("on_disconnect") - 1:
-      n = NGX_RTMP_NOTIFY_DISCONNECT;
-      break;
+  if (decision == NGX_RTMP_NOTIFY_CACHE_ALLOW && status == 2) {
+    valid = ngx_rtmp_notify_cache_valid(s, in, nacf->cache_valid);
+
+  } else if (decision == NGX_RTMP_NOTIFY_CACHE_DENY && status == 4) {
+    valid = ngx_rtmp_notify_cache_valid(s, in, nacf->cache_negative_valid);
   }
 
-  nscf->url[n] = u;
+  if (valid > 0) {
+    ngx_log_debug2(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                   "notify: cache store '%V' for %T", &p->key, valid);
 
-  return NGX_CONF_OK;
+    ngx_rtmp_notify_cache_store(nacf, p, decision, valid);
+  }
+
+  ngx_rtmp_notify_cache_release(p, decision);
 }
 
-static char *ngx_rtmp_notify_on_app_event(ngx_conf_t *cf, ngx_command_t *cmd,
-                                          void *conf) {
-  ngx_rtmp_notify_app_conf_t *nacf = conf;
+static void ngx_rtmp_notify_cache_detach(ngx_rtmp_session_t *s,
+                                         ngx_rtmp_notify_ctx_t *ctx) {
+  ngx_rtmp_notify_cache_pending_t *p;
 
-  ngx_str_t *name, *value;
-  ngx_url_t *u;
-  ngx_uint_t n;
+  p = ctx->cache_pending;
+  if (p == NULL) {
+    return;
+  }
 
-  value = cf->args->elts;
+  ctx->cache_pending = NULL;
 
-  u = ngx_rtmp_notify_parse_url(cf, &value[1]);
-  if (u == NULL) {
-    return NGX_CONF_ERROR;
+  if (p->leader == s) {
+    ngx_rtmp_notify_cache_release(p, 0);
+    return;
   }
 
-  name = &value[0];
-
-  n = 0;
+  ngx_queue_remove(&ctx->cache_queue);
+}
 
-  switch (name->len) {
-    case sizeof("on_done") - 1: /* and on_play */
-      if (name->data[3] == 'd') {
-        n = NGX_RTMP_NOTIFY_DONE;
-      } else {
-        n = NGX_RTMP_NOTIFY_PLAY;
-      }
-      break;
+static void ngx_rtmp_notify_init(ngx_rtmp_session_t *s,
+                                 u_char name[NGX_RTMP_MAX_NAME],
+                                 u_char args[NGX_RTMP_MAX_ARGS],
+                                 ngx_uint_t flags) {
+  ngx_rtmp_notify_ctx_t *ctx;
+  ngx_rtmp_notify_app_conf_t *nacf;
+  ngx_event_t *e;
 
-    case sizeof("on_update") - 1:
-      n = NGX_RTMP_NOTIFY_UPDATE;
-      break;
-
-    case sizeof("on_publish") - 1:
-      n = NGX_RTMP_NOTIFY_PUBLISH;
-      break;
-
-    case sizeof("on_play_done") - 1:
-      n = NGX_RTMP_NOTIFY_PLAY_DONE;
-      break;
-
-    case sizeof("on_record_done") - 1:
-      n = NGX_RTMP_NOTIFY_RECORD_DONE;
-      break;
-
-    case sizeof("on_publish_done") - 1:
-      n = NGX_RTMP_NOTIFY_PUBLISH_DONE;
-      break;
+  nacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_notify_module);
+  if (!nacf->active) {
+    return;
   }
 
-  nacf->url[n] = u;
-
-  return NGX_CONF_OK;
-}
-
-static char *ngx_rtmp_notify_method(ngx_conf_t *cf, ngx_command_t *cmd,
-                                    void *conf) {
-  ngx_rtmp_notify_app_conf_t *nacf = conf;
-
-  ngx_rtmp_notify_srv_conf_t *nscf;
-  ngx_str_t *value;
-
-  value = cf->args->elts;
-  value++;
-
-  if (value->len == sizeof("get") - 1 &&
-      ngx_strncasecmp(value->data, (u_char *)"get", value->len) == 0) {
-    nacf->method = NGX_RTMP_NETCALL_HTTP_GET;
+  ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_notify_module);
 
-  } else if (value->len == sizeof("post") - 1 &&
-             ngx_strncasecmp(value->data, (u_char *)"post", value->len) == 0) {
-    nacf->method = NGX_RTMP_NETCALL_HTTP_POST;
+  if (ctx == NULL) {
+    ctx = ngx_pcalloc(s->connection->pool, sizeof(ngx_rtmp_notify_ctx_t));
+    if (ctx == NULL) {
+      return;
+    }
 
-  } else {
-    return "got unexpected method";
+    ngx_rtmp_set_ctx(s, ctx, ngx_rtmp_notify_module);
   }
 
-  nscf = ngx_rtmp_conf_get_module_srv_conf(cf, ngx_rtmp_notify_module);
-  nscf->method = nacf->method;
-
-  return NGX_CONF_OK;
-}
-
-static ngx_int_t ngx_rtmp_notify_postconfiguration(ngx_conf_t *cf) {
-  next_connect = ngx_rtmp_connect;
-  ngx_rtmp_connect = ngx_rtmp_notify_connect;
-
-  next_disconnect = ngx_rtmp_disconnect;
-  ngx_rtmp_disconnect = ngx_rtmp_notify_disconnect;
-
-  next_publish = ngx_rtmp_publish;
-  ngx_rtmp_publish = ngx_rtmp_notify_publish;
-
-  next_play = ngx_rtmp_play;
-  ngx_rtmp_play = ngx_rtmp_notify_play;
+  ctx->session = s;
 
-  next_close_stream = ngx_rtmp_close_stream;
-  ngx_rtmp_close_stream = ngx_rtmp_notify_close_stream;
-
-  next_record_done = ngx_rtmp_record_done;
-  ngx_rtmp_record_done = ngx_rtmp_notify_record_done;
+  ngx_memcpy(ctx->name, name, NGX_RTMP_MAX_NAME);
+  ngx_memcpy(ctx->args, args, NGX_RTMP_MAX_ARGS);
 
-  return NGX_OK;
-}
+  ctx->flags |= flags;
+  ctx->cnt = 0;
+  ctx->addrs_buffer = NULL;
+  ctx->v_play = NULL;
 
-//////////////////////Json parse//////////////////////
-
-#ifdef _MSC_VER
-#ifndef _CRT_SECURE_NO_WARNINGS
-#define _CRT_SECURE_NO_WARNINGS
-#endif
-#endif
-
-const struct _json_value json_value_none;
-
-#include <ctype.h>
-#include <math.h>
-#include <stdio.h>
-#include <string.h>
-
-typedef unsigned int json_uchar;
-
-static unsigned char hex_value(json_char c) {
-  if (isdigit(c)) return c - '0';
-
-  switch (c) {
-    case 'a':
-    case 'A':
-      return 0x0A;
-    case 'b':
-    case 'B':
-      return 0x0B;
-    case 'c':
-    case 'C':
-      return 0x0C;
-    case 'd':
-    case 'D':
-      return 0x0D;
-    case 'e':
-    case 'E':
-      return 0x0E;
-    case 'f':
-    case 'F':
-      return 0x0F;
-    default:
-      return 0xFF;
+  if (nacf->url[NGX_RTMP_NOTIFY_UPDATE] == NULL || nacf->update_timeout == 0) {
+    return;
   }
-}
 
-typedef struct {
-  unsigned long used_memory;
+  if (ctx->update_evt.timer_set) {
+    return;
+  }
 
-  unsigned int uint_max;
-  unsigned long ulong_max;
+  ctx->start = ngx_cached_time->sec;
 
-  json_settings settings;
-  int first_pass;
+  e = &ctx->update_evt;
 
-  const json_char *ptr;
-  unsigned int cur_line, cur_col;
+  e->data = s->connection;
+  e->log = s->connection->log;
+  e->handler = ngx_rtmp_notify_update;
 
-} json_state;
+  ngx_add_timer(e, nacf->update_timeout);
 
-static void *default_alloc(size_t size, int zero, void *user_data) {
-  return zero ? calloc(1, size) : malloc(size);
+  ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                 "notify: schedule initial update %Mms", nacf->update_timeout);
 }
 
-static void default_free(void *ptr, void *user_data) { free(ptr); }
-
-static void *json_alloc(json_state *state, unsigned long size, int zero) {
-  if ((state->ulong_max - state->used_memory) < size) return 0;
+static ngx_int_t ngx_rtmp_notify_connect(ngx_rtmp_session_t *s,
+                                         ngx_rtmp_connect_t *v) {
+  ngx_rtmp_notify_srv_conf_t *nscf;
+  ngx_rtmp_netcall_init_t ci;
+  ngx_url_t *url;
 
-  if (state->settings.max_memory &&
-      (state->used_memory += size) > state->settings.max_memory) {
-    return 0;
+  if (s->auto_pushed || s->relay) {
+    goto next;
   }
 
-  return state->settings.mem_alloc(size, zero, state->settings.user_data);
-}
-
-double pow(double base, double exponent) {
-  double ret = 1;
-  unsigned int i;
+  nscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_notify_module);
 
-  for (i = 0; i < exponent; ++i) {
-    ret *= base;
+  url = nscf->url[NGX_RTMP_NOTIFY_CONNECT];
+  if (url == NULL) {
+    goto next;
   }
 
-  return ret;
-}
-
-static int new_value(json_state *state, json_value **top, json_value **root,
-                     json_value **alloc, json_type type) {
-  json_value *value;
-  int values_size;
-
-  if (!state->first_pass) {
-    value = *top = *alloc;
-    *alloc = (*alloc)->_reserved.next_alloc;
-
-    if (!*root) *root = value;
+  ngx_log_error(NGX_LOG_INFO, s->connection->log, 0, "notify: connect '%V'",
+                &url->url);
 
-    switch (value->type) {
-      case json_array:
+  ngx_memzero(&ci, sizeof(ci));
 
-        if (value->u.array.length == 0) break;
+  ci.url = url;
+  ci.create = ngx_rtmp_notify_connect_create;
+  ci.handle = ngx_rtmp_notify_connect_handle;
+  ci.arg = v;
+  ci.argsize = sizeof(*v);
 
-        if (!(value->u.array.values = (json_value **)json_alloc(
-                  state, value->u.array.length * sizeof(json_value *), 0))) {
-          return 0;
-        }
+  return ngx_rtmp_netcall_create(s, &ci);
 
-        value->u.array.length = 0;
-        break;
+next:
+  return next_connect(s, v);
+}
 
-      case json_object:
+static ngx_int_t ngx_rtmp_notify_disconnect(ngx_rtmp_session_t *s) {
+  ngx_rtmp_notify_srv_conf_t *nscf;
+  ngx_rtmp_netcall_init_t ci;
+  ngx_url_t *url;
 
-        if (value->u.object.length == 0) break;
+  if (s->auto_pushed || s->relay) {
+    goto next;
+  }
 
-        values_size = sizeof(*value->u.object.values) * value->u.object.length;
+  nscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_notify_module);
 
-        if (!(value->u.object.values = (json_object_entry *)json_alloc(
-                  state, values_size + ((unsigned long)value->u.object.values),
-                  0))) {
-          return 0;
-        }
+  url = nscf->url[NGX_RTMP_NOTIFY_DISCONNECT];
+  if (url == NULL) {
+    goto next;
+  }
 
-        value->_reserved.object_mem =
-            (*(char **)&value->u.object.values) + values_size;
+  ngx_log_error(NGX_LOG_INFO, s->connection->log, 0, "notify: disconnect '%V'",
+                &url->url);
 
-        value->u.object.length = 0;
-        break;
+  ngx_memzero(&ci, sizeof(ci));
 
-      case json_string:
+  ci.url = url;
+  ci.create = ngx_rtmp_notify_disconnect_create;
 
-        if (!(value->u.string.ptr = (json_char *)json_alloc(
-                  state, (value->u.string.length + 1) * sizeof(json_char),
-                  0))) {
-          return 0;
-        }
+  ngx_rtmp_netcall_create(s, &ci);
 
-        value->u.string.length = 0;
-        break;
+next:
+  return next_disconnect(s);
+}
 
-      default:
-        break;
-    };
+static ngx_int_t ngx_rtmp_notify_publish(ngx_rtmp_session_t *s,
+                                         ngx_rtmp_publish_t *v) {
+  ngx_rtmp_notify_app_conf_t *nacf;
+  ngx_url_t *url;
+  ngx_int_t rc;
 
-    return 1;
+  if (s->auto_pushed) {
+    goto next;
   }
 
-  if (!(value = (json_value *)json_alloc(
-            state, sizeof(json_value) + state->settings.value_extra, 1))) {
-    return 0;
+  nacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_notify_module);
+  if (nacf == NULL) {
+    goto next;
   }
 
-  if (!*root) *root = value;
-
-  value->type = type;
-  value->parent = *top;
-
-#ifdef JSON_TRACK_SOURCE
-  value->line = state->cur_line;
-  value->col = state->cur_col;
-#endif
-
-  if (*alloc) (*alloc)->_reserved.next_alloc = value;
-
-  *alloc = *top = value;
+  url = nacf->url[NGX_RTMP_NOTIFY_PUBLISH];
 
-  return 1;
-}
+  ngx_rtmp_notify_init(s, v->name, v->args, NGX_RTMP_NOTIFY_PUBLISHING);
 
-#define whitespace     \
-  case '\n':           \
-    ++state.cur_line;  \
-    state.cur_col = 0; \
-  case ' ':            \
-  case '\t':           \
-  case '\r'
-
-#define string_add(b)                                 \
-  do {                                                \
-    if (!state.first_pass) string[string_length] = b; \
-    ++string_length;                                  \
-  } while (0);
-
-#define line_and_col state.cur_line, state.cur_col
-
-static const long flag_next = 1 << 0, flag_reproc = 1 << 1,
-                  flag_need_comma = 1 << 2, flag_seek_value = 1 << 3,
-                  flag_escaped = 1 << 4, flag_string = 1 << 5,
-                  flag_need_colon = 1 << 6, flag_done = 1 << 7,
-                  flag_num_negative = 1 << 8, flag_num_zero = 1 << 9,
-                  flag_num_e = 1 << 10, flag_num_e_got_sign = 1 << 11,
-                  flag_num_e_negative = 1 << 12, flag_line_comment = 1 << 13,
-                  flag_block_comment = 1 << 14;
-
-json_value *json_parse_ex(json_settings *settings, const json_char *json,
-                          size_t length, char *error_buf) {
-  json_char error[json_error_max];
-  const json_char *end;
-  json_value *top, *root, *alloc = 0;
-  //全部包装到state类
-  json_state state;
-  long flags;
-  long num_digits = 0, num_e = 0;
-  json_int_t num_fraction = 0;
-
-  ngx_memzero(&state, sizeof(json_state));
-  /* Skip UTF-8 BOM
-   */
-  if (length >= 3 && ((unsigned char)json[0]) == 0xEF &&
-      ((unsigned char)json[1]) == 0xBB && ((unsigned char)json[2]) == 0xBF) {
-    json += 3;
-    length -= 3;
+  if (url == NULL) {
+    goto next;
   }
-  //设置
-  error[0] = '\0';
-  end = (json + length);
-
-  memcpy(&state.settings, settings, sizeof(json_settings));
-
-  if (!state.settings.mem_alloc) state.settings.mem_alloc = default_alloc;
-
-  if (!state.settings.mem_free) state.settings.mem_free = default_free;
-
-  memset(&state.uint_max, 0xFF, sizeof(state.uint_max));
-  memset(&state.ulong_max, 0xFF, sizeof(state.ulong_max));
-
-  state.uint_max -= 8; /* limit of how much can be added before next check */
-  state.ulong_max -= 8;
-  //设置结束
-
-  //解析
-  for (state.first_pass = 1; state.first_pass >= 0; --state.first_pass) {
-    json_uchar uchar;
-    unsigned char uc_b1, uc_b2, uc_b3, uc_b4;
-    json_char *string = 0;
-    unsigned int string_length = 0;
-
-    top = root = 0;
-    flags = flag_seek_value;
-
-    state.cur_line = 1;
 
-    for (state.ptr = json;; ++state.ptr) {
-      json_char b = (state.ptr == end ? 0 : *state.ptr);
+  switch (ngx_rtmp_notify_cache_lookup(s, NGX_RTMP_NOTIFY_PUBLISH, v->name,
+                                       v->args, v, sizeof(*v))) {
+    case NGX_OK:
+      goto next;
 
-      if (flags & flag_string) {
-        if (!b) {
-          sprintf(error, "Unexpected EOF in string (at %d:%d)", line_and_col);
-          goto e_failed;
-        }
-
-        if (string_length > state.uint_max) goto e_overflow;
-
-        if (flags & flag_escaped) {
-          flags &= ~flag_escaped;
-
-          switch (b) {
-            case 'b':
-              string_add('\b');
-              break;
-            case 'f':
-              string_add('\f');
-              break;
-            case 'n':
-              string_add('\n');
-              break;
-            case 'r':
-              string_add('\r');
-              break;
-            case 't':
-              string_add('\t');
-              break;
-            case 'u':
-
-              if (end - state.ptr <= 4 ||
-                  (uc_b1 = hex_value(*++state.ptr)) == 0xFF ||
-                  (uc_b2 = hex_value(*++state.ptr)) == 0xFF ||
-                  (uc_b3 = hex_value(*++state.ptr)) == 0xFF ||
-                  (uc_b4 = hex_value(*++state.ptr)) == 0xFF) {
-                sprintf(error, "Invalid character value `%c` (at %d:%d)", b,
-                        line_and_col);
-                goto e_failed;
-              }
-
-              uc_b1 = (uc_b1 << 4) | uc_b2;
-              uc_b2 = (uc_b3 << 4) | uc_b4;
-              uchar = (uc_b1 << 8) | uc_b2;
-
-              if ((uchar & 0xF800) == 0xD800) {
-                json_uchar uchar2;
-
-                if (end - state.ptr <= 6 || (*++state.ptr) != '\\' ||
-                    (*++state.ptr) != 'u' ||
-                    (uc_b1 = hex_value(*++state.ptr)) == 0xFF ||
-                    (uc_b2 = hex_value(*++state.ptr)) == 0xFF ||
-                    (uc_b3 = hex_value(*++state.ptr)) == 0xFF ||
-                    (uc_b4 = hex_value(*++state.ptr)) == 0xFF) {
-                  sprintf(error, "Invalid character value `%c` (at %d:%d)", b,
-                          line_and_col);
-                  goto e_failed;
-                }
-
-                uc_b1 = (uc_b1 << 4) | uc_b2;
-                uc_b2 = (uc_b3 << 4) | uc_b4;
-                uchar2 = (uc_b1 << 8) | uc_b2;
-
-                uchar = 0x010000 | ((uchar & 0x3FF) << 10) | (uchar2 & 0x3FF);
-              }
-
-              if (sizeof(json_char) >= sizeof(json_uchar) || (uchar <= 0x7F)) {
-                string_add((json_char)uchar);
-                break;
-              }
-
-              if (uchar <= 0x7FF) {
-                if (state.first_pass)
-                  string_length += 2;
-                else {
-                  string[string_length++] = 0xC0 | (uchar >> 6);
-                  string[string_length++] = 0x80 | (uchar & 0x3F);
-                }
-
-                break;
-              }
-
-              if (uchar <= 0xFFFF) {
-                if (state.first_pass)
-                  string_length += 3;
-                else {
-                  string[string_length++] = 0xE0 | (uchar >> 12);
-                  string[string_length++] = 0x80 | ((uchar >> 6) & 0x3F);
-                  string[string_length++] = 0x80 | (uchar & 0x3F);
-                }
-
-                break;
-              }
-
-              if (state.first_pass)
-                string_length += 4;
-              else {
-                string[string_length++] = 0xF0 | (uchar >> 18);
-                string[string_length++] = 0x80 | ((uchar >> 12) & 0x3F);
-                string[string_length++] = 0x80 | ((uchar >> 6) & 0x3F);
-                string[string_length++] = 0x80 | (uchar & 0x3F);
-              }
-
-              break;
-
-            default:
-              string_add(b);
-          };
-
-          continue;
-        }
-
-        if (b == '\\') {
-          flags |= flag_escaped;
-          continue;
-        }
-
-        if (b == '"') {
-          if (!state.first_pass) string[string_length] = 0;
-
-          flags &= ~flag_string;
-          string = 0;
-
-          switch (top->type) {
-            case json_string:
-
-              top->u.string.length = string_length;
-              flags |= flag_next;
-
-              break;
-
-            case json_object:
-
-              if (state.first_pass)
-                (*(json_char **)&top->u.object.values) += string_length + 1;
-              else {
-                top->u.object.values[top->u.object.length].name =
-                    (json_char *)top->_reserved.object_mem;
-
-                top->u.object.values[top->u.object.length].name_length =
-                    string_length;
-
-                (*(json_char **)&top->_reserved.object_mem) +=
-                    string_length + 1;
-              }
-
-              flags |= flag_seek_value | flag_need_colon;
-              continue;
-
-            default:
-              break;
-          };
-        } else {
-          string_add(b);
-          continue;
-        }
-      }
-
-      if (state.settings.settings & json_enable_comments) {
-        if (flags & (flag_line_comment | flag_block_comment)) {
-          if (flags & flag_line_comment) {
-            if (b == '\r' || b == '\n' || !b) {
-              flags &= ~flag_line_comment;
-              --state.ptr; /* so null can be reproc'd */
-            }
-
-            continue;
-          }
-
-          if (flags & flag_block_comment) {
-            if (!b) {
-              sprintf(error, "%d:%d: Unexpected EOF in block comment",
-                      line_and_col);
-              goto e_failed;
-            }
-
-            if (b == '*' && state.ptr < (end - 1) && state.ptr[1] == '/') {
-              flags &= ~flag_block_comment;
-              ++state.ptr; /* skip closing sequence */
-            }
-
-            continue;
-          }
-        } else if (b == '/') {
-          if (!(flags & (flag_seek_value | flag_done)) &&
-              top->type != json_object) {
-            sprintf(error, "%d:%d: Comment not allowed here", line_and_col);
-            goto e_failed;
-          }
-
-          if (++state.ptr == end) {
-            sprintf(error, "%d:%d: EOF unexpected", line_and_col);
-            goto e_failed;
-          }
-
-          switch (b = *state.ptr) {
-            case '/':
-              flags |= flag_line_comment;
-              continue;
-
-            case '*':
-              flags |= flag_block_comment;
-              continue;
-
-            default:
-              sprintf(error,
-                      "%d:%d: Unexpected `%c` in comment opening sequence",
-                      line_and_col, b);
-              goto e_failed;
-          };
-        }
-      }
-
-      if (flags & flag_done) {
-        if (!b) break;
-
-        switch (b) {
-        whitespace:
-          continue;
-
-          default:
-
-            sprintf(error, "%d:%d: Trailing garbage: `%c`", state.cur_line,
-                    state.cur_col, b);
-
-            goto e_failed;
-        };
-      }
-
-      if (flags & flag_seek_value) {
-        switch (b) {
-        whitespace:
-          continue;
-
-          case ']':
-
-            if (top && top->type == json_array)
-              flags =
-                  (flags & ~(flag_need_comma | flag_seek_value)) | flag_next;
-            else {
-              sprintf(error, "%d:%d: Unexpected ]", line_and_col);
-              goto e_failed;
-            }
-
-            break;
-
-          default:
-
-            if (flags & flag_need_comma) {
-              if (b == ',') {
-                flags &= ~flag_need_comma;
-                continue;
-              } else {
-                sprintf(error, "%d:%d: Expected , before %c", state.cur_line,
-                        state.cur_col, b);
-
-                goto e_failed;
-              }
-            }
-
-            if (flags & flag_need_colon) {
-              if (b == ':') {
-                flags &= ~flag_need_colon;
-                continue;
-              } else {
-                sprintf(error, "%d:%d: Expected : before %c", state.cur_line,
-                        state.cur_col, b);
-
-                goto e_failed;
-              }
-            }
-
-            flags &= ~flag_seek_value;
-
-            switch (b) {
-              case '{':
-
-                if (!new_value(&state, &top, &root, &alloc, json_object))
-                  goto e_alloc_failure;
+    case NGX_DECLINED:
+      ngx_rtmp_notify_clear_flag(s, NGX_RTMP_NOTIFY_PUBLISHING);
+      return NGX_ERROR;
 
-                continue;
+    case NGX_AGAIN:
+      return NGX_OK;
+  }
 
-              case '[':
+  rc = ngx_rtmp_notify_publish_netcall(s, v);
+  if (rc != NGX_OK) {
+    ngx_rtmp_notify_cache_done(s, NULL, 0);
+  }
 
-                if (!new_value(&state, &top, &root, &alloc, json_array))
-                  goto e_alloc_failure;
+  return rc;
 
-                flags |= flag_seek_value;
-                continue;
+next:
+  return next_publish(s, v);
+}
 
-              case '"':
+static ngx_int_t ngx_rtmp_notify_play(ngx_rtmp_session_t *s,
+                                      ngx_rtmp_play_t *v) {
+  ngx_rtmp_notify_app_conf_t *nacf;
+  ngx_url_t *url;
+  ngx_int_t rc;
 
-                if (!new_value(&state, &top, &root, &alloc, json_string))
-                  goto e_alloc_failure;
+  if (s->auto_pushed || v->silent) {
+    goto next;
+  }
 
-                flags |= flag_string;
+  nacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_notify_module);
+  if (nacf == NULL) {
+    goto next;
+  }
 
-                string = top->u.string.ptr;
-                string_length = 0;
+  url = nacf->url[NGX_RTMP_NOTIFY_PLAY];
 
-                continue;
+  ngx_rtmp_notify_init(s, v->name, v->args, NGX_RTMP_NOTIFY_PLAYING);
 
-              case 't':
+  if (url == NULL) {
+    goto next;
+  }
 
-                if ((end - state.ptr) < 3 || *(++state.ptr) != 'r' ||
-                    *(++state.ptr) != 'u' || *(++state.ptr) != 'e') {
-                  goto e_unknown_value;
-                }
+  switch (ngx_rtmp_notify_cache_lookup(s, NGX_RTMP_NOTIFY_PLAY, v->name,
+                                       v->args, v, sizeof(*v))) {
+    case NGX_OK:
+      goto next;
 
-                if (!new_value(&state, &top, &root, &alloc, json_boolean))
-                  goto e_alloc_failure;
+    case NGX_DECLINED:
+      ngx_rtmp_notify_clear_flag(s, NGX_RTMP_NOTIFY_PLAYING);
+      return NGX_ERROR;
 
-                top->u.boolean = 1;
+    case NGX_AGAIN:
+      return NGX_OK;
+  }
 
-                flags |= flag_next;
-                break;
+  rc = ngx_rtmp_notify_play_netcall(s, v);
+  if (rc != NGX_OK) {
+    ngx_rtmp_notify_cache_done(s, NULL, 0);
+  }
 
-              case 'f':
+  return rc;
 
-                if ((end - state.ptr) < 4 || *(++state.ptr) != 'a' ||
-                    *(++state.ptr) != 'l' || *(++state.ptr) != 's' ||
-                    *(++state.ptr) != 'e') {
-                  goto e_unknown_value;
-                }
+next:
+  return next_play(s, v);
+}
 
-                if (!new_value(&state, &top, &root, &alloc, json_boolean))
-                  goto e_alloc_failure;
+static ngx_int_t ngx_rtmp_notify_close_stream(ngx_rtmp_session_t *s,
+                                              ngx_rtmp_close_stream_t *v) {
+  ngx_rtmp_notify_ctx_t *ctx;
+  ngx_rtmp_notify_app_conf_t *nacf;
 
-                flags |= flag_next;
-                break;
+  if (s->auto_pushed) {
+    goto next;
+  }
 
-              case 'n':
+  ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_notify_module);
 
-                if ((end - state.ptr) < 3 || *(++state.ptr) != 'u' ||
-                    *(++state.ptr) != 'l' || *(++state.ptr) != 'l') {
-                  goto e_unknown_value;
-                }
+  if (ctx == NULL) {
+    goto next;
+  }
 
-                if (!new_value(&state, &top, &root, &alloc, json_null))
-                  goto e_alloc_failure;
+  nacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_notify_module);
 
-                flags |= flag_next;
-                break;
+  if (nacf == NULL) {
+    goto next;
+  }
 
-              default:
-
-                if (isdigit(b) || b == '-') {
-                  if (!new_value(&state, &top, &root, &alloc, json_integer))
-                    goto e_alloc_failure;
-
-                  if (!state.first_pass) {
-                    while (isdigit(b) || b == '+' || b == '-' || b == 'e' ||
-                           b == 'E' || b == '.') {
-                      if ((++state.ptr) == end) {
-                        b = 0;
-                        break;
-                      }
-
-                      b = *state.ptr;
-                    }
-
-                    flags |= flag_next | flag_reproc;
-                    break;
-                  }
-
-                  flags &=
-                      ~(flag_num_negative | flag_num_e | flag_num_e_got_sign |
-                        flag_num_e_negative | flag_num_zero);
-
-                  num_digits = 0;
-                  num_fraction = 0;
-                  num_e = 0;
-
-                  if (b != '-') {
-                    flags |= flag_reproc;
-                    break;
-                  }
-
-                  flags |= flag_num_negative;
-                  continue;
-                } else {
-                  sprintf(error, "%d:%d: Unexpected %c when seeking value",
-                          line_and_col, b);
-                  goto e_failed;
-                }
-            };
-        };
-      } else {
-        switch (top->type) {
-          case json_object:
+  ngx_rtmp_notify_cache_detach(s, ctx);
 
-            switch (b) {
-            whitespace:
-              continue;
+  if (ctx->flags & NGX_RTMP_NOTIFY_PUBLISHING) {
+    ngx_rtmp_notify_done(s, "publish_done", NGX_RTMP_NOTIFY_PUBLISH_DONE);
+  }
 
-              case '"':
+  if (ctx->flags & NGX_RTMP_NOTIFY_PLAYING) {
+    ngx_rtmp_notify_done(s, "play_done", NGX_RTMP_NOTIFY_PLAY_DONE);
+  }
 
-                if (flags & flag_need_comma) {
-                  sprintf(error, "%d:%d: Expected , before \"", line_and_col);
-                  goto e_failed;
-                }
+  if (ctx->flags) {
+    ngx_rtmp_notify_done(s, "done", NGX_RTMP_NOTIFY_DONE);
+  }
 
-                flags |= flag_string;
+  if (ctx->update_evt.timer_set) {
+    ngx_del_timer(&ctx->update_evt);
+  }
 
-                string = (json_char *)top->_reserved.object_mem;
-                string_length = 0;
+  ctx->flags = 0;
 
-                break;
+next:
+  return next_close_stream(s, v);
+}
 
-              case '}':
+static ngx_int_t ngx_rtmp_notify_record_done(ngx_rtmp_session_t *s,
+                                             ngx_rtmp_record_done_t *v) {
+  ngx_rtmp_netcall_init_t ci;
+  ngx_rtmp_notify_app_conf_t *nacf;
 
-                flags = (flags & ~flag_need_comma) | flag_next;
-                break;
+  if (s->auto_pushed) {
+    goto next;
+  }
 
-              case ',':
+  nacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_notify_module);
+  if (nacf == NULL || nacf->url[NGX_RTMP_NOTIFY_RECORD_DONE] == NULL) {
+    goto next;
+  }
 
-                if (flags & flag_need_comma) {
-                  flags &= ~flag_need_comma;
-                  break;
-                }
+  ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
+                "notify: record_done recorder=%V path='%V' url='%V'",
+                &v->recorder, &v->path,
+                &nacf->url[NGX_RTMP_NOTIFY_RECORD_DONE]->url);
 
-              default:
-                sprintf(error, "%d:%d: Unexpected `%c` in object", line_and_col,
-                        b);
-                goto e_failed;
-            };
+  ngx_memzero(&ci, sizeof(ci));
 
-            break;
+  ci.url = nacf->url[NGX_RTMP_NOTIFY_RECORD_DONE];
+  ci.create = ngx_rtmp_notify_record_done_create;
+  ci.arg = v;
 
-          case json_integer:
-          case json_double:
-
-            if (isdigit(b)) {
-              ++num_digits;
-
-              if (top->type == json_integer || flags & flag_num_e) {
-                if (!(flags & flag_num_e)) {
-                  if (flags & flag_num_zero) {
-                    sprintf(error, "%d:%d: Unexpected `0` before `%c`",
-                            line_and_col, b);
-                    goto e_failed;
-                  }
-
-                  if (num_digits == 1 && b == '0') flags |= flag_num_zero;
-                } else {
-                  flags |= flag_num_e_got_sign;
-                  num_e = (num_e * 10) + (b - '0');
-                  continue;
-                }
+  ngx_rtmp_netcall_create(s, &ci);
 
-                top->u.integer = (top->u.integer * 10) + (b - '0');
-                continue;
-              }
+next:
+  return next_record_done(s, v);
+}
 
-              num_fraction = (num_fraction * 10) + (b - '0');
-              continue;
-            }
+static ngx_int_t ngx_rtmp_notify_done(ngx_rtmp_session_t *s, char *cbname,
+                                      ngx_uint_t url_idx) {
+  ngx_rtmp_netcall_init_t ci;
+  ngx_rtmp_notify_done_t ds;
+  ngx_rtmp_notify_app_conf_t *nacf;
+  ngx_url_t *url;
 
-            if (b == '+' || b == '-') {
-              if ((flags & flag_num_e) && !(flags & flag_num_e_got_sign)) {
-                flags |= flag_num_e_got_sign;
+  nacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_notify_module);
 
-                if (b == '-') flags |= flag_num_e_negative;
+  url = nacf->url[url_idx];
+  if (url == NULL) {
+    return NGX_OK;
+  }
 
-                continue;
-              }
-            } else if (b == '.' && top->type == json_integer) {
-              if (!num_digits) {
-                sprintf(error, "%d:%d: Expected digit before `.`",
-                        line_and_col);
-                goto e_failed;
-              }
+  ngx_log_error(NGX_LOG_INFO, s->connection->log, 0, "notify: %s '%V'", cbname,
+                &url->url);
 
-              top->type = json_double;
-              top->u.dbl = (double)top->u.integer;
+  ds.cbname = (u_char *)cbname;
+  ds.url_idx = url_idx;
 
-              num_digits = 0;
-              continue;
-            }
+  ngx_memzero(&ci, sizeof(ci));
 
-            if (!(flags & flag_num_e)) {
-              if (top->type == json_double) {
-                if (!num_digits) {
-                  sprintf(error, "%d:%d: Expected digit after `.`",
-                          line_and_col);
-                  goto e_failed;
-                }
+  ci.url = url;
+  ci.arg = &ds;
+  ci.create = ngx_rtmp_notify_done_create;
 
-                top->u.dbl +=
-                    ((double)num_fraction) / (pow(10.0, (double)num_digits));
-              }
+  return ngx_rtmp_netcall_create(s, &ci);
+}
 
-              if (b == 'e' || b == 'E') {
-                flags |= flag_num_e;
+static ngx_url_t *ngx_rtmp_notify_parse_url(ngx_conf_t *cf, ngx_str_t *url) {
+  ngx_url_t *u;
+  size_t add;
 
-                if (top->type == json_integer) {
-                  top->type = json_double;
-                  top->u.dbl = (double)top->u.integer;
-                }
+  add = 0;
 
-                num_digits = 0;
-                flags &= ~flag_num_zero;
+  u = ngx_pcalloc(cf->pool, sizeof(ngx_url_t));
+  if (u == NULL) {
+    return NULL;
+  }
 
-                continue;
-              }
-            } else {
-              if (!num_digits) {
-                sprintf(error, "%d:%d: Expected digit after `e`", line_and_col);
-                goto e_failed;
-              }
+  if (ngx_strncasecmp(url->data, (u_char *)"http://", 7) == 0) {
+    add = 7;
+  }
 
-              top->u.dbl *= pow(
-                  10.0, (double)(flags & flag_num_e_negative ? -num_e : num_e));
-            }
+  u->url.len = url->len - add;
+  u->url.data = url->data + add;
+  u->default_port = 80;
+  u->uri_part = 1;
 
-            if (flags & flag_num_negative) {
-              if (top->type == json_integer)
-                top->u.integer = -top->u.integer;
-              else
-                top->u.dbl = -top->u.dbl;
-            }
+  if (ngx_parse_url(cf->pool, u) != NGX_OK) {
+    if (u->err) {
+      ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "%s in url \"%V\"", u->err,
+                         &u->url);
+    }
+    return NULL;
+  }
 
-            flags |= flag_next | flag_reproc;
-            break;
+  return u;
+}
 
-          default:
-            break;
-        };
-      }
+static char *ngx_rtmp_notify_on_srv_event(ngx_conf_t *cf, ngx_command_t *cmd,
+                                          void *conf) {
+  ngx_rtmp_notify_srv_conf_t *nscf = conf;
 
-      if (flags & flag_reproc) {
-        flags &= ~flag_reproc;
-        --state.ptr;
-      }
+  ngx_str_t *name, *value;
+  ngx_url_t *u;
+  ngx_uint_t n;
 
-      if (flags & flag_next) {
-        flags = (flags & ~flag_next) | flag_need_comma;
+  value = cf->args->elts;
 
-        if (!top->parent) {
-          /* root value done */
+  u = ngx_rtmp_notify_parse_url(cf, &value[1]);
+  if (u == NULL) {
+    return NGX_CONF_ERROR;
+  }
 
-          flags |= flag_done;
-          continue;
-        }
+  name = &value[0];
 
-        if (top->parent->type == json_array) flags |= flag_seek_value;
+  n = 0;
 
-        if (!state.first_pass) {
-          json_value *parent = top->parent;
+  switch (name->len) {
+    case sizeof("on_connect") - 1:
+      n = NGX_RTMP_NOTIFY_CONNECT;
+      break;
 
-          switch (parent->type) {
-            case json_object:
+    case sizeof("on_disconnect") - 1:
+      n = NGX_RTMP_NOTIFY_DISCONNECT;
+      break;
+  }
 
-              parent->u.object.values[parent->u.object.length].value = top;
+  nscf->url[n] = u;
 
-              break;
+  return NGX_CONF_OK;
+}
 
-            case json_array:
+static char *ngx_rtmp_notify_on_app_event(ngx_conf_t *cf, ngx_command_t *cmd,
+                                          void *conf) {
+  ngx_rtmp_notify_app_conf_t *nacf = conf;
 
-              parent->u.array.values[parent->u.array.length] = top;
+  ngx_str_t *name, *value;
+  ngx_url_t *u;
+  ngx_uint_t n;
 
-              break;
+  value = cf->args->elts;
 
-            default:
-              break;
-          };
-        }
+  u = ngx_rtmp_notify_parse_url(cf, &value[1]);
+  if (u == NULL) {
+    return NGX_CONF_ERROR;
+  }
 
-        if ((++top->parent->u.array.length) > state.uint_max) goto e_overflow;
+  name = &value[0];
 
-        top = top->parent;
+  n = 0;
 
-        continue;
+  switch (name->len) {
+    case sizeof("on_done") - 1: /* and on_play */
+      if (name->data[3] == 'd') {
+        n = NGX_RTMP_NOTIFY_DONE;
+      } else {
+        n = NGX_RTMP_NOTIFY_PLAY;
       }
-    }
+      break;
 
-    alloc = root;
-  }
+    case sizeof("on_update") - 1:
+      n = NGX_RTMP_NOTIFY_UPDATE;
+      break;
+
+    case sizeof("on_publish") - 1:
+      n = NGX_RTMP_NOTIFY_PUBLISH;
+      break;
 
-  return root;
+    case sizeof("on_play_done") - 1:
+      n = NGX_RTMP_NOTIFY_PLAY_DONE;
+      break;
 
-e_unknown_value:
+    case sizeof("on_record_done") - 1:
+      n = NGX_RTMP_NOTIFY_RECORD_DONE;
+      break;
 
-  sprintf(error, "%d:%d: Unknown value", line_and_col);
-  goto e_failed;
+    case sizeof("on_publish_done") - 1:
+      n = NGX_RTMP_NOTIFY_PUBLISH_DONE;
+      break;
+  }
 
-e_alloc_failure:
+  nacf->url[n] = u;
 
-  strcpy(error, "Memory allocation failure");
-  goto e_failed;
+  return NGX_CONF_OK;
+}
 
-e_overflow:
+static char *ngx_rtmp_notify_method(ngx_conf_t *cf, ngx_command_t *cmd,
+                                    void *conf) {
+  ngx_rtmp_notify_app_conf_t *nacf = conf;
 
-  sprintf(error, "%d:%d: Too long (caught overflow)", line_and_col);
-  goto e_failed;
+  ngx_rtmp_notify_srv_conf_t *nscf;
+  ngx_str_t *value;
 
-e_failed:
+  value = cf->args->elts;
+  value++;
 
-  if (error_buf) {
-    if (*error)
-      strcpy(error_buf, error);
-    else
-      strcpy(error_buf, "Unknown error");
-  }
+  if (value->len == sizeof("get") - 1 &&
+      ngx_strncasecmp(value->data, (u_char *)"get", value->len) == 0) {
+    nacf->method = NGX_RTMP_NETCALL_HTTP_GET;
 
-  if (state.first_pass) alloc = root;
+  } else if (value->len == sizeof("post") - 1 &&
+             ngx_strncasecmp(value->data, (u_char *)"post", value->len) == 0) {
+    nacf->method = NGX_RTMP_NETCALL_HTTP_POST;
 
-  while (alloc) {
-    top = alloc->_reserved.next_alloc;
-    state.settings.mem_free(alloc, state.settings.user_data);
-    alloc = top;
+  } else {
+    return "got unexpected method";
   }
 
-  if (!state.first_pass) json_value_free_ex(&state.settings, root);
+  nscf = ngx_rtmp_conf_get_module_srv_conf(cf, ngx_rtmp_notify_module);
+  nscf->method = nacf->method;
 
-  return 0;
+  return NGX_CONF_OK;
 }
 
-// length 为大小
-json_value *json_parse(const json_char *json, size_t length) {
-  json_settings settings;
-  ngx_memzero(&settings, sizeof(json_settings));
-  return json_parse_ex(&settings, json, length, 0);
-}
+static ngx_int_t ngx_rtmp_notify_cache_init_zone(ngx_shm_zone_t *shm_zone,
+                                                 void *data) {
+  ngx_rtmp_notify_cache_t *ocache = data;
 
-void json_value_free_ex(json_settings *settings, json_value *value) {
-  json_value *cur_value;
+  ngx_rtmp_notify_cache_t *cache;
 
-  if (!value) return;
+  cache = shm_zone->data;
 
-  value->parent = 0;
-  while (value) {
-    switch (value->type) {
-      case json_array:
+  if (ocache) {
+    cache->sh = ocache->sh;
+    cache->shpool = ocache->shpool;
+    return NGX_OK;
+  }
 
-        if (!value->u.array.length) {
-          settings->mem_free(value->u.array.values, settings->user_data);
-          break;
-        }
+  cache->shpool = (ngx_slab_pool_t *)shm_zone->shm.addr;
 
-        value = value->u.array.values[--value->u.array.length];
-        continue;
+  if (shm_zone->shm.exists) {
+    cache->sh = cache->shpool->data;
+    return NGX_OK;
+  }
 
-      case json_object:
+  cache->sh = ngx_slab_alloc(cache->shpool, sizeof(ngx_rtmp_notify_cache_sh_t));
+  if (cache->sh == NULL) {
+    return NGX_ERROR;
+  }
 
-        if (!value->u.object.length) {
-          settings->mem_free(value->u.object.values, settings->user_data);
-          break;
-        }
+  cache->shpool->data = cache->sh;
 
-        value = value->u.object.values[--value->u.object.length].value;
-        continue;
+  ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel,
+                  ngx_str_rbtree_insert_value);
+  ngx_queue_init(&cache->sh->queue);
 
-      case json_string:
+  return NGX_OK;
+}
 
-        settings->mem_free(value->u.string.ptr, settings->user_data);
-        break;
+static char *ngx_rtmp_notify_cache_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+                                        void *conf) {
+  ngx_rtmp_notify_app_conf_t *nacf = conf;
 
-      default:
-        break;
-    };
+  ngx_rtmp_notify_cache_t *cache;
+  ngx_str_t *value, name, size;
+  ssize_t n;
+  u_char *p;
 
-    cur_value = value;
-    value = value->parent;
-    settings->mem_free(cur_value, settings->user_data);
+  if (nacf->cache_zone != NGX_CONF_UNSET_PTR) {
+    return "is duplicate";
   }
-}
 
-void json_value_free(json_value *value) {
-  json_settings settings;
-  ngx_memzero(&settings, sizeof(json_settings));
-  settings.mem_free = default_free;
-  json_value_free_ex(&settings, value);
-}
+  value = cf->args->elts;
 
-json_value *ngx_find_json_name(json_value *root, ngx_str_t *target) {
-  if (root == NULL || target == NULL) return NULL;
-  switch (root->type) {
-    case json_object:
-      return ngx_find_json_name_in_object(root, target);
-    case json_array:
-      return ngx_find_json_name_in_array(root, target);
-    default:
-      return NULL;
+  if (ngx_strcmp(value[1].data, "off") == 0) {
+    nacf->cache_zone = NULL;
+    return NGX_CONF_OK;
   }
-  return NULL;
-}
 
-json_value *ngx_find_json_name_in_object(json_value *root, ngx_str_t *target) {
-  int length, i;
-  json_object_entry temp;
-  json_value *ret;
-  if (root == NULL || target == NULL || root->type != json_object) return NULL;
+  p = ngx_strlchr(value[1].data, value[1].data + value[1].len, ':');
+  if (p == NULL || p == value[1].data) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid zone \"%V\"",
+                       &value[1]);
+    return NGX_CONF_ERROR;
+  }
 
-  length = root->u.object.length;
-  // root->u.object.values[x].name||value;
+  name.data = value[1].data;
+  name.len = p - value[1].data;
 
-  for (i = 0; i < length; ++i) {
-    temp = root->u.object.values[i];
-    if (ngx_strncasecmp((u_char *)temp.name, target->data, target->len) == 0) {
-      return temp.value;
-    }
+  size.data = p + 1;
+  size.len = value[1].data + value[1].len - size.data;
 
-    switch (temp.value->type) {
-      case json_object:
-        ret = ngx_find_json_name_in_object(temp.value, target);
-        if (ret != NULL) return ret;
-        break;
-      case json_array:
-        ret = ngx_find_json_name_in_array(temp.value, target);
-        if (ret != NULL) return ret;
-        break;
-      default:
-        break;
-    }
+  n = ngx_parse_size(&size);
+  if (n == NGX_ERROR || n < (ssize_t)(8 * ngx_pagesize)) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid zone size \"%V\"",
+                       &value[1]);
+    return NGX_CONF_ERROR;
   }
 
-  return NULL;
-}
+  nacf->cache_zone =
+      ngx_shared_memory_add(cf, &name, n, &ngx_rtmp_notify_module);
+  if (nacf->cache_zone == NULL) {
+    return NGX_CONF_ERROR;
+  }
 
-json_value *ngx_find_json_name_in_array(json_value *root, ngx_str_t *target) {
-  int length, i;
-  struct _json_value *temp;
-  json_value *ret;
-  if (root == NULL || target == NULL || root->type != json_array) return NULL;
+  if (nacf->cache_zone->data) {
+    /* same zone shared by several applications */
+    return NGX_CONF_OK;
+  }
 
-  length = root->u.array.length;
+  cache = ngx_pcalloc(cf->pool, sizeof(ngx_rtmp_notify_cache_t));
+  if (cache == NULL) {
+    return NGX_CONF_ERROR;
+  }
 
-  for (i = 0; i < length; ++i) {
-    temp = root->u.array.values[i];
-    if (temp->type != json_object) continue;
+  nacf->cache_zone->init = ngx_rtmp_notify_cache_init_zone;
+  nacf->cache_zone->data = cache;
 
-    ret = ngx_find_json_name_in_object(temp, target);
-    if (ret != NULL) return ret;
-  }
-  return NULL;
+  return NGX_CONF_OK;
 }
 
-void ngx_match_json_name(json_value *root, ngx_str_t *target, ngx_pool_t *pool,
-                         ngx_array_t *arr) {
-  if (root == NULL || target == NULL || pool == NULL || arr == NULL) return;
+static ngx_int_t ngx_rtmp_notify_close_session(ngx_rtmp_session_t *s,
+                                               ngx_rtmp_header_t *h,
+                                               ngx_chain_t *in) {
+  ngx_rtmp_notify_ctx_t *ctx;
 
-  switch (root->type) {
-    case json_object:
-      ngx_match_json_name_in_object(root, target, pool, arr);
-    case json_array:
-      ngx_match_json_name_in_array(root, target, pool, arr);
-    default:
-      return;
+  ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_notify_module);
+  if (ctx) {
+    ngx_rtmp_notify_pull_leave(s, ctx, 0);
   }
+
+  return NGX_OK;
 }
 
-void ngx_match_json_name_in_object(json_value *root, ngx_str_t *target,
-                                   ngx_pool_t *pool, ngx_array_t *arr) {
-  int length, i;
-  json_object_entry temp;
-  json_value *to_copy;
-  ngx_str_t *string;
-  if (root == NULL || target == NULL || pool == NULL || arr == NULL ||
-      root->type != json_object)
-    return;
+static ngx_int_t ngx_rtmp_notify_postconfiguration(ngx_conf_t *cf) {
+  ngx_rtmp_core_main_conf_t *cmcf;
+  ngx_rtmp_handler_pt *h;
 
-  length = root->u.object.length;
-  // root->u.object.values[x].name||value;
+  cmcf = ngx_rtmp_conf_get_module_main_conf(cf, ngx_rtmp_core_module);
 
-  for (i = 0; i < length; ++i) {
-    temp = root->u.object.values[i];
-    if (ngx_strncasecmp((u_char *)temp.name, target->data, target->len) == 0 &&
-        temp.value->type == json_string && temp.value->u.string.length >= 7) {
-      to_copy = temp.value;
-      string = ngx_array_push(arr);
-      string->len = to_copy->u.string.length;
-      string->data = ngx_pcalloc(pool, to_copy->u.string.length);
+  h = ngx_array_push(&cmcf->events[NGX_RTMP_DISCONNECT]);
+  *h = ngx_rtmp_notify_close_session;
 
-      ngx_memcpy(string->data, to_copy->u.string.ptr, to_copy->u.string.length);
-      continue;
-    }
+  ngx_queue_init(&ngx_rtmp_notify_cache_pending);
+  ngx_queue_init(&ngx_rtmp_notify_pulls);
 
-    switch (temp.value->type) {
-      case json_object:
-        ngx_match_json_name_in_object(temp.value, target, pool, arr);
-        break;
-      case json_array:
-        ngx_match_json_name_in_array(temp.value, target, pool, arr);
-      default:
-        break;
-    }
-  }
-}
+  next_connect = ngx_rtmp_connect;
+  ngx_rtmp_connect = ngx_rtmp_notify_connect;
 
-void ngx_match_json_name_in_array(json_value *root, ngx_str_t *target,
-                                  ngx_pool_t *pool, ngx_array_t *arr) {
-  int length, i;
-  struct _json_value *temp;
-  if (root == NULL || target == NULL || pool == NULL || arr == NULL ||
-      root->type != json_array)
-    return;
+  next_disconnect = ngx_rtmp_disconnect;
+  ngx_rtmp_disconnect = ngx_rtmp_notify_disconnect;
+
+  next_publish = ngx_rtmp_publish;
+  ngx_rtmp_publish = ngx_rtmp_notify_publish;
+
+  next_play = ngx_rtmp_play;
+  ngx_rtmp_play = ngx_rtmp_notify_play;
 
-  length = root->u.array.length;
+  next_close_stream = ngx_rtmp_close_stream;
+  ngx_rtmp_close_stream = ngx_rtmp_notify_close_stream;
 
-  for (i = 0; i < length; ++i) {
-    temp = root->u.array.values[i];
-    if (temp->type != json_object) continue;
+  next_record_done = ngx_rtmp_record_done;
+  ngx_rtmp_record_done = ngx_rtmp_notify_record_done;
 
-    ngx_match_json_name_in_object(temp, target, pool, arr);
-  }
-  return;
+  return NGX_OK;
 }
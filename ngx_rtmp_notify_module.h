@@ -6,20 +6,6 @@
 #include "ngx_rtmp.h"
 #include "ngx_rtmp_cmd_module.h"
 
-#ifndef json_char
-#define json_char char
-#endif
-
-#ifndef json_int_t
-#ifndef _MSC_VER
-#include <inttypes.h>
-#define json_int_t int64_t
-#else
-#define json_int_t __int64
-#endif
-#endif
-
-#include <stdlib.h>
 enum {
   NGX_RTMP_NOTIFY_CONNECT,
   NGX_RTMP_NOTIFY_DISCONNECT,
@@ -44,6 +30,8 @@ typedef struct {
   ngx_msec_t update_timeout, reconnect_timegap, reconnect_timeout;
   ngx_flag_t update_strict;
   ngx_flag_t relay_redirect;
+  ngx_shm_zone_t* cache_zone;
+  time_t cache_valid, cache_negative_valid;
 } ngx_rtmp_notify_app_conf_t;
 
 typedef struct {
@@ -61,108 +49,20 @@ typedef struct {
   ngx_array_t* addrs_buffer;
   ngx_event_t reconnect_evt;
   ngx_str_t* stream_name;
-} ngx_rtmp_notify_ctx_t;
-
-typedef struct {
-  unsigned long max_memory;
-  int settings;
-
-  /* Custom allocator support (leave null to use malloc/free)
-   */
-
-  void* (*mem_alloc)(size_t, int zero, void* user_data);
-  void (*mem_free)(void*, void* user_data);
-
-  void* user_data; /* will be passed to mem_alloc and mem_free */
-
-  size_t value_extra; /* how much extra space to allocate for values? */
-
-} json_settings;
-
-#define json_enable_comments 0x01
-
-typedef enum {
-  json_none,
-  json_object,
-  json_array,
-  json_integer,
-  json_double,
-  json_string,
-  json_boolean,
-  json_null
-
-} json_type;
-
-extern const struct _json_value json_value_none;
-
-typedef struct _json_object_entry {
-  json_char* name;
-  unsigned int name_length;
 
-  struct _json_value* value;
+  ngx_rtmp_session_t* session;
 
-} json_object_entry;
+  /* auth decision cache: in-flight callback this session leads or waits on */
+  void* cache_pending;
+  ngx_queue_t cache_queue;
+  ngx_uint_t cache_event;
+  void* cache_arg;
 
-typedef struct _json_value {
-  struct _json_value* parent;
-
-  json_type type;
-
-  union {
-    int boolean;
-    json_int_t integer;
-    double dbl;
-
-    struct {
-      unsigned int length;
-      json_char* ptr; /* null terminated */
-
-    } string;
-
-    struct {
-      unsigned int length;
-
-      json_object_entry* values;
-    } object;
-
-    struct {
-      unsigned int length;
-      struct _json_value** values;
-    } array;
-
-  } u;
-
-  union {
-    struct _json_value* next_alloc;
-    void* object_mem;
-
-  } _reserved;
-} json_value;
-
-json_value* json_parse(const json_char* json, size_t length);
-
-#define json_error_max 128
-
-json_value* json_parse_ex(json_settings* settings, const json_char* json,
-                          size_t length, char* error);
-
-void json_value_free(json_value*);
-
-/* Not usually necessary, unless you used a custom mem_alloc and now want to
- * use a custom mem_free.
- */
-
-void json_value_free_ex(json_settings* settings, json_value*);
-json_value* ngx_find_json_name(json_value* root, ngx_str_t* target);
-json_value* ngx_find_json_name_in_object(json_value* root, ngx_str_t* target);
-json_value* ngx_find_json_name_in_array(json_value* root, ngx_str_t* target);
-
-void ngx_match_json_name(json_value* root, ngx_str_t* target, ngx_pool_t* pool,
-                         ngx_array_t* arr);
-void ngx_match_json_name_in_object(json_value* root, ngx_str_t* target,
-                                   ngx_pool_t* pool, ngx_array_t* arr);
-void ngx_match_json_name_in_array(json_value* root, ngx_str_t* target,
-                                  ngx_pool_t* pool, ngx_array_t* arr);
+  /* single-flight pull of redirected play this session belongs to */
+  void* pull;
+  ngx_queue_t pull_queue;
+  unsigned pull_wait : 1;
+} ngx_rtmp_notify_ctx_t;
 
 extern ngx_module_t ngx_rtmp_notify_module;
 
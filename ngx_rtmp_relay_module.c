@@ -7,8 +7,11 @@
 #include "ngx_rtmp_relay_module.h"
 #include <ngx_config.h>
 #include <ngx_core.h>
+#include "ngx_rtmp_bandwidth.h"
 #include "ngx_rtmp_cmd_module.h"
+#include "ngx_rtmp_codec_module.h"
 #include "ngx_rtmp_notify_module.h"
+#include "ngx_rtmp_streams.h"
 
 static ngx_rtmp_publish_pt next_publish;
 static ngx_rtmp_play_pt next_play;
@@ -27,6 +30,12 @@ static ngx_int_t ngx_rtmp_relay_publish(ngx_rtmp_session_t *s,
 static ngx_rtmp_relay_ctx_t *ngx_rtmp_relay_create_connection(
     ngx_rtmp_conf_ctx_t *cctx, ngx_str_t *name,
     ngx_rtmp_relay_target_t *target);
+static ngx_rtmp_relay_ctx_t *ngx_rtmp_relay_create_remote_ctx(
+    ngx_rtmp_session_t *s, ngx_str_t *name, ngx_rtmp_relay_target_t *target);
+static ngx_int_t ngx_rtmp_relay_send_create_stream(ngx_rtmp_session_t *s);
+static ngx_int_t ngx_rtmp_relay_send_delete_stream(ngx_rtmp_session_t *s);
+static void ngx_rtmp_relay_http_start(ngx_rtmp_session_t *s,
+                                      ngx_uint_t async);
 
 /*                _____
  * =push=        |     |---publish--->
@@ -58,6 +67,9 @@ typedef struct {
 /* default flashVer */
 #define NGX_RTMP_RELAY_FLASHVER "LNX.11,1,102,55"
 
+/* bits of ngx_rtmp_relay_ctx_t.tried */
+#define NGX_RTMP_RELAY_MAX_HASH_PULLS (int)(sizeof(ngx_uint_t) * 8)
+
 static ngx_command_t ngx_rtmp_relay_commands[] = {
 
     {ngx_string("push"), NGX_RTMP_APP_CONF | NGX_CONF_1MORE,
@@ -83,6 +95,30 @@ static ngx_command_t ngx_rtmp_relay_commands[] = {
      ngx_conf_set_msec_slot, NGX_RTMP_APP_CONF_OFFSET,
      offsetof(ngx_rtmp_relay_app_conf_t, pull_reconnect), NULL},
 
+    {ngx_string("pull_reconnect_max"),
+     NGX_RTMP_MAIN_CONF | NGX_RTMP_SRV_CONF | NGX_RTMP_APP_CONF |
+         NGX_CONF_TAKE1,
+     ngx_conf_set_msec_slot, NGX_RTMP_APP_CONF_OFFSET,
+     offsetof(ngx_rtmp_relay_app_conf_t, pull_reconnect_max), NULL},
+
+    {ngx_string("pull_hash"),
+     NGX_RTMP_MAIN_CONF | NGX_RTMP_SRV_CONF | NGX_RTMP_APP_CONF |
+         NGX_CONF_TAKE1,
+     ngx_conf_set_flag_slot, NGX_RTMP_APP_CONF_OFFSET,
+     offsetof(ngx_rtmp_relay_app_conf_t, pull_hash), NULL},
+
+    {ngx_string("pull_keepalive"),
+     NGX_RTMP_MAIN_CONF | NGX_RTMP_SRV_CONF | NGX_RTMP_APP_CONF |
+         NGX_CONF_TAKE1,
+     ngx_conf_set_num_slot, NGX_RTMP_APP_CONF_OFFSET,
+     offsetof(ngx_rtmp_relay_app_conf_t, pull_keepalive), NULL},
+
+    {ngx_string("pull_keepalive_timeout"),
+     NGX_RTMP_MAIN_CONF | NGX_RTMP_SRV_CONF | NGX_RTMP_APP_CONF |
+         NGX_CONF_TAKE1,
+     ngx_conf_set_msec_slot, NGX_RTMP_APP_CONF_OFFSET,
+     offsetof(ngx_rtmp_relay_app_conf_t, pull_keepalive_timeout), NULL},
+
     {ngx_string("session_relay"),
      NGX_RTMP_MAIN_CONF | NGX_RTMP_SRV_CONF | NGX_RTMP_APP_CONF |
          NGX_CONF_TAKE1,
@@ -148,6 +184,10 @@ static void *ngx_rtmp_relay_create_app_conf(ngx_conf_t *cf) {
   racf->session_relay = NGX_CONF_UNSET;
   racf->push_reconnect = NGX_CONF_UNSET_MSEC;
   racf->pull_reconnect = NGX_CONF_UNSET_MSEC;
+  racf->pull_reconnect_max = NGX_CONF_UNSET_MSEC;
+  racf->pull_hash = NGX_CONF_UNSET;
+  racf->pull_keepalive = NGX_CONF_UNSET;
+  racf->pull_keepalive_timeout = NGX_CONF_UNSET_MSEC;
 
   return racf;
 }
@@ -164,10 +204,188 @@ static char *ngx_rtmp_relay_merge_app_conf(ngx_conf_t *cf, void *parent,
   ngx_conf_merge_msec_value(conf->buflen, prev->buflen, 5000);
   ngx_conf_merge_msec_value(conf->push_reconnect, prev->push_reconnect, 3000);
   ngx_conf_merge_msec_value(conf->pull_reconnect, prev->pull_reconnect, 3000);
+  ngx_conf_merge_msec_value(conf->pull_reconnect_max, prev->pull_reconnect_max,
+                            ngx_max(conf->pull_reconnect, 60000));
+  ngx_conf_merge_value(conf->pull_hash, prev->pull_hash, 0);
+  ngx_conf_merge_value(conf->pull_keepalive, prev->pull_keepalive, 0);
+  ngx_conf_merge_msec_value(conf->pull_keepalive_timeout,
+                            prev->pull_keepalive_timeout, 30000);
+
+  /* hashed pulls remember the tried origins in a bit mask */
+  if (conf->pull_hash && conf->pulls.nelts > NGX_RTMP_RELAY_MAX_HASH_PULLS) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "pull_hash supports at most %d pull targets, %ui given",
+                       NGX_RTMP_RELAY_MAX_HASH_PULLS, conf->pulls.nelts);
+    return NGX_CONF_ERROR;
+  }
 
   return NGX_CONF_OK;
 }
 
+/* exponential backoff for an origin which keeps failing */
+
+static ngx_msec_t ngx_rtmp_relay_backoff(ngx_rtmp_relay_app_conf_t *racf,
+                                         ngx_rtmp_relay_target_t *target) {
+  ngx_uint_t n;
+  ngx_msec_t timeout;
+
+  timeout = racf->pull_reconnect;
+
+  for (n = 1; n < target->fails && timeout < racf->pull_reconnect_max; n++) {
+    timeout *= 2;
+  }
+
+  return ngx_min(timeout, racf->pull_reconnect_max);
+}
+
+static void ngx_rtmp_relay_target_failed(ngx_rtmp_relay_app_conf_t *racf,
+                                         ngx_rtmp_relay_target_t *target) {
+  target->fails++;
+  target->retry = ngx_current_msec + ngx_rtmp_relay_backoff(racf, target);
+
+  ngx_log_error(NGX_LOG_WARN, racf->log, 0,
+                "relay: origin '%V' failed %ui time(s), retry in %Mms",
+                &target->url.url, target->fails,
+                ngx_rtmp_relay_backoff(racf, target));
+}
+
+/*
+ * Rendezvous hashing over the pull targets matching the stream name:
+ * every edge picks the same origin for a stream and streams spread
+ * evenly over the group. Origins in backoff and those already tried
+ * for this pull are skipped; when only backing-off origins are left
+ * the one due first is returned.
+ */
+
+static ngx_rtmp_relay_target_t *ngx_rtmp_relay_hash_pull(
+    ngx_rtmp_relay_app_conf_t *racf, ngx_str_t *name, ngx_uint_t *tried) {
+  uint32_t key, w, best_w;
+  ngx_uint_t n, bit, best_bit, spare_bit;
+  ngx_rtmp_relay_target_t *target, **t, *best, *spare;
+
+  key = ngx_murmur_hash2(name->data, name->len);
+
+  best = NULL;
+  spare = NULL;
+  best_w = 0;
+  best_bit = 0;
+  spare_bit = 0;
+
+  t = racf->pulls.elts;
+  for (n = 0; n < racf->pulls.nelts; ++n, ++t) {
+    target = *t;
+
+    if (target->name.len &&
+        (name->len != target->name.len ||
+         ngx_memcmp(name->data, target->name.data, name->len))) {
+      continue;
+    }
+
+    bit = (ngx_uint_t)1 << n;
+    if (*tried & bit) {
+      continue;
+    }
+
+    if (target->fails &&
+        (ngx_msec_int_t)(ngx_current_msec - target->retry) < 0) {
+      if (spare == NULL ||
+          (ngx_msec_int_t)(target->retry - spare->retry) < 0) {
+        spare = target;
+        spare_bit = bit;
+      }
+      continue;
+    }
+
+    /* murmur3 finalizer */
+    w = key ^ target->hash;
+    w ^= w >> 16;
+    w *= 0x85ebca6b;
+    w ^= w >> 13;
+    w *= 0xc2b2ae35;
+    w ^= w >> 16;
+
+    if (best == NULL || w > best_w) {
+      best = target;
+      best_w = w;
+      best_bit = bit;
+    }
+  }
+
+  if (best == NULL) {
+    best = spare;
+    best_bit = spare_bit;
+  }
+
+  *tried |= best_bit;
+
+  return best;
+}
+
+/*
+ * The origin of a hashed pull went away; move the players waiting on it
+ * to the next origin in hash order instead of disconnecting them.
+ */
+
+static ngx_int_t ngx_rtmp_relay_failover(ngx_rtmp_session_t *s,
+                                         ngx_rtmp_relay_ctx_t *ctx) {
+  ngx_uint_t hash, tried;
+  ngx_rtmp_session_t *ps;
+  ngx_rtmp_relay_ctx_t *nctx, *pctx, **cctx;
+  ngx_rtmp_relay_target_t *target;
+  ngx_rtmp_relay_app_conf_t *racf;
+
+  racf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_relay_module);
+
+  if (!racf->pull_hash || !s->relay || s->static_relay ||
+      ctx->tag != &ngx_rtmp_relay_module || ctx->play == NULL) {
+    return NGX_DECLINED;
+  }
+
+  ps = ctx->play->session;
+  tried = ctx->tried;
+
+  for (;;) {
+    target = ngx_rtmp_relay_hash_pull(racf, &ctx->name, &tried);
+    if (target == NULL) {
+      return NGX_DECLINED;
+    }
+
+    ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
+                  "relay: pull failover name='%V' url='%V'", &ctx->name,
+                  &target->url.url);
+
+    nctx = ngx_rtmp_relay_create_remote_ctx(ps, &ctx->name, target);
+    if (nctx) {
+      break;
+    }
+
+    ngx_rtmp_relay_target_failed(racf, target);
+  }
+
+  nctx->tried = tried;
+  nctx->publish = nctx;
+  nctx->play = ctx->play;
+
+  for (pctx = nctx->play; pctx; pctx = pctx->next) {
+    pctx->publish = nctx;
+  }
+
+  hash = ngx_hash_key(ctx->name.data, ctx->name.len);
+  cctx = &racf->ctx[hash % racf->nbuckets];
+  for (; *cctx && *cctx != ctx; cctx = &(*cctx)->next)
+    ;
+
+  nctx->next = ctx->next;
+  if (*cctx) {
+    *cctx = nctx;
+  }
+
+  ctx->play = NULL;
+  ctx->next = NULL;
+
+  return NGX_OK;
+}
+
 static void ngx_rtmp_relay_static_pull_reconnect(ngx_event_t *ev) {
   ngx_rtmp_relay_static_t *rs = ev->data;
 
@@ -187,7 +405,9 @@ static void ngx_rtmp_relay_static_pull_reconnect(ngx_event_t *ev) {
     return;
   }
 
-  ngx_add_timer(ev, racf->pull_reconnect);
+  rs->target->fails++;
+
+  ngx_add_timer(ev, ngx_rtmp_relay_backoff(racf, rs->target));
 }
 
 static void ngx_rtmp_relay_push_reconnect(ngx_event_t *ev) {
@@ -462,6 +682,11 @@ static ngx_rtmp_relay_ctx_t *ngx_rtmp_relay_create_connection(
   (void)ngx_atomic_fetch_add(ngx_stat_active, 1);
 #endif
 
+  if (target->http) {
+    ngx_rtmp_relay_http_start(rs, rc == NGX_AGAIN);
+    return rctx;
+  }
+
   ngx_rtmp_client_handshake(rs, 1);
   return rctx;
 
@@ -472,6 +697,145 @@ clear:
   return NULL;
 }
 
+/*
+ * Pull connections are kept open for pull_keepalive_timeout after their
+ * last player leaves: the stream is deleted upstream and unpublished
+ * locally, and the next pull from the same target skips the TCP connect,
+ * handshake and connect command and goes straight to createStream.
+ */
+
+static void ngx_rtmp_relay_unpark(ngx_rtmp_relay_ctx_t *ctx) {
+  ngx_rtmp_relay_ctx_t **pctx;
+  ngx_rtmp_relay_target_t *target;
+
+  target = ctx->data;
+
+  for (pctx = &target->idle; *pctx; pctx = &(*pctx)->next) {
+    if (*pctx == ctx) {
+      *pctx = ctx->next;
+      target->nidle--;
+      break;
+    }
+  }
+
+  ctx->next = NULL;
+  ctx->parked = 0;
+
+  if (ctx->idle_evt.timer_set) {
+    ngx_del_timer(&ctx->idle_evt);
+  }
+}
+
+static void ngx_rtmp_relay_idle_timeout(ngx_event_t *ev) {
+  ngx_rtmp_relay_ctx_t *ctx;
+
+  ctx = ev->data;
+
+  ngx_log_debug1(NGX_LOG_DEBUG_RTMP, ev->log, 0,
+                 "relay: idle connection timed out url='%V'", &ctx->url);
+
+  ngx_rtmp_relay_unpark(ctx);
+  ngx_rtmp_finalize_session(ctx->session);
+}
+
+static ngx_int_t ngx_rtmp_relay_park(ngx_rtmp_relay_ctx_t *ctx) {
+  ngx_rtmp_session_t *s;
+  ngx_rtmp_relay_ctx_t **cctx;
+  ngx_rtmp_relay_target_t *target;
+  ngx_rtmp_relay_app_conf_t *racf;
+  ngx_rtmp_close_stream_t cv;
+  ngx_uint_t hash;
+
+  s = ctx->session;
+  racf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_relay_module);
+
+  if (racf->pull_keepalive == 0 || ctx->tag != &ngx_rtmp_relay_module ||
+      ctx->http || ctx->publish != ctx || !ctx->established ||
+      s->static_relay || s->connection->destroyed) {
+    return NGX_DECLINED;
+  }
+
+  target = ctx->data;
+  if (target->nidle >= (ngx_uint_t)racf->pull_keepalive) {
+    return NGX_DECLINED;
+  }
+
+  if (ngx_rtmp_relay_send_delete_stream(s) != NGX_OK) {
+    return NGX_ERROR;
+  }
+
+  hash = ngx_hash_key(ctx->name.data, ctx->name.len);
+  cctx = &racf->ctx[hash % racf->nbuckets];
+  for (; *cctx && *cctx != ctx; cctx = &(*cctx)->next)
+    ;
+  if (*cctx) {
+    *cctx = ctx->next;
+  }
+
+  /* unpublish locally; relay close sees no publish and stays away */
+  ctx->publish = NULL;
+  ctx->play = NULL;
+  ctx->next = NULL;
+  ctx->reused = 0;
+
+  cv.stream = 0;
+  ngx_rtmp_close_stream(s, &cv);
+
+  ngx_rtmp_codec_reset(s);
+
+  ngx_log_debug2(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                 "relay: keep connection name='%V' url='%V'", &ctx->name,
+                 &ctx->url);
+
+  ctx->parked = 1;
+  ctx->next = target->idle;
+  target->idle = ctx;
+  target->nidle++;
+
+  ctx->idle_evt.data = ctx;
+  ctx->idle_evt.log = s->connection->log;
+  ctx->idle_evt.handler = ngx_rtmp_relay_idle_timeout;
+
+  ngx_add_timer(&ctx->idle_evt, racf->pull_keepalive_timeout);
+
+  return NGX_OK;
+}
+
+static ngx_rtmp_relay_ctx_t *ngx_rtmp_relay_reuse(
+    ngx_rtmp_session_t *s, ngx_str_t *name, ngx_rtmp_relay_target_t *target) {
+  ngx_rtmp_session_t *rs;
+  ngx_rtmp_relay_ctx_t *rctx;
+
+  while (target->idle) {
+    rctx = target->idle;
+    ngx_rtmp_relay_unpark(rctx);
+
+    rs = rctx->session;
+    if (rs->connection->destroyed) {
+      continue;
+    }
+
+    if (ngx_rtmp_relay_copy_str(rs->connection->pool, &rctx->name, name) !=
+            NGX_OK ||
+        ngx_rtmp_relay_send_create_stream(rs) != NGX_OK) {
+      ngx_rtmp_finalize_session(rs);
+      continue;
+    }
+
+    ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
+                  "relay: reuse connection name='%V' url='%V'", name,
+                  &rctx->url);
+
+    /* publish once the upstream confirms the new play, anything still in
+     * flight belongs to the previous stream */
+    rctx->reused = 1;
+
+    return rctx;
+  }
+
+  return NULL;
+}
+
 static ngx_rtmp_relay_ctx_t *ngx_rtmp_relay_create_remote_ctx(
     ngx_rtmp_session_t *s, ngx_str_t *name, ngx_rtmp_relay_target_t *target) {
   ngx_rtmp_conf_ctx_t cctx;
@@ -481,7 +845,11 @@ static ngx_rtmp_relay_ctx_t *ngx_rtmp_relay_create_remote_ctx(
   cctx.srv_conf = s->srv_conf;
   cctx.main_conf = s->main_conf;
 
-  rctx = ngx_rtmp_relay_create_connection(&cctx, name, target);
+  rctx = ngx_rtmp_relay_reuse(s, name, target);
+  if (rctx == NULL) {
+    rctx = ngx_rtmp_relay_create_connection(&cctx, name, target);
+  }
+
   if (rctx) {
     rctx->server_name.data = s->host_start;
     rctx->server_name.len = s->host_end - s->host_start;
@@ -531,199 +899,937 @@ static ngx_int_t ngx_rtmp_relay_create(
   ngx_rtmp_relay_ctx_t *publish_ctx, *play_ctx, **cctx;
   ngx_uint_t hash;
 
-  racf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_relay_module);
-  if (racf == NULL) {
-    return NGX_ERROR;
-  }
+  racf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_relay_module);
+  if (racf == NULL) {
+    return NGX_ERROR;
+  }
+
+  play_ctx = create_play_ctx(s, name, target);
+  if (play_ctx == NULL) {
+    return NGX_ERROR;
+  }
+
+  hash = ngx_hash_key(name->data, name->len);
+  cctx = &racf->ctx[hash % racf->nbuckets];
+  for (; *cctx; cctx = &(*cctx)->next) {
+    if ((*cctx)->name.len == name->len &&
+        !ngx_memcmp(name->data, (*cctx)->name.data, name->len)) {
+      break;
+    }
+  }
+
+  if (*cctx) {
+    play_ctx->publish = (*cctx)->publish;
+    play_ctx->next = (*cctx)->play;
+    (*cctx)->play = play_ctx;
+    return NGX_OK;
+  }
+
+  publish_ctx = create_publish_ctx(s, name, target);
+  if (publish_ctx == NULL) {
+    ngx_rtmp_finalize_session(play_ctx->session);
+    return NGX_ERROR;
+  }
+
+  publish_ctx->publish = publish_ctx;
+  publish_ctx->play = play_ctx;
+  play_ctx->publish = publish_ctx;
+  *cctx = publish_ctx;
+
+  return NGX_OK;
+}
+
+ngx_int_t ngx_rtmp_relay_pull(ngx_rtmp_session_t *s, ngx_str_t *name,
+                              ngx_rtmp_relay_target_t *target) {
+  ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
+                "relay: create pull name='%V' app='%V' playpath='%V' url='%V'",
+                name, &target->app, &target->play_path, &target->url.url);
+
+  return ngx_rtmp_relay_create(s, name, target,
+                               ngx_rtmp_relay_create_remote_ctx,
+                               ngx_rtmp_relay_create_local_ctx);
+}
+
+ngx_int_t ngx_rtmp_relay_push(ngx_rtmp_session_t *s, ngx_str_t *name,
+                              ngx_rtmp_relay_target_t *target) {
+  ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
+                "relay: create push name='%V' app='%V' playpath='%V' url='%V'",
+                name, &target->app, &target->play_path, &target->url.url);
+
+  return ngx_rtmp_relay_create(s, name, target, ngx_rtmp_relay_create_local_ctx,
+                               ngx_rtmp_relay_create_remote_ctx);
+}
+
+ngx_int_t ngx_rtmp_relay_attach(ngx_rtmp_session_t *s, ngx_str_t *name) {
+  ngx_rtmp_relay_app_conf_t *racf;
+  ngx_rtmp_relay_ctx_t *play_ctx, **cctx;
+  ngx_uint_t hash;
+
+  racf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_relay_module);
+  if (racf == NULL) {
+    return NGX_ERROR;
+  }
+
+  hash = ngx_hash_key(name->data, name->len);
+  cctx = &racf->ctx[hash % racf->nbuckets];
+  for (; *cctx; cctx = &(*cctx)->next) {
+    if ((*cctx)->name.len == name->len &&
+        !ngx_memcmp(name->data, (*cctx)->name.data, name->len)) {
+      break;
+    }
+  }
+
+  if (*cctx == NULL) {
+    return NGX_DECLINED;
+  }
+
+  play_ctx = ngx_rtmp_relay_create_local_ctx(s, name, NULL);
+  if (play_ctx == NULL) {
+    return NGX_ERROR;
+  }
+
+  ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                 "relay: attach to pull name='%V'", name);
+
+  play_ctx->publish = (*cctx)->publish;
+  play_ctx->next = (*cctx)->play;
+  (*cctx)->play = play_ctx;
+
+  return NGX_OK;
+}
+
+static ngx_int_t ngx_rtmp_relay_publish(ngx_rtmp_session_t *s,
+                                        ngx_rtmp_publish_t *v) {
+  ngx_rtmp_relay_app_conf_t *racf;
+  ngx_rtmp_relay_target_t *target, **t;
+  ngx_str_t name;
+  size_t n;
+  ngx_rtmp_relay_ctx_t *ctx;
+
+  if (s->auto_pushed) {
+    goto next;
+  }
+
+  ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_relay_module);
+  if (ctx && s->relay) {
+    goto next;
+  }
+
+  racf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_relay_module);
+  if (racf == NULL || racf->pushes.nelts == 0) {
+    goto next;
+  }
+
+  name.len = ngx_strlen(v->name);
+  name.data = v->name;
+
+  t = racf->pushes.elts;
+  for (n = 0; n < racf->pushes.nelts; ++n, ++t) {
+    target = *t;
+
+    if (target->name.len &&
+        (name.len != target->name.len ||
+         ngx_memcmp(name.data, target->name.data, name.len))) {
+      continue;
+    }
+
+    if (ngx_rtmp_relay_push(s, &name, target) == NGX_OK) {
+      continue;
+    }
+
+    ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                  "relay: push failed name='%V' app='%V' "
+                  "playpath='%V' url='%V'",
+                  &name, &target->app, &target->play_path, &target->url.url);
+
+    if (!ctx->push_evt.timer_set) {
+      ngx_add_timer(&ctx->push_evt, racf->push_reconnect);
+    }
+  }
+
+next:
+  return next_publish(s, v);
+}
+
+static ngx_int_t ngx_rtmp_relay_play(ngx_rtmp_session_t *s,
+                                     ngx_rtmp_play_t *v) {
+  ngx_rtmp_relay_app_conf_t *racf;
+  ngx_rtmp_relay_target_t *target, **t;
+  ngx_str_t name;
+  size_t n;
+  ngx_uint_t tried;
+  ngx_rtmp_relay_ctx_t *ctx;
+
+  ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_relay_module);
+  if (ctx && s->relay) {
+    goto next;
+  }
+
+  racf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_relay_module);
+  if (racf == NULL || racf->pulls.nelts == 0) {
+    goto next;
+  }
+
+  name.len = ngx_strlen(v->name);
+  name.data = v->name;
+
+  if (racf->pull_hash) {
+    tried = 0;
+
+    /* a failed pull may finalize the session; later origins are reached
+     * through failover */
+    target = ngx_rtmp_relay_hash_pull(racf, &name, &tried);
+    if (target == NULL) {
+      goto next;
+    }
+
+    if (ngx_rtmp_relay_pull(s, &name, target) != NGX_OK) {
+      ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                    "relay: pull failed name='%V' url='%V'", &name,
+                    &target->url.url);
+      ngx_rtmp_relay_target_failed(racf, target);
+      goto next;
+    }
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_relay_module);
+    if (ctx && ctx->publish && ctx->publish != ctx) {
+      ctx->publish->tried |= tried;
+    }
+
+    goto next;
+  }
+
+  t = racf->pulls.elts;
+  for (n = 0; n < racf->pulls.nelts; ++n, ++t) {
+    target = *t;
+
+    if (target->name.len &&
+        (name.len != target->name.len ||
+         ngx_memcmp(name.data, target->name.data, name.len))) {
+      continue;
+    }
+
+    if (ngx_rtmp_relay_pull(s, &name, target) == NGX_OK) {
+      continue;
+    }
+
+    ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                  "relay: pull failed name='%V' app='%V' "
+                  "playpath='%V' url='%V'",
+                  &name, &target->app, &target->play_path, &target->url.url);
+  }
+
+next:
+  return next_play(s, v);
+}
+
+static ngx_int_t ngx_rtmp_relay_play_local(ngx_rtmp_session_t *s) {
+  ngx_rtmp_play_t v;
+  ngx_rtmp_relay_ctx_t *ctx;
+
+  ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_relay_module);
+  if (ctx == NULL) {
+    return NGX_ERROR;
+  }
+
+  ngx_memzero(&v, sizeof(ngx_rtmp_play_t));
+  v.silent = 1;
+  *(ngx_cpymem(v.name, ctx->name.data,
+               ngx_min(sizeof(v.name) - 1, ctx->name.len))) = 0;
+
+  return ngx_rtmp_play(s, &v);
+}
+
+static ngx_int_t ngx_rtmp_relay_publish_local(ngx_rtmp_session_t *s) {
+  ngx_rtmp_publish_t v;
+  ngx_rtmp_relay_ctx_t *ctx;
+
+  ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_relay_module);
+  if (ctx == NULL) {
+    return NGX_ERROR;
+  }
+
+  ngx_memzero(&v, sizeof(ngx_rtmp_publish_t));
+  v.silent = 1;
+  *(ngx_cpymem(v.name, ctx->name.data,
+               ngx_min(sizeof(v.name) - 1, ctx->name.len))) = 0;
+
+  ngx_memcpy(s->stream_name, v.name, ngx_strlen(v.name) + 1);
+
+  return ngx_rtmp_publish(s, &v);
+}
+
+/*
+ * HTTP-FLV pull transport: the relay session sends a plain GET and feeds
+ * the FLV tags of the response body to the usual message handlers, as if
+ * they had arrived over RTMP. Tag payloads are passed as chains pointing
+ * into the receive buffer, split at chunked transfer-encoding boundaries;
+ * only a tag still incomplete when the buffer fills up is moved.
+ */
+
+#define NGX_RTMP_RELAY_HTTP_BUFSIZE 65536
+
+#define NGX_RTMP_RELAY_FLV_HEADER 9
+#define NGX_RTMP_RELAY_FLV_TAG_HEADER 11
+
+enum {
+  ngx_rtmp_relay_http_status = 0,
+  ngx_rtmp_relay_http_chunk_size,
+  ngx_rtmp_relay_http_chunk_ext,
+  ngx_rtmp_relay_http_chunk_data,
+  ngx_rtmp_relay_http_chunk_crlf,
+  ngx_rtmp_relay_http_chunk_last,
+  ngx_rtmp_relay_http_plain
+};
+
+enum {
+  ngx_rtmp_relay_flv_header = 0,
+  ngx_rtmp_relay_flv_skip,
+  ngx_rtmp_relay_flv_tag_header,
+  ngx_rtmp_relay_flv_tag_data
+};
+
+struct ngx_rtmp_relay_http_s {
+  ngx_buf_t *request;
+  ngx_buf_t buf;
+  ngx_uint_t state;
+  size_t chunk;
+
+  ngx_uint_t flv_state;
+  size_t need;
+  u_char hdr[NGX_RTMP_RELAY_FLV_TAG_HEADER];
+  size_t nhdr;
+
+  ngx_rtmp_header_t h;
+  ngx_chain_t *tag;
+  ngx_chain_t **last;
+  ngx_chain_t *free;
+};
+
+static void ngx_rtmp_relay_http_recv(ngx_event_t *rev);
+
+static void ngx_rtmp_relay_http_dummy(ngx_event_t *ev) {}
+
+static void ngx_rtmp_relay_http_send(ngx_event_t *wev) {
+  ngx_connection_t *c;
+  ngx_rtmp_session_t *s;
+  ngx_rtmp_relay_ctx_t *ctx;
+  ngx_buf_t *b;
+  ssize_t n;
+
+  c = wev->data;
+  s = c->data;
+
+  if (c->destroyed) {
+    return;
+  }
+
+  if (wev->timedout) {
+    ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT,
+                  "relay: http upstream timed out");
+    c->timedout = 1;
+    ngx_rtmp_finalize_session(s);
+    return;
+  }
+
+  if (wev->timer_set) {
+    ngx_del_timer(wev);
+  }
+
+  ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_relay_module);
+  b = ctx->http->request;
+
+  while (b->pos < b->last) {
+    n = c->send(c, b->pos, b->last - b->pos);
+
+    if (n == NGX_AGAIN || n == 0) {
+      ngx_add_timer(wev, s->timeout);
+      if (ngx_handle_write_event(wev, 0) != NGX_OK) {
+        ngx_rtmp_finalize_session(s);
+      }
+      return;
+    }
+
+    if (n < 0) {
+      ngx_rtmp_finalize_session(s);
+      return;
+    }
+
+    b->pos += n;
+  }
+
+  /* nothing else is ever sent upstream */
+  wev->handler = ngx_rtmp_relay_http_dummy;
+
+  if (wev->active) {
+    ngx_del_event(wev, NGX_WRITE_EVENT, 0);
+  }
+
+  ngx_add_timer(c->read, s->timeout);
+  if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+    ngx_rtmp_finalize_session(s);
+  }
+}
+
+static void ngx_rtmp_relay_http_start(ngx_rtmp_session_t *s,
+                                      ngx_uint_t async) {
+  ngx_connection_t *c;
+  ngx_rtmp_relay_ctx_t *ctx;
+  ngx_rtmp_relay_http_t *hc;
+  ngx_rtmp_core_app_conf_t *cacf;
+  ngx_str_t host, app, path, agent;
+  u_char *p;
+  size_t len;
+
+  c = s->connection;
+  ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_relay_module);
+  cacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_core_module);
+
+  hc = ngx_pcalloc(c->pool, sizeof(ngx_rtmp_relay_http_t));
+  if (hc == NULL) {
+    ngx_rtmp_finalize_session(s);
+    return;
+  }
+
+  ctx->http = hc;
+  hc->last = &hc->tag;
+
+  hc->buf.start = ngx_palloc(c->pool, NGX_RTMP_RELAY_HTTP_BUFSIZE);
+  if (hc->buf.start == NULL) {
+    ngx_rtmp_finalize_session(s);
+    return;
+  }
+
+  hc->buf.pos = hc->buf.start;
+  hc->buf.last = hc->buf.start;
+  hc->buf.end = hc->buf.start + NGX_RTMP_RELAY_HTTP_BUFSIZE;
+
+  host = ctx->url;
+  p = ngx_strlchr(host.data, host.data + host.len, '/');
+  if (p) {
+    host.len = p - host.data;
+  }
+
+  app = ctx->app.len ? ctx->app : cacf->name;
+  path = ctx->play_path.len ? ctx->play_path : ctx->name;
+
+  if (ctx->flash_ver.len) {
+    agent = ctx->flash_ver;
+  } else {
+    ngx_str_set(&agent, NGX_RTMP_RELAY_FLASHVER);
+  }
+
+  len = sizeof("GET / / HTTP/1.1" CRLF) - 1 + app.len + path.len +
+        sizeof(".flv") - 1 + sizeof("Host: " CRLF) - 1 + host.len +
+        sizeof("User-Agent: " CRLF) - 1 + agent.len +
+        sizeof("Accept: */*" CRLF "Connection: close" CRLF CRLF) - 1;
+
+  hc->request = ngx_create_temp_buf(c->pool, len);
+  if (hc->request == NULL) {
+    ngx_rtmp_finalize_session(s);
+    return;
+  }
+
+  hc->request->last = ngx_sprintf(
+      hc->request->last,
+      "GET /%V/%V%s HTTP/1.1" CRLF "Host: %V" CRLF "User-Agent: %V" CRLF
+      "Accept: */*" CRLF "Connection: close" CRLF CRLF,
+      &app, &path, ctx->play_path.len ? "" : ".flv", &host, &agent);
+
+  ngx_log_debug2(NGX_LOG_DEBUG_RTMP, c->log, 0,
+                 "relay: http request app='%V' path='%V'", &app, &path);
+
+  c->read->handler = ngx_rtmp_relay_http_recv;
+  c->write->handler = ngx_rtmp_relay_http_send;
+
+  if (async) {
+    /* connect in progress, the request goes out once it completes */
+    ngx_add_timer(c->write, s->timeout);
+    if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+      ngx_rtmp_finalize_session(s);
+    }
+    return;
+  }
+
+  ngx_rtmp_relay_http_send(c->write);
+}
+
+static ngx_int_t ngx_rtmp_relay_http_headers(ngx_rtmp_session_t *s,
+                                             ngx_rtmp_relay_http_t *hc) {
+  ngx_buf_t *b;
+  ngx_int_t status;
+  ngx_rtmp_relay_ctx_t *ctx;
+  ngx_rtmp_relay_target_t *target;
+  u_char *p, *end, *line;
+
+  b = &hc->buf;
+
+  for (end = b->pos; end + 3 < b->last; end++) {
+    if (end[0] == CR && end[1] == LF && end[2] == CR && end[3] == LF) {
+      break;
+    }
+  }
+
+  if (end + 3 >= b->last) {
+    if (b->last == b->end) {
+      ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                    "relay: http upstream sent too big header");
+      return NGX_ERROR;
+    }
+    return NGX_AGAIN;
+  }
+
+  ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_relay_module);
+
+  status = NGX_ERROR;
+  if (end - b->pos >= 12 &&
+      ngx_strncmp(b->pos, "HTTP/1.", sizeof("HTTP/1.") - 1) == 0) {
+    status = ngx_atoi(b->pos + 9, 3);
+  }
+
+  if (status != 200) {
+    ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                  "relay: http upstream '%V' responded with status %i",
+                  &ctx->url, status);
+    return NGX_ERROR;
+  }
+
+  hc->state = ngx_rtmp_relay_http_plain;
+
+  for (line = b->pos; line < end; line = p + 2) {
+    p = ngx_strlchr(line, end, CR);
+    if (p == NULL) {
+      p = end;
+    }
+
+    if (p - line > (ssize_t)sizeof("Transfer-Encoding:") - 1 &&
+        ngx_strncasecmp(line, (u_char *)"Transfer-Encoding:",
+                        sizeof("Transfer-Encoding:") - 1) == 0 &&
+        ngx_strlcasestrn(line, p, (u_char *)"chunked",
+                         sizeof("chunked") - 2) != NULL) {
+      hc->state = ngx_rtmp_relay_http_chunk_size;
+      hc->chunk = 0;
+    }
+  }
+
+  b->pos = end + 4;
+
+  hc->flv_state = ngx_rtmp_relay_flv_header;
+  hc->nhdr = 0;
+
+  if (ctx->tag == &ngx_rtmp_relay_module && ctx->data) {
+    target = ctx->data;
+    target->fails = 0;
+    ctx->established = 1;
+  }
+
+  return ngx_rtmp_relay_publish_local(s);
+}
+
+static ngx_chain_t *ngx_rtmp_relay_http_alloc_link(ngx_pool_t *pool,
+                                                   ngx_rtmp_relay_http_t *hc) {
+  ngx_chain_t *cl;
+
+  cl = hc->free;
+  if (cl) {
+    hc->free = cl->next;
+    return cl;
+  }
+
+  cl = ngx_alloc_chain_link(pool);
+  if (cl == NULL) {
+    return NULL;
+  }
+
+  cl->buf = ngx_calloc_buf(pool);
+  if (cl->buf == NULL) {
+    return NULL;
+  }
+
+  cl->buf->memory = 1;
+
+  return cl;
+}
+
+static ngx_int_t ngx_rtmp_relay_http_tag(ngx_rtmp_session_t *s,
+                                         ngx_rtmp_relay_http_t *hc) {
+  ngx_int_t rc;
+
+  if (hc->tag == NULL) {
+    return NGX_OK;
+  }
+
+  *hc->last = NULL;
+
+  rc = NGX_OK;
+
+  switch (hc->h.type) {
+    case NGX_RTMP_MSG_AUDIO:
+    case NGX_RTMP_MSG_VIDEO:
+    case NGX_RTMP_MSG_AMF_META:
+      rc = ngx_rtmp_receive_message(s, &hc->h, hc->tag);
+      break;
+
+    default:
+      ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                     "relay: skipping flv tag type=%d", (int)hc->h.type);
+  }
+
+  *hc->last = hc->free;
+  hc->free = hc->tag;
+  hc->tag = NULL;
+  hc->last = &hc->tag;
+
+  return rc;
+}
+
+static ngx_int_t ngx_rtmp_relay_http_flv(ngx_rtmp_session_t *s,
+                                         ngx_rtmp_relay_http_t *hc, u_char *p,
+                                         u_char *last) {
+  ngx_rtmp_core_srv_conf_t *cscf;
+  ngx_chain_t *cl;
+  u_char *h;
+  size_t n;
+
+  while (p < last) {
+    switch (hc->flv_state) {
+      case ngx_rtmp_relay_flv_header:
+      case ngx_rtmp_relay_flv_tag_header:
+        n = (hc->flv_state == ngx_rtmp_relay_flv_header
+                 ? NGX_RTMP_RELAY_FLV_HEADER
+                 : NGX_RTMP_RELAY_FLV_TAG_HEADER);
+
+        n = ngx_min(n - hc->nhdr, (size_t)(last - p));
+        ngx_memcpy(hc->hdr + hc->nhdr, p, n);
+        hc->nhdr += n;
+        p += n;
+
+        h = hc->hdr;
+
+        if (hc->flv_state == ngx_rtmp_relay_flv_header) {
+          if (hc->nhdr < NGX_RTMP_RELAY_FLV_HEADER) {
+            break;
+          }
+
+          if (h[0] != 'F' || h[1] != 'L' || h[2] != 'V') {
+            ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                          "relay: http upstream sent no flv stream");
+            return NGX_ERROR;
+          }
+
+          /* rest of the header and PreviousTagSize0 */
+          n = ((size_t)h[5] << 24) | ((size_t)h[6] << 16) |
+              ((size_t)h[7] << 8) | h[8];
+          if (n < NGX_RTMP_RELAY_FLV_HEADER) {
+            return NGX_ERROR;
+          }
+
+          hc->need = n - NGX_RTMP_RELAY_FLV_HEADER + 4;
+          hc->flv_state = ngx_rtmp_relay_flv_skip;
+          break;
+        }
+
+        if (hc->nhdr < NGX_RTMP_RELAY_FLV_TAG_HEADER) {
+          break;
+        }
+
+        ngx_memzero(&hc->h, sizeof(hc->h));
+        hc->h.type = h[0] & 0x1f;
+        hc->h.mlen = ((uint32_t)h[1] << 16) | ((uint32_t)h[2] << 8) | h[3];
+        hc->h.timestamp = ((uint32_t)h[7] << 24) | ((uint32_t)h[4] << 16) |
+                          ((uint32_t)h[5] << 8) | h[6];
+        hc->h.msid = NGX_RTMP_MSID;
+        hc->h.csid = (hc->h.type == NGX_RTMP_MSG_AUDIO   ? NGX_RTMP_CSID_AUDIO
+                      : hc->h.type == NGX_RTMP_MSG_VIDEO ? NGX_RTMP_CSID_VIDEO
+                                                         : NGX_RTMP_CSID_AMF);
+
+        cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
+        if (hc->h.mlen > cscf->max_message) {
+          ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                        "relay: too big flv tag: %uD", hc->h.mlen);
+          return NGX_ERROR;
+        }
+
+        hc->need = hc->h.mlen;
+        hc->flv_state = ngx_rtmp_relay_flv_tag_data;
+
+        if (hc->need) {
+          break;
+        }
+
+        /* fall through */
+
+      case ngx_rtmp_relay_flv_tag_data:
+        n = ngx_min(hc->need, (size_t)(last - p));
+
+        if (n) {
+          cl = ngx_rtmp_relay_http_alloc_link(s->connection->pool, hc);
+          if (cl == NULL) {
+            return NGX_ERROR;
+          }
+
+          cl->buf->pos = p;
+          cl->buf->last = p + n;
+          cl->buf->start = p;
+          cl->buf->end = p + n;
+
+          *hc->last = cl;
+          hc->last = &cl->next;
+
+          p += n;
+          hc->need -= n;
+        }
+
+        if (hc->need) {
+          break;
+        }
 
-  play_ctx = create_play_ctx(s, name, target);
-  if (play_ctx == NULL) {
-    return NGX_ERROR;
-  }
+        if (ngx_rtmp_relay_http_tag(s, hc) != NGX_OK) {
+          return NGX_ERROR;
+        }
 
-  hash = ngx_hash_key(name->data, name->len);
-  cctx = &racf->ctx[hash % racf->nbuckets];
-  for (; *cctx; cctx = &(*cctx)->next) {
-    if ((*cctx)->name.len == name->len &&
-        !ngx_memcmp(name->data, (*cctx)->name.data, name->len)) {
-      break;
-    }
-  }
+        /* PreviousTagSize */
+        hc->need = 4;
+        hc->flv_state = ngx_rtmp_relay_flv_skip;
+        break;
 
-  if (*cctx) {
-    play_ctx->publish = (*cctx)->publish;
-    play_ctx->next = (*cctx)->play;
-    (*cctx)->play = play_ctx;
-    return NGX_OK;
-  }
+      case ngx_rtmp_relay_flv_skip:
+        n = ngx_min(hc->need, (size_t)(last - p));
+        p += n;
+        hc->need -= n;
 
-  publish_ctx = create_publish_ctx(s, name, target);
-  if (publish_ctx == NULL) {
-    ngx_rtmp_finalize_session(play_ctx->session);
-    return NGX_ERROR;
+        if (hc->need == 0) {
+          hc->nhdr = 0;
+          hc->flv_state = ngx_rtmp_relay_flv_tag_header;
+        }
+        break;
+    }
   }
 
-  publish_ctx->publish = publish_ctx;
-  publish_ctx->play = play_ctx;
-  play_ctx->publish = publish_ctx;
-  *cctx = publish_ctx;
-
   return NGX_OK;
 }
 
-ngx_int_t ngx_rtmp_relay_pull(ngx_rtmp_session_t *s, ngx_str_t *name,
-                              ngx_rtmp_relay_target_t *target) {
-  ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
-                "relay: create pull name='%V' app='%V' playpath='%V' url='%V'",
-                name, &target->app, &target->play_path, &target->url.url);
+static ngx_int_t ngx_rtmp_relay_http_body(ngx_rtmp_session_t *s,
+                                          ngx_rtmp_relay_http_t *hc, u_char *p,
+                                          u_char *last) {
+  ngx_int_t d;
+  size_t n;
 
-  return ngx_rtmp_relay_create(s, name, target,
-                               ngx_rtmp_relay_create_remote_ctx,
-                               ngx_rtmp_relay_create_local_ctx);
-}
+  while (p < last) {
+    switch (hc->state) {
+      case ngx_rtmp_relay_http_plain:
+        return ngx_rtmp_relay_http_flv(s, hc, p, last);
+
+      case ngx_rtmp_relay_http_chunk_size:
+        d = ngx_hextoi(p, 1);
+        if (d == NGX_ERROR) {
+          /* CRLF or extension, up to LF */
+          hc->state = ngx_rtmp_relay_http_chunk_ext;
+          break;
+        }
 
-ngx_int_t ngx_rtmp_relay_push(ngx_rtmp_session_t *s, ngx_str_t *name,
-                              ngx_rtmp_relay_target_t *target) {
-  ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
-                "relay: create push name='%V' app='%V' playpath='%V' url='%V'",
-                name, &target->app, &target->play_path, &target->url.url);
+        p++;
 
-  return ngx_rtmp_relay_create(s, name, target, ngx_rtmp_relay_create_local_ctx,
-                               ngx_rtmp_relay_create_remote_ctx);
-}
+        if (hc->chunk > NGX_MAX_SIZE_T_VALUE / 16) {
+          return NGX_ERROR;
+        }
 
-static ngx_int_t ngx_rtmp_relay_publish(ngx_rtmp_session_t *s,
-                                        ngx_rtmp_publish_t *v) {
-  ngx_rtmp_relay_app_conf_t *racf;
-  ngx_rtmp_relay_target_t *target, **t;
-  ngx_str_t name;
-  size_t n;
-  ngx_rtmp_relay_ctx_t *ctx;
+        hc->chunk = hc->chunk * 16 + d;
+        break;
 
-  if (s->auto_pushed) {
-    goto next;
-  }
+      case ngx_rtmp_relay_http_chunk_ext:
+        if (*p++ == LF) {
+          hc->state = (hc->chunk ? ngx_rtmp_relay_http_chunk_data
+                                 : ngx_rtmp_relay_http_chunk_last);
+        }
+        break;
 
-  ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_relay_module);
-  if (ctx && s->relay) {
-    goto next;
-  }
+      case ngx_rtmp_relay_http_chunk_data:
+        n = ngx_min(hc->chunk, (size_t)(last - p));
 
-  racf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_relay_module);
-  if (racf == NULL || racf->pushes.nelts == 0) {
-    goto next;
+        if (ngx_rtmp_relay_http_flv(s, hc, p, p + n) != NGX_OK) {
+          return NGX_ERROR;
+        }
+
+        p += n;
+        hc->chunk -= n;
+
+        if (hc->chunk == 0) {
+          hc->state = ngx_rtmp_relay_http_chunk_crlf;
+        }
+        break;
+
+      case ngx_rtmp_relay_http_chunk_crlf:
+        if (*p++ == LF) {
+          hc->state = ngx_rtmp_relay_http_chunk_size;
+        }
+        break;
+
+      default: /* last chunk */
+        return NGX_DONE;
+    }
   }
 
-  name.len = ngx_strlen(v->name);
-  name.data = v->name;
+  return hc->state == ngx_rtmp_relay_http_chunk_last ? NGX_DONE : NGX_OK;
+}
 
-  t = racf->pushes.elts;
-  for (n = 0; n < racf->pushes.nelts; ++n, ++t) {
-    target = *t;
+/* make room in the receive buffer, keeping the tag being collected */
 
-    if (target->name.len &&
-        (name.len != target->name.len ||
-         ngx_memcmp(name.data, target->name.data, name.len))) {
-      continue;
+static ngx_int_t ngx_rtmp_relay_http_compact(ngx_rtmp_session_t *s,
+                                             ngx_rtmp_relay_http_t *hc) {
+  ngx_rtmp_core_srv_conf_t *cscf;
+  ngx_chain_t *cl;
+  ngx_buf_t *b, *cb;
+  u_char *keep, *start;
+  size_t size;
+
+  b = &hc->buf;
+  keep = hc->tag ? hc->tag->buf->pos : b->last;
+  start = b->start;
+
+  if (keep == b->start) {
+    cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
+
+    size = 2 * (b->end - b->start);
+    if (size > 2 * cscf->max_message + NGX_RTMP_RELAY_HTTP_BUFSIZE) {
+      ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                    "relay: http upstream buffer overflow");
+      return NGX_ERROR;
     }
 
-    if (ngx_rtmp_relay_push(s, &name, target) == NGX_OK) {
-      continue;
+    start = ngx_palloc(s->connection->pool, size);
+    if (start == NULL) {
+      return NGX_ERROR;
     }
 
-    ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
-                  "relay: push failed name='%V' app='%V' "
-                  "playpath='%V' url='%V'",
-                  &name, &target->app, &target->play_path, &target->url.url);
+    b->end = start + size;
+  }
 
-    if (!ctx->push_evt.timer_set) {
-      ngx_add_timer(&ctx->push_evt, racf->push_reconnect);
+  ngx_memmove(start, keep, b->last - keep);
+
+  if (hc->tag) {
+    for (cl = hc->tag; /* void */; cl = cl->next) {
+      cb = cl->buf;
+      cb->last = start + (cb->last - keep);
+      cb->pos = start + (cb->pos - keep);
+      cb->start = cb->pos;
+      cb->end = cb->last;
+
+      if (&cl->next == hc->last) {
+        break;
+      }
     }
   }
 
-next:
-  return next_publish(s, v);
+  if (start != b->start) {
+    ngx_pfree(s->connection->pool, b->start);
+    b->start = start;
+  }
+
+  b->last = start + (b->last - keep);
+  b->pos = b->last;
+
+  return NGX_OK;
 }
 
-static ngx_int_t ngx_rtmp_relay_play(ngx_rtmp_session_t *s,
-                                     ngx_rtmp_play_t *v) {
-  ngx_rtmp_relay_app_conf_t *racf;
-  ngx_rtmp_relay_target_t *target, **t;
-  ngx_str_t name;
-  size_t n;
+static void ngx_rtmp_relay_http_recv(ngx_event_t *rev) {
+  ngx_connection_t *c;
+  ngx_rtmp_session_t *s;
   ngx_rtmp_relay_ctx_t *ctx;
+  ngx_rtmp_relay_http_t *hc;
+  ngx_buf_t *b;
+  ngx_int_t rc;
+  ssize_t n;
+  u_char *p;
 
-  ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_relay_module);
-  if (ctx && s->relay) {
-    goto next;
+  c = rev->data;
+  s = c->data;
+
+  if (c->destroyed) {
+    return;
   }
 
-  racf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_relay_module);
-  if (racf == NULL || racf->pulls.nelts == 0) {
-    goto next;
+  if (rev->timedout) {
+    ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT,
+                  "relay: http upstream timed out");
+    c->timedout = 1;
+    ngx_rtmp_finalize_session(s);
+    return;
   }
 
-  name.len = ngx_strlen(v->name);
-  name.data = v->name;
+  if (rev->timer_set) {
+    ngx_del_timer(rev);
+  }
 
-  t = racf->pulls.elts;
-  for (n = 0; n < racf->pulls.nelts; ++n, ++t) {
-    target = *t;
+  ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_relay_module);
+  hc = ctx->http;
+  b = &hc->buf;
+
+  for (;;) {
+    if (b->last == b->end && hc->state != ngx_rtmp_relay_http_status &&
+        ngx_rtmp_relay_http_compact(s, hc) != NGX_OK) {
+      ngx_rtmp_finalize_session(s);
+      return;
+    }
 
-    if (target->name.len &&
-        (name.len != target->name.len ||
-         ngx_memcmp(name.data, target->name.data, name.len))) {
-      continue;
+    n = c->recv(c, b->last, b->end - b->last);
+
+    if (n == NGX_AGAIN) {
+      ngx_add_timer(rev, s->timeout);
+      if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+        ngx_rtmp_finalize_session(s);
+      }
+      return;
     }
 
-    if (ngx_rtmp_relay_pull(s, &name, target) == NGX_OK) {
-      continue;
+    if (n == NGX_ERROR || n == 0) {
+      ngx_rtmp_finalize_session(s);
+      return;
     }
 
-    ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
-                  "relay: pull failed name='%V' app='%V' "
-                  "playpath='%V' url='%V'",
-                  &name, &target->app, &target->play_path, &target->url.url);
-  }
+    ngx_rtmp_update_bandwidth(&ngx_rtmp_bw_in, n);
+    s->in_bytes += n;
 
-next:
-  return next_play(s, v);
-}
+    p = b->last;
+    b->last += n;
 
-static ngx_int_t ngx_rtmp_relay_play_local(ngx_rtmp_session_t *s) {
-  ngx_rtmp_play_t v;
-  ngx_rtmp_relay_ctx_t *ctx;
+    if (hc->state == ngx_rtmp_relay_http_status) {
+      rc = ngx_rtmp_relay_http_headers(s, hc);
 
-  ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_relay_module);
-  if (ctx == NULL) {
-    return NGX_ERROR;
-  }
+      if (rc == NGX_AGAIN) {
+        continue;
+      }
 
-  ngx_memzero(&v, sizeof(ngx_rtmp_play_t));
-  v.silent = 1;
-  *(ngx_cpymem(v.name, ctx->name.data,
-               ngx_min(sizeof(v.name) - 1, ctx->name.len))) = 0;
+      if (rc != NGX_OK) {
+        ngx_rtmp_finalize_session(s);
+        return;
+      }
 
-  return ngx_rtmp_play(s, &v);
-}
+      p = b->pos;
+    }
 
-static ngx_int_t ngx_rtmp_relay_publish_local(ngx_rtmp_session_t *s) {
-  ngx_rtmp_publish_t v;
-  ngx_rtmp_relay_ctx_t *ctx;
+    rc = ngx_rtmp_relay_http_body(s, hc, p, b->last);
 
-  ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_relay_module);
-  if (ctx == NULL) {
-    return NGX_ERROR;
-  }
+    if (c->destroyed) {
+      return;
+    }
 
-  ngx_memzero(&v, sizeof(ngx_rtmp_publish_t));
-  v.silent = 1;
-  *(ngx_cpymem(v.name, ctx->name.data,
-               ngx_min(sizeof(v.name) - 1, ctx->name.len))) = 0;
+    if (rc == NGX_DONE) {
+      ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                    "relay: http upstream finished the stream");
+    }
 
-  ngx_memcpy(s->stream_name, v.name, ngx_strlen(v.name));
+    if (rc != NGX_OK) {
+      ngx_rtmp_finalize_session(s);
+      return;
+    }
 
-  return ngx_rtmp_publish(s, &v);
+    /* nothing refers to the buffer between tags */
+    if (hc->tag == NULL) {
+      b->pos = b->start;
+      b->last = b->start;
+    }
+  }
 }
 
 static ngx_int_t ngx_rtmp_relay_send_connect(ngx_rtmp_session_t *s) {
@@ -968,6 +2074,30 @@ static ngx_int_t ngx_rtmp_relay_send_create_stream(ngx_rtmp_session_t *s) {
                            sizeof(out_elts) / sizeof(out_elts[0]));
 }
 
+static ngx_int_t ngx_rtmp_relay_send_delete_stream(ngx_rtmp_session_t *s) {
+  static double trans;
+  static double stream = NGX_RTMP_RELAY_MSID;
+
+  static ngx_rtmp_amf_elt_t out_elts[] = {
+
+      {NGX_RTMP_AMF_STRING, ngx_null_string, "deleteStream", 0},
+
+      {NGX_RTMP_AMF_NUMBER, ngx_null_string, &trans, 0},
+
+      {NGX_RTMP_AMF_NULL, ngx_null_string, NULL, 0},
+
+      {NGX_RTMP_AMF_NUMBER, ngx_null_string, &stream, 0}};
+
+  ngx_rtmp_header_t h;
+
+  ngx_memzero(&h, sizeof(h));
+  h.csid = NGX_RTMP_RELAY_CSID_AMF_INI;
+  h.type = NGX_RTMP_MSG_AMF_CMD;
+
+  return ngx_rtmp_send_amf(s, &h, out_elts,
+                           sizeof(out_elts) / sizeof(out_elts[0]));
+}
+
 static ngx_int_t ngx_rtmp_relay_send_publish(ngx_rtmp_session_t *s) {
   static double trans;
 
@@ -1070,6 +2200,7 @@ static ngx_int_t ngx_rtmp_relay_on_result(ngx_rtmp_session_t *s,
                                           ngx_rtmp_header_t *h,
                                           ngx_chain_t *in) {
   ngx_rtmp_relay_ctx_t *ctx;
+  ngx_rtmp_relay_target_t *target;
   static struct {
     double trans;
     u_char level[32];
@@ -1112,6 +2243,12 @@ static ngx_int_t ngx_rtmp_relay_on_result(ngx_rtmp_session_t *s,
 
   switch ((ngx_int_t)v.trans) {
     case NGX_RTMP_RELAY_CONNECT_TRANS:
+      if (ctx->tag == &ngx_rtmp_relay_module && ctx->data) {
+        target = ctx->data;
+        target->fails = 0;
+        ctx->established = 1;
+      }
+
       return ngx_rtmp_relay_send_create_stream(s);
 
     case NGX_RTMP_RELAY_CREATE_STREAM_TRANS:
@@ -1125,6 +2262,11 @@ static ngx_int_t ngx_rtmp_relay_on_result(ngx_rtmp_session_t *s,
         if (ngx_rtmp_relay_send_play(s) != NGX_OK) {
           return NGX_ERROR;
         }
+
+        if (ctx->reused) {
+          return NGX_OK;
+        }
+
         return ngx_rtmp_relay_publish_local(s);
       }
 
@@ -1231,6 +2373,12 @@ static ngx_int_t ngx_rtmp_relay_on_status(ngx_rtmp_session_t *s,
                  "relay: onStatus: level='%s' code='%s' description='%s'",
                  v.level, v.code, v.desc);
 
+  if (ctx->reused && ctx->publish == ctx &&
+      ngx_strcmp(v.code, "NetStream.Play.Start") == 0) {
+    ctx->reused = 0;
+    return ngx_rtmp_relay_publish_local(s);
+  }
+
   return NGX_OK;
 }
 
@@ -1253,6 +2401,8 @@ static void ngx_rtmp_relay_close(ngx_rtmp_session_t *s) {
   ngx_rtmp_notify_ctx_t *nctx;
   ngx_uint_t hash, i;
   ngx_rtmp_session_t *ss, **temp, **cur;
+  ngx_rtmp_relay_target_t *target;
+  ngx_rtmp_close_stream_t cv;
   ngx_array_t *buffer;
   racf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_relay_module);
 
@@ -1262,8 +2412,25 @@ static void ngx_rtmp_relay_close(ngx_rtmp_session_t *s) {
     return;
   }
 
+  if (ctx->parked) {
+    ngx_rtmp_relay_unpark(ctx);
+    return;
+  }
+
+  target = NULL;
+
+  if (s->relay && ctx->tag == &ngx_rtmp_relay_module && ctx->publish == ctx) {
+    target = ctx->data;
+
+    if (!ctx->established) {
+      ngx_rtmp_relay_target_failed(racf, target);
+    }
+  }
+
   if (s->static_relay) {
-    ngx_add_timer(ctx->static_evt, racf->pull_reconnect);
+    ngx_add_timer(ctx->static_evt,
+                  target && target->fails ? ngx_rtmp_relay_backoff(racf, target)
+                                          : racf->pull_reconnect);
   }
 
   if (nctx && nctx->reconnect_evt.timer_set) {
@@ -1298,7 +2465,10 @@ static void ngx_rtmp_relay_close(ngx_rtmp_session_t *s) {
       ngx_log_debug2(NGX_LOG_DEBUG_RTMP, ctx->publish->session->connection->log,
                      0, "relay: publish disconnect empty app='%V' name='%V'",
                      &ctx->app, &ctx->name);
-      ngx_rtmp_finalize_session(ctx->publish->session);
+
+      if (ngx_rtmp_relay_park(ctx->publish) != NGX_OK) {
+        ngx_rtmp_finalize_session(ctx->publish->session);
+      }
     }
 
     ctx->publish = NULL;
@@ -1314,6 +2484,16 @@ static void ngx_rtmp_relay_close(ngx_rtmp_session_t *s) {
   if (ctx->push_evt.timer_set) {
     ngx_del_timer(&ctx->push_evt);
   }
+
+  if (ngx_rtmp_relay_failover(s, ctx) == NGX_OK) {
+    ctx->publish = NULL;
+
+    cv.stream = 0;
+    ngx_rtmp_close_stream(s, &cv);
+
+    return;
+  }
+
   ///加加加
   buffer =
       ngx_array_create(s->connection->pool, 1, sizeof(ngx_rtmp_session_t *));
@@ -1338,8 +2518,6 @@ static void ngx_rtmp_relay_close(ngx_rtmp_session_t *s) {
     *cctx = ctx->next;
   }
 
-  ngx_rtmp_close_stream_t cv;
-
   cv.stream = 0;
 
   ngx_rtmp_close_stream(s, &cv);
@@ -1409,6 +2587,18 @@ static char *ngx_rtmp_relay_push_pull(ngx_conf_t *cf, ngx_command_t *cmd,
   if (ngx_strncasecmp(u->url.data, (u_char *)"rtmp://", 7) == 0) {
     u->url.data += 7;
     u->url.len -= 7;
+
+  } else if (ngx_strncasecmp(u->url.data, (u_char *)"http://", 7) == 0) {
+    if (!is_pull) {
+      ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                         "http upstream is only supported for pull");
+      return NGX_CONF_ERROR;
+    }
+
+    u->url.data += 7;
+    u->url.len -= 7;
+    u->default_port = 80;
+    target->http = 1;
   }
 
   if (ngx_parse_url(cf->pool, u) != NGX_OK) {
@@ -1419,6 +2609,8 @@ static char *ngx_rtmp_relay_push_pull(ngx_conf_t *cf, ngx_command_t *cmd,
     return NGX_CONF_ERROR;
   }
 
+  target->hash = ngx_murmur_hash2(u->url.data, u->url.len);
+
   value += 2;
   for (i = 2; i < cf->args->nelts; ++i, ++value) {
     p = ngx_strlchr(value->data, value->data + value->len, '=');
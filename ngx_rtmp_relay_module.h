@@ -10,6 +10,9 @@
 #include <ngx_core.h>
 #include "ngx_rtmp.h"
 
+typedef struct ngx_rtmp_relay_ctx_s ngx_rtmp_relay_ctx_t;
+typedef struct ngx_rtmp_relay_http_s ngx_rtmp_relay_http_t;
+
 typedef struct {
   ngx_url_t url;
   ngx_str_t app;
@@ -22,13 +25,21 @@ typedef struct {
   ngx_int_t live;
   ngx_int_t start;
   ngx_int_t stop;
+  ngx_flag_t http; /* HTTP-FLV upstream */
 
   void *tag;          /* usually module reference */
   void *data;         /* module-specific data */
   ngx_uint_t counter; /* mutable connection counter */
-} ngx_rtmp_relay_target_t;
 
-typedef struct ngx_rtmp_relay_ctx_s ngx_rtmp_relay_ctx_t;
+  /* origin health, per worker */
+  uint32_t hash;
+  ngx_uint_t fails;
+  ngx_msec_t retry;
+
+  /* idle upstream connections, per worker */
+  ngx_rtmp_relay_ctx_t *idle;
+  ngx_uint_t nidle;
+} ngx_rtmp_relay_target_t;
 
 struct ngx_rtmp_relay_ctx_s {
   ngx_str_t server_name;
@@ -54,6 +65,17 @@ struct ngx_rtmp_relay_ctx_s {
   ngx_event_t *static_evt;
   void *tag;
   void *data;
+
+  ngx_uint_t tried; /* pull origins already tried, by index */
+  unsigned established : 1;
+
+  /* HTTP-FLV transport, NULL for RTMP */
+  ngx_rtmp_relay_http_t *http;
+
+  /* kept alive between streams */
+  ngx_event_t idle_evt;
+  unsigned parked : 1;
+  unsigned reused : 1;
 };
 
 typedef struct {
@@ -67,6 +89,10 @@ typedef struct {
   ngx_flag_t session_relay;
   ngx_msec_t push_reconnect;
   ngx_msec_t pull_reconnect;
+  ngx_msec_t pull_reconnect_max;
+  ngx_flag_t pull_hash;
+  ngx_int_t pull_keepalive;
+  ngx_msec_t pull_keepalive_timeout;
   ngx_rtmp_relay_ctx_t **ctx;
 } ngx_rtmp_relay_app_conf_t;
 
@@ -77,4 +103,7 @@ ngx_int_t ngx_rtmp_relay_pull(ngx_rtmp_session_t *s, ngx_str_t *name,
 ngx_int_t ngx_rtmp_relay_push(ngx_rtmp_session_t *s, ngx_str_t *name,
                               ngx_rtmp_relay_target_t *target);
 
+/* join an already running pull for name, NGX_DECLINED if there is none */
+ngx_int_t ngx_rtmp_relay_attach(ngx_rtmp_session_t *s, ngx_str_t *name);
+
 #endif /* _NGX_RTMP_RELAY_H_INCLUDED_ */
@@ -45,10 +45,12 @@
   ngx_rtmp_prepare_message(s, &__h, NULL, __l); \
   return __l;
 
+/* rquest from http, RTMP replies are not sent */
+#define ngx_rtmp_send_discarded(s) (!(s)->relay && (s)->data)
+
 static ngx_int_t ngx_rtmp_send_shared_packet(ngx_rtmp_session_t *s,
                                              ngx_chain_t *cl) {
   ngx_rtmp_core_srv_conf_t *cscf;
-  ngx_http_request_t *r;
   ngx_int_t rc;
 
   if (cl == NULL) {
@@ -57,14 +59,10 @@ static ngx_int_t ngx_rtmp_send_shared_packet(ngx_rtmp_session_t *s,
 
   cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
 
-  if (!s->relay) {
-    /* rquest from http */
-    r = s->data;
-    if (r) {
-      ngx_rtmp_free_shared_chain(cscf, cl);
+  if (ngx_rtmp_send_discarded(s)) {
+    ngx_rtmp_free_shared_chain(cscf, cl);
 
-      return NGX_OK;
-    }
+    return NGX_OK;
   }
 
   rc = ngx_rtmp_send_message(s, cl, 0);
@@ -372,12 +370,131 @@ ngx_chain_t *ngx_rtmp_create_amf(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
 
 ngx_int_t ngx_rtmp_send_amf(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
                             ngx_rtmp_amf_elt_t *elts, size_t nelts) {
+  if (ngx_rtmp_send_discarded(s)) {
+    return NGX_OK;
+  }
+
   return ngx_rtmp_send_shared_packet(s, ngx_rtmp_create_amf(s, h, elts, nelts));
 }
 
-ngx_chain_t *ngx_rtmp_create_status(ngx_rtmp_session_t *s, char *code,
-                                    char *level, char *desc) {
-  ngx_rtmp_header_t h;
+#define NGX_RTMP_ENCODE_AMF_BUFSIZE 1024
+
+static ngx_chain_t *ngx_rtmp_alloc_encode_buf(void *arg) {
+  ngx_chain_t *cl;
+
+  cl = ngx_alloc_chain_link((ngx_pool_t *)arg);
+  if (cl == NULL) {
+    return NULL;
+  }
+
+  cl->buf = ngx_create_temp_buf((ngx_pool_t *)arg, NGX_RTMP_ENCODE_AMF_BUFSIZE);
+  if (cl->buf == NULL) {
+    return NULL;
+  }
+
+  cl->next = NULL;
+
+  return cl;
+}
+
+ngx_int_t ngx_rtmp_encode_amf(ngx_conf_t *cf, ngx_rtmp_amf_elt_t *elts,
+                              size_t nelts, ngx_str_t *out) {
+  u_char *p;
+  ngx_chain_t *cl;
+  ngx_rtmp_amf_ctx_t act;
+
+  ngx_memzero(&act, sizeof(act));
+  act.arg = cf->temp_pool;
+  act.alloc = ngx_rtmp_alloc_encode_buf;
+  act.log = cf->log;
+
+  if (ngx_rtmp_amf_write(&act, elts, nelts) != NGX_OK) {
+    return NGX_ERROR;
+  }
+
+  out->len = 0;
+  for (cl = act.first; cl; cl = cl->next) {
+    out->len += cl->buf->last - cl->buf->pos;
+  }
+
+  out->data = ngx_pnalloc(cf->pool, out->len);
+  if (out->data == NULL) {
+    return NGX_ERROR;
+  }
+
+  p = out->data;
+  for (cl = act.first; cl; cl = cl->next) {
+    p = ngx_cpymem(p, cl->buf->pos, cl->buf->last - cl->buf->pos);
+  }
+
+  return NGX_OK;
+}
+
+ngx_chain_t *ngx_rtmp_create_encoded_amf(ngx_rtmp_session_t *s,
+                                         ngx_rtmp_header_t *h, u_char *data,
+                                         size_t len) {
+  ngx_buf_t b;
+  ngx_chain_t in, *out;
+  ngx_rtmp_core_srv_conf_t *cscf;
+
+  ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                 "create: encoded amf len=%uz", len);
+
+  cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
+
+  ngx_memzero(&b, sizeof(b));
+  b.pos = data;
+  b.last = data + len;
+
+  in.buf = &b;
+  in.next = NULL;
+
+  out = ngx_rtmp_append_shared_bufs(cscf, NULL, &in);
+  if (out) {
+    ngx_rtmp_prepare_message(s, h, NULL, out);
+  }
+
+  return out;
+}
+
+ngx_int_t ngx_rtmp_send_encoded_amf(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
+                                    u_char *data, size_t len) {
+  if (ngx_rtmp_send_discarded(s)) {
+    return NGX_OK;
+  }
+
+  return ngx_rtmp_send_shared_packet(
+      s, ngx_rtmp_create_encoded_amf(s, h, data, len));
+}
+
+/*
+ * onStatus with transaction id 0 and a null command object; the info
+ * object strings are written after it
+ */
+static u_char ngx_rtmp_status_head[] = {
+    NGX_RTMP_AMF_STRING, 0x00, 0x08, 'o', 'n', 'S', 't', 'a', 't', 'u', 's',
+    NGX_RTMP_AMF_NUMBER, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    NGX_RTMP_AMF_NULL, NGX_RTMP_AMF_OBJECT, 0x00, 0x05, 'l', 'e', 'v', 'e',
+    'l'};
+
+#define NGX_RTMP_STATUS_CODE "\x00\x04" "code"
+#define NGX_RTMP_STATUS_DESC "\x00\x0b" "description"
+#define NGX_RTMP_STATUS_END "\x00\x00\x09"
+
+#define NGX_RTMP_STATUS_BUFSIZE 512
+
+static u_char *ngx_rtmp_status_string(u_char *p, char *s, size_t len) {
+  *p++ = NGX_RTMP_AMF_STRING;
+  *p++ = (u_char)(len >> 8);
+  *p++ = (u_char)len;
+
+  return ngx_cpymem(p, s, len);
+}
+
+static ngx_chain_t *ngx_rtmp_create_status_amf(ngx_rtmp_session_t *s,
+                                               ngx_rtmp_header_t *h,
+                                               char *code, char *level,
+                                               char *desc) {
   static double trans;
 
   static ngx_rtmp_amf_elt_t out_inf[] = {
@@ -400,26 +517,59 @@ ngx_chain_t *ngx_rtmp_create_status(ngx_rtmp_session_t *s, char *code,
       {NGX_RTMP_AMF_OBJECT, ngx_null_string, out_inf, sizeof(out_inf)},
   };
 
-  ngx_log_debug3(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
-                 "create: status code='%s' level='%s' desc='%s'", code, level,
-                 desc);
-
   out_inf[0].data = level;
   out_inf[1].data = code;
   out_inf[2].data = desc;
 
+  return ngx_rtmp_create_amf(s, h, out_elts,
+                             sizeof(out_elts) / sizeof(out_elts[0]));
+}
+
+ngx_chain_t *ngx_rtmp_create_status(ngx_rtmp_session_t *s, char *code,
+                                    char *level, char *desc) {
+  ngx_rtmp_header_t h;
+  size_t lcode, llevel, ldesc;
+  u_char buf[NGX_RTMP_STATUS_BUFSIZE], *p;
+
+  ngx_log_debug3(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                 "create: status code='%s' level='%s' desc='%s'", code, level,
+                 desc);
+
   memset(&h, 0, sizeof(h));
 
   h.type = NGX_RTMP_MSG_AMF_CMD;
   h.csid = NGX_RTMP_CSID_AMF;
   h.msid = NGX_RTMP_MSID;
 
-  return ngx_rtmp_create_amf(s, &h, out_elts,
-                             sizeof(out_elts) / sizeof(out_elts[0]));
+  lcode = ngx_strlen(code);
+  llevel = ngx_strlen(level);
+  ldesc = ngx_strlen(desc);
+
+  if (sizeof(ngx_rtmp_status_head) + 3 + llevel +
+          sizeof(NGX_RTMP_STATUS_CODE) - 1 + 3 + lcode +
+          sizeof(NGX_RTMP_STATUS_DESC) - 1 + 3 + ldesc +
+          sizeof(NGX_RTMP_STATUS_END) - 1 >
+      sizeof(buf)) {
+    return ngx_rtmp_create_status_amf(s, &h, code, level, desc);
+  }
+
+  p = ngx_cpymem(buf, ngx_rtmp_status_head, sizeof(ngx_rtmp_status_head));
+  p = ngx_rtmp_status_string(p, level, llevel);
+  p = ngx_cpymem(p, NGX_RTMP_STATUS_CODE, sizeof(NGX_RTMP_STATUS_CODE) - 1);
+  p = ngx_rtmp_status_string(p, code, lcode);
+  p = ngx_cpymem(p, NGX_RTMP_STATUS_DESC, sizeof(NGX_RTMP_STATUS_DESC) - 1);
+  p = ngx_rtmp_status_string(p, desc, ldesc);
+  p = ngx_cpymem(p, NGX_RTMP_STATUS_END, sizeof(NGX_RTMP_STATUS_END) - 1);
+
+  return ngx_rtmp_create_encoded_amf(s, &h, buf, p - buf);
 }
 
 ngx_int_t ngx_rtmp_send_status(ngx_rtmp_session_t *s, char *code, char *level,
                                char *desc) {
+  if (ngx_rtmp_send_discarded(s)) {
+    return NGX_OK;
+  }
+
   return ngx_rtmp_send_shared_packet(
       s, ngx_rtmp_create_status(s, code, level, desc));
 }
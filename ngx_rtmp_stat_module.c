@@ -7,6 +7,7 @@
 #include "ngx_rtmp.h"
 #include "ngx_rtmp_bandwidth.h"
 #include "ngx_rtmp_codec_module.h"
+#include "ngx_rtmp_histogram.h"
 #include "ngx_rtmp_live_module.h"
 #include "ngx_rtmp_play_module.h"
 #include "ngx_rtmp_version.h"
@@ -281,6 +282,108 @@ static void ngx_rtmp_stat_bw(ngx_http_request_t *r, ngx_chain_t ***lll,
   }
 }
 
+/*
+ * Only the buckets up to the last non-empty one are listed, each with its
+ * inclusive upper bound; the bound of the overflow bucket is the maximum.
+ */
+static void ngx_rtmp_stat_histogram(ngx_http_request_t *r, ngx_chain_t ***lll,
+                                    ngx_rtmp_histogram_t *h, char *name,
+                                    char *unit) {
+  u_char buf[NGX_INT64_LEN * 3 + 64];
+  ngx_uint_t n, top;
+  uint64_t le;
+  ngx_rtmp_stat_loc_conf_t *slcf;
+
+  slcf = ngx_http_get_module_loc_conf(r, ngx_rtmp_stat_module);
+
+  for (top = NGX_RTMP_HISTOGRAM_BUCKETS; top && h->bucket[top - 1] == 0;
+       top--)
+    ;
+
+  if (slcf->format & NGX_RTMP_STAT_FORMAT_XML) {
+    NGX_RTMP_STAT_L("<");
+    NGX_RTMP_STAT_CS(name);
+    NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
+                                    " unit=\"%s\"><count>%uL</count>"
+                                    "<sum>%uL</sum><max>%uL</max>",
+                                    unit, h->count, h->sum, h->max) -
+                           buf);
+  } else {
+    NGX_RTMP_STAT_L("\"");
+    NGX_RTMP_STAT_CS(name);
+    NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
+                                    "\":{\"unit\":\"%s\",\"count\":%uL,"
+                                    "\"sum\":%uL,\"max\":%uL,\"buckets\":[",
+                                    unit, h->count, h->sum, h->max) -
+                           buf);
+  }
+
+  for (n = 0; n < top; n++) {
+    le = n == NGX_RTMP_HISTOGRAM_BUCKETS - 1 ? h->max
+                                             : ((uint64_t)1 << n) - 1;
+
+    if (slcf->format & NGX_RTMP_STAT_FORMAT_XML) {
+      NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
+                                      "<bucket le=\"%uL\">%uL</bucket>", le,
+                                      h->bucket[n]) -
+                             buf);
+    } else {
+      NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
+                                      "%s{\"le\":%uL,\"n\":%uL}",
+                                      n ? "," : "", le, h->bucket[n]) -
+                             buf);
+    }
+  }
+
+  if (slcf->format & NGX_RTMP_STAT_FORMAT_XML) {
+    NGX_RTMP_STAT_L("</");
+    NGX_RTMP_STAT_CS(name);
+    NGX_RTMP_STAT_L(">\r\n");
+  } else {
+    NGX_RTMP_STAT_L("]}");
+  }
+}
+
+static void ngx_rtmp_stat_histograms(ngx_http_request_t *r,
+                                     ngx_chain_t ***lll) {
+  ngx_rtmp_stat_loc_conf_t *slcf;
+
+  slcf = ngx_http_get_module_loc_conf(r, ngx_rtmp_stat_module);
+
+  if (slcf->format & NGX_RTMP_STAT_FORMAT_XML) {
+    NGX_RTMP_STAT_L("<histograms>\r\n");
+  } else {
+    NGX_RTMP_STAT_L("\"histograms\":{");
+  }
+
+  ngx_rtmp_stat_histogram(r, lll, &ngx_rtmp_hist_latency, "latency", "msec");
+
+  if (slcf->format & NGX_RTMP_STAT_FORMAT_JSON) {
+    NGX_RTMP_STAT_L(",");
+  }
+
+  ngx_rtmp_stat_histogram(r, lll, &ngx_rtmp_hist_out_queue, "out_queue",
+                          "messages");
+
+  if (slcf->format & NGX_RTMP_STAT_FORMAT_JSON) {
+    NGX_RTMP_STAT_L(",");
+  }
+
+  ngx_rtmp_stat_histogram(r, lll, &ngx_rtmp_hist_join, "join", "msec");
+
+  if (slcf->format & NGX_RTMP_STAT_FORMAT_JSON) {
+    NGX_RTMP_STAT_L(",");
+  }
+
+  ngx_rtmp_stat_histogram(r, lll, &ngx_rtmp_hist_send, "send", "bytes");
+
+  if (slcf->format & NGX_RTMP_STAT_FORMAT_XML) {
+    NGX_RTMP_STAT_L("</histograms>\r\n");
+  } else {
+    NGX_RTMP_STAT_L("},");
+  }
+}
+
 #ifdef NGX_RTMP_POOL_DEBUG
 static void ngx_rtmp_stat_get_pool_size(ngx_pool_t *pool, ngx_uint_t *nlarge,
                                         ngx_uint_t *size) {
@@ -529,6 +632,18 @@ static void ngx_rtmp_stat_live(ngx_http_request_t *r, ngx_chain_t ***lll,
                 ngx_snprintf(buf, sizeof(buf), "%ui", ctx->ndropped) - buf);
             NGX_RTMP_STAT_L("</dropped>");
 
+            NGX_RTMP_STAT_L("<queued>");
+            NGX_RTMP_STAT(
+                buf,
+                ngx_snprintf(buf, sizeof(buf), "%uz", s->out_queued) - buf);
+            NGX_RTMP_STAT_L("</queued>");
+
+            NGX_RTMP_STAT_L("<queue_dropped>");
+            NGX_RTMP_STAT(
+                buf,
+                ngx_snprintf(buf, sizeof(buf), "%ui", s->out_dropped) - buf);
+            NGX_RTMP_STAT_L("</queue_dropped>");
+
             NGX_RTMP_STAT_L("<avsync>");
             if (!lacf->interleave) {
               NGX_RTMP_STAT(bbuf, ngx_snprintf(bbuf, sizeof(bbuf), "%D",
@@ -557,6 +672,16 @@ static void ngx_rtmp_stat_live(ngx_http_request_t *r, ngx_chain_t ***lll,
                 buf,
                 ngx_snprintf(buf, sizeof(buf), "%ui", ctx->ndropped) - buf);
 
+            NGX_RTMP_STAT_L(",\"queued\":");
+            NGX_RTMP_STAT(
+                buf,
+                ngx_snprintf(buf, sizeof(buf), "%uz", s->out_queued) - buf);
+
+            NGX_RTMP_STAT_L(",\"queue_dropped\":");
+            NGX_RTMP_STAT(
+                buf,
+                ngx_snprintf(buf, sizeof(buf), "%ui", s->out_dropped) - buf);
+
             NGX_RTMP_STAT_L(",\"avsync\":");
             if (!lacf->interleave) {
               NGX_RTMP_STAT(bbuf, ngx_snprintf(bbuf, sizeof(bbuf), "%D",
@@ -1116,6 +1241,8 @@ static ngx_int_t ngx_rtmp_stat_handler(ngx_http_request_t *r) {
   ngx_rtmp_stat_bw(r, lll, &ngx_rtmp_bw_in, "in", NGX_RTMP_STAT_BW_BYTES);
   ngx_rtmp_stat_bw(r, lll, &ngx_rtmp_bw_out, "out", NGX_RTMP_STAT_BW_BYTES);
 
+  ngx_rtmp_stat_histograms(r, lll);
+
   if (slcf->format & NGX_RTMP_STAT_FORMAT_JSON) {
     NGX_RTMP_STAT_L("\"servers\":[");
   }
@@ -0,0 +1,875 @@
+
+/*
+ * Copyright (C) Winshining
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include "ngx_rtmp.h"
+#include "ngx_rtmp_cmd_module.h"
+#include "ngx_rtmp_codec_module.h"
+#include "ngx_rtmp_live_module.h"
+#include "ngx_http_flv_live_module.h"
+
+/*
+ * Time-shift window.
+ *
+ * Every audio/video frame a publisher sends is kept in a per-stream ring
+ * covering timeshift_window. A player asking for "timeshift=<sec>" in its
+ * play arguments (RTMP and HTTP-FLV alike) leaves the live fan-out and is
+ * fed from the ring that far behind live by a timer of its own, paced in
+ * real time. RTMP seek and pause move or stop its cursor; seeking to the
+ * live edge puts it back on the fan-out. The ring is reference counted,
+ * so time-shifted players run to its end after the publisher is gone.
+ */
+
+#define NGX_RTMP_TIMESHIFT_ALLOC 1024
+
+/* play clock lead, keeps the player buffer filled */
+#define NGX_RTMP_TIMESHIFT_LEAD 500
+
+#define NGX_RTMP_TIMESHIFT_MIN_DELAY 10
+#define NGX_RTMP_TIMESHIFT_MAX_DELAY 200
+
+/* a frame older than the newest one by more is a timestamp reset */
+#define NGX_RTMP_TIMESHIFT_MAX_REORDER 1000
+
+typedef struct {
+  ngx_rtmp_header_t h;
+  ngx_uint_t prio;
+  ngx_chain_t *frame;
+  size_t size;
+} ngx_rtmp_timeshift_frame_t;
+
+typedef struct {
+  ngx_uint_t refs;
+  unsigned closed : 1;
+  unsigned video : 1;
+
+  ngx_rtmp_core_srv_conf_t *cscf;
+
+  /* frames are numbered, frame n lives at frames[n & (nalloc - 1)] */
+  ngx_rtmp_timeshift_frame_t *frames;
+  ngx_uint_t nalloc;
+  ngx_uint_t first;
+  ngx_uint_t last;
+  size_t size;
+
+  ngx_chain_t *avc_header;
+  ngx_chain_t *aac_header;
+  ngx_chain_t *meta;
+  ngx_uint_t meta_version;
+} ngx_rtmp_timeshift_ring_t;
+
+typedef struct {
+  ngx_rtmp_session_t *session;
+  ngx_rtmp_timeshift_ring_t *ring;
+
+  /* player cursor and play clock */
+  ngx_uint_t next;
+  uint32_t base_ts;
+  ngx_msec_t base_msec;
+  ngx_msec_t pause_msec;
+  ngx_event_t pump;
+  unsigned player : 1;
+  unsigned paused : 1;
+} ngx_rtmp_timeshift_ctx_t;
+
+typedef struct {
+  ngx_flag_t timeshift;
+  ngx_msec_t window;
+  size_t max_size;
+} ngx_rtmp_timeshift_app_conf_t;
+
+#define ngx_rtmp_timeshift_frame(ring, n) \
+  (&(ring)->frames[(n) & ((ring)->nalloc - 1)])
+
+static ngx_rtmp_play_pt next_play;
+static ngx_rtmp_seek_pt next_seek;
+static ngx_rtmp_pause_pt next_pause;
+static ngx_rtmp_close_stream_pt next_close_stream;
+
+static ngx_int_t ngx_rtmp_timeshift_postconfiguration(ngx_conf_t *cf);
+static void *ngx_rtmp_timeshift_create_app_conf(ngx_conf_t *cf);
+static char *ngx_rtmp_timeshift_merge_app_conf(ngx_conf_t *cf, void *parent,
+                                               void *child);
+
+extern ngx_rtmp_live_proc_handler_t
+    *ngx_rtmp_live_proc_handlers[NGX_RTMP_PROTOCOL_TS + 1];
+extern ngx_module_t ngx_http_flv_live_module;
+
+static ngx_command_t ngx_rtmp_timeshift_commands[] = {
+    {ngx_string("timeshift"), NGX_RTMP_MAIN_CONF | NGX_RTMP_SRV_CONF |
+                                  NGX_RTMP_APP_CONF | NGX_CONF_TAKE1,
+     ngx_conf_set_flag_slot, NGX_RTMP_APP_CONF_OFFSET,
+     offsetof(ngx_rtmp_timeshift_app_conf_t, timeshift), NULL},
+
+    {ngx_string("timeshift_window"), NGX_RTMP_MAIN_CONF | NGX_RTMP_SRV_CONF |
+                                         NGX_RTMP_APP_CONF | NGX_CONF_TAKE1,
+     ngx_conf_set_msec_slot, NGX_RTMP_APP_CONF_OFFSET,
+     offsetof(ngx_rtmp_timeshift_app_conf_t, window), NULL},
+
+    {ngx_string("timeshift_max_size"), NGX_RTMP_MAIN_CONF |
+                                           NGX_RTMP_SRV_CONF |
+                                           NGX_RTMP_APP_CONF | NGX_CONF_TAKE1,
+     ngx_conf_set_size_slot, NGX_RTMP_APP_CONF_OFFSET,
+     offsetof(ngx_rtmp_timeshift_app_conf_t, max_size), NULL},
+
+    ngx_null_command};
+
+static ngx_rtmp_module_t ngx_rtmp_timeshift_module_ctx = {
+    NULL,                                 /* preconfiguration */
+    ngx_rtmp_timeshift_postconfiguration, /* postconfiguration */
+    NULL,                                 /* create main configuration */
+    NULL,                                 /* init main configuration */
+    NULL,                                 /* create server configuration */
+    NULL,                                 /* merge server configuration */
+    ngx_rtmp_timeshift_create_app_conf,   /* create app configuration */
+    ngx_rtmp_timeshift_merge_app_conf     /* merge app configuration */
+};
+
+ngx_module_t ngx_rtmp_timeshift_module = {
+    NGX_MODULE_V1,
+    &ngx_rtmp_timeshift_module_ctx, /* module context */
+    ngx_rtmp_timeshift_commands,    /* module directives */
+    NGX_RTMP_MODULE,                /* module type */
+    NULL,                           /* init master */
+    NULL,                           /* init module */
+    NULL,                           /* init process */
+    NULL,                           /* init thread */
+    NULL,                           /* exit thread */
+    NULL,                           /* exit process */
+    NULL,                           /* exit master */
+    NGX_MODULE_V1_PADDING};
+
+static void *ngx_rtmp_timeshift_create_app_conf(ngx_conf_t *cf) {
+  ngx_rtmp_timeshift_app_conf_t *tacf;
+
+  tacf = ngx_pcalloc(cf->pool, sizeof(ngx_rtmp_timeshift_app_conf_t));
+  if (tacf == NULL) {
+    return NULL;
+  }
+
+  tacf->timeshift = NGX_CONF_UNSET;
+  tacf->window = NGX_CONF_UNSET_MSEC;
+  tacf->max_size = NGX_CONF_UNSET_SIZE;
+
+  return tacf;
+}
+
+static char *ngx_rtmp_timeshift_merge_app_conf(ngx_conf_t *cf, void *parent,
+                                               void *child) {
+  ngx_rtmp_timeshift_app_conf_t *prev = parent;
+  ngx_rtmp_timeshift_app_conf_t *conf = child;
+
+  ngx_conf_merge_value(conf->timeshift, prev->timeshift, 0);
+  ngx_conf_merge_msec_value(conf->window, prev->window, 60000);
+  ngx_conf_merge_size_value(conf->max_size, prev->max_size, 64 * 1024 * 1024);
+
+  return NGX_CONF_OK;
+}
+
+static void ngx_rtmp_timeshift_set_chain(ngx_rtmp_timeshift_ring_t *ring,
+                                         ngx_chain_t **dst, ngx_chain_t *src) {
+  if (*dst == src) {
+    return;
+  }
+
+  if (*dst) {
+    ngx_rtmp_free_shared_chain(ring->cscf, *dst);
+  }
+
+  *dst = src;
+
+  if (src) {
+    ngx_rtmp_acquire_shared_chain(src);
+  }
+}
+
+static void ngx_rtmp_timeshift_evict(ngx_rtmp_timeshift_ring_t *ring) {
+  ngx_rtmp_timeshift_frame_t *f;
+
+  f = ngx_rtmp_timeshift_frame(ring, ring->first);
+
+  ngx_rtmp_free_shared_chain(ring->cscf, f->frame);
+  f->frame = NULL;
+
+  ring->size -= f->size;
+  ring->first++;
+}
+
+static ngx_rtmp_timeshift_ring_t *ngx_rtmp_timeshift_create_ring(
+    ngx_rtmp_session_t *s) {
+  ngx_rtmp_timeshift_ring_t *ring;
+
+  ring = ngx_calloc(sizeof(ngx_rtmp_timeshift_ring_t), ngx_cycle->log);
+  if (ring == NULL) {
+    return NULL;
+  }
+
+  ring->frames =
+      ngx_alloc(NGX_RTMP_TIMESHIFT_ALLOC * sizeof(ngx_rtmp_timeshift_frame_t),
+                ngx_cycle->log);
+  if (ring->frames == NULL) {
+    ngx_free(ring);
+    return NULL;
+  }
+
+  ring->nalloc = NGX_RTMP_TIMESHIFT_ALLOC;
+  ring->refs = 1;
+  ring->cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
+
+  return ring;
+}
+
+static void ngx_rtmp_timeshift_release_ring(ngx_rtmp_timeshift_ring_t *ring) {
+  if (--ring->refs) {
+    return;
+  }
+
+  while (ring->first != ring->last) {
+    ngx_rtmp_timeshift_evict(ring);
+  }
+
+  ngx_rtmp_timeshift_set_chain(ring, &ring->avc_header, NULL);
+  ngx_rtmp_timeshift_set_chain(ring, &ring->aac_header, NULL);
+  ngx_rtmp_timeshift_set_chain(ring, &ring->meta, NULL);
+
+  ngx_free(ring->frames);
+  ngx_free(ring);
+}
+
+static ngx_int_t ngx_rtmp_timeshift_grow(ngx_rtmp_timeshift_ring_t *ring) {
+  ngx_rtmp_timeshift_frame_t *frames;
+  ngx_uint_t n, nalloc;
+
+  nalloc = ring->nalloc * 2;
+
+  frames = ngx_alloc(nalloc * sizeof(ngx_rtmp_timeshift_frame_t),
+                     ngx_cycle->log);
+  if (frames == NULL) {
+    return NGX_ERROR;
+  }
+
+  for (n = ring->first; n != ring->last; n++) {
+    frames[n & (nalloc - 1)] = *ngx_rtmp_timeshift_frame(ring, n);
+  }
+
+  ngx_free(ring->frames);
+
+  ring->frames = frames;
+  ring->nalloc = nalloc;
+
+  return NGX_OK;
+}
+
+/* the frame to start from: the last key frame at or before ts */
+static ngx_uint_t ngx_rtmp_timeshift_find(ngx_rtmp_timeshift_ring_t *ring,
+                                          uint32_t ts) {
+  ngx_rtmp_timeshift_frame_t *f;
+  ngx_uint_t n, found;
+
+  found = ring->last;
+
+  for (n = ring->first; n != ring->last; n++) {
+    f = ngx_rtmp_timeshift_frame(ring, n);
+
+    if (ring->video && (f->h.type != NGX_RTMP_MSG_VIDEO ||
+                        f->prio != NGX_RTMP_VIDEO_KEY_FRAME)) {
+      continue;
+    }
+
+    if ((int32_t)(f->h.timestamp - ts) > 0) {
+      if (found == ring->last) {
+        found = n;
+      }
+      break;
+    }
+
+    found = n;
+  }
+
+  return found;
+}
+
+static ngx_int_t ngx_rtmp_timeshift_av(ngx_rtmp_session_t *s,
+                                       ngx_rtmp_header_t *h, ngx_chain_t *in) {
+  ngx_rtmp_timeshift_app_conf_t *tacf;
+  ngx_rtmp_timeshift_ctx_t *ctx;
+  ngx_rtmp_timeshift_ring_t *ring;
+  ngx_rtmp_timeshift_frame_t *f;
+  ngx_rtmp_live_app_conf_t *lacf;
+  ngx_rtmp_live_ctx_t *lctx;
+  ngx_rtmp_codec_ctx_t *codec_ctx;
+  ngx_chain_t *cl;
+  uint32_t csidx;
+
+  tacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_timeshift_module);
+  if (tacf == NULL || !tacf->timeshift || in == NULL || in->buf == NULL) {
+    return NGX_OK;
+  }
+
+  lctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_live_module);
+  if (lctx == NULL || lctx->stream == NULL || !lctx->publishing) {
+    return NGX_OK;
+  }
+
+  lacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_live_module);
+  codec_ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_codec_module);
+
+  ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_timeshift_module);
+  if (ctx == NULL) {
+    ctx = ngx_pcalloc(s->connection->pool, sizeof(ngx_rtmp_timeshift_ctx_t));
+    if (ctx == NULL) {
+      return NGX_ERROR;
+    }
+
+    ctx->session = s;
+    ngx_rtmp_set_ctx(s, ctx, ngx_rtmp_timeshift_module);
+  }
+
+  if (ctx->ring == NULL) {
+    ctx->ring = ngx_rtmp_timeshift_create_ring(s);
+    if (ctx->ring == NULL) {
+      return NGX_OK;
+    }
+  }
+
+  ring = ctx->ring;
+
+  /* sequence headers and metadata are kept as of the live edge */
+  if (codec_ctx) {
+    ngx_rtmp_timeshift_set_chain(ring, &ring->avc_header,
+                                 codec_ctx->avc_header);
+    ngx_rtmp_timeshift_set_chain(ring, &ring->aac_header,
+                                 codec_ctx->aac_header);
+
+    if (ring->meta_version != codec_ctx->meta_version) {
+      ngx_rtmp_timeshift_set_chain(ring, &ring->meta, codec_ctx->meta);
+      ring->meta_version = codec_ctx->meta_version;
+    }
+  }
+
+  if (ngx_rtmp_is_codec_header(in)) {
+    return NGX_OK;
+  }
+
+  if (ring->last - ring->first == ring->nalloc &&
+      ngx_rtmp_timeshift_grow(ring) != NGX_OK) {
+    return NGX_OK;
+  }
+
+  /*
+   * the payload is copied into shared bufs: the message still points into
+   * the receive blocks of the publisher, which are bounded per session and
+   * must not be pinned for a whole window, and the live fan-out chains are
+   * already framed per protocol and released after the fan-out
+   */
+  cl = ngx_rtmp_append_shared_bufs(ring->cscf, NULL, in);
+  if (cl == NULL) {
+    return NGX_OK;
+  }
+
+  /* republish or encoder restart, the old timeline cannot be sought */
+  if (ring->first != ring->last &&
+      (int32_t)(h->timestamp -
+                ngx_rtmp_timeshift_frame(ring, ring->last - 1)->h.timestamp) <
+          -NGX_RTMP_TIMESHIFT_MAX_REORDER) {
+    ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
+                  "timeshift: timestamp reset, restarting window");
+
+    while (ring->first != ring->last) {
+      ngx_rtmp_timeshift_evict(ring);
+    }
+  }
+
+  csidx = !(lacf->interleave || h->type == NGX_RTMP_MSG_VIDEO);
+
+  f = ngx_rtmp_timeshift_frame(ring, ring->last);
+
+  ngx_memzero(&f->h, sizeof(f->h));
+  f->h.timestamp = h->timestamp;
+  f->h.msid = NGX_RTMP_MSID;
+  f->h.csid = lctx->cs[csidx].csid;
+  f->h.type = h->type;
+  f->prio = (h->type == NGX_RTMP_MSG_VIDEO ? ngx_rtmp_get_video_frame_type(in)
+                                           : 0);
+  f->frame = cl;
+  f->size = h->mlen;
+
+  if (h->type == NGX_RTMP_MSG_VIDEO) {
+    ring->video = 1;
+  }
+
+  ring->size += f->size;
+  ring->last++;
+
+  while (ring->last - ring->first > 1 &&
+         (ring->size > tacf->max_size ||
+          (int32_t)(h->timestamp - ngx_rtmp_timeshift_frame(ring, ring->first)
+                                       ->h.timestamp) >
+              (ngx_msec_int_t)tacf->window)) {
+    ngx_rtmp_timeshift_evict(ring);
+  }
+
+  return NGX_OK;
+}
+
+static ngx_int_t ngx_rtmp_timeshift_send(ngx_rtmp_session_t *s,
+                                         ngx_rtmp_timeshift_ring_t *ring,
+                                         ngx_rtmp_timeshift_frame_t *f) {
+  ngx_rtmp_live_proc_handler_t *handler;
+  ngx_rtmp_live_chunk_stream_t *cs;
+  ngx_rtmp_live_ctx_t *lctx;
+  ngx_rtmp_live_app_conf_t *lacf;
+  ngx_http_flv_live_ctx_t *hflctx;
+  ngx_http_request_t *r;
+  ngx_rtmp_header_t ch, lh;
+  ngx_chain_t *pkt, *header;
+  ngx_uint_t csidx;
+  ngx_int_t rc;
+
+  lacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_live_module);
+  lctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_live_module);
+
+  handler = ngx_rtmp_live_proc_handlers[lctx->protocol];
+
+  if (lctx->protocol != NGX_RTMP_PROTOCOL_RTMP) {
+    r = s->data;
+    if (r == NULL || (r->connection && r->connection->destroyed)) {
+      return NGX_ERROR;
+    }
+
+    hflctx = ngx_http_get_module_ctx(r, ngx_http_flv_live_module);
+    if (!hflctx->header_sent) {
+      hflctx->header_sent = 1;
+      ngx_http_flv_live_send_header(s);
+    }
+  }
+
+  if (ring->meta && lctx->meta_version != ring->meta_version) {
+    pkt = ngx_rtmp_live_get_meta(s, lctx, ring->meta, ring->meta_version);
+    if (pkt == NULL) {
+      return NGX_ERROR;
+    }
+
+    rc = handler->send_message_pt(s, pkt, 0);
+
+    if (rc == NGX_ERROR) {
+      return NGX_ERROR;
+    }
+
+    lctx->meta_version = ring->meta_version;
+  }
+
+  csidx = !(lacf->interleave || f->h.type == NGX_RTMP_MSG_VIDEO);
+  cs = &lctx->cs[csidx];
+
+  lh = ch = f->h;
+
+  if (!cs->active) {
+    header = (f->h.type == NGX_RTMP_MSG_VIDEO ? ring->avc_header
+                                              : ring->aac_header);
+    if (header) {
+      pkt = handler->append_message_pt(s, &lh, NULL, header);
+      if (pkt == NULL) {
+        return NGX_ERROR;
+      }
+
+      rc = handler->send_message_pt(s, pkt, 0);
+      handler->free_message_pt(s, pkt);
+
+      if (rc != NGX_OK) {
+        return NGX_AGAIN;
+      }
+    }
+
+    cs->active = 1;
+
+  } else {
+    lh.timestamp = cs->timestamp;
+  }
+
+  cs->timestamp = ch.timestamp;
+  s->current_time = ch.timestamp;
+
+  pkt = handler->append_message_pt(s, &ch, &lh, f->frame);
+  if (pkt == NULL) {
+    return NGX_ERROR;
+  }
+
+  rc = handler->send_message_pt(s, pkt, f->prio);
+  handler->free_message_pt(s, pkt);
+
+  if (rc != NGX_OK) {
+    ++lctx->ndropped;
+  }
+
+  return NGX_OK;
+}
+
+static void ngx_rtmp_timeshift_pump(ngx_event_t *ev) {
+  ngx_rtmp_session_t *s;
+  ngx_rtmp_timeshift_ctx_t *ctx;
+  ngx_rtmp_timeshift_ring_t *ring;
+  ngx_rtmp_timeshift_frame_t *f;
+  ngx_msec_t delay;
+  uint32_t clock;
+  int32_t due;
+
+  s = ev->data;
+  ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_timeshift_module);
+
+  if (s->connection->destroyed || ctx == NULL || ctx->ring == NULL ||
+      ctx->paused) {
+    return;
+  }
+
+  ring = ctx->ring;
+
+  clock = ctx->base_ts + (uint32_t)(ngx_current_msec - ctx->base_msec) +
+          NGX_RTMP_TIMESHIFT_LEAD;
+
+  /* paused or stalled past the window, resume from its oldest key frame */
+  if (ctx->next - ring->first > ring->last - ring->first) {
+    ctx->next = ngx_rtmp_timeshift_find(
+        ring, ngx_rtmp_timeshift_frame(ring, ring->first)->h.timestamp);
+
+    if (ctx->next != ring->last) {
+      ctx->base_ts = ngx_rtmp_timeshift_frame(ring, ctx->next)->h.timestamp;
+      ctx->base_msec = ngx_current_msec;
+      clock = ctx->base_ts + NGX_RTMP_TIMESHIFT_LEAD;
+    }
+  }
+
+  delay = NGX_RTMP_TIMESHIFT_MAX_DELAY;
+
+  while (ctx->next != ring->last) {
+    f = ngx_rtmp_timeshift_frame(ring, ctx->next);
+
+    due = (int32_t)(f->h.timestamp - clock);
+    if (due > 0) {
+      delay = ngx_min((ngx_msec_t)due, NGX_RTMP_TIMESHIFT_MAX_DELAY);
+      break;
+    }
+
+    /* let the output queue drain rather than drop */
+    if ((s->out_last + s->out_queue - s->out_pos) % s->out_queue >=
+        s->out_queue / 2) {
+      delay = NGX_RTMP_TIMESHIFT_MIN_DELAY;
+      break;
+    }
+
+    switch (ngx_rtmp_timeshift_send(s, ring, f)) {
+      case NGX_ERROR:
+        ngx_rtmp_finalize_session(s);
+        return;
+
+      case NGX_AGAIN:
+        delay = NGX_RTMP_TIMESHIFT_MIN_DELAY;
+        goto done;
+    }
+
+    ctx->next++;
+  }
+
+  if (ctx->next == ring->last && ring->closed) {
+    ngx_log_debug0(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                   "timeshift: end of window");
+    ngx_rtmp_finalize_session(s);
+    return;
+  }
+
+done:
+
+  ngx_add_timer(ev, ngx_max(delay, NGX_RTMP_TIMESHIFT_MIN_DELAY));
+}
+
+static void ngx_rtmp_timeshift_detach(ngx_rtmp_session_t *s,
+                                      ngx_rtmp_timeshift_ctx_t *ctx) {
+  ngx_rtmp_live_ctx_t *lctx;
+
+  if (ctx->pump.timer_set) {
+    ngx_del_timer(&ctx->pump);
+  }
+
+  if (ctx->ring) {
+    ngx_rtmp_timeshift_release_ring(ctx->ring);
+    ctx->ring = NULL;
+  }
+
+  ctx->player = 0;
+  ctx->paused = 0;
+
+  lctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_live_module);
+  if (lctx) {
+    lctx->timeshift = 0;
+
+    /*
+     * the live fan-out restarts the viewer with metadata, codec headers
+     * and absolute packets on the live clock
+     */
+    lctx->cs[0].active = 0;
+    lctx->cs[0].dropped = 0;
+    lctx->cs[1].active = 0;
+    lctx->cs[1].dropped = 0;
+    lctx->meta_version = 0;
+  }
+}
+
+/* position a player at ts, attaching it to the publisher's ring */
+static ngx_int_t ngx_rtmp_timeshift_attach(ngx_rtmp_session_t *s,
+                                           uint32_t ts) {
+  ngx_rtmp_timeshift_ctx_t *ctx, *pctx;
+  ngx_rtmp_timeshift_ring_t *ring;
+  ngx_rtmp_live_ctx_t *lctx;
+  ngx_uint_t next;
+
+  lctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_live_module);
+  if (lctx == NULL || lctx->stream == NULL || lctx->publishing) {
+    return NGX_DECLINED;
+  }
+
+  ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_timeshift_module);
+
+  if (ctx && ctx->ring) {
+    ring = ctx->ring;
+
+  } else {
+    if (lctx->stream->pub_ctx == NULL) {
+      return NGX_DECLINED;
+    }
+
+    pctx = ngx_rtmp_get_module_ctx(lctx->stream->pub_ctx->session,
+                                   ngx_rtmp_timeshift_module);
+    if (pctx == NULL || pctx->ring == NULL) {
+      return NGX_DECLINED;
+    }
+
+    ring = pctx->ring;
+  }
+
+  next = ngx_rtmp_timeshift_find(ring, ts);
+  if (next == ring->last) {
+    return NGX_DECLINED;
+  }
+
+  if (ctx == NULL) {
+    ctx = ngx_pcalloc(s->connection->pool, sizeof(ngx_rtmp_timeshift_ctx_t));
+    if (ctx == NULL) {
+      return NGX_ERROR;
+    }
+
+    ctx->session = s;
+    ngx_rtmp_set_ctx(s, ctx, ngx_rtmp_timeshift_module);
+  }
+
+  if (ctx->ring == NULL) {
+    ctx->ring = ring;
+    ring->refs++;
+  }
+
+  ctx->player = 1;
+  ctx->next = next;
+  ctx->base_ts = ngx_rtmp_timeshift_frame(ring, next)->h.timestamp;
+  ctx->base_msec = ngx_current_msec;
+  ctx->pause_msec = ngx_current_msec;
+
+  ctx->pump.data = s;
+  ctx->pump.log = s->connection->log;
+  ctx->pump.handler = ngx_rtmp_timeshift_pump;
+
+  if (ctx->pump.timer_set) {
+    ngx_del_timer(&ctx->pump);
+  }
+
+  /* off the live fan-out; restart both chunk streams from a header */
+  lctx->timeshift = 1;
+  lctx->cs[0].active = 0;
+  lctx->cs[1].active = 0;
+
+  ngx_log_debug2(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                 "timeshift: attach ts=%uD from=%uD", ts, ctx->base_ts);
+
+  return NGX_OK;
+}
+
+static ngx_int_t ngx_rtmp_timeshift_play(ngx_rtmp_session_t *s,
+                                         ngx_rtmp_play_t *v) {
+  ngx_rtmp_timeshift_app_conf_t *tacf;
+  ngx_rtmp_timeshift_ctx_t *ctx, *pctx;
+  ngx_rtmp_live_ctx_t *lctx;
+  ngx_rtmp_timeshift_ring_t *ring;
+  ngx_str_t value;
+  ngx_int_t shift, rc;
+  uint32_t ts;
+
+  tacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_timeshift_module);
+  if (tacf == NULL || !tacf->timeshift) {
+    return next_play(s, v);
+  }
+
+  if (ngx_rtmp_arg(s, (u_char *)"timeshift", sizeof("timeshift") - 1,
+                   &value) != NGX_OK) {
+    return next_play(s, v);
+  }
+
+  shift = ngx_atoi(value.data, value.len);
+  if (shift <= 0) {
+    return next_play(s, v);
+  }
+
+  lctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_live_module);
+  if (lctx == NULL || lctx->stream == NULL || lctx->stream->pub_ctx == NULL) {
+    return next_play(s, v);
+  }
+
+  pctx = ngx_rtmp_get_module_ctx(lctx->stream->pub_ctx->session,
+                                 ngx_rtmp_timeshift_module);
+  if (pctx == NULL || pctx->ring == NULL ||
+      pctx->ring->first == pctx->ring->last) {
+    return next_play(s, v);
+  }
+
+  ring = pctx->ring;
+  ts = ngx_rtmp_timeshift_frame(ring, ring->last - 1)->h.timestamp -
+       (uint32_t)shift * 1000;
+
+  if (ngx_rtmp_timeshift_attach(s, ts) == NGX_ERROR) {
+    return NGX_ERROR;
+  }
+
+  /* the gop cache skips time-shifted players */
+  rc = next_play(s, v);
+
+  ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_timeshift_module);
+  if (rc == NGX_OK && ctx && ctx->player) {
+    ngx_rtmp_timeshift_pump(&ctx->pump);
+  }
+
+  return rc;
+}
+
+static ngx_int_t ngx_rtmp_timeshift_seek(ngx_rtmp_session_t *s,
+                                         ngx_rtmp_seek_t *v) {
+  ngx_rtmp_timeshift_app_conf_t *tacf;
+  ngx_rtmp_timeshift_ctx_t *ctx;
+  ngx_int_t rc;
+
+  tacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_timeshift_module);
+  if (tacf == NULL || !tacf->timeshift) {
+    goto next;
+  }
+
+  ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                 "timeshift: seek offset=%f", v->offset);
+
+  rc = ngx_rtmp_timeshift_attach(s, (uint32_t)v->offset);
+
+  if (rc == NGX_ERROR) {
+    return NGX_ERROR;
+  }
+
+  ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_timeshift_module);
+
+  if (rc == NGX_DECLINED) {
+    /* past the window end, back to live */
+    if (ctx == NULL || !ctx->player) {
+      goto next;
+    }
+
+    ngx_rtmp_timeshift_detach(s, ctx);
+  }
+
+  if (ngx_rtmp_send_stream_begin(s, NGX_RTMP_MSID) != NGX_OK ||
+      ngx_rtmp_send_status(s, "NetStream.Seek.Notify", "status",
+                           "Seeking") != NGX_OK) {
+    return NGX_ERROR;
+  }
+
+  if (ctx && ctx->player && !ctx->paused) {
+    ngx_rtmp_timeshift_pump(&ctx->pump);
+  }
+
+next:
+  return next_seek(s, v);
+}
+
+static ngx_int_t ngx_rtmp_timeshift_pause(ngx_rtmp_session_t *s,
+                                          ngx_rtmp_pause_t *v) {
+  ngx_rtmp_timeshift_ctx_t *ctx;
+
+  ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_timeshift_module);
+  if (ctx == NULL || !ctx->player) {
+    goto next;
+  }
+
+  if (v->pause && !ctx->paused) {
+    ctx->paused = 1;
+    ctx->pause_msec = ngx_current_msec;
+
+    if (ctx->pump.timer_set) {
+      ngx_del_timer(&ctx->pump);
+    }
+
+  } else if (!v->pause && ctx->paused) {
+    ctx->paused = 0;
+    ctx->base_msec += ngx_current_msec - ctx->pause_msec;
+
+    ngx_rtmp_timeshift_pump(&ctx->pump);
+  }
+
+next:
+  return next_pause(s, v);
+}
+
+static ngx_int_t ngx_rtmp_timeshift_close_stream(ngx_rtmp_session_t *s,
+                                                 ngx_rtmp_close_stream_t *v) {
+  ngx_rtmp_timeshift_ctx_t *ctx;
+
+  ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_timeshift_module);
+  if (ctx == NULL || ctx->ring == NULL) {
+    goto next;
+  }
+
+  if (ctx->player) {
+    ngx_rtmp_timeshift_detach(s, ctx);
+    goto next;
+  }
+
+  /* publisher gone, players keep the ring until they reach its end */
+  ctx->ring->closed = 1;
+  ngx_rtmp_timeshift_release_ring(ctx->ring);
+  ctx->ring = NULL;
+
+next:
+  return next_close_stream(s, v);
+}
+
+static ngx_int_t ngx_rtmp_timeshift_postconfiguration(ngx_conf_t *cf) {
+  ngx_rtmp_core_main_conf_t *cmcf;
+  ngx_rtmp_handler_pt *h;
+
+  cmcf = ngx_rtmp_conf_get_module_main_conf(cf, ngx_rtmp_core_module);
+
+  h = ngx_array_push(&cmcf->events[NGX_RTMP_MSG_AUDIO]);
+  *h = ngx_rtmp_timeshift_av;
+
+  h = ngx_array_push(&cmcf->events[NGX_RTMP_MSG_VIDEO]);
+  *h = ngx_rtmp_timeshift_av;
+
+  next_play = ngx_rtmp_play;
+  ngx_rtmp_play = ngx_rtmp_timeshift_play;
+
+  next_seek = ngx_rtmp_seek;
+  ngx_rtmp_seek = ngx_rtmp_timeshift_seek;
+
+  next_pause = ngx_rtmp_pause;
+  ngx_rtmp_pause = ngx_rtmp_timeshift_pause;
+
+  next_close_stream = ngx_rtmp_close_stream;
+  ngx_rtmp_close_stream = ngx_rtmp_timeshift_close_stream;
+
+  return NGX_OK;
+}
@@ -53,6 +53,9 @@ ngx_rtmp_variable_value_t *ngx_rtmp_get_variable(ngx_rtmp_session_t *s,
                                                  ngx_str_t *name,
                                                  ngx_uint_t key);
 
+ngx_int_t ngx_rtmp_arg(ngx_rtmp_session_t *s, u_char *name, size_t len,
+                       ngx_str_t *value);
+
 #if (NGX_PCRE)
 
 typedef struct {
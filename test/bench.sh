@@ -0,0 +1,85 @@
+#!/bin/sh
+#
+# Fan-out benchmark over loopback, no network or media files needed.
+#
+#   ./bench.sh /path/to/nginx [seconds]
+#
+# Builds flvbench and hsbench, starts the given nginx on a temporary prefix
+# with a single worker, runs a few subscriber mixes against it and then a
+# handshake storm. Set
+# BENCH_MODULE to the .so path when the module is built as a dynamic one.
+
+set -e
+
+NGINX=${1:?usage: bench.sh /path/to/nginx [seconds]}
+SECONDS_PER_RUN=${2:-10}
+RTMP_PORT=${RTMP_PORT:-19350}
+HTTP_PORT=${HTTP_PORT:-18080}
+
+DIR=$(cd "$(dirname "$0")" && pwd)
+PREFIX=$(mktemp -d)
+trap 'kill $(cat "$PREFIX/nginx.pid" 2>/dev/null) 2>/dev/null; rm -rf "$PREFIX"' EXIT
+
+${CC:-cc} -O2 -o "$PREFIX/flvbench" "$DIR/flvbench.c" -lpthread
+${CC:-cc} -O2 -o "$PREFIX/hsbench" "$DIR/hsbench.c" -lpthread -lcrypto
+
+mkdir -p "$PREFIX/logs"
+
+{
+    [ -n "$BENCH_MODULE" ] && echo "load_module $BENCH_MODULE;"
+    cat <<EOF
+daemon on;
+master_process on;
+worker_processes 1;
+pid $PREFIX/nginx.pid;
+error_log $PREFIX/logs/error.log warn;
+
+worker_rlimit_nofile 65536;
+
+events {
+    worker_connections 65536;
+}
+
+rtmp {
+    server {
+        listen $RTMP_PORT;
+
+        application myapp {
+            live on;
+            gop_cache on;
+        }
+    }
+}
+
+http {
+    access_log off;
+
+    server {
+        listen $HTTP_PORT;
+
+        location /live {
+            flv_live on;
+        }
+    }
+}
+EOF
+} > "$PREFIX/nginx.conf"
+
+"$NGINX" -p "$PREFIX" -c "$PREFIX/nginx.conf"
+sleep 1
+
+MASTER=$(cat "$PREFIX/nginx.pid")
+WORKER=$(pgrep -P "$MASTER" | head -n 1)
+
+for MIX in "1 0" "100 0" "0 100" "500 500"; do
+    set -- $MIX
+    echo "== rtmp $1, http-flv $2"
+    "$PREFIX/flvbench" -r "$RTMP_PORT" -p "$HTTP_PORT" -n "$1" -N "$2" \
+        -t "$SECONDS_PER_RUN" -P "$WORKER" || echo "run failed"
+done
+
+for MODE in "" "-o"; do
+    echo "== handshakes${MODE:+, old-style}"
+    "$PREFIX/hsbench" -r "$RTMP_PORT" -c 32 -t "$SECONDS_PER_RUN" \
+        -P "$WORKER" $MODE || echo "run failed"
+done
@@ -0,0 +1,1143 @@
+/*
+ * Copyright (C) Winshining
+ *
+ * Loopback load generator for the live fan-out path.
+ *
+ * Publishes a synthetic H.264 stream over RTMP and plays it back with N RTMP
+ * and M HTTP-FLV subscribers. Every video frame carries its sequence number
+ * and send time, so each subscriber measures delivery latency and loss
+ * without any media file or decoder. The nginx worker RSS is sampled before
+ * and after the subscribers join when its pid is given.
+ *
+ *   cc -O2 -o flvbench flvbench.c -lpthread
+ *   ./flvbench -n 100 -N 100 -t 10 -P $(pgrep -f 'nginx: worker')
+ *
+ * See bench.sh for a self-contained run against a temporary nginx.
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_MAGIC "FBNC"
+#define BENCH_STAMP 10 /* offset of the stamp in a video message */
+#define BENCH_MIN_FRAME (BENCH_STAMP + 16)
+#define BENCH_MAX_FRAME (512 * 1024)
+#define BENCH_CHUNK_SIZE 65536
+#define BENCH_MAX_PIDS 16
+
+#define RTMP_MSG_CHUNK_SIZE 1
+#define RTMP_MSG_USER 4
+#define RTMP_MSG_VIDEO 9
+#define RTMP_MSG_AMF_CMD 20
+
+#define RTMP_USER_PING_REQUEST 6
+#define RTMP_USER_PING_RESPONSE 7
+
+typedef struct {
+  const char *host;
+  int rtmp_port;
+  int http_port;
+  const char *app;
+  const char *stream;
+  const char *location;
+  int rtmp_subs;
+  int http_subs;
+  int fps;
+  int frame_size;
+  int gop;
+  int duration;
+  int pids[BENCH_MAX_PIDS];
+  int npids;
+} bench_conf_t;
+
+typedef struct {
+  uint32_t ts;
+  uint32_t delta;
+  uint32_t len;
+  uint32_t type;
+  uint32_t msid;
+  uint32_t got;
+  int ext;
+  uint8_t *buf;
+  size_t cap;
+} rtmp_stream_t;
+
+typedef struct bench_conn_s bench_conn_t;
+
+struct bench_conn_s {
+  int fd;
+  int http;
+
+  uint8_t *in;
+  size_t len;
+  size_t cap;
+
+  /* RTMP */
+  uint32_t chunk_size;
+  rtmp_stream_t cs[64];
+
+  /* HTTP-FLV */
+  int header_done;
+  int chunked;
+  size_t chunk_left;
+  size_t body; /* decoded bytes at the start of the input */
+  int flv_header_done;
+
+  int64_t start;
+  int joined;
+  int closed;
+  int have_seq;
+  uint32_t last_seq;
+};
+
+typedef struct {
+  uint32_t *v;
+  size_t n;
+  size_t cap;
+} bench_samples_t;
+
+static bench_conf_t conf = {"127.0.0.1", 1935, 8080, "myapp", "bench",
+                            "/live", 10, 0, 25, 4096, 25, 10, {0}, 0};
+
+static volatile int stop;
+static volatile int publishing;
+static volatile int64_t measure_start;
+static volatile int64_t measure_end;
+
+static int epfd;
+static volatile int joined;
+static int failed;
+static uint64_t published;
+static uint64_t delivered;
+static uint64_t lost;
+static bench_samples_t latency; /* microseconds */
+static bench_samples_t join;    /* microseconds */
+
+static int64_t now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sample_add(bench_samples_t *s, uint32_t v) {
+  uint32_t *nv;
+
+  if (s->n == s->cap) {
+    s->cap = s->cap ? s->cap * 2 : 4096;
+    nv = realloc(s->v, s->cap * sizeof(uint32_t));
+    if (nv == NULL) {
+      return;
+    }
+    s->v = nv;
+  }
+
+  s->v[s->n++] = v;
+}
+
+static int sample_cmp(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+static uint32_t sample_pct(bench_samples_t *s, double pct) {
+  size_t i;
+
+  if (s->n == 0) {
+    return 0;
+  }
+
+  i = (size_t)(pct / 100 * (s->n - 1) + 0.5);
+
+  return s->v[i];
+}
+
+static long read_rss(void) {
+  int i;
+  long kb, total;
+  char path[64], line[256];
+  FILE *f;
+
+  total = 0;
+
+  for (i = 0; i < conf.npids; i++) {
+    snprintf(path, sizeof(path), "/proc/%d/status", conf.pids[i]);
+
+    f = fopen(path, "r");
+    if (f == NULL) {
+      continue;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+      if (sscanf(line, "VmRSS: %ld", &kb) == 1) {
+        total += kb;
+        break;
+      }
+    }
+
+    fclose(f);
+  }
+
+  return total;
+}
+
+static void put_be16(uint8_t *p, uint32_t v) {
+  p[0] = v >> 8;
+  p[1] = v;
+}
+
+static void put_be24(uint8_t *p, uint32_t v) {
+  p[0] = v >> 16;
+  p[1] = v >> 8;
+  p[2] = v;
+}
+
+static void put_be32(uint8_t *p, uint32_t v) {
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+static void put_be64(uint8_t *p, uint64_t v) {
+  put_be32(p, v >> 32);
+  put_be32(p + 4, (uint32_t)v);
+}
+
+static uint32_t get_be24(const uint8_t *p) {
+  return (uint32_t)p[0] << 16 | p[1] << 8 | p[2];
+}
+
+static uint32_t get_be32(const uint8_t *p) {
+  return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static uint64_t get_be64(const uint8_t *p) {
+  return (uint64_t)get_be32(p) << 32 | get_be32(p + 4);
+}
+
+/* AMF0 */
+
+static uint8_t *amf_string(uint8_t *p, const char *s) {
+  size_t n = strlen(s);
+
+  *p++ = 0x02;
+  put_be16(p, n);
+  memcpy(p + 2, s, n);
+
+  return p + 2 + n;
+}
+
+static uint8_t *amf_number(uint8_t *p, double d) {
+  uint64_t v;
+
+  memcpy(&v, &d, 8);
+  *p++ = 0x00;
+  put_be64(p, v);
+
+  return p + 8;
+}
+
+static uint8_t *amf_null(uint8_t *p) {
+  *p++ = 0x05;
+  return p;
+}
+
+static uint8_t *amf_key(uint8_t *p, const char *s) {
+  size_t n = strlen(s);
+
+  put_be16(p, n);
+  memcpy(p + 2, s, n);
+
+  return p + 2 + n;
+}
+
+static uint8_t *amf_object_end(uint8_t *p) {
+  put_be24(p, 0x000009);
+  return p + 3;
+}
+
+/* sockets */
+
+static int tcp_connect(int port) {
+  int fd, one;
+  char service[16];
+  struct addrinfo hints, *res;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  snprintf(service, sizeof(service), "%d", port);
+
+  if (getaddrinfo(conf.host, service, &hints, &res) != 0) {
+    return -1;
+  }
+
+  fd = socket(res->ai_family, SOCK_STREAM, 0);
+  if (fd == -1) {
+    freeaddrinfo(res);
+    return -1;
+  }
+
+  if (connect(fd, res->ai_addr, res->ai_addrlen) == -1) {
+    freeaddrinfo(res);
+    close(fd);
+    return -1;
+  }
+
+  freeaddrinfo(res);
+
+  one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  return fd;
+}
+
+static int write_all(int fd, const uint8_t *p, size_t n) {
+  ssize_t w;
+
+  while (n) {
+    w = send(fd, p, n, MSG_NOSIGNAL);
+    if (w == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    p += w;
+    n -= w;
+  }
+
+  return 0;
+}
+
+static int read_all(int fd, uint8_t *p, size_t n) {
+  ssize_t r;
+
+  while (n) {
+    r = recv(fd, p, n, 0);
+    if (r == 0 || (r == -1 && errno != EINTR)) {
+      return -1;
+    }
+    if (r > 0) {
+      p += r;
+      n -= r;
+    }
+  }
+
+  return 0;
+}
+
+/* RTMP */
+
+static int rtmp_handshake(int fd) {
+  uint8_t c[1 + 1536], s[1 + 1536 + 1536];
+  size_t i;
+
+  c[0] = 0x03;
+  memset(c + 1, 0, 8); /* zero version, no digest */
+  for (i = 9; i < sizeof(c); i++) {
+    c[i] = (uint8_t)rand();
+  }
+
+  if (write_all(fd, c, sizeof(c)) || read_all(fd, s, sizeof(s))) {
+    return -1;
+  }
+
+  /* C2 echoes S1 */
+  return write_all(fd, s + 1, 1536);
+}
+
+/*
+ * Only a type 0 header is written, so the timestamp must stay below
+ * 0xffffff ms (4.6 hours) to avoid extended timestamps.
+ */
+static int rtmp_send(int fd, uint32_t csid, uint32_t type, uint32_t msid,
+                     uint32_t ts, const uint8_t *data, size_t len,
+                     size_t chunk) {
+  uint8_t hdr[12], *out, *p;
+  size_t n, size;
+  int rc;
+
+  size = 12 + len + (len ? (len - 1) / chunk : 0);
+
+  out = malloc(size);
+  if (out == NULL) {
+    return -1;
+  }
+
+  hdr[0] = csid;
+  put_be24(hdr + 1, ts);
+  put_be24(hdr + 4, len);
+  hdr[7] = type;
+  hdr[8] = msid;
+  hdr[9] = msid >> 8;
+  hdr[10] = msid >> 16;
+  hdr[11] = msid >> 24;
+
+  memcpy(out, hdr, 12);
+  p = out + 12;
+
+  while (len) {
+    n = len < chunk ? len : chunk;
+    memcpy(p, data, n);
+    p += n;
+    data += n;
+    len -= n;
+
+    if (len) {
+      *p++ = 0xc0 | csid;
+    }
+  }
+
+  rc = write_all(fd, out, p - out);
+  free(out);
+
+  return rc;
+}
+
+static int rtmp_connect(int fd) {
+  uint8_t buf[512], *p;
+  char tc_url[256];
+
+  snprintf(tc_url, sizeof(tc_url), "rtmp://%s:%d/%s", conf.host,
+           conf.rtmp_port, conf.app);
+
+  p = amf_string(buf, "connect");
+  p = amf_number(p, 1);
+  *p++ = 0x03;
+  p = amf_key(p, "app");
+  p = amf_string(p, conf.app);
+  p = amf_key(p, "type");
+  p = amf_string(p, "nonprivate");
+  p = amf_key(p, "flashVer");
+  p = amf_string(p, "FMLE/3.0 (compatible; flvbench)");
+  p = amf_key(p, "tcUrl");
+  p = amf_string(p, tc_url);
+  p = amf_object_end(p);
+
+  if (rtmp_send(fd, 3, RTMP_MSG_AMF_CMD, 0, 0, buf, p - buf, 128)) {
+    return -1;
+  }
+
+  p = amf_string(buf, "createStream");
+  p = amf_number(p, 2);
+  p = amf_null(p);
+
+  return rtmp_send(fd, 3, RTMP_MSG_AMF_CMD, 0, 0, buf, p - buf, 128);
+}
+
+static void conn_deliver(bench_conn_t *c, uint32_t type, const uint8_t *data,
+                         size_t len);
+
+/*
+ * Parses every complete chunk in the input buffer. Chunk stream ids are
+ * folded into 64 slots, nginx only uses the low ones.
+ */
+static int rtmp_parse(bench_conn_t *c) {
+  static const size_t mh[] = {11, 7, 3, 0};
+  uint8_t *p, *last;
+  uint8_t *nb;
+  uint32_t fmt, csid, hl, field, len, type, msid, got, n;
+  int ext;
+  rtmp_stream_t *st;
+
+  p = c->in;
+  last = c->in + c->len;
+
+  for (;;) {
+    if (last - p < 1) {
+      break;
+    }
+
+    fmt = p[0] >> 6;
+    csid = p[0] & 0x3f;
+    hl = 1;
+
+    if (csid == 0) {
+      if (last - p < 2) {
+        break;
+      }
+      csid = 64 + p[1];
+      hl = 2;
+
+    } else if (csid == 1) {
+      if (last - p < 3) {
+        break;
+      }
+      csid = 64 + p[1] + p[2] * 256;
+      hl = 3;
+    }
+
+    st = &c->cs[csid % 64];
+
+    if ((size_t)(last - p) < hl + mh[fmt]) {
+      break;
+    }
+
+    field = fmt < 3 ? get_be24(p + hl) : 0;
+    len = fmt < 2 ? get_be24(p + hl + 3) : st->len;
+    type = fmt < 2 ? p[hl + 6] : st->type;
+    msid = fmt == 0 ? (uint32_t)p[hl + 7] | p[hl + 8] << 8 |
+                          p[hl + 9] << 16 | (uint32_t)p[hl + 10] << 24
+                    : st->msid;
+    ext = fmt < 3 ? field == 0xffffff : st->ext;
+
+    hl += mh[fmt];
+
+    if (ext) {
+      if ((size_t)(last - p) < hl + 4) {
+        break;
+      }
+      field = get_be32(p + hl);
+      hl += 4;
+    }
+
+    /* a new message header drops an unfinished message */
+    got = fmt < 2 ? 0 : st->got;
+
+    n = len - got;
+    if (n > c->chunk_size) {
+      n = c->chunk_size;
+    }
+
+    if ((size_t)(last - p) < hl + n) {
+      break;
+    }
+
+    /* the chunk is complete, commit the header */
+
+    st->got = got;
+
+    if (got == 0) {
+      if (fmt == 0) {
+        st->ts = field;
+        st->delta = 0;
+
+      } else if (fmt < 3) {
+        st->delta = field;
+        st->ts += field;
+
+      } else {
+        st->ts += st->delta;
+      }
+    }
+
+    st->len = len;
+    st->type = type;
+    st->msid = msid;
+    st->ext = ext;
+
+    if (st->cap < len) {
+      nb = realloc(st->buf, len);
+      if (nb == NULL) {
+        return -1;
+      }
+      st->buf = nb;
+      st->cap = len;
+    }
+
+    memcpy(st->buf + st->got, p + hl, n);
+    st->got += n;
+    p += hl + n;
+
+    if (st->got == st->len) {
+      st->got = 0;
+      conn_deliver(c, st->type, st->buf, st->len);
+    }
+  }
+
+  c->len = last - p;
+  memmove(c->in, p, c->len);
+
+  return 0;
+}
+
+/* HTTP-FLV */
+
+static int http_request(int fd) {
+  char req[1024];
+  int n;
+
+  n = snprintf(req, sizeof(req),
+               "GET %s?port=%d&app=%s&stream=%s HTTP/1.1\r\n"
+               "Host: %s\r\n\r\n",
+               conf.location, conf.rtmp_port, conf.app, conf.stream,
+               conf.host);
+
+  return write_all(fd, (uint8_t *)req, n);
+}
+
+/* strips the chunked framing in place, an incomplete size line is kept */
+static void http_dechunk(bench_conn_t *c) {
+  uint8_t *src, *dst, *last, *eol;
+  size_t n;
+
+  src = dst = c->in + c->body;
+  last = c->in + c->len;
+
+  while (src < last && !c->closed) {
+    if (c->chunk_left == 0) {
+      eol = memmem(src, last - src, "\r\n", 2);
+      if (eol == NULL) {
+        break;
+      }
+
+      if (eol == src) {
+        /* CRLF closing the previous chunk */
+        src += 2;
+        continue;
+      }
+
+      c->chunk_left = strtoul((char *)src, NULL, 16);
+      src = eol + 2;
+
+      if (c->chunk_left == 0) {
+        c->closed = 1;
+      }
+
+      continue;
+    }
+
+    n = (size_t)(last - src) < c->chunk_left ? (size_t)(last - src)
+                                             : c->chunk_left;
+    memmove(dst, src, n);
+    dst += n;
+    src += n;
+    c->chunk_left -= n;
+  }
+
+  memmove(dst, src, last - src);
+
+  c->body = dst - c->in;
+  c->len = c->body + (last - src);
+}
+
+static int http_parse(bench_conn_t *c) {
+  uint8_t *p, *last, *eoh;
+  size_t size;
+
+  if (!c->header_done) {
+    eoh = memmem(c->in, c->len, "\r\n\r\n", 4);
+    if (eoh == NULL) {
+      return 0;
+    }
+
+    if (c->len < 12 || memcmp(c->in + 9, "200", 3) != 0) {
+      return -1;
+    }
+
+    *eoh = '\0';
+    c->chunked = strcasestr((char *)c->in, "chunked") != NULL;
+    c->header_done = 1;
+
+    eoh += 4;
+    c->len -= eoh - c->in;
+    memmove(c->in, eoh, c->len);
+  }
+
+  if (c->chunked) {
+    http_dechunk(c);
+
+  } else {
+    c->body = c->len;
+  }
+
+  p = c->in;
+  last = c->in + c->body;
+
+  if (c->flv_header_done == 0) {
+    if (last - p < 13) {
+      return 0;
+    }
+    if (memcmp(p, "FLV", 3) != 0) {
+      return -1;
+    }
+    p += 13;
+    c->flv_header_done = 1;
+  }
+
+  while (last - p >= 11) {
+    size = get_be24(p + 1);
+    if ((size_t)(last - p) < 11 + size + 4) {
+      break;
+    }
+
+    conn_deliver(c, p[0], p + 11, size);
+    p += 11 + size + 4;
+  }
+
+  c->body -= p - c->in;
+  c->len -= p - c->in;
+  memmove(c->in, p, c->len);
+
+  return 0;
+}
+
+/* subscribers */
+
+static void conn_deliver(bench_conn_t *c, uint32_t type, const uint8_t *data,
+                         size_t len) {
+  uint8_t pong[6];
+  uint32_t seq;
+  int64_t now, sent;
+
+  if (!c->http && type == RTMP_MSG_CHUNK_SIZE && len >= 4) {
+    c->chunk_size = get_be32(data) & 0x7fffffff;
+    return;
+  }
+
+  if (!c->http && type == RTMP_MSG_USER && len >= 6 &&
+      (data[0] << 8 | data[1]) == RTMP_USER_PING_REQUEST) {
+    put_be16(pong, RTMP_USER_PING_RESPONSE);
+    memcpy(pong + 2, data + 2, 4);
+    rtmp_send(c->fd, 2, RTMP_MSG_USER, 0, 0, pong, 6, c->chunk_size);
+    return;
+  }
+
+  if (type != RTMP_MSG_VIDEO || len < BENCH_MIN_FRAME ||
+      memcmp(data + BENCH_STAMP, BENCH_MAGIC, 4) != 0) {
+    return;
+  }
+
+  now = now_ns();
+  seq = get_be32(data + BENCH_STAMP + 4);
+  sent = (int64_t)get_be64(data + BENCH_STAMP + 8);
+
+  if (!c->joined) {
+    c->joined = 1;
+    joined++;
+    sample_add(&join, (uint32_t)((now - c->start) / 1000));
+  }
+
+  if (now >= measure_start && measure_start && !measure_end) {
+    delivered++;
+    sample_add(&latency, (uint32_t)((now - sent) / 1000));
+
+    if (c->have_seq && seq != c->last_seq + 1) {
+      lost += seq - c->last_seq - 1;
+    }
+  }
+
+  c->have_seq = 1;
+  c->last_seq = seq;
+}
+
+static bench_conn_t *subscribe(int http) {
+  int fd;
+  bench_conn_t *c;
+  struct epoll_event ee;
+
+  c = calloc(1, sizeof(bench_conn_t));
+  if (c == NULL) {
+    return NULL;
+  }
+
+  c->http = http;
+  c->chunk_size = 128;
+  c->start = now_ns();
+
+  fd = tcp_connect(http ? conf.http_port : conf.rtmp_port);
+  if (fd == -1) {
+    free(c);
+    return NULL;
+  }
+
+  if (http) {
+    if (http_request(fd)) {
+      goto failed;
+    }
+
+  } else {
+    uint8_t buf[256], *p;
+
+    if (rtmp_handshake(fd) || rtmp_connect(fd)) {
+      goto failed;
+    }
+
+    /* nginx answers createStream with stream id 1 */
+    p = amf_string(buf, "play");
+    p = amf_number(p, 0);
+    p = amf_null(p);
+    p = amf_string(p, conf.stream);
+
+    if (rtmp_send(fd, 8, RTMP_MSG_AMF_CMD, 1, 0, buf, p - buf, 128)) {
+      goto failed;
+    }
+  }
+
+  c->fd = fd;
+
+  ee.events = EPOLLIN;
+  ee.data.ptr = c;
+
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ee) == -1) {
+    goto failed;
+  }
+
+  return c;
+
+failed:
+
+  close(fd);
+  free(c);
+
+  return NULL;
+}
+
+static int conn_read(bench_conn_t *c) {
+  ssize_t n;
+  uint8_t *nb;
+
+  for (;;) {
+    if (c->cap - c->len < 65536) {
+      nb = realloc(c->in, c->cap + 65536);
+      if (nb == NULL) {
+        return -1;
+      }
+      c->in = nb;
+      c->cap += 65536;
+    }
+
+    n = recv(c->fd, c->in + c->len, c->cap - c->len, MSG_DONTWAIT);
+
+    if (n == 0) {
+      return -1;
+    }
+
+    if (n == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return 0;
+      }
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+
+    c->len += n;
+
+    if ((c->http ? http_parse(c) : rtmp_parse(c)) != 0) {
+      return -1;
+    }
+  }
+}
+
+static void *event_loop(void *data) {
+  int i, n;
+  bench_conn_t *c;
+  struct epoll_event events[256];
+
+  (void)data;
+
+  while (!stop) {
+    n = epoll_wait(epfd, events, 256, 100);
+
+    for (i = 0; i < n; i++) {
+      c = events[i].data.ptr;
+
+      if (c->closed) {
+        continue;
+      }
+
+      if (conn_read(c) != 0) {
+        c->closed = 1;
+        epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+      }
+    }
+  }
+
+  return NULL;
+}
+
+/* publisher */
+
+static int wait_reply(int fd, const char *code) {
+  uint8_t buf[4096];
+  ssize_t n;
+  size_t len;
+
+  len = 0;
+
+  /* replies are small, scanning the raw chunks is good enough */
+  while (len < sizeof(buf)) {
+    n = recv(fd, buf + len, sizeof(buf) - len, 0);
+    if (n <= 0) {
+      return -1;
+    }
+    len += n;
+
+    if (memmem(buf, len, code, strlen(code))) {
+      return 0;
+    }
+    if (memmem(buf, len, "_error", 6)) {
+      return -1;
+    }
+  }
+
+  return -1;
+}
+
+static void *publish(void *data) {
+  static const uint8_t avcc[] = {
+      0x17, 0x00, 0x00, 0x00, 0x00,
+      /* AVCDecoderConfigurationRecord, baseline 320x240 */
+      0x01, 0x42, 0xc0, 0x0d, 0xff, 0xe1, 0x00, 0x0b, 0x67, 0x42, 0xc0, 0x0d,
+      0xda, 0x05, 0x07, 0xe8, 0x40, 0x00, 0x00, 0x01, 0x00, 0x04, 0x68, 0xce,
+      0x3c, 0x80};
+  int fd;
+  uint8_t buf[512], *frame, *p;
+  uint32_t seq, chunk;
+  int64_t next;
+  struct timespec ts;
+
+  (void)data;
+
+  fd = tcp_connect(conf.rtmp_port);
+  if (fd == -1 || rtmp_handshake(fd)) {
+    fprintf(stderr, "flvbench: publisher cannot connect\n");
+    goto failed;
+  }
+
+  if (rtmp_connect(fd) || wait_reply(fd, "NetConnection.Connect.Success")) {
+    fprintf(stderr, "flvbench: publisher connect failed\n");
+    goto failed;
+  }
+
+  /* frames go out in a single chunk from now on */
+  put_be32(buf, BENCH_CHUNK_SIZE);
+  if (rtmp_send(fd, 2, RTMP_MSG_CHUNK_SIZE, 0, 0, buf, 4, 128)) {
+    goto failed;
+  }
+
+  p = amf_string(buf, "publish");
+  p = amf_number(p, 0);
+  p = amf_null(p);
+  p = amf_string(p, conf.stream);
+  p = amf_string(p, "live");
+
+  chunk = BENCH_CHUNK_SIZE;
+
+  if (rtmp_send(fd, 8, RTMP_MSG_AMF_CMD, 1, 0, buf, p - buf, chunk) ||
+      wait_reply(fd, "NetStream.Publish.Start")) {
+    fprintf(stderr, "flvbench: publish failed\n");
+    goto failed;
+  }
+
+  if (rtmp_send(fd, 6, RTMP_MSG_VIDEO, 1, 0, avcc, sizeof(avcc), chunk)) {
+    goto failed;
+  }
+
+  frame = calloc(1, conf.frame_size);
+  if (frame == NULL) {
+    goto failed;
+  }
+
+  publishing = 1;
+  next = now_ns();
+
+  for (seq = 0; !stop; seq++) {
+    next += 1000000000 / conf.fps;
+    ts.tv_sec = next / 1000000000;
+    ts.tv_nsec = next % 1000000000;
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+           EINTR) {
+    }
+
+    /* one length-prefixed NAL unit carrying the stamp */
+    frame[0] = seq % conf.gop == 0 ? 0x17 : 0x27;
+    frame[1] = 0x01;
+    put_be24(frame + 2, 0);
+    put_be32(frame + 5, conf.frame_size - 9);
+    frame[9] = seq % conf.gop == 0 ? 0x65 : 0x41;
+    memcpy(frame + BENCH_STAMP, BENCH_MAGIC, 4);
+    put_be32(frame + BENCH_STAMP + 4, seq);
+    put_be64(frame + BENCH_STAMP + 8, (uint64_t)now_ns());
+
+    if (rtmp_send(fd, 6, RTMP_MSG_VIDEO, 1,
+                  (uint32_t)((uint64_t)seq * 1000 / conf.fps), frame,
+                  conf.frame_size, chunk)) {
+      fprintf(stderr, "flvbench: publisher disconnected\n");
+      break;
+    }
+
+    if (measure_start && !measure_end && now_ns() >= measure_start) {
+      published++;
+    }
+
+    /* acks and pings from the server are not needed */
+    while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0) {
+    }
+  }
+
+  free(frame);
+  close(fd);
+
+  return NULL;
+
+failed:
+
+  if (fd != -1) {
+    close(fd);
+  }
+
+  publishing = -1;
+
+  return NULL;
+}
+
+static void usage(void) {
+  fprintf(stderr,
+          "usage: flvbench [options]\n"
+          "  -h host       server address (127.0.0.1)\n"
+          "  -r port       RTMP port (1935)\n"
+          "  -p port       HTTP port (8080)\n"
+          "  -a app        application (myapp)\n"
+          "  -s stream     stream name (bench)\n"
+          "  -l location   flv_live location (/live)\n"
+          "  -n count      RTMP subscribers (10)\n"
+          "  -N count      HTTP-FLV subscribers (0)\n"
+          "  -f fps        frames per second (25)\n"
+          "  -b bytes      video frame size (4096)\n"
+          "  -g frames     key frame interval (25)\n"
+          "  -t seconds    measurement window (10)\n"
+          "  -P pid        nginx process to sample RSS of, repeatable\n");
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  int i, ch, subs;
+  long rss_idle, rss_loaded;
+  double window;
+  int64_t deadline;
+  struct rlimit rl;
+  pthread_t loop, pub;
+
+  while ((ch = getopt(argc, argv, "h:r:p:a:s:l:n:N:f:b:g:t:P:")) != -1) {
+    switch (ch) {
+      case 'h': conf.host = optarg; break;
+      case 'r': conf.rtmp_port = atoi(optarg); break;
+      case 'p': conf.http_port = atoi(optarg); break;
+      case 'a': conf.app = optarg; break;
+      case 's': conf.stream = optarg; break;
+      case 'l': conf.location = optarg; break;
+      case 'n': conf.rtmp_subs = atoi(optarg); break;
+      case 'N': conf.http_subs = atoi(optarg); break;
+      case 'f': conf.fps = atoi(optarg); break;
+      case 'b': conf.frame_size = atoi(optarg); break;
+      case 'g': conf.gop = atoi(optarg); break;
+      case 't': conf.duration = atoi(optarg); break;
+      case 'P':
+        if (conf.npids < BENCH_MAX_PIDS) {
+          conf.pids[conf.npids++] = atoi(optarg);
+        }
+        break;
+      default: usage();
+    }
+  }
+
+  if (conf.fps <= 0 || conf.gop <= 0 || conf.duration <= 0 ||
+      conf.frame_size < BENCH_MIN_FRAME || conf.frame_size > BENCH_MAX_FRAME) {
+    usage();
+  }
+
+  subs = conf.rtmp_subs + conf.http_subs;
+
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  srand((unsigned)now_ns());
+
+  epfd = epoll_create1(0);
+  if (epfd == -1) {
+    perror("epoll_create1");
+    return 1;
+  }
+
+  pthread_create(&loop, NULL, event_loop, NULL);
+  pthread_create(&pub, NULL, publish, NULL);
+
+  while (publishing == 0) {
+    usleep(10000);
+  }
+
+  if (publishing < 0) {
+    stop = 1;
+    pthread_join(loop, NULL);
+    pthread_join(pub, NULL);
+    return 1;
+  }
+
+  /* let a GOP through before sampling the idle footprint */
+  usleep(1000000 * conf.gop / conf.fps);
+  rss_idle = read_rss();
+
+  for (i = 0; i < subs; i++) {
+    if (subscribe(i >= conf.rtmp_subs) == NULL) {
+      failed++;
+    }
+  }
+
+  /* joins complete at the next key frame at the latest */
+  deadline = now_ns() + 2000000000LL * conf.gop / conf.fps + 1000000000LL;
+  while (joined + failed < subs && now_ns() < deadline) {
+    usleep(10000);
+  }
+
+  measure_start = now_ns();
+  usleep(1000000 * conf.duration);
+  measure_end = now_ns();
+
+  rss_loaded = read_rss();
+
+  stop = 1;
+  pthread_join(pub, NULL);
+  pthread_join(loop, NULL);
+
+  window = (measure_end - measure_start) / 1e9;
+
+  qsort(latency.v, latency.n, sizeof(uint32_t), sample_cmp);
+  qsort(join.v, join.n, sizeof(uint32_t), sample_cmp);
+
+  printf("subscribers    rtmp %d, http %d, joined %d, failed %d\n",
+         conf.rtmp_subs, conf.http_subs, joined, failed);
+  printf("published      %llu frames, %.1f frames/s, %d bytes\n",
+         (unsigned long long)published, published / window, conf.frame_size);
+  printf("delivered      %llu frames, %.1f frames/s, %llu lost\n",
+         (unsigned long long)delivered, delivered / window,
+         (unsigned long long)lost);
+  printf("latency us     p50 %u, p99 %u, max %u\n", sample_pct(&latency, 50),
+         sample_pct(&latency, 99), sample_pct(&latency, 100));
+  printf("join ms        p50 %.1f, p99 %.1f\n", sample_pct(&join, 50) / 1e3,
+         sample_pct(&join, 99) / 1e3);
+
+  if (conf.npids) {
+    printf("nginx rss kB   idle %ld, loaded %ld, %.1f per viewer\n", rss_idle,
+           rss_loaded, subs ? (double)(rss_loaded - rss_idle) / subs : 0.0);
+  }
+
+  return joined == subs && delivered ? 0 : 1;
+}
@@ -0,0 +1,469 @@
+/*
+ * Copyright (C) Winshining
+ *
+ * Handshake micro-benchmark, the reconnect storm case.
+ *
+ * Each thread connects, runs a complete RTMP handshake and closes the
+ * connection, as fast as the server answers. The default is the digest
+ * (Flash Player) handshake, which costs the server its HMACs and random
+ * fills; -o sends the old-style zero-version handshake instead. Server
+ * digests in S1 and S2 are checked, so a broken handshake shows up as
+ * "bad" rather than as a faster run.
+ *
+ *   cc -O2 -o hsbench hsbench.c -lpthread -lcrypto
+ *   ./hsbench -c 32 -t 10 -P $(pgrep -f 'nginx: worker')
+ *
+ * See bench.sh for a self-contained run against a temporary nginx.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define HS_SIZE 1536
+#define HS_DIGEST 32
+#define HS_MAX_THREADS 1024
+
+typedef struct {
+  const char *host;
+  int port;
+  int threads;
+  int duration;
+  int old;
+  int pid;
+} hs_conf_t;
+
+typedef struct {
+  uint32_t *v;
+  size_t n;
+  size_t cap;
+  uint64_t done;
+  uint64_t bad;
+  uint64_t failed;
+  unsigned seed;
+} hs_thread_t;
+
+static hs_conf_t conf = {"127.0.0.1", 1935, 8, 10, 0, 0};
+
+static volatile int stop;
+
+static struct addrinfo *addr;
+
+static const uint8_t server_key[] = {
+    'G',  'e',  'n',  'u',  'i',  'n',  'e',  ' ',  'A',  'd',  'o',  'b',
+    'e',  ' ',  'F',  'l',  'a',  's',  'h',  ' ',  'M',  'e',  'd',  'i',
+    'a',  ' ',  'S',  'e',  'r',  'v',  'e',  'r',  ' ',  '0',  '0',  '1',
+
+    0xF0, 0xEE, 0xC2, 0x4A, 0x80, 0x68, 0xBE, 0xE8, 0x2E, 0x00, 0xD0, 0xD1,
+    0x02, 0x9E, 0x7E, 0x57, 0x6E, 0xEC, 0x5D, 0x2D, 0x29, 0x80, 0x6F, 0xAB,
+    0x93, 0xB8, 0xE6, 0x36, 0xCF, 0xEB, 0x31, 0xAE};
+
+static const uint8_t client_key[] = "Genuine Adobe Flash Player 001";
+
+#define SERVER_PARTIAL_KEY 36
+#define CLIENT_PARTIAL_KEY 30
+
+static int64_t now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sample_add(hs_thread_t *t, uint32_t v) {
+  uint32_t *nv;
+
+  if (t->n == t->cap) {
+    t->cap = t->cap ? t->cap * 2 : 4096;
+    nv = realloc(t->v, t->cap * sizeof(uint32_t));
+    if (nv == NULL) {
+      return;
+    }
+    t->v = nv;
+  }
+
+  t->v[t->n++] = v;
+}
+
+static int sample_cmp(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+static long read_rss(void) {
+  long kb;
+  char path[64], line[256];
+  FILE *f;
+
+  if (conf.pid == 0) {
+    return 0;
+  }
+
+  snprintf(path, sizeof(path), "/proc/%d/status", conf.pid);
+
+  f = fopen(path, "r");
+  if (f == NULL) {
+    return 0;
+  }
+
+  kb = 0;
+
+  while (fgets(line, sizeof(line), f)) {
+    if (sscanf(line, "VmRSS: %ld", &kb) == 1) {
+      break;
+    }
+  }
+
+  fclose(f);
+
+  return kb;
+}
+
+static double read_cpu(void) {
+  char path[64], buf[1024], *p;
+  unsigned long utime, stime;
+  FILE *f;
+  int n;
+
+  if (conf.pid == 0) {
+    return 0;
+  }
+
+  snprintf(path, sizeof(path), "/proc/%d/stat", conf.pid);
+
+  f = fopen(path, "r");
+  if (f == NULL) {
+    return 0;
+  }
+
+  n = fread(buf, 1, sizeof(buf) - 1, f);
+  fclose(f);
+
+  buf[n > 0 ? n : 0] = '\0';
+
+  /* fields 14 and 15, past the parenthesized command name */
+  p = strrchr(buf, ')');
+  if (p == NULL ||
+      sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+             &utime, &stime) != 2) {
+    return 0;
+  }
+
+  return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static int write_all(int fd, const uint8_t *p, size_t n) {
+  ssize_t w;
+
+  while (n) {
+    w = send(fd, p, n, MSG_NOSIGNAL);
+    if (w == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    p += w;
+    n -= w;
+  }
+
+  return 0;
+}
+
+static int read_all(int fd, uint8_t *p, size_t n) {
+  ssize_t r;
+
+  while (n) {
+    r = recv(fd, p, n, 0);
+    if (r == 0 || (r == -1 && errno != EINTR)) {
+      return -1;
+    }
+    if (r > 0) {
+      p += r;
+      n -= r;
+    }
+  }
+
+  return 0;
+}
+
+/* HMAC-SHA256 of the packet with the 32 bytes at skip left out */
+static void hs_digest(const uint8_t *key, size_t key_len, const uint8_t *p,
+                      size_t skip, uint8_t *out) {
+  uint8_t msg[HS_SIZE];
+  unsigned int len;
+
+  memcpy(msg, p, skip);
+  memcpy(msg + skip, p + skip + HS_DIGEST, HS_SIZE - skip - HS_DIGEST);
+
+  HMAC(EVP_sha256(), key, key_len, msg, HS_SIZE - HS_DIGEST, out, &len);
+}
+
+/* digest position of the scheme used by both nginx sides, base 8 */
+static size_t hs_offset(const uint8_t *p) {
+  return (p[8] + p[9] + p[10] + p[11]) % 728 + 12;
+}
+
+static void hs_random(hs_thread_t *t, uint8_t *p, size_t n) {
+  while (n--) {
+    *p++ = (uint8_t)rand_r(&t->seed);
+  }
+}
+
+static int hs_connect(void) {
+  int fd, one;
+
+  fd = socket(addr->ai_family, SOCK_STREAM, 0);
+  if (fd == -1) {
+    return -1;
+  }
+
+  if (connect(fd, addr->ai_addr, addr->ai_addrlen) == -1) {
+    close(fd);
+    return -1;
+  }
+
+  one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  return fd;
+}
+
+/* returns 0 on success, 1 on a wrong server digest, -1 on I/O failure */
+static int hs_run(hs_thread_t *t, int fd) {
+  uint8_t c[1 + HS_SIZE], s[1 + HS_SIZE + HS_SIZE], digest[HS_DIGEST];
+  uint8_t key[HS_DIGEST], *c1, *s1, *s2;
+  unsigned int len;
+  size_t offs;
+
+  c1 = c + 1;
+  s1 = s + 1;
+  s2 = s1 + HS_SIZE;
+
+  c[0] = 0x03;
+  memset(c1, 0, 4);
+  hs_random(t, c1 + 8, HS_SIZE - 8);
+
+  if (conf.old) {
+    memset(c1 + 4, 0, 4);
+
+  } else {
+    c1[4] = 0x0a;
+    c1[5] = 0x00;
+    c1[6] = 0x2d;
+    c1[7] = 0x02;
+
+    offs = hs_offset(c1);
+    hs_digest(client_key, CLIENT_PARTIAL_KEY, c1, offs, c1 + offs);
+  }
+
+  if (write_all(fd, c, sizeof(c)) || read_all(fd, s, sizeof(s))) {
+    return -1;
+  }
+
+  if (s[0] != 0x03) {
+    return 1;
+  }
+
+  if (!conf.old) {
+    offs = hs_offset(s1);
+    hs_digest(server_key, SERVER_PARTIAL_KEY, s1, offs, digest);
+
+    if (memcmp(digest, s1 + offs, HS_DIGEST) != 0) {
+      return 1;
+    }
+
+    /* S2 is keyed by our C1 digest */
+    offs = hs_offset(c1);
+    HMAC(EVP_sha256(), server_key, sizeof(server_key), c1 + offs, HS_DIGEST,
+         key, &len);
+    hs_digest(key, HS_DIGEST, s2, HS_SIZE - HS_DIGEST, digest);
+
+    if (memcmp(digest, s2 + HS_SIZE - HS_DIGEST, HS_DIGEST) != 0) {
+      return 1;
+    }
+  }
+
+  /* C2 echoes S1 */
+  return write_all(fd, s1, HS_SIZE) ? -1 : 0;
+}
+
+static void *hs_loop(void *data) {
+  hs_thread_t *t = data;
+  int fd, rc;
+  int64_t start;
+
+  while (!stop) {
+    start = now_ns();
+
+    fd = hs_connect();
+    if (fd == -1) {
+      t->failed++;
+      usleep(1000);
+      continue;
+    }
+
+    rc = hs_run(t, fd);
+    close(fd);
+
+    if (rc < 0) {
+      t->failed++;
+      continue;
+    }
+
+    if (rc > 0) {
+      t->bad++;
+      continue;
+    }
+
+    t->done++;
+    sample_add(t, (uint32_t)((now_ns() - start) / 1000));
+  }
+
+  return NULL;
+}
+
+static void usage(void) {
+  fprintf(stderr,
+          "usage: hsbench [options]\n"
+          "  -h host       server address (127.0.0.1)\n"
+          "  -r port       RTMP port (1935)\n"
+          "  -c count      concurrent connecting threads (8)\n"
+          "  -t seconds    measurement window (10)\n"
+          "  -o            old-style handshake, no digests\n"
+          "  -P pid        nginx worker to sample CPU and RSS of\n");
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  int i, ch;
+  char service[16];
+  long rss_idle, rss_loaded;
+  double cpu, window;
+  int64_t start;
+  uint64_t done, bad, failed;
+  size_t n, k;
+  uint32_t *all;
+  struct addrinfo hints;
+  struct rlimit rl;
+  hs_thread_t *threads;
+  pthread_t *tids;
+
+  while ((ch = getopt(argc, argv, "h:r:c:t:oP:")) != -1) {
+    switch (ch) {
+      case 'h': conf.host = optarg; break;
+      case 'r': conf.port = atoi(optarg); break;
+      case 'c': conf.threads = atoi(optarg); break;
+      case 't': conf.duration = atoi(optarg); break;
+      case 'o': conf.old = 1; break;
+      case 'P': conf.pid = atoi(optarg); break;
+      default: usage();
+    }
+  }
+
+  if (conf.threads <= 0 || conf.threads > HS_MAX_THREADS ||
+      conf.duration <= 0) {
+    usage();
+  }
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  snprintf(service, sizeof(service), "%d", conf.port);
+
+  if (getaddrinfo(conf.host, service, &hints, &addr) != 0) {
+    fprintf(stderr, "hsbench: cannot resolve %s\n", conf.host);
+    return 1;
+  }
+
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+
+  threads = calloc(conf.threads, sizeof(hs_thread_t));
+  tids = calloc(conf.threads, sizeof(pthread_t));
+  if (threads == NULL || tids == NULL) {
+    return 1;
+  }
+
+  rss_idle = read_rss();
+  cpu = read_cpu();
+  start = now_ns();
+
+  for (i = 0; i < conf.threads; i++) {
+    threads[i].seed = (unsigned)start ^ (unsigned)i * 2654435761u;
+    pthread_create(&tids[i], NULL, hs_loop, &threads[i]);
+  }
+
+  sleep(conf.duration);
+
+  rss_loaded = read_rss();
+  stop = 1;
+
+  for (i = 0; i < conf.threads; i++) {
+    pthread_join(tids[i], NULL);
+  }
+
+  window = (now_ns() - start) / 1e9;
+  cpu = read_cpu() - cpu;
+
+  done = bad = failed = 0;
+  n = 0;
+
+  for (i = 0; i < conf.threads; i++) {
+    done += threads[i].done;
+    bad += threads[i].bad;
+    failed += threads[i].failed;
+    n += threads[i].n;
+  }
+
+  all = malloc((n ? n : 1) * sizeof(uint32_t));
+  if (all == NULL) {
+    return 1;
+  }
+
+  for (i = 0, k = 0; i < conf.threads; i++) {
+    memcpy(all + k, threads[i].v, threads[i].n * sizeof(uint32_t));
+    k += threads[i].n;
+  }
+
+  qsort(all, n, sizeof(uint32_t), sample_cmp);
+
+  printf("handshakes     %s, %d threads\n", conf.old ? "old-style" : "digest",
+         conf.threads);
+  printf("completed      %llu, %.0f/s, %llu bad, %llu failed\n",
+         (unsigned long long)done, done / window, (unsigned long long)bad,
+         (unsigned long long)failed);
+  printf("latency us     p50 %u, p99 %u, max %u\n",
+         n ? all[(size_t)(0.5 * (n - 1) + 0.5)] : 0,
+         n ? all[(size_t)(0.99 * (n - 1) + 0.5)] : 0, n ? all[n - 1] : 0);
+
+  if (conf.pid) {
+    printf("nginx cpu      %.2f s, %.1f us per handshake\n", cpu,
+           done ? cpu * 1e6 / done : 0.0);
+    printf("nginx rss kB   idle %ld, loaded %ld\n", rss_idle, rss_loaded);
+  }
+
+  return done && bad == 0 ? 0 : 1;
+}
@@ -0,0 +1,112 @@
+#!/usr/bin/env python3
+#
+# Loopback check of WebSocket-FLV framing.
+#
+# Publish to rtmp://localhost/myapp/mystream (see ffstream.sh), then
+#
+#   ./ws-flv.py [host] [port] [app] [stream] [frames]
+#
+# Checks the 101 handshake, that every server frame is a final unmasked
+# binary frame, that the first one carries the FLV header and that each
+# following one carries exactly one tag plus its PreviousTagSize. Replies
+# to a ping and closes cleanly at the end.
+
+import base64
+import hashlib
+import os
+import socket
+import struct
+import sys
+
+GUID = b"258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+
+def recv_exact(sock, n):
+    data = b""
+    while len(data) < n:
+        chunk = sock.recv(n - len(data))
+        if not chunk:
+            raise EOFError("connection closed")
+        data += chunk
+    return data
+
+
+def read_frame(sock):
+    b0, b1 = recv_exact(sock, 2)
+    if b1 & 0x80:
+        raise ValueError("server frame is masked")
+    size = b1 & 0x7f
+    if size == 126:
+        size = struct.unpack(">H", recv_exact(sock, 2))[0]
+    elif size == 127:
+        size = struct.unpack(">Q", recv_exact(sock, 8))[0]
+    return b0 & 0x80, b0 & 0x0f, recv_exact(sock, size)
+
+
+def send_frame(sock, opcode, payload=b""):
+    mask = os.urandom(4)
+    masked = bytes(c ^ mask[i & 3] for i, c in enumerate(payload))
+    sock.sendall(bytes([0x80 | opcode, 0x80 | len(payload)]) + mask + masked)
+
+
+def main():
+    host = sys.argv[1] if len(sys.argv) > 1 else "127.0.0.1"
+    port = int(sys.argv[2]) if len(sys.argv) > 2 else 8080
+    app = sys.argv[3] if len(sys.argv) > 3 else "myapp"
+    stream = sys.argv[4] if len(sys.argv) > 4 else "mystream"
+    frames = int(sys.argv[5]) if len(sys.argv) > 5 else 200
+
+    key = base64.b64encode(os.urandom(16))
+    sock = socket.create_connection((host, port))
+    sock.sendall(b"GET /live?app=%s&stream=%s HTTP/1.1\r\n"
+                 b"Host: %s\r\n"
+                 b"Upgrade: websocket\r\n"
+                 b"Connection: Upgrade\r\n"
+                 b"Sec-WebSocket-Key: %s\r\n"
+                 b"Sec-WebSocket-Version: 13\r\n\r\n"
+                 % (app.encode(), stream.encode(), host.encode(), key))
+
+    head = b""
+    while b"\r\n\r\n" not in head:
+        head += recv_exact(sock, 1)
+
+    lines = head.decode().split("\r\n")
+    assert lines[0].startswith("HTTP/1.1 101"), lines[0]
+    headers = dict(l.split(": ", 1) for l in lines[1:] if l)
+    accept = base64.b64encode(hashlib.sha1(key + GUID).digest()).decode()
+    assert headers.get("Sec-WebSocket-Accept") == accept, headers
+
+    fin, opcode, payload = read_frame(sock)
+    assert fin and opcode == 0x2, (fin, opcode)
+    assert payload[:3] == b"FLV" and len(payload) == 13, payload
+
+    send_frame(sock, 0x9, b"ws-flv")
+
+    pong = False
+    for n in range(frames):
+        fin, opcode, payload = read_frame(sock)
+        assert fin, "fragmented frame"
+        if opcode == 0xa:
+            assert payload == b"ws-flv", payload
+            pong = True
+            continue
+        assert opcode == 0x2, opcode
+        size = struct.unpack(">I", b"\0" + payload[1:4])[0]
+        assert len(payload) == 11 + size + 4, (len(payload), size)
+        prev = struct.unpack(">I", payload[-4:])[0]
+        assert prev == 11 + size, (prev, size)
+
+    assert pong, "no pong"
+
+    send_frame(sock, 0x8, struct.pack(">H", 1000))
+    try:
+        while read_frame(sock)[1] != 0x8:
+            pass
+    except EOFError:
+        pass
+
+    print("ok: %d frames" % frames)
+
+
+if __name__ == "__main__":
+    main()